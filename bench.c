@@ -0,0 +1,576 @@
+/*
+ * Microbenchmarks for the server's core components
+ * Usage: ./benchmarks [-r reps] [-f filter] [-o file]
+ *
+ * Every benchmark runs once to warm up and then reps times; the median,
+ * minimum and maximum are printed to stderr and written as JSON to the
+ * output file (stdout by default) so runs can be diffed between commits.
+ * Log output produced while benchmarking is discarded.
+ */
+
+#include "thread_pool.h"
+#include "reactor.h"
+#include "protocol.h"
+#include "kvstore.h"
+#include "ratelimit.h"
+#include "logger.h"
+#include "config.h"
+#include "clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_REPS 5
+#define MAX_REPS 100
+
+// Work per repetition
+#define POOL_TASKS 200000
+#define POOL_ROUND_TRIPS 20000
+#define LANE_BACKLOG 2000
+#define LANE_TASK_NS 20000
+#define COMMAND_OPS 200000
+#define RATELIMIT_CHECKS 1000000
+#define LOG_MESSAGES 100000
+#define CONFIG_LOADS 2000
+#define LOOPBACK_MS 500
+#define LOOPBACK_CLIENTS 4
+#define LOOPBACK_PIPELINE 16
+
+static int reps = DEFAULT_REPS;
+static const char* filter = NULL;
+static FILE* json = NULL;
+static int json_count = 0;
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void run_benchmark(const char* name, const char* unit, double (*run)(void*), void* arg) {
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+    
+    double results[MAX_REPS];
+    run(arg);
+    for (int i = 0; i < reps; i++) {
+        results[i] = run(arg);
+    }
+    qsort(results, (size_t)reps, sizeof(double), compare_double);
+    
+    double median = results[reps / 2];
+    fprintf(stderr, "%-36s %14.1f %-6s (min %.1f, max %.1f)\n",
+            name, median, unit, results[0], results[reps - 1]);
+    fprintf(json, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"median\": %.3f, "
+            "\"min\": %.3f, \"max\": %.3f, \"reps\": %d}",
+            (json_count++ > 0) ? "," : "", name, unit, median, results[0], results[reps - 1], reps);
+}
+
+// ---- Thread pool ----
+
+typedef struct {
+    ThreadPoolQueueType queue;
+    ThreadPoolScheduler scheduler;
+    int threads;
+} PoolCase;
+
+static atomic_long tasks_done;
+
+static void count_task(void* arg) {
+    (void)arg;
+    atomic_fetch_add_explicit(&tasks_done, 1, memory_order_relaxed);
+}
+
+static ThreadPool* pool_for(const PoolCase* pc) {
+    ThreadPoolOptions options;
+    thread_pool_options_init(&options);
+    options.queue_type = pc->queue;
+    options.scheduler = pc->scheduler;
+    return thread_pool_create(pc->threads, &options);
+}
+
+// Submit from one thread and wait for all tasks: ns per task
+static double bench_pool_throughput(void* arg) {
+    ThreadPool* pool = pool_for((const PoolCase*)arg);
+    atomic_store(&tasks_done, 0);
+    
+    uint64_t start = clock_monotonic_ns();
+    for (long i = 0; i < POOL_TASKS; i++) {
+        while (thread_pool_add_task(pool, count_task, NULL) != 0) {
+            sched_yield();
+        }
+    }
+    while (atomic_load_explicit(&tasks_done, memory_order_relaxed) < POOL_TASKS) {
+        sched_yield();
+    }
+    uint64_t elapsed = clock_monotonic_ns() - start;
+    
+    thread_pool_destroy(pool);
+    return (double)elapsed / POOL_TASKS;
+}
+
+// One task at a time: ns from submit until the task has run
+static double bench_pool_latency(void* arg) {
+    ThreadPool* pool = pool_for((const PoolCase*)arg);
+    atomic_store(&tasks_done, 0);
+    
+    uint64_t start = clock_monotonic_ns();
+    for (long i = 0; i < POOL_ROUND_TRIPS; i++) {
+        thread_pool_add_task(pool, count_task, NULL);
+        while (atomic_load_explicit(&tasks_done, memory_order_acquire) <= i) {
+        }
+    }
+    uint64_t elapsed = clock_monotonic_ns() - start;
+    
+    thread_pool_destroy(pool);
+    return (double)elapsed / POOL_ROUND_TRIPS;
+}
+
+static void bench_pools(void) {
+    static const struct {
+        const char* name;
+        ThreadPoolQueueType queue;
+        ThreadPoolScheduler scheduler;
+    } kinds[] = {
+        { "mutex", THREAD_POOL_QUEUE_MUTEX, THREAD_POOL_SCHED_FIFO },
+        { "lockfree", THREAD_POOL_QUEUE_LOCKFREE, THREAD_POOL_SCHED_FIFO },
+        { "stealing", THREAD_POOL_QUEUE_LOCKFREE, THREAD_POOL_SCHED_WORK_STEALING },
+    };
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+            PoolCase pc = { kinds[k].queue, kinds[k].scheduler, thread_counts[t] };
+            char name[64];
+            snprintf(name, sizeof(name), "pool.submit.%s.t%d", kinds[k].name, pc.threads);
+            run_benchmark(name, "ns/op", bench_pool_throughput, &pc);
+            snprintf(name, sizeof(name), "pool.latency.%s.t%d", kinds[k].name, pc.threads);
+            run_benchmark(name, "ns/op", bench_pool_latency, &pc);
+        }
+    }
+}
+
+typedef struct {
+    ThreadPoolQueueType queue;
+    ThreadPoolScheduler scheduler;
+    ThreadPoolPriority prio;
+    int reserved;
+} LaneCase;
+
+static _Atomic uint64_t probe_ran_at;
+
+// A long-lived task: about LANE_TASK_NS of work
+static void slow_task(void* arg) {
+    (void)arg;
+    uint64_t until = clock_monotonic_ns() + LANE_TASK_NS;
+    while (clock_monotonic_ns() < until) {
+    }
+    atomic_fetch_add_explicit(&tasks_done, 1, memory_order_relaxed);
+}
+
+static void probe_task(void* arg) {
+    (void)arg;
+    atomic_store_explicit(&probe_ran_at, clock_monotonic_ns(), memory_order_release);
+}
+
+// One task submitted behind a normal-lane backlog of slow ones: us until
+// it runs
+static double bench_pool_lanes(void* arg) {
+    const LaneCase* lc = (const LaneCase*)arg;
+    ThreadPoolOptions options;
+    thread_pool_options_init(&options);
+    options.queue_type = lc->queue;
+    options.scheduler = lc->scheduler;
+    options.reserved_workers = lc->reserved;
+    ThreadPool* pool = thread_pool_create(4, &options);
+    atomic_store(&tasks_done, 0);
+    atomic_store(&probe_ran_at, 0);
+    
+    for (long i = 0; i < LANE_BACKLOG; i++) {
+        while (thread_pool_add_task(pool, slow_task, NULL) != 0) {
+            sched_yield();
+        }
+    }
+    uint64_t start = clock_monotonic_ns();
+    thread_pool_add_task_prio(pool, probe_task, NULL, lc->prio);
+    uint64_t ran_at;
+    while ((ran_at = atomic_load_explicit(&probe_ran_at, memory_order_acquire)) == 0) {
+        sched_yield();
+    }
+    while (atomic_load_explicit(&tasks_done, memory_order_relaxed) < LANE_BACKLOG) {
+        sched_yield();
+    }
+    
+    thread_pool_destroy(pool);
+    return (double)(ran_at - start) / 1000.0;
+}
+
+static void bench_pool_lane_cases(void) {
+    static const struct {
+        const char* name;
+        LaneCase lc;
+    } cases[] = {
+        { "pool.lanes.lockfree.normal", { THREAD_POOL_QUEUE_LOCKFREE, THREAD_POOL_SCHED_FIFO,
+                                          THREAD_POOL_PRIO_NORMAL, 0 } },
+        { "pool.lanes.lockfree.high", { THREAD_POOL_QUEUE_LOCKFREE, THREAD_POOL_SCHED_FIFO,
+                                        THREAD_POOL_PRIO_HIGH, 0 } },
+        { "pool.lanes.lockfree.reserved", { THREAD_POOL_QUEUE_LOCKFREE, THREAD_POOL_SCHED_FIFO,
+                                            THREAD_POOL_PRIO_HIGH, 1 } },
+        { "pool.lanes.mutex.high", { THREAD_POOL_QUEUE_MUTEX, THREAD_POOL_SCHED_FIFO,
+                                     THREAD_POOL_PRIO_HIGH, 0 } },
+        { "pool.lanes.stealing.high", { THREAD_POOL_QUEUE_LOCKFREE,
+                                        THREAD_POOL_SCHED_WORK_STEALING,
+                                        THREAD_POOL_PRIO_HIGH, 0 } },
+    };
+    
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        run_benchmark(cases[i].name, "us", bench_pool_lanes, (void*)&cases[i].lc);
+    }
+}
+
+// ---- Command dispatch ----
+
+typedef struct {
+    const char* line;
+    uint8_t opcode;         // nonzero: send as a binary frame
+} CommandCase;
+
+static double bench_command(void* arg) {
+    const CommandCase* cc = (const CommandCase*)arg;
+    size_t len = strlen(cc->line);
+    Buffer out;
+    buffer_init(&out);
+    
+    BinaryHeader header = { cc->opcode, 0, 0, 1, (uint32_t)len };
+    uint64_t start = clock_monotonic_ns();
+    for (long i = 0; i < COMMAND_OPS; i++) {
+        if (cc->opcode != 0) {
+            process_binary_command(&header, cc->line, &out);
+        } else {
+            process_command(cc->line, len, &out, NULL, NULL);
+        }
+        buffer_consume(&out, buffer_length(&out));
+    }
+    uint64_t elapsed = clock_monotonic_ns() - start;
+    
+    buffer_free(&out);
+    return (double)elapsed / COMMAND_OPS;
+}
+
+static void bench_commands(void) {
+    static const struct {
+        const char* name;
+        CommandCase cc;
+    } cases[] = {
+        { "command.PING", { "PING", 0 } },
+        { "command.TIME", { "TIME", 0 } },
+        { "command.ECHO", { "ECHO hello world", 0 } },
+        { "command.STATS", { "STATS", 0 } },
+        { "command.QUIT", { "QUIT", 0 } },
+        { "command.SET", { "SET bench:key hello world", 0 } },
+        { "command.GET", { "GET bench:key", 0 } },
+        { "command.INCR", { "INCR bench:counter", 0 } },
+        { "command.unknown", { "NOSUCHVERB", 0 } },
+        { "command.binary.PING", { "", OPCODE_PING } },
+        { "command.binary.ECHO", { "hello world", OPCODE_ECHO } },
+    };
+    
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        run_benchmark(cases[i].name, "ns/op", bench_command, (void*)&cases[i].cc);
+    }
+}
+
+// ---- Rate limiting ----
+
+typedef struct {
+    int threads;
+    int addresses;          // distinct clients, spread over the threads
+} RateCase;
+
+typedef struct {
+    const RateCase* rc;
+    int index;
+} RateThread;
+
+static void* ratelimit_thread(void* arg) {
+    const RateThread* rt = (const RateThread*)arg;
+    long checks = RATELIMIT_CHECKS / rt->rc->threads;
+    uint32_t first = (uint32_t)(rt->index * rt->rc->addresses / rt->rc->threads);
+    for (long i = 0; i < checks; i++) {
+        // 10.x.y.z in network byte order
+        uint32_t host = 0x0A000000u + first + (uint32_t)(i % rt->rc->addresses);
+        ratelimit_allow_command(htonl(host));
+    }
+    return NULL;
+}
+
+static double bench_ratelimit(void* arg) {
+    const RateCase* rc = (const RateCase*)arg;
+    pthread_t threads[16];
+    RateThread args[16];
+    
+    uint64_t start = clock_monotonic_ns();
+    for (int i = 0; i < rc->threads; i++) {
+        args[i].rc = rc;
+        args[i].index = i;
+        pthread_create(&threads[i], NULL, ratelimit_thread, &args[i]);
+    }
+    for (int i = 0; i < rc->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = clock_monotonic_ns() - start;
+    return (double)elapsed * rc->threads / RATELIMIT_CHECKS;
+}
+
+static void bench_ratelimits(void) {
+    static const struct {
+        const char* name;
+        RateCase rc;
+    } cases[] = {
+        { "ratelimit.command.one", { 1, 1 } },
+        { "ratelimit.command.many", { 1, 1024 } },
+        { "ratelimit.command.shared.t4", { 4, 1 } },
+    };
+    
+    // Limits high enough that every check takes a token
+    RateLimitConfig config = { 0, 0, RATELIMIT_RATE_MAX, RATELIMIT_BURST_MAX, 4096 };
+    if (ratelimit_init(&config) < 0) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        run_benchmark(cases[i].name, "ns/op", bench_ratelimit, (void*)&cases[i].rc);
+    }
+    
+    // The loopback benchmark runs unlimited
+    RateLimitConfig off = { 0, 0, 0, 0, 0 };
+    ratelimit_init(&off);
+}
+
+// ---- Logger ----
+
+typedef struct {
+    int threads;
+} LogCase;
+
+static void* log_thread(void* arg) {
+    long count = (long)(intptr_t)arg;
+    for (long i = 0; i < count; i++) {
+        log_message(LOG_INFO, "Benchmark message %ld from a contending thread", i);
+    }
+    return NULL;
+}
+
+// Messages per second over all threads
+static double bench_logger(void* arg) {
+    const LogCase* lc = (const LogCase*)arg;
+    pthread_t threads[16];
+    long per_thread = LOG_MESSAGES / lc->threads;
+    
+    uint64_t start = clock_monotonic_ns();
+    for (int i = 0; i < lc->threads; i++) {
+        pthread_create(&threads[i], NULL, log_thread, (void*)(intptr_t)per_thread);
+    }
+    for (int i = 0; i < lc->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = clock_monotonic_ns() - start;
+    return (double)(per_thread * lc->threads) * 1e9 / (double)elapsed;
+}
+
+static void bench_loggers(void) {
+    static const int thread_counts[] = { 1, 4, 8 };
+    char name[64];
+    
+    for (int async = 0; async <= 1; async++) {
+        logger_init("/dev/null", LOG_INFO);
+        if (async && logger_start_async(4096, LOG_OVERFLOW_BLOCK) < 0) {
+            logger_close();
+            return;
+        }
+        for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+            LogCase lc = { thread_counts[t] };
+            snprintf(name, sizeof(name), "logger.%s.t%d", async ? "async" : "sync", lc.threads);
+            run_benchmark(name, "msg/s", bench_logger, &lc);
+        }
+        logger_close();
+    }
+}
+
+// ---- Configuration ----
+
+static double bench_config(void* arg) {
+    const char* path = (const char*)arg;
+    ServerConfig config;
+    uint64_t start = clock_monotonic_ns();
+    for (int i = 0; i < CONFIG_LOADS; i++) {
+        config_load(path, &config);
+    }
+    return (double)(clock_monotonic_ns() - start) / CONFIG_LOADS;
+}
+
+// ---- Loopback ----
+
+typedef struct {
+    int port;
+    uint64_t deadline;
+    long requests;
+} LoopbackClient;
+
+static void* loopback_client(void* arg) {
+    LoopbackClient* client = (LoopbackClient*)arg;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)client->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    char request[LOOPBACK_PIPELINE * 5];
+    for (int i = 0; i < LOOPBACK_PIPELINE; i++) {
+        memcpy(request + i * 5, "PING\n", 5);
+    }
+    char reply[LOOPBACK_PIPELINE * 5];
+    
+    while (clock_monotonic_ns() < client->deadline) {
+        if (send(fd, request, sizeof(request), 0) != (ssize_t)sizeof(request)) {
+            break;
+        }
+        size_t got = 0;
+        while (got < sizeof(reply)) {
+            ssize_t n = recv(fd, reply + got, sizeof(reply) - got, 0);
+            if (n <= 0) {
+                close(fd);
+                return NULL;
+            }
+            got += (size_t)n;
+        }
+        client->requests += LOOPBACK_PIPELINE;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void* reactor_thread(void* arg) {
+    reactor_run((Reactor*)arg);
+    return NULL;
+}
+
+// Pipelined PINGs against an in-process reactor: requests per second
+static double bench_loopback(void* arg) {
+    (void)arg;
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 128) < 0 ||
+        getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len) < 0) {
+        perror("loopback listener");
+        exit(1);
+    }
+    
+    int stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ThreadPool* pool = thread_pool_create(4, NULL);
+    Reactor* reactor = reactor_create(stop_fd, pool);
+    reactor_add_listener(reactor, listen_fd, NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, reactor_thread, reactor);
+    
+    LoopbackClient clients[LOOPBACK_CLIENTS];
+    pthread_t client_threads[LOOPBACK_CLIENTS];
+    uint64_t start = clock_monotonic_ns();
+    for (int i = 0; i < LOOPBACK_CLIENTS; i++) {
+        clients[i].port = ntohs(addr.sin_port);
+        clients[i].deadline = start + LOOPBACK_MS * 1000000ULL;
+        clients[i].requests = 0;
+        pthread_create(&client_threads[i], NULL, loopback_client, &clients[i]);
+    }
+    long requests = 0;
+    for (int i = 0; i < LOOPBACK_CLIENTS; i++) {
+        pthread_join(client_threads[i], NULL);
+        requests += clients[i].requests;
+    }
+    uint64_t elapsed = clock_monotonic_ns() - start;
+    
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) < 0) {
+        perror("write");
+    }
+    pthread_join(thread, NULL);
+    thread_pool_destroy(pool);
+    reactor_destroy(reactor);
+    close(listen_fd);
+    close(stop_fd);
+    return (double)requests * 1e9 / (double)elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    const char* output = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:f:o:")) != -1) {
+        switch (opt) {
+            case 'r': reps = atoi(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'o': output = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-r reps] [-f filter] [-o file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (reps < 1 || reps > MAX_REPS) {
+        fprintf(stderr, "reps must be between 1 and %d\n", MAX_REPS);
+        return 1;
+    }
+    
+    // The logger always writes to stdout, so keep the real stdout for the
+    // JSON and send everything else to /dev/null
+    int stdout_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (stdout_fd < 0 || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+        perror("stdout");
+        return 1;
+    }
+    close(null_fd);
+    json = (output != NULL) ? fopen(output, "w") : fdopen(stdout_fd, "w");
+    if (json == NULL) {
+        perror(output);
+        return 1;
+    }
+    logger_init(NULL, LOG_ERROR);
+    kv_init(0);
+    
+    fprintf(json, "{\n  \"benchmarks\": [");
+    bench_pools();
+    bench_pool_lane_cases();
+    bench_commands();
+    bench_ratelimits();
+    bench_loggers();
+    logger_init(NULL, LOG_ERROR);
+    if (access("config.txt", R_OK) == 0) {
+        run_benchmark("config.load", "ns/op", bench_config, (void*)"config.txt");
+    }
+    run_benchmark("loopback.ping", "req/s", bench_loopback, NULL);
+    fprintf(json, "\n  ]\n}\n");
+    
+    fclose(json);
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include "buffer.h"
+#include "object_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Slab size of every class, so a class costs at most this much before
+// its first buffer is returned
+#define BUFFER_SLAB_BYTES (256 * 1024)
+
+static ObjectPool* pools[BUFFER_CLASSES];
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+
+// Buffers past BUFFER_POOLED_MAX, or of a class whose pool could not be
+// created
+static atomic_size_t malloc_count = 0;
+static atomic_size_t malloc_bytes = 0;
+
+static void pools_init(void) {
+    static const char* names[BUFFER_CLASSES] = {
+        "buffers 4K", "buffers 8K", "buffers 16K", "buffers 32K", "buffers 64K"
+    };
+    for (int c = 0; c < BUFFER_CLASSES; c++) {
+        size_t size = (size_t)BUFFER_MIN_CAPACITY << c;
+        pools[c] = object_pool_create(names[c], size, BUFFER_SLAB_BYTES / size);
+    }
+}
+
+// Pool for storage of cap bytes, or NULL if it comes from malloc
+static ObjectPool* class_pool(size_t cap) {
+    int c = 0;
+    while (c < BUFFER_CLASSES && ((size_t)BUFFER_MIN_CAPACITY << c) < cap) {
+        c++;
+    }
+    if (c == BUFFER_CLASSES || ((size_t)BUFFER_MIN_CAPACITY << c) != cap) {
+        return NULL;
+    }
+    return pools[c];
+}
+
+static char* storage_alloc(size_t cap) {
+    pthread_once(&pools_once, pools_init);
+    ObjectPool* pool = class_pool(cap);
+    if (pool != NULL) {
+        return (char*)object_pool_alloc(pool);
+    }
+    char* data = (char*)malloc(cap);
+    if (data != NULL) {
+        atomic_fetch_add_explicit(&malloc_count, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&malloc_bytes, cap, memory_order_relaxed);
+    }
+    return data;
+}
+
+static void storage_free(char* data, size_t cap) {
+    if (data == NULL) {
+        return;
+    }
+    ObjectPool* pool = class_pool(cap);
+    if (pool != NULL) {
+        object_pool_free(pool, data);
+        return;
+    }
+    free(data);
+    atomic_fetch_sub_explicit(&malloc_count, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&malloc_bytes, cap, memory_order_relaxed);
+}
+
+void buffer_init(Buffer* buf) {
+    buf->data = NULL;
+    buf->start = 0;
+    buf->end = 0;
+    buf->cap = 0;
+}
+
+void buffer_free(Buffer* buf) {
+    storage_free(buf->data, buf->cap);
+    buffer_init(buf);
+}
+
+int buffer_reserve(Buffer* buf, size_t len) {
+    if (buffer_space(buf) >= len) {
+        return 0;
+    }
+    
+    // Slide unread data to the front if that makes room
+    size_t used = buffer_length(buf);
+    if (buf->cap - used >= len) {
+        memmove(buf->data, buf->data + buf->start, used);
+        buf->start = 0;
+        buf->end = (uint32_t)used;
+        return 0;
+    }
+    if (len > BUFFER_MAX_SIZE - used) {
+        return -1;
+    }
+    
+    // Move up a size class; the unread data is copied to the front
+    size_t cap = (buf->cap == 0) ? BUFFER_MIN_CAPACITY : (size_t)buf->cap * 2;
+    while (cap - used < len) {
+        cap *= 2;
+    }
+    if (cap > BUFFER_MAX_SIZE) {
+        cap = BUFFER_MAX_SIZE;
+    }
+    
+    char* data = storage_alloc(cap);
+    if (data == NULL) {
+        return -1;
+    }
+    if (used > 0) {
+        memcpy(data, buf->data + buf->start, used);
+    }
+    storage_free(buf->data, buf->cap);
+    buf->data = data;
+    buf->start = 0;
+    buf->end = (uint32_t)used;
+    buf->cap = (uint32_t)cap;
+    return 0;
+}
+
+int buffer_append(Buffer* buf, const void* data, size_t len) {
+    if (buffer_reserve(buf, len) < 0) {
+        return -1;
+    }
+    memcpy(buffer_tail(buf), data, len);
+    buf->end += (uint32_t)len;
+    return 0;
+}
+
+void buffer_consume(Buffer* buf, size_t len) {
+    buf->start += (uint32_t)len;
+    if (buf->start >= buf->end) {
+        // Empty: rewind so the next append starts at the front
+        buf->start = 0;
+        buf->end = 0;
+    }
+}
+
+void buffer_swap(Buffer* a, Buffer* b) {
+    Buffer tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+void buffer_pool_stats(BufferClassStats* stats) {
+    pthread_once(&pools_once, pools_init);
+    for (int c = 0; c < BUFFER_CLASSES; c++) {
+        BufferClassStats* entry = &stats[c];
+        memset(entry, 0, sizeof(*entry));
+        entry->size = (size_t)BUFFER_MIN_CAPACITY << c;
+        if (pools[c] != NULL) {
+            ObjectPoolStats pool;
+            object_pool_stats(pools[c], &pool);
+            entry->in_use = pool.live;
+            entry->bytes = pool.live * entry->size;
+            entry->cached = pool.free;
+        }
+    }
+    BufferClassStats* large = &stats[BUFFER_CLASSES];
+    large->size = 0;
+    large->in_use = atomic_load_explicit(&malloc_count, memory_order_relaxed);
+    large->bytes = atomic_load_explicit(&malloc_bytes, memory_order_relaxed);
+    large->cached = 0;
+}
@@ -0,0 +1,89 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Growable byte buffer with a read cursor. Data lives in [start, end);
+// consuming advances start and appending compacts before it grows.
+// Storage comes from size-classed pools shared by every buffer, and is
+// only held while the buffer is in use: owners call buffer_free() once
+// it is drained. Buffers are kept small (24 bytes) for per-connection
+// state, so they hold at most BUFFER_MAX_SIZE bytes.
+typedef struct {
+    char* data;
+    uint32_t start;
+    uint32_t end;
+    uint32_t cap;
+} Buffer;
+
+#define BUFFER_MAX_SIZE UINT32_MAX
+
+// Storage size classes: powers of two from BUFFER_MIN_CAPACITY to
+// BUFFER_POOLED_MAX; larger buffers come from malloc
+#define BUFFER_MIN_CAPACITY 4096
+#define BUFFER_POOLED_MAX (64 * 1024)
+#define BUFFER_CLASSES 5
+
+// Storage of one size class (size 0 reports the malloc'd buffers above
+// the largest class)
+typedef struct {
+    size_t size;
+    size_t in_use;          // buffers holding storage of this class
+    size_t bytes;           // of storage they hold
+    size_t cached;          // pooled and not in use
+} BufferClassStats;
+
+// Snapshot the classes, then the malloc'd buffers, into stats
+// (BUFFER_CLASSES + 1 entries); approximate while other threads run
+void buffer_pool_stats(BufferClassStats* stats);
+
+// Start empty; no memory is allocated until the first append
+void buffer_init(Buffer* buf);
+
+// Free the storage and return to the empty state
+void buffer_free(Buffer* buf);
+
+// Make room for at least len more bytes at the end. Returns 0 on
+// success, -1 if allocation fails.
+int buffer_reserve(Buffer* buf, size_t len);
+
+// Copy len bytes to the end. Returns 0 on success, -1 on failure.
+int buffer_append(Buffer* buf, const void* data, size_t len);
+
+// Drop len bytes from the front
+void buffer_consume(Buffer* buf, size_t len);
+
+// Exchange the contents of two buffers
+void buffer_swap(Buffer* a, Buffer* b);
+
+// Unread bytes
+static inline size_t buffer_length(const Buffer* buf) {
+    return buf->end - buf->start;
+}
+
+// First unread byte
+static inline char* buffer_begin(Buffer* buf) {
+    return buf->data + buf->start;
+}
+
+// Free space after the data, filled by the caller then committed
+static inline char* buffer_tail(Buffer* buf) {
+    return buf->data + buf->end;
+}
+
+static inline size_t buffer_space(const Buffer* buf) {
+    return buf->cap - buf->end;
+}
+
+// Account for len bytes written at buffer_tail()
+static inline void buffer_commit(Buffer* buf, size_t len) {
+    buf->end += len;
+}
+
+// Drop len bytes from the end
+static inline void buffer_trim(Buffer* buf, size_t len) {
+    buf->end -= len;
+}
+
+#endif // BUFFER_H
@@ -0,0 +1,88 @@
+#include "clock.h"
+#include <string.h>
+#include <stdatomic.h>
+
+#define TIMESTAMP_WORDS ((CLOCK_TIMESTAMP_LEN + 7) / 8)
+
+// The formatted second, published through a seqlock: the writer makes seq
+// odd while it updates second and text, readers retry if seq was odd or
+// changed under them. The text is kept in atomic words so torn reads are
+// discarded rather than undefined.
+static atomic_uint seq = 0;
+static _Atomic time_t cached_second = (time_t)-1;
+static _Atomic uint64_t cached_text[TIMESTAMP_WORDS];
+
+// Held by the thread that refreshes the cache; others don't wait for it
+static atomic_flag refreshing = ATOMIC_FLAG_INIT;
+
+time_t clock_now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void format_local(time_t second, uint64_t* words) {
+    char text[TIMESTAMP_WORDS * 8] = {0};
+    struct tm tm_info;
+    localtime_r(&second, &tm_info);
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm_info);
+    memcpy(words, text, sizeof(text));
+}
+
+static void publish(time_t second, const uint64_t* words) {
+    unsigned start = atomic_load_explicit(&seq, memory_order_relaxed);
+    atomic_store_explicit(&seq, start + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    
+    atomic_store_explicit(&cached_second, second, memory_order_relaxed);
+    for (int i = 0; i < TIMESTAMP_WORDS; i++) {
+        atomic_store_explicit(&cached_text[i], words[i], memory_order_relaxed);
+    }
+    
+    atomic_store_explicit(&seq, start + 2, memory_order_release);
+}
+
+// Returns 1 with the cached text in words if it is for the given second
+static int read_cached(time_t second, uint64_t* words) {
+    for (;;) {
+        unsigned start = atomic_load_explicit(&seq, memory_order_acquire);
+        if (start & 1) {
+            return 0;
+        }
+        time_t cached = atomic_load_explicit(&cached_second, memory_order_relaxed);
+        for (int i = 0; i < TIMESTAMP_WORDS; i++) {
+            words[i] = atomic_load_explicit(&cached_text[i], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&seq, memory_order_relaxed) == start) {
+            return cached == second;
+        }
+    }
+}
+
+size_t clock_timestamp(char* buf) {
+    uint64_t words[TIMESTAMP_WORDS];
+    time_t now = clock_now_seconds();
+    
+    if (!read_cached(now, words)) {
+        // First caller of a new second formats it; callers that race it
+        // format privately rather than wait
+        format_local(now, words);
+        if (!atomic_flag_test_and_set_explicit(&refreshing, memory_order_acquire)) {
+            if (atomic_load_explicit(&cached_second, memory_order_relaxed) < now) {
+                publish(now, words);
+            }
+            atomic_flag_clear_explicit(&refreshing, memory_order_release);
+        }
+    }
+    
+    memcpy(buf, words, CLOCK_TIMESTAMP_LEN);
+    buf[CLOCK_TIMESTAMP_LEN] = '\0';
+    return CLOCK_TIMESTAMP_LEN;
+}
+
+uint64_t clock_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
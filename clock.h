@@ -0,0 +1,22 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Length of a "YYYY-MM-DD HH:MM:SS" local timestamp, without the NUL
+#define CLOCK_TIMESTAMP_LEN 19
+
+// Wall-clock seconds since the epoch (coarse clock, no system call)
+time_t clock_now_seconds(void);
+
+// Copy the local time of the current second, formatted once per second
+// and shared by all threads, to buf (at least CLOCK_TIMESTAMP_LEN + 1
+// bytes, NUL-terminated). Returns CLOCK_TIMESTAMP_LEN.
+size_t clock_timestamp(char* buf);
+
+// High-resolution monotonic clock in nanoseconds, for latencies
+uint64_t clock_monotonic_ns(void);
+
+#endif // CLOCK_H
@@ -1,4 +1,5 @@
 #include "config.h"
+#include "udp.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,9 +7,48 @@
 void config_set_defaults(ServerConfig* config) {
     config->port = 8080;
     config->thread_pool_size = 4;
-    config->max_connections = 100;
+    config->thread_pool_queue = THREAD_POOL_QUEUE_LOCKFREE;
+    config->task_queue_capacity = 65536;
+    config->thread_pool_scheduler = THREAD_POOL_SCHED_FIFO;
+    config->thread_pool_high_weight = 8;
+    config->thread_pool_reserved_workers = 0;
+    config->reactor_threads = 1;
+    config->worker_cpus.count = 0;
+    config->reactor_cpus.count = 0;
+    config->io_backend = IO_BACKEND_EPOLL;
+    config->task_queue_limit = 65536;
+    config->max_connections = 1024;
+    config->listen_backlog = 128;
+    config->overload_policy = CONNECTION_OVERLOAD_REJECT;
+    config->idle_timeout_ms = 300000;
+    config->read_timeout_ms = 30000;
+    config->write_timeout_ms = 30000;
+    config->drain_timeout_ms = 10000;
+    socket_profile_init(&config->socket_profiles[0], "default");
+    config->socket_profile_count = 1;
+    config->listeners[0].port = config->port;
+    config->listeners[0].profile = 0;
+    strcpy(config->listeners[0].profile_name, "default");
+    config->listener_count = 1;
+    strcpy(config->tls_cert_file, "");
+    strcpy(config->tls_key_file, "");
+    config->tls_session_cache = 20480;
+    strcpy(config->upgrade_socket, "");
+    config->udp_port = 0;
+    config->udp_batch = 32;
+    config->kv_memory_limit_mb = 64;
+    config->pubsub_queue_limit_kb = 1024;
+    config->pubsub_overflow = PUBSUB_OVERFLOW_DISCONNECT;
+    config->rate_limit.connections_per_sec = 0;
+    config->rate_limit.connection_burst = 0;
+    config->rate_limit.commands_per_sec = 0;
+    config->rate_limit.command_burst = 0;
+    config->rate_limit.table_size = 65536;
     config->log_level = LOG_INFO;
     strcpy(config->log_file, "");
+    config->log_async = 1;
+    config->log_buffer_records = 4096;
+    config->log_overflow = LOG_OVERFLOW_DROP;
 }
 
 static LogLevel parse_log_level(const char* level_str) {
@@ -22,6 +62,111 @@ static LogLevel parse_log_level(const char* level_str) {
     return LOG_INFO;
 }
 
+static LogOverflowPolicy parse_log_overflow(const char* overflow_str) {
+    if (strcmp(overflow_str, "block") == 0) {
+        return LOG_OVERFLOW_BLOCK;
+    }
+    return LOG_OVERFLOW_DROP;
+}
+
+static ThreadPoolQueueType parse_queue_type(const char* queue_str) {
+    if (strcmp(queue_str, "mutex") == 0) {
+        return THREAD_POOL_QUEUE_MUTEX;
+    }
+    return THREAD_POOL_QUEUE_LOCKFREE;
+}
+
+static ThreadPoolScheduler parse_scheduler(const char* scheduler_str) {
+    if (strcmp(scheduler_str, "work_stealing") == 0) {
+        return THREAD_POOL_SCHED_WORK_STEALING;
+    }
+    return THREAD_POOL_SCHED_FIFO;
+}
+
+static PubsubOverflowPolicy parse_pubsub_overflow(const char* overflow_str) {
+    if (strcmp(overflow_str, "drop") == 0) {
+        return PUBSUB_OVERFLOW_DROP;
+    }
+    return PUBSUB_OVERFLOW_DISCONNECT;
+}
+
+static ConnectionOverloadPolicy parse_overload_policy(const char* policy_str) {
+    if (strcmp(policy_str, "pause") == 0) {
+        return CONNECTION_OVERLOAD_PAUSE;
+    }
+    return CONNECTION_OVERLOAD_REJECT;
+}
+
+static int find_profile(ServerConfig* config, const char* name) {
+    for (int i = 0; i < config->socket_profile_count; i++) {
+        if (strcmp(config->socket_profiles[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// SOCKET_PROFILE.<name>.<option>: profiles are created on first mention
+static void parse_profile_option(ServerConfig* config, const char* key, const char* value) {
+    char name[SOCKET_PROFILE_NAME_SIZE];
+    const char* dot = strchr(key, '.');
+    size_t len = (dot != NULL) ? (size_t)(dot - key) : 0;
+    if (len == 0 || len >= sizeof(name)) {
+        fprintf(stderr, "Invalid socket profile key: SOCKET_PROFILE.%s\n", key);
+        return;
+    }
+    memcpy(name, key, len);
+    name[len] = '\0';
+    
+    int index = find_profile(config, name);
+    if (index < 0) {
+        if (config->socket_profile_count == SOCKET_MAX_PROFILES) {
+            fprintf(stderr, "Too many socket profiles, ignoring %s\n", name);
+            return;
+        }
+        index = config->socket_profile_count++;
+        socket_profile_init(&config->socket_profiles[index], name);
+    }
+    if (socket_profile_set(&config->socket_profiles[index], dot + 1, value) < 0) {
+        fprintf(stderr, "Unknown socket option: SOCKET_PROFILE.%s\n", key);
+    }
+}
+
+// LISTENERS=port[:profile],...; profile names are resolved once the
+// whole file has been read
+static void parse_listeners(ServerConfig* config, const char* value) {
+    char list[192];
+    snprintf(list, sizeof(list), "%s", value);
+    
+    config->listener_count = 0;
+    char* saveptr = NULL;
+    for (char* item = strtok_r(list, ", ", &saveptr); item != NULL;
+         item = strtok_r(NULL, ", ", &saveptr)) {
+        if (config->listener_count == SOCKET_MAX_LISTENERS) {
+            fprintf(stderr, "Too many listeners, ignoring %s\n", item);
+            continue;
+        }
+        int port = atoi(item);
+        if (port <= 0) {
+            fprintf(stderr, "Invalid listener: %s\n", item);
+            continue;
+        }
+        ListenerConfig* listener = &config->listeners[config->listener_count++];
+        char* colon = strchr(item, ':');
+        listener->port = port;
+        listener->profile = 0;
+        snprintf(listener->profile_name, sizeof(listener->profile_name), "%s",
+                 (colon != NULL) ? colon + 1 : "default");
+    }
+}
+
+static IoBackend parse_io_backend(const char* backend_str) {
+    if (strcmp(backend_str, "io_uring") == 0) {
+        return IO_BACKEND_IO_URING;
+    }
+    return IO_BACKEND_EPOLL;
+}
+
 int config_load(const char* config_file, ServerConfig* config) {
     FILE* fp = fopen(config_file, "r");
     if (fp == NULL) {
@@ -31,6 +176,7 @@ int config_load(const char* config_file, ServerConfig* config) {
     char line[256];
     char key[64];
     char value[192];
+    int listeners_set = 0;
     
     while (fgets(line, sizeof(line), fp) != NULL) {
         // Skip comments and empty lines
@@ -60,19 +206,131 @@ int config_load(const char* config_file, ServerConfig* config) {
             // Set configuration values
             if (strcmp(key_start, "PORT") == 0) {
                 config->port = atoi(value_start);
+                if (!listeners_set) {
+                    config->listeners[0].port = config->port;
+                }
             } else if (strcmp(key_start, "THREAD_POOL_SIZE") == 0) {
                 config->thread_pool_size = atoi(value_start);
+            } else if (strcmp(key_start, "THREAD_POOL_QUEUE") == 0) {
+                config->thread_pool_queue = parse_queue_type(value_start);
+            } else if (strcmp(key_start, "TASK_QUEUE_CAPACITY") == 0) {
+                config->task_queue_capacity = atoi(value_start);
+            } else if (strcmp(key_start, "THREAD_POOL_SCHEDULER") == 0) {
+                config->thread_pool_scheduler = parse_scheduler(value_start);
+            } else if (strcmp(key_start, "THREAD_POOL_HIGH_WEIGHT") == 0) {
+                config->thread_pool_high_weight = atoi(value_start);
+            } else if (strcmp(key_start, "THREAD_POOL_RESERVED_WORKERS") == 0) {
+                config->thread_pool_reserved_workers = atoi(value_start);
+            } else if (strcmp(key_start, "REACTOR_THREADS") == 0) {
+                config->reactor_threads = atoi(value_start);
+            } else if (strcmp(key_start, "WORKER_CPUS") == 0) {
+                if (cpu_list_parse(value_start, &config->worker_cpus) < 0) {
+                    fprintf(stderr, "Invalid CPU list: WORKER_CPUS=%s\n", value_start);
+                }
+            } else if (strcmp(key_start, "REACTOR_CPUS") == 0) {
+                if (cpu_list_parse(value_start, &config->reactor_cpus) < 0) {
+                    fprintf(stderr, "Invalid CPU list: REACTOR_CPUS=%s\n", value_start);
+                }
+            } else if (strcmp(key_start, "IO_BACKEND") == 0) {
+                config->io_backend = parse_io_backend(value_start);
+            } else if (strcmp(key_start, "TASK_QUEUE_LIMIT") == 0) {
+                config->task_queue_limit = atoi(value_start);
             } else if (strcmp(key_start, "MAX_CONNECTIONS") == 0) {
                 config->max_connections = atoi(value_start);
+            } else if (strcmp(key_start, "LISTEN_BACKLOG") == 0) {
+                config->listen_backlog = atoi(value_start);
+            } else if (strcmp(key_start, "OVERLOAD_POLICY") == 0) {
+                config->overload_policy = parse_overload_policy(value_start);
+            } else if (strcmp(key_start, "IDLE_TIMEOUT_MS") == 0) {
+                config->idle_timeout_ms = atoi(value_start);
+            } else if (strcmp(key_start, "READ_TIMEOUT_MS") == 0) {
+                config->read_timeout_ms = atoi(value_start);
+            } else if (strcmp(key_start, "WRITE_TIMEOUT_MS") == 0) {
+                config->write_timeout_ms = atoi(value_start);
+            } else if (strcmp(key_start, "DRAIN_TIMEOUT_MS") == 0) {
+                config->drain_timeout_ms = atoi(value_start);
+            } else if (strcmp(key_start, "LISTENERS") == 0) {
+                parse_listeners(config, value_start);
+                listeners_set = 1;
+            } else if (strcmp(key_start, "TLS_CERT_FILE") == 0) {
+                snprintf(config->tls_cert_file, sizeof(config->tls_cert_file), "%s", value_start);
+            } else if (strcmp(key_start, "TLS_KEY_FILE") == 0) {
+                snprintf(config->tls_key_file, sizeof(config->tls_key_file), "%s", value_start);
+            } else if (strcmp(key_start, "TLS_SESSION_CACHE") == 0) {
+                config->tls_session_cache = atoi(value_start);
+            } else if (strcmp(key_start, "UPGRADE_SOCKET") == 0) {
+                snprintf(config->upgrade_socket, sizeof(config->upgrade_socket), "%s", value_start);
+            } else if (strcmp(key_start, "UDP_PORT") == 0) {
+                config->udp_port = atoi(value_start);
+            } else if (strcmp(key_start, "UDP_BATCH") == 0) {
+                config->udp_batch = atoi(value_start);
+            } else if (strcmp(key_start, "KV_MEMORY_LIMIT_MB") == 0) {
+                config->kv_memory_limit_mb = atoi(value_start);
+            } else if (strcmp(key_start, "PUBSUB_QUEUE_LIMIT_KB") == 0) {
+                config->pubsub_queue_limit_kb = atoi(value_start);
+            } else if (strcmp(key_start, "PUBSUB_OVERFLOW") == 0) {
+                config->pubsub_overflow = parse_pubsub_overflow(value_start);
+            } else if (strcmp(key_start, "RATE_LIMIT_CONNECTIONS") == 0) {
+                config->rate_limit.connections_per_sec = atoi(value_start);
+            } else if (strcmp(key_start, "RATE_LIMIT_CONNECTION_BURST") == 0) {
+                config->rate_limit.connection_burst = atoi(value_start);
+            } else if (strcmp(key_start, "RATE_LIMIT_COMMANDS") == 0) {
+                config->rate_limit.commands_per_sec = atoi(value_start);
+            } else if (strcmp(key_start, "RATE_LIMIT_COMMAND_BURST") == 0) {
+                config->rate_limit.command_burst = atoi(value_start);
+            } else if (strcmp(key_start, "RATE_LIMIT_TABLE_SIZE") == 0) {
+                config->rate_limit.table_size = atoi(value_start);
+            } else if (strncmp(key_start, "SOCKET_PROFILE.", 15) == 0) {
+                parse_profile_option(config, key_start + 15, value_start);
             } else if (strcmp(key_start, "LOG_LEVEL") == 0) {
                 config->log_level = parse_log_level(value_start);
             } else if (strcmp(key_start, "LOG_FILE") == 0) {
                 strncpy(config->log_file, value_start, sizeof(config->log_file) - 1);
                 config->log_file[sizeof(config->log_file) - 1] = '\0';
+            } else if (strcmp(key_start, "LOG_ASYNC") == 0) {
+                config->log_async = atoi(value_start);
+            } else if (strcmp(key_start, "LOG_BUFFER_RECORDS") == 0) {
+                config->log_buffer_records = atoi(value_start);
+            } else if (strcmp(key_start, "LOG_OVERFLOW") == 0) {
+                config->log_overflow = parse_log_overflow(value_start);
             }
         }
     }
     
     fclose(fp);
+    
+    if (config->reactor_threads < 1) {
+        config->reactor_threads = 1;
+    }
+    
+    if (config->pubsub_queue_limit_kb < 1) {
+        config->pubsub_queue_limit_kb = 1;
+    }
+    
+    if (config->rate_limit.table_size < 1) {
+        config->rate_limit.table_size = 65536;
+    }
+    
+    if (config->udp_batch < 1) {
+        config->udp_batch = 1;
+    } else if (config->udp_batch > UDP_BATCH_MAX) {
+        config->udp_batch = UDP_BATCH_MAX;
+    }
+    
+    if (config->listener_count == 0) {
+        config->listeners[0].port = config->port;
+        strcpy(config->listeners[0].profile_name, "default");
+        config->listener_count = 1;
+    }
+    for (int i = 0; i < config->listener_count; i++) {
+        ListenerConfig* listener = &config->listeners[i];
+        listener->profile = find_profile(config, listener->profile_name);
+        if (listener->profile < 0) {
+            fprintf(stderr, "Unknown socket profile %s for port %d, using default\n",
+                    listener->profile_name, listener->port);
+            listener->profile = 0;
+        }
+    }
+    
     return 0;
 }
@@ -2,13 +2,71 @@
 #define CONFIG_H
 
 #include "logger.h"
+#include "thread_pool.h"
+#include "connection.h"
+#include "socket_options.h"
+#include "cpu_affinity.h"
+#include "pubsub.h"
+#include "ratelimit.h"
+
+// Connection I/O backend
+typedef enum {
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_IO_URING
+} IoBackend;
+
+// A port to listen on and the socket profile it uses
+typedef struct {
+    int port;
+    int profile;                // index into ServerConfig.socket_profiles
+    char profile_name[SOCKET_PROFILE_NAME_SIZE];
+} ListenerConfig;
 
 typedef struct {
     int port;
     int thread_pool_size;
+    ThreadPoolQueueType thread_pool_queue;
+    int task_queue_capacity;
+    ThreadPoolScheduler thread_pool_scheduler;
+    int thread_pool_high_weight;
+    int thread_pool_reserved_workers;   // per shard
+    int reactor_threads;
+    // Empty lists leave threads to the scheduler
+    CpuList worker_cpus;
+    CpuList reactor_cpus;
+    IoBackend io_backend;
+    int task_queue_limit;
     int max_connections;
+    int listen_backlog;
+    ConnectionOverloadPolicy overload_policy;
+    int idle_timeout_ms;
+    int read_timeout_ms;
+    int write_timeout_ms;
+    int drain_timeout_ms;       // shutdown drain deadline; 0 closes at once
+    // socket_profiles[0] is "default"; LISTENERS replaces the single
+    // PORT listener
+    SocketProfile socket_profiles[SOCKET_MAX_PROFILES];
+    int socket_profile_count;
+    ListenerConfig listeners[SOCKET_MAX_LISTENERS];
+    int listener_count;
+    // Certificate chain and key for listeners whose profile sets TLS=1,
+    // and how many sessions the server keeps for resumption (0 = none:
+    // only session tickets resume)
+    char tls_cert_file[256];
+    char tls_key_file[256];
+    int tls_session_cache;
+    char upgrade_socket[108];    // Unix socket for listener handoff; "" = off
+    int udp_port;               // UDP health checks; 0 = off
+    int udp_batch;              // datagrams per recvmmsg()/sendmmsg()
+    int kv_memory_limit_mb;     // cache item memory; 0 = no limit
+    int pubsub_queue_limit_kb;  // messages queued per subscriber
+    PubsubOverflowPolicy pubsub_overflow;
+    RateLimitConfig rate_limit; // per client IP; rates of 0 = no limit
     LogLevel log_level;
     char log_file[256];
+    int log_async;
+    int log_buffer_records;
+    LogOverflowPolicy log_overflow;
 } ServerConfig;
 
 // Load configuration from file
@@ -0,0 +1,987 @@
+#define _GNU_SOURCE
+#include "connection.h"
+#include "reactor.h"
+#include "logger.h"
+#include "protocol.h"
+#include "pubsub.h"
+#include "object_pool.h"
+#include "stats.h"
+#include "ratelimit.h"
+#include "probes.h"
+#ifdef HAVE_TLS
+#include "tls.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define BUFFER_SIZE 4096
+
+// Longest partial line buffered before the connection is dropped
+#define CONNECTION_MAX_LINE (64 * 1024)
+
+// Reads per task before a busy connection yields its worker
+#define CONNECTION_READ_BUDGET 16
+
+#define CONNECTIONS_PER_SLAB 64
+
+// Most STREAM payload moved by one splice() call; a pipe holds 64 KB
+#define CONNECTION_SPLICE_CHUNK (64 * 1024)
+
+// Queued pub/sub messages written per sendmsg()
+#define CONNECTION_IOV_MAX 64
+
+// Connections are allocated and freed on reactor threads, and on the ring
+// thread under io_uring; the pool's per-thread caches absorb both
+static ObjectPool* connection_pool = NULL;
+static pthread_once_t connection_pool_once = PTHREAD_ONCE_INIT;
+
+// Per-client state of the backend in use, for STATS MEMORY
+static size_t connection_state_size = sizeof(Connection);
+
+// Admitted connections, counted exactly so the limit holds across shards
+static atomic_int connection_limit = 0;
+static atomic_int admitted = 0;
+
+static const char busy_reply[] = "ERROR: busy\n";
+static const char drain_reply[] = "ERROR: shutting down\n";
+static const char rate_limited_reply[] = "ERROR: Rate limited\n";
+
+static void connection_pool_init(void) {
+    connection_pool = object_pool_create("connections", sizeof(Connection), CONNECTIONS_PER_SLAB);
+}
+
+void connection_init(Connection* conn, int fd, const struct sockaddr_in* addr, struct Reactor* reactor) {
+    conn->fd = fd;
+    conn->reactor = reactor;
+    inet_ntop(AF_INET, &addr->sin_addr, conn->ip, sizeof(conn->ip));
+    conn->port = ntohs(addr->sin_port);
+    conn->addr = addr->sin_addr.s_addr;
+    PROBE3(connection__accept, fd, (const char*)conn->ip, conn->port);
+    buffer_init(&conn->in);
+    buffer_init(&conn->out);
+    conn->closing = 0;
+    conn->input_paused = 0;
+    conn->bulk = 0;
+    conn->protocol = CONNECTION_PROTOCOL_NEW;
+    conn->stream_remaining = 0;
+    conn->stream_pipe[0] = -1;
+    conn->stream_pipe[1] = -1;
+    conn->stream_piped = 0;
+    conn->stream_copy = 0;
+    conn->tls = 0;
+    conn->handshake = NULL;
+    conn->handshake_wants_write = 0;
+    conn->pubsub = NULL;
+    conn->adopted = 0;
+    conn->closed = 0;
+    atomic_init(&conn->deadline, 0);
+    conn->read_since_ms = 0;
+    conn->write_since_ms = 0;
+    conn->output_progress = 0;
+    timer_entry_init(&conn->timer);
+    conn->next_queued = NULL;
+    conn->next_kicked = NULL;
+    conn->live_prev = NULL;
+    conn->live_next = NULL;
+    
+    stats_add(STATS_CONNECTIONS_ACCEPTED, 1);
+}
+
+int connection_timeouts_min(const ConnectionTimeouts* timeouts) {
+    int limits[] = { timeouts->idle_ms, timeouts->read_ms, timeouts->write_ms };
+    int min = 0;
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        if (limits[i] > 0 && (min == 0 || limits[i] < min)) {
+            min = limits[i];
+        }
+    }
+    return min;
+}
+
+void connection_update_deadline(Connection* conn, const ConnectionTimeouts* timeouts,
+                                size_t unsent, uint64_t now_ms) {
+    ConnectionTimeoutKind kind;
+    uint64_t since;
+    int limit;
+    
+    if (unsent > 0) {
+        // Slow reader: the clock restarts whenever the peer takes output
+        if (conn->write_since_ms == 0 || conn->output_progress) {
+            conn->write_since_ms = now_ms;
+        }
+        kind = CONNECTION_TIMEOUT_WRITE;
+        since = conn->write_since_ms;
+        limit = timeouts->write_ms;
+    } else if (buffer_length(&conn->in) > 0 || conn->handshake != NULL) {
+        // Slow sender: a request, or the TLS handshake, must complete in
+        // time however it trickles in
+        conn->write_since_ms = 0;
+        if (conn->read_since_ms == 0) {
+            conn->read_since_ms = now_ms;
+        }
+        kind = CONNECTION_TIMEOUT_READ;
+        since = conn->read_since_ms;
+        limit = timeouts->read_ms;
+    } else {
+        conn->write_since_ms = 0;
+        conn->read_since_ms = 0;
+        kind = CONNECTION_TIMEOUT_IDLE;
+        since = now_ms;
+        limit = timeouts->idle_ms;
+    }
+    conn->output_progress = 0;
+    
+    // The kind rides in the low bits so one load reads a consistent pair
+    uint64_t deadline = (limit > 0) ? (((since + (uint64_t)limit) << 2) | kind) : 0;
+    atomic_store_explicit(&conn->deadline, deadline, memory_order_relaxed);
+}
+
+void connection_clear_deadline(Connection* conn) {
+    atomic_store_explicit(&conn->deadline, 0, memory_order_relaxed);
+}
+
+ConnectionTimeoutKind connection_deadline(Connection* conn, uint64_t* due_ms) {
+    uint64_t deadline = atomic_load_explicit(&conn->deadline, memory_order_relaxed);
+    *due_ms = deadline >> 2;
+    return (ConnectionTimeoutKind)(deadline & 3);
+}
+
+void connection_timed_out(Connection* conn, ConnectionTimeoutKind kind) {
+    static const char* names[] = { "", "Idle", "Read", "Write" };
+    static const StatsCounter counters[] = {
+        STATS_TIMEOUTS_IDLE, STATS_TIMEOUTS_IDLE, STATS_TIMEOUTS_READ, STATS_TIMEOUTS_WRITE
+    };
+    LOG_INFO("%s timeout, closing %s:%d", names[kind], conn->ip, conn->port);
+    stats_add(counters[kind], 1);
+}
+
+void connection_set_limit(int max_connections) {
+    atomic_store(&connection_limit, (max_connections > 0) ? max_connections : 0);
+}
+
+int connection_admit(void) {
+    int limit = atomic_load_explicit(&connection_limit, memory_order_relaxed);
+    int count = atomic_fetch_add_explicit(&admitted, 1, memory_order_relaxed);
+    if (limit > 0 && count >= limit) {
+        atomic_fetch_sub_explicit(&admitted, 1, memory_order_relaxed);
+        return -1;
+    }
+    return 0;
+}
+
+void connection_admit_cancel(void) {
+    atomic_fetch_sub_explicit(&admitted, 1, memory_order_relaxed);
+}
+
+int connection_admission_full(void) {
+    int limit = atomic_load_explicit(&connection_limit, memory_order_relaxed);
+    return limit > 0 && atomic_load_explicit(&admitted, memory_order_relaxed) >= limit;
+}
+
+void connection_reject(int fd) {
+    // A fresh socket has an empty send buffer, so this doesn't block
+    send(fd, busy_reply, sizeof(busy_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    stats_add(STATS_CONNECTIONS_REJECTED, 1);
+}
+
+void connection_reject_rate_limited(int fd) {
+    send(fd, rate_limited_reply, sizeof(rate_limited_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    stats_add(STATS_RATE_LIMITED_CONNECTIONS, 1);
+}
+
+void connection_shed(Connection* conn) {
+    LOG_ERROR("Task queue full, dropping %s:%d", conn->ip, conn->port);
+    // Mid-handshake the client could not read it
+    if (conn->handshake == NULL) {
+        send(conn->fd, busy_reply, sizeof(busy_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    stats_add(STATS_CONNECTIONS_SHED, 1);
+    connection_close(conn);
+}
+
+void connection_release(Connection* conn) {
+    atomic_fetch_sub_explicit(&admitted, 1, memory_order_relaxed);
+    pubsub_detach(conn);
+    if (conn->stream_pipe[0] >= 0) {
+        close(conn->stream_pipe[0]);
+        close(conn->stream_pipe[1]);
+    }
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    stats_add(STATS_CONNECTIONS_CLOSED, 1);
+    LOG_DEBUG("Connection closed: %s:%d (Active: %d)",
+              conn->ip, conn->port, stats_active_connections());
+}
+
+void connection_link(Connection** head, Connection* conn) {
+    conn->live_prev = NULL;
+    conn->live_next = *head;
+    if (*head != NULL) {
+        (*head)->live_prev = conn;
+    }
+    *head = conn;
+}
+
+void connection_unlink(Connection** head, Connection* conn) {
+    if (conn->live_prev != NULL) {
+        conn->live_prev->live_next = conn->live_next;
+    } else if (*head == conn) {
+        *head = conn->live_next;
+    }
+    if (conn->live_next != NULL) {
+        conn->live_next->live_prev = conn->live_prev;
+    }
+    conn->live_prev = NULL;
+    conn->live_next = NULL;
+}
+
+void connection_drain(Connection* conn) {
+    // Binary clients only ever get replies to their own frames
+    if (conn->protocol != CONNECTION_PROTOCOL_BINARY) {
+        buffer_append(&conn->out, drain_reply, sizeof(drain_reply) - 1);
+    }
+    conn->closing = 1;
+}
+
+int connection_start_tls(Connection* conn) {
+#ifdef HAVE_TLS
+    conn->handshake = tls_accept(conn->fd);
+    if (conn->handshake == NULL) {
+        return -1;
+    }
+    conn->tls = 1;
+    return 0;
+#else
+    LOG_ERROR("TLS connection from %s:%d, but TLS is not compiled in", conn->ip, conn->port);
+    return -1;
+#endif
+}
+
+void connection_set_state_size(size_t bytes) {
+    connection_state_size = bytes;
+}
+
+int connection_memory_report(char* buf, size_t size) {
+    BufferClassStats classes[BUFFER_CLASSES + 1];
+    buffer_pool_stats(classes);
+    
+    int connections = stats_active_connections();
+    size_t used = 0;
+    size_t buffers = 0;
+    size_t buffer_bytes = 0;
+    size_t cached_bytes = 0;
+    stats_report_append(buf, size, &used, "connections: %d\nconnection_state_bytes: %zu\n",
+                        connections, connection_state_size);
+    for (int c = 0; c < BUFFER_CLASSES; c++) {
+        const BufferClassStats* entry = &classes[c];
+        stats_report_append(buf, size, &used, "buffers_%zuk: %zu in use, %zu cached\n",
+                            entry->size / 1024, entry->in_use, entry->cached);
+        buffers += entry->in_use;
+        buffer_bytes += entry->bytes;
+        cached_bytes += entry->cached * entry->size;
+    }
+    const BufferClassStats* large = &classes[BUFFER_CLASSES];
+    stats_report_append(buf, size, &used, "buffers_large: %zu in use, %zu bytes\n",
+                        large->in_use, large->bytes);
+    buffers += large->in_use;
+    buffer_bytes += large->bytes;
+    
+    // Only connections with data pending hold buffers; the average is
+    // what the open connections cost together
+    size_t per_connection = connection_state_size;
+    if (connections > 0) {
+        per_connection += buffer_bytes / (size_t)connections;
+    }
+    stats_report_append(buf, size, &used, "buffer_bytes: %zu in %zu buffers, %zu cached\n",
+                        buffer_bytes, buffers, cached_bytes);
+    stats_report_append(buf, size, &used, "bytes_per_connection: %zu\n", per_connection);
+    
+    if (used >= size) {
+        used = (size > 0) ? size - 1 : 0;
+    }
+    return (int)used;
+}
+
+Connection* connection_create(int fd, const struct sockaddr_in* addr, struct Reactor* reactor) {
+    pthread_once(&connection_pool_once, connection_pool_init);
+    Connection* conn = (Connection*)object_pool_alloc(connection_pool);
+    if (conn == NULL) {
+        return NULL;
+    }
+    
+    connection_init(conn, fd, addr, reactor);
+    return conn;
+}
+
+void connection_close(Connection* conn) {
+    if (conn->reactor != NULL) {
+        reactor_close(conn->reactor, conn);
+        return;
+    }
+    connection_destroy(conn);
+}
+
+void connection_destroy(Connection* conn) {
+#ifdef HAVE_TLS
+    if (conn->handshake != NULL) {
+        tls_free(conn->handshake);
+        conn->handshake = NULL;
+    } else if (conn->tls) {
+        tls_close_notify(conn->fd);
+    }
+#endif
+    // close() also removes the descriptor from the reactor's epoll set
+    close(conn->fd);
+    connection_release(conn);
+    object_pool_free(connection_pool, conn);
+}
+
+// Answer a request over RATE_LIMIT_COMMANDS; header is NULL for text
+static int refuse_command(Connection* conn, const BinaryHeader* header) {
+    stats_add(STATS_RATE_LIMITED_COMMANDS, 1);
+    return protocol_rate_limited(header, &conn->out);
+}
+
+int connection_execute(Connection* conn, const char* line, size_t len) {
+    if (!ratelimit_allow_command(conn->addr)) {
+        return refuse_command(conn, NULL);
+    }
+    
+    if (!conn->bulk && !command_is_fast(line, len)) {
+        conn->bulk = 1;
+    }
+    int result = (conn->pubsub != NULL)
+                 ? process_subscriber_command(line, len, &conn->out, conn)
+                 : process_command(line, len, &conn->out, &conn->stream_remaining, conn);
+    
+    if (result == 1) {
+        LOG_INFO("Client requested disconnect: %s:%d", conn->ip, conn->port);
+    }
+    return result;
+}
+
+// Run every complete line in data, appending replies to conn->out, and
+// report through consumed how many bytes were framed
+static int frame_lines(Connection* conn, char* data, size_t len, size_t* consumed) {
+    size_t pos = 0;
+    int result = 0;
+    
+    conn->input_paused = 0;
+    while (pos < len) {
+        if (buffer_length(&conn->out) >= CONNECTION_OUTPUT_HIGH_WATER) {
+            conn->input_paused = 1;
+            break;
+        }
+        
+        // STREAM payload is echoed, not framed, and no more of it is
+        // copied than fits under the high-water mark
+        if (conn->stream_remaining > 0) {
+            size_t chunk = CONNECTION_OUTPUT_HIGH_WATER - buffer_length(&conn->out);
+            if (chunk > len - pos) {
+                chunk = len - pos;
+            }
+            if (chunk > conn->stream_remaining) {
+                chunk = (size_t)conn->stream_remaining;
+            }
+            if (buffer_append(&conn->out, data + pos, chunk) < 0) {
+                result = -1;
+                break;
+            }
+            conn->stream_remaining -= chunk;
+            pos += chunk;
+            continue;
+        }
+        
+        char* line = data + pos;
+        char* newline = (char*)memchr(line, '\n', len - pos);
+        if (newline == NULL) {
+            break;
+        }
+        pos += (size_t)(newline - line) + 1;
+        
+        size_t line_len = (size_t)(newline - line);
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len--;
+        }
+        
+        // Handlers parse the line in place and reply straight into the
+        // output buffer
+        int quit = connection_execute(conn, line, line_len);
+        if (quit < 0) {
+            result = -1;
+            break;
+        }
+        if (quit == 1) {
+            // Anything pipelined after QUIT is discarded
+            conn->closing = 1;
+            result = 1;
+            break;
+        }
+    }
+    
+    *consumed = pos;
+    return result;
+}
+
+// Run every complete binary frame in data, as frame_lines() does for text
+static int frame_binary(Connection* conn, char* data, size_t len, size_t* consumed) {
+    size_t pos = 0;
+    int result = 0;
+    
+    conn->input_paused = 0;
+    while (len - pos >= PROTOCOL_BINARY_HEADER_SIZE) {
+        if (buffer_length(&conn->out) >= CONNECTION_OUTPUT_HIGH_WATER) {
+            conn->input_paused = 1;
+            break;
+        }
+        
+        BinaryHeader header;
+        binary_header_decode(data + pos, &header);
+        if (header.length > PROTOCOL_BINARY_MAX_PAYLOAD) {
+            LOG_ERROR("Frame too large from %s:%d", conn->ip, conn->port);
+            stats_add(STATS_ERRORS, 1);
+            result = -1;
+            break;
+        }
+        if (len - pos - PROTOCOL_BINARY_HEADER_SIZE < header.length) {
+            break;
+        }
+        const char* payload = data + pos + PROTOCOL_BINARY_HEADER_SIZE;
+        pos += PROTOCOL_BINARY_HEADER_SIZE + header.length;
+        
+        if (!conn->bulk && !opcode_is_fast(header.opcode)) {
+            conn->bulk = 1;
+        }
+        int quit = ratelimit_allow_command(conn->addr)
+                   ? process_binary_command(&header, payload, &conn->out)
+                   : refuse_command(conn, &header);
+        if (quit < 0) {
+            result = -1;
+            break;
+        }
+        if (quit == 1) {
+            LOG_INFO("Client requested disconnect: %s:%d", conn->ip, conn->port);
+            conn->closing = 1;
+            result = 1;
+            break;
+        }
+    }
+    
+    *consumed = pos;
+    return result;
+}
+
+static int frame_input(Connection* conn, char* data, size_t len, size_t* consumed) {
+    size_t skip = 0;
+    if (conn->protocol == CONNECTION_PROTOCOL_NEW && len > 0) {
+        if ((unsigned char)data[0] == PROTOCOL_BINARY_MAGIC) {
+            conn->protocol = CONNECTION_PROTOCOL_BINARY;
+            skip = 1;
+        } else {
+            conn->protocol = CONNECTION_PROTOCOL_TEXT;
+        }
+    }
+    
+    int result;
+    if (conn->protocol == CONNECTION_PROTOCOL_BINARY) {
+        result = frame_binary(conn, data + skip, len - skip, consumed);
+    } else {
+        result = frame_lines(conn, data, len, consumed);
+    }
+    *consumed += skip;
+    if (*consumed > 0) {
+        // A request completed: the read timeout restarts with the next one
+        conn->read_since_ms = 0;
+    }
+    return result;
+}
+
+// Unless framing is paused, in holds a single incomplete request. Paused
+// input is bounded by the backend no longer reading.
+static int check_line_length(Connection* conn) {
+    size_t limit = (conn->protocol == CONNECTION_PROTOCOL_BINARY)
+                   ? PROTOCOL_BINARY_HEADER_SIZE + PROTOCOL_BINARY_MAX_PAYLOAD
+                   : CONNECTION_MAX_LINE;
+    if (!conn->input_paused && buffer_length(&conn->in) > limit) {
+        LOG_ERROR("Line too long from %s:%d", conn->ip, conn->port);
+        stats_add(STATS_ERRORS, 1);
+        return -1;
+    }
+    return 0;
+}
+
+int connection_feed(Connection* conn, char* data, size_t len) {
+    if (conn->closing) {
+        return 1;
+    }
+    
+    // A partial line is waiting: complete it in the input buffer
+    if (buffer_length(&conn->in) > 0) {
+        if (buffer_append(&conn->in, data, len) < 0) {
+            return -1;
+        }
+        return connection_consume(conn);
+    }
+    
+    // Common case: frame straight out of the caller's buffer and only
+    // copy a leftover tail
+    size_t consumed = 0;
+    int result = frame_input(conn, data, len, &consumed);
+    if (result != 0 || consumed == len) {
+        return result;
+    }
+    
+    if (buffer_append(&conn->in, data + consumed, len - consumed) < 0) {
+        return -1;
+    }
+    return check_line_length(conn);
+}
+
+int connection_consume(Connection* conn) {
+    if (conn->closing) {
+        return 1;
+    }
+    if (buffer_length(&conn->in) == 0) {
+        conn->input_paused = 0;
+        return 0;
+    }
+    
+    size_t consumed = 0;
+    int result = frame_input(conn, buffer_begin(&conn->in), buffer_length(&conn->in), &consumed);
+    buffer_consume(&conn->in, consumed);
+    if (buffer_length(&conn->in) == 0) {
+        // Split lines are rare; don't keep idle connections' memory
+        buffer_free(&conn->in);
+    }
+    
+    if (result != 0) {
+        return result;
+    }
+    return check_line_length(conn);
+}
+
+// Move spliced STREAM payload from the pipe to the socket
+static int flush_pipe(Connection* conn) {
+    while (conn->stream_piped > 0) {
+        ssize_t moved = splice(conn->stream_pipe[0], NULL, conn->fd, NULL, conn->stream_piped,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            conn->stream_piped -= (size_t)moved;
+            stats_add(STATS_BYTES_OUT, (uint64_t)moved);
+            conn->output_progress = 1;
+            continue;
+        }
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Write as much queued output as the socket accepts without blocking;
+// replies coalesced by the framer normally leave in a single send().
+// Spliced payload goes first: it was received before anything in out.
+static int flush_output(Connection* conn) {
+    if (flush_pipe(conn) < 0) {
+        return -1;
+    }
+    if (conn->stream_piped > 0) {
+        return 0;
+    }
+    
+    while (buffer_length(&conn->out) > 0) {
+        ssize_t sent = send(conn->fd, buffer_begin(&conn->out), buffer_length(&conn->out),
+                            MSG_NOSIGNAL);
+        if (sent > 0) {
+            buffer_consume(&conn->out, (size_t)sent);
+            stats_add(STATS_BYTES_OUT, (uint64_t)sent);
+            conn->output_progress = 1;
+            if (buffer_length(&conn->out) == 0) {
+                PROBE2(send__done, conn->fd, sent);
+            }
+            continue;
+        }
+        
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // The reactor reports EPOLLOUT once there is room
+            return 0;
+        }
+        return -1;
+    }
+    
+    // Drained: the storage goes back to the pool, so idle connections
+    // hold no buffers
+    buffer_free(&conn->out);
+    return 0;
+}
+
+// Read STREAM payload into the pipe without copying it to user space.
+// Returns like recv(); on EAGAIN the pipe may be full rather than the
+// socket empty, which a re-arm with EPOLLOUT sorts out.
+static ssize_t splice_stream(Connection* conn) {
+    if (conn->stream_pipe[0] < 0 && pipe2(conn->stream_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        conn->stream_pipe[0] = -1;
+        return -1;
+    }
+    
+    size_t want = CONNECTION_SPLICE_CHUNK - conn->stream_piped;
+    if (want > conn->stream_remaining) {
+        want = (size_t)conn->stream_remaining;
+    }
+    ssize_t moved = splice(conn->fd, NULL, conn->stream_pipe[1], NULL, want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved > 0) {
+        conn->stream_remaining -= (uint64_t)moved;
+        conn->stream_piped += (size_t)moved;
+    }
+    return moved;
+}
+
+// Whether the next read can splice: the stream's payload is all that is
+// left to relay, so nothing buffered has to go out before it
+static int can_splice(Connection* conn) {
+    return conn->stream_remaining > 0 && !conn->stream_copy &&
+           buffer_length(&conn->in) == 0 && buffer_length(&conn->out) == 0;
+}
+
+static void send_failed(Connection* conn) {
+    LOG_ERROR("send() failed for %s:%d: %s",
+              conn->ip, conn->port, strerror(errno));
+    stats_add(STATS_ERRORS, 1);
+    connection_close(conn);
+}
+
+// recv() into buffer. Returns the byte count, 0 to stop reading for now
+// (the socket is empty, or the drain shut its read side), or -1 once the
+// connection has been closed.
+static ssize_t receive(Connection* conn, char* buffer, size_t size) {
+    while (1) {
+        ssize_t bytes_received = recv(conn->fd, buffer, size, 0);
+        if (bytes_received > 0) {
+            stats_add(STATS_BYTES_IN, (uint64_t)bytes_received);
+            return bytes_received;
+        }
+        
+        // The drain shut the read side: answer what was read, then leave
+        // once the notice is out
+        if (bytes_received == 0 && reactor_draining(conn->reactor)) {
+            connection_drain(conn);
+            return 0;
+        }
+        if (bytes_received == 0) {
+            LOG_INFO("Client disconnected: %s:%d", conn->ip, conn->port);
+            // Best effort for replies to commands sent before the FIN
+            flush_output(conn);
+            connection_close(conn);
+            return -1;
+        }
+        
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        // Kernel TLS hands over application data only; anything else,
+        // such as the client's close_notify alert, ends the stream
+        if (errno == EIO && conn->tls) {
+            LOG_INFO("Client disconnected: %s:%d", conn->ip, conn->port);
+            flush_output(conn);
+            connection_close(conn);
+            return -1;
+        }
+        LOG_ERROR("recv() failed for %s:%d: %s",
+                  conn->ip, conn->port, strerror(errno));
+        stats_add(STATS_ERRORS, 1);
+        connection_close(conn);
+        return -1;
+    }
+}
+
+// Advance the TLS handshake. Returns 0 once it is done, and the socket
+// carries plaintext, or 1 if the connection was re-armed to wait for the
+// peer or closed.
+static int continue_handshake(Connection* conn) {
+#ifdef HAVE_TLS
+    TlsHandshakeResult result = tls_handshake(conn->handshake, conn->ip, conn->port);
+    if (result == TLS_HANDSHAKE_DONE) {
+        // Keys are in the kernel; nothing of OpenSSL's is kept per client
+        tls_free(conn->handshake);
+        conn->handshake = NULL;
+        conn->handshake_wants_write = 0;
+        return 0;
+    }
+    if (result == TLS_HANDSHAKE_FAILED) {
+        connection_close(conn);
+        return 1;
+    }
+    conn->handshake_wants_write = (result == TLS_HANDSHAKE_WANT_WRITE);
+    if (reactor_rearm(conn->reactor, conn) < 0) {
+        LOG_ERROR("Failed to re-arm %s:%d: %s",
+                  conn->ip, conn->port, strerror(errno));
+        connection_close(conn);
+    }
+    return 1;
+#else
+    connection_close(conn);
+    return 1;
+#endif
+}
+
+void connection_process(void* arg) {
+    Connection* conn = (Connection*)arg;
+    char buffer[BUFFER_SIZE];
+    
+    // Requests that came with the client's Finished are read below
+    if (conn->handshake != NULL && continue_handshake(conn) != 0) {
+        return;
+    }
+    
+    // A connection with nothing in flight is judged afresh by the
+    // commands it sends now
+    if (buffer_length(&conn->out) == 0 && conn->stream_remaining == 0 && !conn->input_paused) {
+        conn->bulk = 0;
+    }
+    
+    // Edge-triggered: keep reading until the socket is drained, but give
+    // other connections a turn once the read budget is spent
+    for (int reads = 0; !conn->closing; reads++) {
+        // Stop reading while the peer is not taking its replies
+        if (buffer_length(&conn->out) >= CONNECTION_OUTPUT_HIGH_WATER) {
+            if (flush_output(conn) < 0) {
+                send_failed(conn);
+                return;
+            }
+            if (buffer_length(&conn->out) >= CONNECTION_OUTPUT_HIGH_WATER) {
+                break;
+            }
+        }
+        
+        // Lines held back by the high-water mark come before new input
+        if (conn->input_paused && connection_consume(conn) < 0) {
+            connection_close(conn);
+            return;
+        }
+        if (conn->closing || conn->input_paused) {
+            continue;
+        }
+        
+        if (reads == CONNECTION_READ_BUDGET) {
+            if (flush_output(conn) < 0) {
+                send_failed(conn);
+                return;
+            }
+            // Re-queue ourselves in the normal lane; under work stealing
+            // this lands on this worker's own deque and runs next with a
+            // warm cache, unless the worker is reserved for the high lane
+            conn->bulk = 1;
+            if (thread_pool_add_task(conn->reactor->pool, connection_process, conn) == 0) {
+                return;
+            }
+            // Queue full: re-arming reports the pending data again
+            break;
+        }
+        
+        // Spliced payload has to leave before more is read, and a stream
+        // can only be spliced once earlier replies are out
+        if ((conn->stream_piped > 0 ||
+             (conn->stream_remaining > 0 && buffer_length(&conn->out) > 0)) &&
+            flush_output(conn) < 0) {
+            send_failed(conn);
+            return;
+        }
+        if (conn->stream_piped > 0) {
+            break;
+        }
+        if (can_splice(conn)) {
+            ssize_t moved = splice_stream(conn);
+            if (moved < 0 && (errno == EINVAL || errno == ENOSYS || errno == EMFILE ||
+                              errno == ENFILE)) {
+                // No pipe or no splice for this socket: copy instead
+                conn->stream_copy = 1;
+                continue;
+            }
+            if (moved > 0) {
+                stats_add(STATS_BYTES_IN, (uint64_t)moved);
+                if (flush_output(conn) < 0) {
+                    send_failed(conn);
+                    return;
+                }
+                continue;
+            }
+            if (moved == 0 && reactor_draining(conn->reactor)) {
+                connection_drain(conn);
+                break;
+            }
+            if (moved == 0) {
+                LOG_INFO("Client disconnected: %s:%d", conn->ip, conn->port);
+                flush_output(conn);
+                connection_close(conn);
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            LOG_ERROR("splice() failed for %s:%d: %s",
+                      conn->ip, conn->port, strerror(errno));
+            stats_add(STATS_ERRORS, 1);
+            connection_close(conn);
+            return;
+        }
+        
+        ssize_t bytes_received = receive(conn, buffer, sizeof(buffer));
+        if (bytes_received < 0) {
+            return;
+        }
+        if (bytes_received == 0) {
+            break;
+        }
+        if (connection_feed(conn, buffer, (size_t)bytes_received) < 0) {
+            connection_close(conn);
+            return;
+        }
+    }
+    
+    // One send for everything answered in this round
+    if (flush_output(conn) < 0) {
+        send_failed(conn);
+        return;
+    }
+    
+    // QUIT or drain: close once the last reply has been written
+    if (conn->closing && buffer_length(&conn->out) == 0) {
+        connection_close(conn);
+        return;
+    }
+    
+    // A new subscriber is not re-armed: its reactor takes it over, and
+    // writes whatever is still unsent from there
+    if (conn->pubsub != NULL) {
+        reactor_adopt(conn->reactor, conn);
+        return;
+    }
+    
+    // Hand the connection back to the reactor until it is ready again
+    if (reactor_rearm(conn->reactor, conn) < 0) {
+        LOG_ERROR("Failed to re-arm %s:%d: %s",
+                  conn->ip, conn->port, strerror(errno));
+        connection_close(conn);
+    }
+}
+
+// Write replies, then queued messages, as many per sendmsg() as
+// CONNECTION_IOV_MAX allows. Once closing only the replies go out.
+static int flush_subscriber(Connection* conn) {
+    if (flush_output(conn) < 0) {
+        return -1;
+    }
+    if (conn->stream_piped > 0 || buffer_length(&conn->out) > 0 || conn->closing) {
+        return 0;
+    }
+    
+    struct iovec iov[CONNECTION_IOV_MAX];
+    while (1) {
+        int count = pubsub_pending(conn->pubsub, iov, CONNECTION_IOV_MAX);
+        if (count == 0) {
+            return 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)count;
+        ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (sent > 0) {
+            pubsub_written(conn->pubsub, (size_t)sent);
+            stats_add(STATS_BYTES_OUT, (uint64_t)sent);
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // The edge-triggered EPOLLOUT brings us back
+            return 0;
+        }
+        return -1;
+    }
+}
+
+void connection_serve(Connection* conn) {
+    char buffer[BUFFER_SIZE];
+    
+    if (pubsub_overflowed(conn->pubsub)) {
+        LOG_INFO("Subscriber %s:%d fell behind, disconnecting", conn->ip, conn->port);
+        stats_add(STATS_PUBSUB_DISCONNECTS, 1);
+        connection_close(conn);
+        return;
+    }
+    
+    // Events are edge-triggered without one-shot: read until the socket
+    // is empty, or ask to be served again once the budget is spent so
+    // one chatty subscriber cannot hold up the loop
+    for (int reads = 0; !conn->closing; reads++) {
+        if (buffer_length(&conn->out) >= CONNECTION_OUTPUT_HIGH_WATER) {
+            if (flush_subscriber(conn) < 0) {
+                send_failed(conn);
+                return;
+            }
+            // EPOLLOUT resumes reading once the peer takes its replies
+            if (buffer_length(&conn->out) >= CONNECTION_OUTPUT_HIGH_WATER) {
+                break;
+            }
+        }
+        
+        if (conn->input_paused && connection_consume(conn) < 0) {
+            connection_close(conn);
+            return;
+        }
+        if (conn->closing || conn->input_paused) {
+            continue;
+        }
+        
+        if (reads == CONNECTION_READ_BUDGET) {
+            pubsub_wakeup(conn);
+            break;
+        }
+        
+        ssize_t bytes_received = receive(conn, buffer, sizeof(buffer));
+        if (bytes_received < 0) {
+            return;
+        }
+        if (bytes_received == 0) {
+            break;
+        }
+        if (connection_feed(conn, buffer, (size_t)bytes_received) < 0) {
+            connection_close(conn);
+            return;
+        }
+    }
+    
+    if (flush_subscriber(conn) < 0) {
+        send_failed(conn);
+        return;
+    }
+    if (conn->closing && buffer_length(&conn->out) == 0 && conn->stream_piped == 0) {
+        connection_close(conn);
+    }
+}
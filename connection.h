@@ -0,0 +1,225 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "buffer.h"
+#include "timer_wheel.h"
+
+struct Reactor;
+struct PubsubSubscriber;
+struct TlsHandshake;
+
+// Framing chosen by the first byte a client sends
+typedef enum {
+    CONNECTION_PROTOCOL_NEW,
+    CONNECTION_PROTOCOL_TEXT,
+    CONNECTION_PROTOCOL_BINARY
+} ConnectionProtocol;
+
+// Per-connection state, owned by the reactor while idle and by a single
+// worker while one of its events is being processed. Subscribers are the
+// exception: once adopted, only their reactor's thread touches them.
+typedef struct Connection {
+    int fd;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    uint32_t addr;              // peer's IPv4 address, for rate limits
+    struct Reactor* reactor;
+    
+    // Incomplete command carried over to the next read
+    Buffer in;
+    // Responses not yet accepted by the socket
+    Buffer out;
+    // Set once the connection should close after out drains (QUIT)
+    uint8_t closing;
+    // Framing stopped at the high-water mark with lines left in in
+    uint8_t input_paused;
+    ConnectionProtocol protocol;
+    // Ran a verb not registered COMMAND_FAST, or is relaying a stream or
+    // a backlog: its events go to the pool's normal lane, not the high one
+    uint8_t bulk;
+    
+    // STREAM payload still to relay. The epoll backend splices it from
+    // the socket through stream_pipe and back out when nothing else is
+    // buffered; otherwise the framer copies it into out.
+    uint64_t stream_remaining;
+    int stream_pipe[2];
+    size_t stream_piped;        // relayed bytes waiting in the pipe
+    uint8_t stream_copy;        // splice() unavailable: always copy
+    
+    // Accepted on a TLS listener. handshake is set until the keys are in
+    // kernel TLS; after that the socket reads and writes plaintext.
+    uint8_t tls;
+    uint8_t handshake_wants_write;  // blocked on the socket's send buffer
+    struct TlsHandshake* handshake;
+    
+    // Set by SUBSCRIBE. When its worker is done with it the connection is
+    // adopted by its reactor, which serves it inline from then on.
+    struct PubsubSubscriber* pubsub;
+    uint8_t adopted;
+    uint8_t closed;             // adopted and queued to close
+    
+    // Timeout bookkeeping. deadline is published by the owner before the
+    // connection goes back to its event loop and read by the loop's timer
+    // wheel; the rest belongs to the owner.
+    _Atomic uint64_t deadline;
+    uint64_t read_since_ms;     // first byte of the incomplete request
+    uint64_t write_since_ms;    // output pending without progress since
+    uint8_t output_progress;    // peer accepted output since the last update
+    TimerEntry timer;
+    // Link in the reactor's queue of connections to close or to adopt
+    struct Connection* next_queued;
+    // Link in the reactor's queue of subscribers to serve
+    struct Connection* next_kicked;
+    // Links in the event loop's list of open connections, which only the
+    // loop's thread touches
+    struct Connection* live_prev;
+    struct Connection* live_next;
+} Connection;
+
+// Responses past this many bytes pause reading until the peer catches up
+#define CONNECTION_OUTPUT_HIGH_WATER (64 * 1024)
+
+// What a reactor does with new clients once the connection limit is hit
+typedef enum {
+    CONNECTION_OVERLOAD_REJECT,  // accept, reply "ERROR: busy" and close
+    CONNECTION_OVERLOAD_PAUSE    // leave them in the listen backlog
+} ConnectionOverloadPolicy;
+
+// Per-connection timeouts in milliseconds; 0 disables one
+typedef struct {
+    int idle_ms;    // nothing received and nothing left to send
+    int read_ms;    // to finish a request once its first byte arrived
+    int write_ms;   // for the peer to accept any pending output
+} ConnectionTimeouts;
+
+typedef enum {
+    CONNECTION_TIMEOUT_NONE,
+    CONNECTION_TIMEOUT_IDLE,
+    CONNECTION_TIMEOUT_READ,
+    CONNECTION_TIMEOUT_WRITE
+} ConnectionTimeoutKind;
+
+// What an event loop's shutdown drain did
+typedef struct {
+    int connections;        // open when the drain began
+    int closed;             // closed before the deadline
+    int forced;             // still open at the deadline
+    uint64_t elapsed_ms;
+} ConnectionDrainStats;
+
+// Shortest enabled timeout, or 0 if all are disabled
+int connection_timeouts_min(const ConnectionTimeouts* timeouts);
+
+// Work out which timeout applies from the connection's buffers (unsent
+// is the output not yet accepted by the socket) and publish its deadline.
+// Called by the owner before handing the connection back to its event
+// loop.
+void connection_update_deadline(Connection* conn, const ConnectionTimeouts* timeouts,
+                                size_t unsent, uint64_t now_ms);
+
+// Withdraw the deadline while a worker owns the connection
+void connection_clear_deadline(Connection* conn);
+
+// Read the published deadline; CONNECTION_TIMEOUT_NONE if there is none
+ConnectionTimeoutKind connection_deadline(Connection* conn, uint64_t* due_ms);
+
+// Log and count an expired timeout
+void connection_timed_out(Connection* conn, ConnectionTimeoutKind kind);
+
+// Cap the number of open connections over all reactors; 0 removes the cap
+void connection_set_limit(int max_connections);
+
+// Reserve a slot for a connection about to be accepted. Returns 0 on
+// success, -1 at the limit. The slot is returned by connection_release()
+// or, if no connection materializes, connection_admit_cancel().
+int connection_admit(void);
+void connection_admit_cancel(void);
+
+// Whether connection_admit() would currently fail
+int connection_admission_full(void);
+
+// Turn away a socket that was not admitted: best-effort "ERROR: busy"
+// reply, then close
+void connection_reject(int fd);
+
+// Turn away a socket whose address is over RATE_LIMIT_CONNECTIONS:
+// best-effort "ERROR: Rate limited" reply, then close
+void connection_reject_rate_limited(int fd);
+
+// Same for an admitted connection that cannot be served, e.g. because
+// the task queue is full; the connection is closed and released
+void connection_shed(Connection* conn);
+
+// Begin the TLS handshake on a connection from a TLS listener, before the
+// reactor first arms it. Returns 0 on success, -1 on failure (logged).
+int connection_start_tls(Connection* conn);
+
+// Initialize state for an accepted socket embedded in a caller-owned
+// structure; reactor may be NULL for backends other than epoll
+void connection_init(Connection* conn, int fd, const struct sockaddr_in* addr, struct Reactor* reactor);
+
+// Drop the accounting of a connection whose socket has been closed
+void connection_release(Connection* conn);
+
+// Add to or remove from an event loop's list of open connections
+void connection_link(Connection** head, Connection* conn);
+void connection_unlink(Connection** head, Connection* conn);
+
+// Shutdown drain: queue a notice for text clients and mark the connection
+// to close once its output has been written
+void connection_drain(Connection* conn);
+
+// Bytes a backend allocates per client (what embeds its Connection);
+// sizeof(Connection) unless set
+void connection_set_state_size(size_t bytes);
+
+// Format the STATS MEMORY report into buf: connection state and the
+// buffer storage in use and cached per size class, and what that comes
+// to per open connection. Returns bytes written.
+int connection_memory_report(char* buf, size_t size);
+
+// Allocate state for an accepted, already non-blocking socket
+Connection* connection_create(int fd, const struct sockaddr_in* addr, struct Reactor* reactor);
+
+// Close the socket and release the connection. Connections of an epoll
+// reactor are handed back to the reactor thread, which owns their timer.
+void connection_close(Connection* conn);
+
+// Close and free immediately; only on the thread owning the connection's
+// timer
+void connection_destroy(Connection* conn);
+
+// Run the command line (len bytes, no terminator) and append the reply
+// to conn->out. Backend-agnostic: I/O is left to the caller.
+// Returns 0 to keep the connection open, 1 if it should be closed, -1
+// on failure.
+int connection_execute(Connection* conn, const char* line, size_t len);
+
+// Frame newly received bytes into lines, or binary frames if the
+// connection opened with PROTOCOL_BINARY_MAGIC, and append every reply to
+// conn->out. Requests are parsed in place; a partial last one is copied
+// to conn->in. Framing pauses while conn->out is above the high-water
+// mark, leaving the unread lines in conn->in for connection_consume().
+// Returns 0 to keep reading, 1 once the connection is closing (see
+// conn->closing), -1 on failure.
+int connection_feed(Connection* conn, char* data, size_t len);
+
+// Resume framing lines already buffered in conn->in; returns as above
+int connection_consume(Connection* conn);
+
+// Thread pool task: drain readable data, answer commands, then re-arm
+// the connection in its reactor, hand it over if it subscribed, or close
+// it
+void connection_process(void* arg);
+
+// Serve an adopted subscriber on its reactor thread: answer what it sent,
+// write its replies and queued messages, and close it if it quit, hung
+// up or fell too far behind
+void connection_serve(Connection* conn);
+
+#endif // CONNECTION_H
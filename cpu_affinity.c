@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include "cpu_affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+
+// Startup affinity, once cpu_affinity_init() has run
+static cpu_set_t startup_set;
+static int startup_set_valid = 0;
+
+void cpu_affinity_init(void) {
+    startup_set_valid = (sched_getaffinity(0, sizeof(startup_set), &startup_set) == 0);
+}
+
+int cpu_list_parse(const char* text, CpuList* list) {
+    list->count = 0;
+    const char* p = text;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            list->count = 0;
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                list->count = 0;
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (list->count == CPU_LIST_MAX) {
+                list->count = 0;
+                return -1;
+            }
+            list->cpus[list->count++] = (int)cpu;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            list->count = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int cpu_list_restrict(CpuList* list) {
+    if (!startup_set_valid) {
+        return 0;
+    }
+    int kept = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (CPU_ISSET(list->cpus[i], &startup_set)) {
+            list->cpus[kept++] = list->cpus[i];
+        }
+    }
+    int removed = list->count - kept;
+    list->count = kept;
+    return removed;
+}
+
+void cpu_list_format(const CpuList* list, char* buf, size_t size) {
+    size_t used = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < list->count && used < size; ) {
+        // Collapse runs of consecutive CPUs into a range
+        int j = i;
+        while (j + 1 < list->count && list->cpus[j + 1] == list->cpus[j] + 1) {
+            j++;
+        }
+        int n;
+        if (j > i) {
+            n = snprintf(buf + used, size - used, "%s%d-%d", (i > 0) ? "," : "",
+                         list->cpus[i], list->cpus[j]);
+        } else {
+            n = snprintf(buf + used, size - used, "%s%d", (i > 0) ? "," : "", list->cpus[i]);
+        }
+        if (n < 0) {
+            break;
+        }
+        used += (size_t)n;
+        i = j + 1;
+    }
+}
+
+int cpu_numa_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    
+    // The CPU's directory links to its node as "node<N>"
+    int node = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int n;
+        if (sscanf(entry->d_name, "node%d", &n) == 1) {
+            node = n;
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+int cpu_numa_node_count(void) {
+    FILE* fp = fopen("/sys/devices/system/node/online", "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    char line[256];
+    CpuList nodes;
+    int count = 1;
+    if (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (cpu_list_parse(line, &nodes) == 0 && nodes.count > 0) {
+            count = nodes.count;
+        }
+    }
+    fclose(fp);
+    return count;
+}
+
+// The set for cpu, or the startup set for cpu < 0; returns 0 if there is
+// nothing to apply
+static int affinity_set(int cpu, cpu_set_t* set) {
+    if (cpu < 0) {
+        if (!startup_set_valid) {
+            return 0;
+        }
+        *set = startup_set;
+        return 1;
+    }
+    CPU_ZERO(set);
+    CPU_SET(cpu, set);
+    return 1;
+}
+
+int cpu_affinity_attr(pthread_attr_t* attr, int cpu) {
+    cpu_set_t set;
+    if (!affinity_set(cpu, &set)) {
+        return 0;
+    }
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int cpu_affinity_set_current(int cpu) {
+    cpu_set_t set;
+    if (!affinity_set(cpu, &set)) {
+        return 0;
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
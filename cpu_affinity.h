@@ -0,0 +1,53 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define CPU_LIST_MAX 256
+
+// An ordered list of CPU numbers, as written in config.txt ("0-3,8,10")
+typedef struct {
+    int cpus[CPU_LIST_MAX];
+    int count;
+} CpuList;
+
+// Remember the CPUs the process may run on (taskset, cgroup cpusets)
+// before any thread is pinned. Call once at startup.
+void cpu_affinity_init(void);
+
+// Parse a comma-separated list of CPUs and ranges. Returns 0 on success,
+// -1 on a malformed list (list is left empty).
+int cpu_list_parse(const char* text, CpuList* list);
+
+// The CPU for the index'th thread, wrapping round the list; -1 if the
+// list is empty
+static inline int cpu_list_pick(const CpuList* list, int index) {
+    return (list->count > 0) ? list->cpus[index % list->count] : -1;
+}
+
+// Drop CPUs outside the startup set. Returns the number removed.
+int cpu_list_restrict(CpuList* list);
+
+// Format the list back into ranges, e.g. "0-3,8"
+void cpu_list_format(const CpuList* list, char* buf, size_t size);
+
+// NUMA node a CPU belongs to, from sysfs; 0 on machines without NUMA
+// and -1 for an unknown CPU
+int cpu_numa_node(int cpu);
+
+// Number of online NUMA nodes (1 without NUMA)
+int cpu_numa_node_count(void);
+
+// Start threads created with attr on cpu, or anywhere in the startup set
+// for cpu < 0 (rather than inheriting a pinned creator's CPU). Returns 0
+// on success.
+int cpu_affinity_attr(pthread_attr_t* attr, int cpu);
+
+// Move the calling thread onto cpu, or back to the startup set for
+// cpu < 0. The kernel places pages on the node of the CPU that first
+// touches them, so memory a thread allocates and initializes after this
+// is local to it. Returns 0 on success.
+int cpu_affinity_set_current(int cpu);
+
+#endif // CPU_AFFINITY_H
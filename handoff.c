@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+
+// First descriptor systemd passes (sd_listen_fds(3))
+#define SD_LISTEN_FDS_START 3
+
+// How long either side waits for the other during a handoff
+#define HANDOFF_TIMEOUT_MS 10000
+
+// Single-byte messages: the old server's fds ride on HANDOFF_MSG_FDS,
+// the new one answers HANDOFF_MSG_READY
+#define HANDOFF_MSG_FDS 'L'
+#define HANDOFF_MSG_READY 'R'
+
+struct HandoffServer {
+    int fd;
+    int stop_fd;                // eventfd that wakes the thread to exit
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int fds[HANDOFF_MAX_FDS];
+    int count;
+    void (*on_complete)(void);
+    pthread_t thread;
+    int thread_started;
+    atomic_int completed;       // the new process took over
+};
+
+int handoff_systemd_listeners(int* fds, int max) {
+    const char* pid = getenv("LISTEN_PID");
+    const char* count_str = getenv("LISTEN_FDS");
+    if (pid == NULL || count_str == NULL || atol(pid) != (long)getpid()) {
+        return 0;
+    }
+    int passed = atoi(count_str);
+    
+    // Not for children we might exec
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    
+    int count = 0;
+    for (int fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + passed; fd++) {
+        // Listening stream sockets, or datagram sockets (ListenDatagram=)
+        int listening = 0;
+        int type = 0;
+        socklen_t len = sizeof(listening);
+        getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len);
+        len = sizeof(type);
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 ||
+            (!listening && type != SOCK_DGRAM)) {
+            LOG_ERROR("Inherited fd %d is not a listening socket, ignoring it", fd);
+            continue;
+        }
+        if (count == max) {
+            LOG_ERROR("Too many inherited listeners, closing fd %d", fd);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fds[count++] = fd;
+    }
+    return count;
+}
+
+// Fill a Unix socket address; returns its length, or 0 if path does not
+// fit. A leading '@' names an abstract socket, as in NOTIFY_SOCKET.
+static socklen_t unix_address(struct sockaddr_un* addr, const char* path) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr->sun_path)) {
+        return 0;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+    if (addr->sun_path[0] == '@') {
+        addr->sun_path[0] = '\0';
+    }
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+}
+
+void handoff_notify(const char* state) {
+    const char* path = getenv("NOTIFY_SOCKET");
+    if (path == NULL) {
+        return;
+    }
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(&addr, path);
+    if (len == 0) {
+        return;
+    }
+    
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return;
+    }
+    if (sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr*)&addr, len) < 0) {
+        LOG_ERROR("sd_notify(%s) failed: %s", state, strerror(errno));
+    }
+    close(fd);
+}
+
+int handoff_listener_port(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &len) < 0) {
+        return -1;
+    }
+    if (addr.ss_family == AF_INET) {
+        return ntohs(((struct sockaddr_in*)&addr)->sin_port);
+    }
+    if (addr.ss_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+    }
+    return -1;
+}
+
+static void set_timeout(int fd, int timeout_ms) {
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int handoff_receive(const char* path, int* fds, int max, int* peer_fd) {
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(&addr, path);
+    if (len == 0) {
+        LOG_ERROR("Upgrade socket path too long: %s", path);
+        return -1;
+    }
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("socket() failed: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, len) < 0) {
+        int err = errno;
+        close(fd);
+        // No server running (or a stale socket file left by a crash)
+        if (err == ENOENT || err == ECONNREFUSED) {
+            return 0;
+        }
+        LOG_ERROR("connect(%s) failed: %s", path, strerror(err));
+        return -1;
+    }
+    set_timeout(fd, HANDOFF_TIMEOUT_MS);
+    
+    char msg;
+    struct iovec iov = { &msg, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+    
+    ssize_t n = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+    if (n != 1 || msg != HANDOFF_MSG_FDS) {
+        LOG_ERROR("No listeners received from %s: %s", path,
+                  (n < 0) ? strerror(errno) : "bad reply");
+        close(fd);
+        return -1;
+    }
+    
+    int count = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int received = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < received; i++) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (count < max) {
+                fds[count++] = passed;
+            } else {
+                close(passed);
+            }
+        }
+    }
+    
+    *peer_fd = fd;
+    return count;
+}
+
+void handoff_confirm(int peer_fd) {
+    char msg = HANDOFF_MSG_READY;
+    if (send(peer_fd, &msg, 1, MSG_NOSIGNAL) != 1) {
+        LOG_ERROR("Failed to confirm handoff: %s", strerror(errno));
+    }
+    close(peer_fd);
+}
+
+// Wait until fd is readable; 0 if the timeout passed or the server is
+// stopping instead
+static int wait_readable(HandoffServer* server, int fd, int timeout_ms) {
+    struct pollfd pfds[2];
+    pfds[0].fd = fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = server->stop_fd;
+    pfds[1].events = POLLIN;
+    while (1) {
+        int n = poll(pfds, 2, timeout_ms);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n > 0 && pfds[1].revents == 0 && pfds[0].revents != 0;
+    }
+}
+
+// Pass the listeners to one new process and wait for it to take over
+static void serve_upgrade(HandoffServer* server, int client) {
+    struct ucred peer;
+    socklen_t len = sizeof(peer);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &len) < 0) {
+        peer.pid = 0;
+    }
+    set_timeout(client, HANDOFF_TIMEOUT_MS);
+    
+    char msg = HANDOFF_MSG_FDS;
+    struct iovec iov = { &msg, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = CMSG_SPACE(sizeof(int) * server->count);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * server->count);
+    memcpy(CMSG_DATA(cmsg), server->fds, sizeof(int) * server->count);
+    
+    if (sendmsg(client, &hdr, MSG_NOSIGNAL) != 1) {
+        LOG_ERROR("Failed to pass listeners to pid %d: %s", (int)peer.pid, strerror(errno));
+        return;
+    }
+    LOG_INFO("Passed %d listeners to pid %d", server->count, (int)peer.pid);
+    
+    // Both processes accept until the new one is up; if it dies first,
+    // this one carries on alone.
+    char reply = 0;
+    if (!wait_readable(server, client, HANDOFF_TIMEOUT_MS) ||
+        recv(client, &reply, 1, 0) != 1 || reply != HANDOFF_MSG_READY) {
+        LOG_ERROR("Pid %d did not take over, still serving", (int)peer.pid);
+        return;
+    }
+    atomic_store(&server->completed, 1);
+}
+
+static void* handoff_thread(void* arg) {
+    HandoffServer* server = (HandoffServer*)arg;
+    while (!atomic_load(&server->completed) && wait_readable(server, server->fd, -1)) {
+        int client = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+        serve_upgrade(server, client);
+        close(client);
+    }
+    if (atomic_load(&server->completed)) {
+        server->on_complete();
+    }
+    return NULL;
+}
+
+HandoffServer* handoff_server_start(const char* path, const int* fds, int count,
+                                    void (*on_complete)(void)) {
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(&addr, path);
+    if (len == 0 || count > HANDOFF_MAX_FDS) {
+        LOG_ERROR("Cannot serve upgrades at %s", path);
+        return NULL;
+    }
+    
+    HandoffServer* server = (HandoffServer*)calloc(1, sizeof(HandoffServer));
+    if (server == NULL) {
+        return NULL;
+    }
+    snprintf(server->path, sizeof(server->path), "%s", path);
+    memcpy(server->fds, fds, sizeof(int) * count);
+    server->count = count;
+    server->on_complete = on_complete;
+    atomic_init(&server->completed, 0);
+    server->stop_fd = eventfd(0, EFD_CLOEXEC);
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->stop_fd < 0 || server->fd < 0) {
+        LOG_ERROR("Upgrade socket setup failed: %s", strerror(errno));
+        handoff_server_stop(server);
+        return NULL;
+    }
+    
+    // Replaces the previous server's socket file, which it no longer uses
+    if (path[0] != '@') {
+        unlink(path);
+    }
+    if (bind(server->fd, (struct sockaddr*)&addr, len) < 0 || listen(server->fd, 4) < 0) {
+        LOG_ERROR("Cannot listen on upgrade socket %s: %s", path, strerror(errno));
+        atomic_store(&server->completed, 1);    // keep whatever is at path
+        handoff_server_stop(server);
+        return NULL;
+    }
+    
+    if (pthread_create(&server->thread, NULL, handoff_thread, server) != 0) {
+        LOG_ERROR("Failed to create upgrade thread");
+        handoff_server_stop(server);
+        return NULL;
+    }
+    server->thread_started = 1;
+    return server;
+}
+
+void handoff_server_stop(HandoffServer* server) {
+    if (server == NULL) {
+        return;
+    }
+    if (server->thread_started) {
+        uint64_t one = 1;
+        ssize_t ignored = write(server->stop_fd, &one, sizeof(one));
+        (void)ignored;
+        pthread_join(server->thread, NULL);
+    }
+    if (server->fd >= 0) {
+        close(server->fd);
+        if (!atomic_load(&server->completed) && server->path[0] != '@') {
+            unlink(server->path);
+        }
+    }
+    if (server->stop_fd >= 0) {
+        close(server->stop_fd);
+    }
+    free(server);
+}
@@ -0,0 +1,46 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// Listening sockets that outlive a process: inherited from systemd
+// socket activation, or passed from a running server to its replacement
+// over a Unix socket (SCM_RIGHTS). The kernel keeps each listener's
+// accept queue while any process holds it, so a restart refuses nothing.
+
+#define HANDOFF_MAX_FDS 64
+
+// Listeners passed by systemd (LISTEN_PID/LISTEN_FDS), made non-blocking
+// and close-on-exec; UDP sockets count as listeners. Returns the number stored in fds, 0 when not socket
+// activated.
+int handoff_systemd_listeners(int* fds, int max);
+
+// Send a state string such as "READY=1" to systemd's notification socket;
+// does nothing when not started by systemd
+void handoff_notify(const char* state);
+
+// Port a listening socket is bound to, or -1
+int handoff_listener_port(int fd);
+
+// Ask the server at path for its listeners. Returns the number stored in
+// fds and sets *peer_fd, which must be passed to handoff_confirm() once
+// this process is ready; 0 when no server is listening at path; -1 on
+// error.
+int handoff_receive(const char* path, int* fds, int max, int* peer_fd);
+
+// Tell the old server this process is serving, so it can stop; closes
+// peer_fd
+void handoff_confirm(int peer_fd);
+
+typedef struct HandoffServer HandoffServer;
+
+// Serve upgrade requests at path from a background thread: a new process
+// connecting gets a copy of fds, and once it confirms, on_complete is
+// called (from that thread) and no further requests are served. Returns
+// NULL on failure (logged).
+HandoffServer* handoff_server_start(const char* path, const int* fds, int count,
+                                    void (*on_complete)(void));
+
+// Stop serving. The socket file is removed unless a handoff completed,
+// in which case it belongs to the new process.
+void handoff_server_stop(HandoffServer* server);
+
+#endif // HANDOFF_H
@@ -0,0 +1,587 @@
+#include "kvstore.h"
+#include "protocol.h"
+#include "object_pool.h"
+#include "task_ring.h"
+#include "stats.h"
+#include "clock.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <pthread.h>
+
+#define KV_SHARD_BITS 6
+
+// Item size classes: powers of two from KV_CLASS_MIN to KV_ITEM_MAX
+#define KV_CLASS_MIN 64
+#define KV_CLASSES 11
+#define KV_SLAB_BYTES (256 * 1024)
+
+// Slots a shard's table starts with; it doubles past 3/4 full
+#define KV_INITIAL_SLOTS 64
+
+// Slots the incremental expiry checks per request, and items sampled to
+// pick an eviction victim
+#define KV_SWEEP_SLOTS 4
+#define KV_EVICTION_SAMPLES 5
+
+typedef struct {
+    uint64_t expires_ms;    // monotonic deadline; 0 = never
+    uint64_t accessed;      // shard clock at the last access
+    uint32_t key_len;
+    uint32_t value_len;
+    uint8_t size_class;
+    char data[];            // key, then value
+} KvItem;
+
+// An empty slot has no item. The full hash is kept so probes and
+// rehashes rarely touch the item itself.
+typedef struct {
+    uint64_t hash;
+    KvItem* item;
+} KvSlot;
+
+typedef struct {
+    alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    KvSlot* slots;
+    size_t capacity;        // a power of two
+    size_t count;
+    size_t bytes;           // size-class bytes of the items held
+    size_t sweep;           // next slot the incremental expiry checks
+    uint64_t clock;         // ticks once per access, for LRU order
+    uint64_t random;        // xorshift state for eviction sampling
+} KvShard;
+
+static KvShard shards[KV_SHARDS];
+static size_t shard_limit = 0;      // bytes per shard; 0 = no limit
+
+static ObjectPool* item_pools[KV_CLASSES];
+static const char* pool_names[KV_CLASSES] = {
+    "kv 64", "kv 128", "kv 256", "kv 512", "kv 1K", "kv 2K", "kv 4K", "kv 8K",
+    "kv 16K", "kv 32K", "kv 64K"
+};
+
+static const char ok_reply[] = "OK\n";
+static const char not_found_reply[] = "NOT_FOUND\n";
+static const char deleted_reply[] = "DELETED\n";
+static const char arity_reply[] = "ERROR: Wrong number of arguments\n";
+static const char too_large_reply[] = "ERROR: Key or value too large\n";
+static const char no_memory_reply[] = "ERROR: Out of memory\n";
+static const char not_integer_reply[] = "ERROR: Not an integer or out of range\n";
+static const char invalid_ttl_reply[] = "ERROR: Invalid TTL\n";
+
+static inline uint64_t now_ms(void) {
+    return clock_monotonic_ns() / 1000000;
+}
+
+// Mixes eight bytes at a time; the top bits pick the shard and the low
+// bits the home slot
+static uint64_t kv_hash(const char* key, size_t len) {
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ len;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, key, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 31;
+        key += 8;
+        len -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, key, len);
+    hash = (hash ^ tail) * 0x94D049BB133111EBULL;
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    return hash ^ (hash >> 32);
+}
+
+static inline KvShard* shard_for(uint64_t hash) {
+    return &shards[hash >> (64 - KV_SHARD_BITS)];
+}
+
+static inline size_t class_size(int size_class) {
+    return (size_t)KV_CLASS_MIN << size_class;
+}
+
+static inline char* item_value(KvItem* item) {
+    return item->data + item->key_len;
+}
+
+static KvItem* item_alloc(size_t key_len, size_t value_len) {
+    size_t size = sizeof(KvItem) + key_len + value_len;
+    int size_class = 0;
+    while (class_size(size_class) < size) {
+        size_class++;
+    }
+    KvItem* item = (KvItem*)object_pool_alloc(item_pools[size_class]);
+    if (item != NULL) {
+        item->size_class = (uint8_t)size_class;
+        item->key_len = (uint32_t)key_len;
+        item->value_len = (uint32_t)value_len;
+    }
+    return item;
+}
+
+static inline int item_expired(const KvItem* item, uint64_t now) {
+    return item->expires_ms != 0 && item->expires_ms <= now;
+}
+
+// Slot holding key, or capacity if absent; caller holds the shard lock
+static size_t find_slot(const KvShard* shard, uint64_t hash, const char* key, size_t key_len) {
+    size_t mask = shard->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const KvSlot* slot = &shard->slots[i];
+        if (slot->item == NULL) {
+            return shard->capacity;
+        }
+        if (slot->hash == hash && slot->item->key_len == key_len &&
+            memcmp(slot->item->data, key, key_len) == 0) {
+            return i;
+        }
+    }
+}
+
+// Free the item at index and close the gap by shifting later entries of
+// the probe run back, so lookups need no tombstones
+static void remove_slot(KvShard* shard, size_t index) {
+    KvItem* item = shard->slots[index].item;
+    shard->bytes -= class_size(item->size_class);
+    shard->count--;
+    object_pool_free(item_pools[item->size_class], item);
+    
+    size_t mask = shard->capacity - 1;
+    size_t hole = index;
+    for (size_t i = (index + 1) & mask; shard->slots[i].item != NULL; i = (i + 1) & mask) {
+        size_t home = shard->slots[i].hash & mask;
+        // Movable if the hole lies between its home slot and where it is
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            shard->slots[hole] = shard->slots[i];
+            hole = i;
+        }
+    }
+    shard->slots[hole].item = NULL;
+}
+
+// Double the table. Returns 0 on success, -1 if allocation fails.
+static int grow(KvShard* shard) {
+    size_t capacity = shard->capacity * 2;
+    KvSlot* slots = (KvSlot*)calloc(capacity, sizeof(KvSlot));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < shard->capacity; i++) {
+        if (shard->slots[i].item == NULL) {
+            continue;
+        }
+        size_t j = shard->slots[i].hash & (capacity - 1);
+        while (slots[j].item != NULL) {
+            j = (j + 1) & (capacity - 1);
+        }
+        slots[j] = shard->slots[i];
+    }
+    free(shard->slots);
+    shard->slots = slots;
+    shard->capacity = capacity;
+    shard->sweep &= capacity - 1;
+    return 0;
+}
+
+// Check the next few slots for expired items
+static void sweep(KvShard* shard, uint64_t now) {
+    for (int n = 0; n < KV_SWEEP_SLOTS && shard->count > 0; n++) {
+        KvSlot* slot = &shard->slots[shard->sweep];
+        if (slot->item != NULL && item_expired(slot->item, now)) {
+            // Another item may shift into this slot; look at it next
+            remove_slot(shard, shard->sweep);
+            stats_add(STATS_KV_EXPIRED, 1);
+            continue;
+        }
+        shard->sweep = (shard->sweep + 1) & (shard->capacity - 1);
+    }
+}
+
+// Evict the least recently used of a few items sampled from a random
+// point in the table
+static void evict_one(KvShard* shard) {
+    shard->random ^= shard->random << 13;
+    shard->random ^= shard->random >> 7;
+    shard->random ^= shard->random << 17;
+    
+    size_t mask = shard->capacity - 1;
+    size_t victim = shard->capacity;
+    int sampled = 0;
+    for (size_t i = shard->random & mask; sampled < KV_EVICTION_SAMPLES; i = (i + 1) & mask) {
+        KvItem* item = shard->slots[i].item;
+        if (item == NULL) {
+            continue;
+        }
+        if (victim == shard->capacity || item->accessed < shard->slots[victim].item->accessed) {
+            victim = i;
+        }
+        if (++sampled == (int)shard->count) {
+            break;
+        }
+    }
+    remove_slot(shard, victim);
+    stats_add(STATS_KV_EVICTIONS, 1);
+}
+
+// Look up a live item, dropping it if it has expired; capacity if absent
+static size_t lookup(KvShard* shard, uint64_t hash, const char* key, size_t key_len,
+                     uint64_t now) {
+    size_t index = find_slot(shard, hash, key, key_len);
+    if (index != shard->capacity && item_expired(shard->slots[index].item, now)) {
+        remove_slot(shard, index);
+        stats_add(STATS_KV_EXPIRED, 1);
+        index = shard->capacity;
+    }
+    return index;
+}
+
+// Replace whatever is stored under key; caller holds the shard lock. On
+// failure the old value, if any, is left in place.
+static KvResult insert(KvShard* shard, uint64_t hash, const char* key, size_t key_len,
+                       const char* value, size_t value_len, uint64_t expires_ms) {
+    size_t index = find_slot(shard, hash, key, key_len);
+    
+    size_t size = sizeof(KvItem) + key_len + value_len;
+    if (shard_limit > 0) {
+        size_t need = KV_CLASS_MIN;
+        while (need < size) {
+            need *= 2;
+        }
+        if (need > shard_limit) {
+            return KV_NO_MEMORY;
+        }
+        // The old item's storage is given back once the new one is in, so
+        // it does not count against the limit. Making it the most recent
+        // keeps eviction off it: with two or more items sampled it is
+        // never the least recently used.
+        size_t kept = 0;
+        if (index != shard->capacity) {
+            shard->slots[index].item->accessed = ++shard->clock;
+            kept = 1;
+        }
+        while (shard->count > kept &&
+               shard->bytes - (kept ? class_size(shard->slots[index].item->size_class) : 0) +
+               need > shard_limit) {
+            evict_one(shard);
+            // Removals shift entries back along their probe run
+            if (kept) {
+                index = find_slot(shard, hash, key, key_len);
+            }
+        }
+    }
+    if (index == shard->capacity && (shard->count + 1) * 4 > shard->capacity * 3) {
+        if (grow(shard) < 0) {
+            return KV_NO_MEMORY;
+        }
+        index = shard->capacity;
+    }
+    
+    KvItem* item = item_alloc(key_len, value_len);
+    if (item == NULL) {
+        return KV_NO_MEMORY;
+    }
+    item->expires_ms = expires_ms;
+    item->accessed = ++shard->clock;
+    memcpy(item->data, key, key_len);
+    memcpy(item_value(item), value, value_len);
+    
+    if (index != shard->capacity) {
+        // Same key, same hash: the new item takes over the slot
+        KvItem* old = shard->slots[index].item;
+        shard->bytes -= class_size(old->size_class);
+        object_pool_free(item_pools[old->size_class], old);
+    } else {
+        size_t mask = shard->capacity - 1;
+        index = hash & mask;
+        while (shard->slots[index].item != NULL) {
+            index = (index + 1) & mask;
+        }
+        shard->slots[index].hash = hash;
+        shard->count++;
+    }
+    shard->slots[index].item = item;
+    shard->bytes += class_size(item->size_class);
+    return KV_OK;
+}
+
+KvResult kv_set(const char* key, size_t key_len, const char* value, size_t value_len) {
+    if (key_len == 0 || key_len > KV_KEY_MAX ||
+        sizeof(KvItem) + key_len + value_len > KV_ITEM_MAX) {
+        return KV_TOO_LARGE;
+    }
+    uint64_t hash = kv_hash(key, key_len);
+    KvShard* shard = shard_for(hash);
+    uint64_t now = now_ms();
+    
+    pthread_mutex_lock(&shard->lock);
+    sweep(shard, now);
+    KvResult result = insert(shard, hash, key, key_len, value, value_len, 0);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+KvResult kv_get(const char* key, size_t key_len, Buffer* out) {
+    uint64_t hash = kv_hash(key, key_len);
+    KvShard* shard = shard_for(hash);
+    uint64_t now = now_ms();
+    KvResult result = KV_NOT_FOUND;
+    
+    pthread_mutex_lock(&shard->lock);
+    sweep(shard, now);
+    size_t index = lookup(shard, hash, key, key_len, now);
+    if (index != shard->capacity) {
+        KvItem* item = shard->slots[index].item;
+        item->accessed = ++shard->clock;
+        result = (buffer_append(out, item_value(item), item->value_len) == 0) ? KV_OK
+                                                                              : KV_NO_MEMORY;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    
+    stats_add((result == KV_NOT_FOUND) ? STATS_KV_MISSES : STATS_KV_HITS, 1);
+    return result;
+}
+
+KvResult kv_delete(const char* key, size_t key_len) {
+    uint64_t hash = kv_hash(key, key_len);
+    KvShard* shard = shard_for(hash);
+    uint64_t now = now_ms();
+    KvResult result = KV_NOT_FOUND;
+    
+    pthread_mutex_lock(&shard->lock);
+    sweep(shard, now);
+    size_t index = lookup(shard, hash, key, key_len, now);
+    if (index != shard->capacity) {
+        remove_slot(shard, index);
+        result = KV_OK;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+// Parse a whole value as a signed 64-bit decimal. Returns 0 on success.
+static int parse_int64(const char* text, size_t len, int64_t* value) {
+    size_t i = (len > 0 && text[0] == '-') ? 1 : 0;
+    if (i == len || len - i > 19) {
+        return -1;
+    }
+    uint64_t magnitude = 0;
+    for (; i < len; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return -1;
+        }
+        magnitude = magnitude * 10 + (uint64_t)(text[i] - '0');
+    }
+    if (text[0] == '-') {
+        if (magnitude > (uint64_t)INT64_MAX + 1) {
+            return -1;
+        }
+        *value = (int64_t)(0 - magnitude);
+    } else {
+        if (magnitude > (uint64_t)INT64_MAX) {
+            return -1;
+        }
+        *value = (int64_t)magnitude;
+    }
+    return 0;
+}
+
+KvResult kv_incr(const char* key, size_t key_len, int64_t delta, int64_t* value) {
+    if (key_len == 0 || key_len > KV_KEY_MAX) {
+        return KV_TOO_LARGE;
+    }
+    uint64_t hash = kv_hash(key, key_len);
+    KvShard* shard = shard_for(hash);
+    uint64_t now = now_ms();
+    KvResult result = KV_OK;
+    
+    pthread_mutex_lock(&shard->lock);
+    sweep(shard, now);
+    size_t index = lookup(shard, hash, key, key_len, now);
+    KvItem* item = (index != shard->capacity) ? shard->slots[index].item : NULL;
+    
+    int64_t current = 0;
+    if (item != NULL && parse_int64(item_value(item), item->value_len, &current) < 0) {
+        result = KV_NOT_INTEGER;
+    } else if ((delta > 0 && current > INT64_MAX - delta) ||
+               (delta < 0 && current < INT64_MIN - delta)) {
+        result = KV_NOT_INTEGER;
+    } else {
+        *value = current + delta;
+        char text[24];
+        size_t len = (size_t)snprintf(text, sizeof(text), "%lld", (long long)*value);
+        if (item != NULL && sizeof(KvItem) + key_len + len <= class_size(item->size_class)) {
+            // Rewrite in place: same object, same slot
+            memcpy(item_value(item), text, len);
+            item->value_len = (uint32_t)len;
+            item->accessed = ++shard->clock;
+        } else {
+            uint64_t expires = (item != NULL) ? item->expires_ms : 0;
+            result = insert(shard, hash, key, key_len, text, len, expires);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+KvResult kv_expire(const char* key, size_t key_len, uint64_t ttl_ms) {
+    uint64_t hash = kv_hash(key, key_len);
+    KvShard* shard = shard_for(hash);
+    uint64_t now = now_ms();
+    KvResult result = KV_NOT_FOUND;
+    
+    pthread_mutex_lock(&shard->lock);
+    sweep(shard, now);
+    size_t index = lookup(shard, hash, key, key_len, now);
+    if (index != shard->capacity) {
+        shard->slots[index].item->expires_ms = (ttl_ms > 0) ? now + ttl_ms : 0;
+        result = KV_OK;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+// ---- Commands ----
+
+static int append_result(KvResult result, Buffer* out) {
+    switch (result) {
+    case KV_OK:
+        return buffer_append(out, ok_reply, sizeof(ok_reply) - 1);
+    case KV_NOT_FOUND:
+        return buffer_append(out, not_found_reply, sizeof(not_found_reply) - 1);
+    case KV_TOO_LARGE:
+        return buffer_append(out, too_large_reply, sizeof(too_large_reply) - 1);
+    case KV_NOT_INTEGER:
+        return buffer_append(out, not_integer_reply, sizeof(not_integer_reply) - 1);
+    case KV_NO_MEMORY:
+    default:
+        return buffer_append(out, no_memory_reply, sizeof(no_memory_reply) - 1);
+    }
+}
+
+// SET <key> <value>: the value is everything after the key's space, so
+// it may contain spaces (and, in binary mode, any byte)
+static int cmd_set(const Command* cmd, Buffer* out) {
+    const CommandArg* rest = &cmd->args[0];
+    const char* space = (const char*)memchr(rest->data, ' ', rest->len);
+    if (space == NULL || space == rest->data) {
+        return buffer_append(out, arity_reply, sizeof(arity_reply) - 1);
+    }
+    size_t key_len = (size_t)(space - rest->data);
+    return append_result(kv_set(rest->data, key_len, space + 1, rest->len - key_len - 1), out);
+}
+
+// GET <key>: "VALUE <value>" or NOT_FOUND
+static int cmd_get(const Command* cmd, Buffer* out) {
+    const CommandArg* key = &cmd->args[0];
+    if (buffer_append(out, "VALUE ", 6) < 0) {
+        return -1;
+    }
+    KvResult result = kv_get(key->data, key->len, out);
+    if (result != KV_OK) {
+        buffer_trim(out, 6);
+        return append_result(result, out);
+    }
+    return buffer_append(out, "\n", 1);
+}
+
+static int cmd_del(const Command* cmd, Buffer* out) {
+    const CommandArg* key = &cmd->args[0];
+    if (kv_delete(key->data, key->len) == KV_OK) {
+        return buffer_append(out, deleted_reply, sizeof(deleted_reply) - 1);
+    }
+    return buffer_append(out, not_found_reply, sizeof(not_found_reply) - 1);
+}
+
+// INCR <key> [<delta>]: the new value
+static int cmd_incr(const Command* cmd, Buffer* out) {
+    int64_t delta = 1;
+    if (cmd->argc > 1 && parse_int64(cmd->args[1].data, cmd->args[1].len, &delta) < 0) {
+        return buffer_append(out, not_integer_reply, sizeof(not_integer_reply) - 1);
+    }
+    int64_t value;
+    KvResult result = kv_incr(cmd->args[0].data, cmd->args[0].len, delta, &value);
+    if (result != KV_OK) {
+        return append_result(result, out);
+    }
+    char reply[24];
+    int len = snprintf(reply, sizeof(reply), "%lld\n", (long long)value);
+    return buffer_append(out, reply, (size_t)len);
+}
+
+// EXPIRE <key> <seconds>: 0 makes the key persistent again
+static int cmd_expire(const Command* cmd, Buffer* out) {
+    int64_t seconds;
+    if (parse_int64(cmd->args[1].data, cmd->args[1].len, &seconds) < 0 || seconds < 0 ||
+        seconds > INT64_MAX / 1000) {
+        return buffer_append(out, invalid_ttl_reply, sizeof(invalid_ttl_reply) - 1);
+    }
+    return append_result(kv_expire(cmd->args[0].data, cmd->args[0].len,
+                                   (uint64_t)seconds * 1000), out);
+}
+
+// Gauges for STATS DETAIL
+static long kv_items(void* arg) {
+    (void)arg;
+    size_t total = 0;
+    for (int i = 0; i < KV_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        total += shards[i].count;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    return (long)total;
+}
+
+static long kv_bytes(void* arg) {
+    (void)arg;
+    size_t total = 0;
+    for (int i = 0; i < KV_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        total += shards[i].bytes;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    return (long)total;
+}
+
+int kv_init(size_t memory_limit) {
+    for (int c = 0; c < KV_CLASSES; c++) {
+        size_t per_slab = KV_SLAB_BYTES / class_size(c);
+        item_pools[c] = object_pool_create(pool_names[c], class_size(c), per_slab);
+        if (item_pools[c] == NULL) {
+            LOG_ERROR("Failed to create cache item pools");
+            return -1;
+        }
+    }
+    
+    shard_limit = memory_limit / KV_SHARDS;
+    if (memory_limit > 0 && shard_limit < KV_CLASS_MIN) {
+        shard_limit = KV_CLASS_MIN;
+    }
+    for (int i = 0; i < KV_SHARDS; i++) {
+        KvShard* shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->slots = (KvSlot*)calloc(KV_INITIAL_SLOTS, sizeof(KvSlot));
+        if (shard->slots == NULL) {
+            LOG_ERROR("malloc() failed for cache shards");
+            return -1;
+        }
+        shard->capacity = KV_INITIAL_SLOTS;
+        shard->random = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+    }
+    
+    stats_register_gauge("kv.items", kv_items, NULL);
+    stats_register_gauge("kv.bytes", kv_bytes, NULL);
+    
+    if (command_register("SET", OPCODE_SET, cmd_set, 1, 1, COMMAND_RAW_ARGS, STATS_CMD_SET) < 0 ||
+        command_register("GET", OPCODE_GET, cmd_get, 1, 1, COMMAND_FAST, STATS_CMD_GET) < 0 ||
+        command_register("DEL", OPCODE_DEL, cmd_del, 1, 1, COMMAND_FAST, STATS_CMD_DEL) < 0 ||
+        command_register("INCR", OPCODE_INCR, cmd_incr, 1, 2, COMMAND_FAST,
+                         STATS_CMD_INCR) < 0 ||
+        command_register("EXPIRE", OPCODE_EXPIRE, cmd_expire, 2, 2, COMMAND_FAST,
+                         STATS_CMD_EXPIRE) < 0) {
+        return -1;
+    }
+    return 0;
+}
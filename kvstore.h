@@ -0,0 +1,50 @@
+#ifndef KVSTORE_H
+#define KVSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+// In-memory cache behind SET, GET, DEL, INCR and EXPIRE. Keys hash to
+// one of KV_SHARDS shards, each an open-addressing table under its own
+// lock, so requests for keys on different shards never contend. An item
+// (key and value together) lives in one object from a size-classed slab
+// pool. Expired items are dropped when looked up and by a sweep every
+// request advances a few slots; a shard at its share of the memory limit
+// evicts the least recently used of a few sampled items.
+
+#define KV_SHARDS 64
+#define KV_KEY_MAX 250
+
+// Largest item, key and value included
+#define KV_ITEM_MAX (64 * 1024)
+
+typedef enum {
+    KV_OK,
+    KV_NOT_FOUND,
+    KV_TOO_LARGE,       // key or item over the limits above
+    KV_NO_MEMORY,       // does not fit even after evicting
+    KV_NOT_INTEGER      // INCR on a value that is not a 64-bit integer
+} KvResult;
+
+// Set up the store and register its commands; call before the server
+// starts accepting clients. memory_limit caps the bytes held by items
+// (0 = no limit). Returns 0 on success, -1 on failure (logged).
+int kv_init(size_t memory_limit);
+
+// Store value under key, replacing any previous value and its TTL
+KvResult kv_set(const char* key, size_t key_len, const char* value, size_t value_len);
+
+// Append the value stored under key to out
+KvResult kv_get(const char* key, size_t key_len, Buffer* out);
+
+KvResult kv_delete(const char* key, size_t key_len);
+
+// Add delta to the integer stored under key (a missing key counts as
+// 0) and store the sum in *value. The TTL is kept.
+KvResult kv_incr(const char* key, size_t key_len, int64_t delta, int64_t* value);
+
+// Expire key ttl_ms from now; 0 removes its TTL
+KvResult kv_expire(const char* key, size_t key_len, uint64_t ttl_ms);
+
+#endif // KVSTORE_H
@@ -0,0 +1,641 @@
+/*
+ * Load generator for the server
+ * Usage: ./loadgen [options]
+ * Example: ./loadgen -t 4 -c 32 -P 8 -d 10 -m "PING:8,ECHO:2"
+ *
+ * Every thread drives its connections from one epoll loop. In closed-loop
+ * mode each connection keeps the pipeline full; with -r the requests are
+ * sent on a fixed schedule instead, and latency is measured from the time
+ * a request was due rather than when it could be sent, so a stalled
+ * server is not hidden by the client waiting for it (coordinated
+ * omission).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8080
+
+#define MAX_MIX 16
+#define MAX_DEPTH 1024
+#define READ_SIZE 65536
+
+// Log-linear latency histogram: 32 buckets per power of two (about 3%
+// relative error), values clamped to 2^40 ns
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB_COUNT)
+
+typedef struct {
+    char* text;             // request line including the newline
+    size_t len;
+    int weight;
+} MixEntry;
+
+typedef struct {
+    const char* host;
+    int port;
+    int threads;
+    int connections;        // per thread
+    int depth;              // requests in flight per connection
+    double rate;            // requests per second over all connections; 0 = closed loop
+    int duration;           // seconds
+    int keepalive;          // 0: one request per connection
+    size_t payload;         // ECHO message size
+    MixEntry mix[MAX_MIX];
+    int mix_count;
+    int total_weight;
+} Options;
+
+typedef struct {
+    int fd;
+    int connected;
+    int want_write;
+    uint64_t opened_at;
+    
+    // Send stamps of requests in flight, oldest at head
+    uint64_t stamps[MAX_DEPTH];
+    int head;
+    int inflight;
+    uint64_t next_due;      // open loop: when the next request is due
+    
+    char* wbuf;
+    size_t wlen;
+    size_t woff;
+    char rbuf[READ_SIZE];
+    size_t rlen;
+} LoadConn;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    int epfd;
+    LoadConn* conns;
+    uint64_t seed;
+    uint64_t interval;      // open loop: ns between requests on one connection
+    
+    uint64_t histogram[HIST_BUCKETS];
+    uint64_t max_latency;
+    uint64_t total_latency;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t failures;      // connections that failed or dropped
+    uint64_t reconnects;
+} Worker;
+
+static Options options;
+static size_t longest_request;
+static size_t write_capacity;
+static uint64_t deadline;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB_COUNT) {
+        return (int)value;
+    }
+    if (value >= (1ULL << (HIST_MAX_EXP + 1))) {
+        value = (1ULL << (HIST_MAX_EXP + 1)) - 1;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + sub;
+}
+
+// Largest value that falls into a bucket
+static uint64_t hist_bucket_limit(int bucket) {
+    if (bucket < HIST_SUB_COUNT) {
+        return (uint64_t)bucket;
+    }
+    int exponent = bucket / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(bucket % HIST_SUB_COUNT);
+    int shift = exponent - HIST_SUB_BITS;
+    return ((HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+static uint64_t hist_percentile(const uint64_t* histogram, uint64_t count, double fraction,
+                                uint64_t max) {
+    uint64_t rank = (uint64_t)(fraction * (double)count);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen > rank) {
+            uint64_t limit = hist_bucket_limit(i);
+            return (limit < max) ? limit : max;
+        }
+    }
+    return max;
+}
+
+static void record_latency(Worker* w, uint64_t latency) {
+    w->histogram[hist_bucket(latency)]++;
+    w->total_latency += latency;
+    if (latency > w->max_latency) {
+        w->max_latency = latency;
+    }
+    w->completed++;
+}
+
+static uint64_t next_random(Worker* w) {
+    // xorshift64*
+    w->seed ^= w->seed >> 12;
+    w->seed ^= w->seed << 25;
+    w->seed ^= w->seed >> 27;
+    return w->seed * 0x2545F4914F6CDD1DULL;
+}
+
+static const MixEntry* pick_command(Worker* w) {
+    int roll = (int)(next_random(w) % (uint64_t)options.total_weight);
+    for (int i = 0; i < options.mix_count; i++) {
+        roll -= options.mix[i].weight;
+        if (roll < 0) {
+            return &options.mix[i];
+        }
+    }
+    return &options.mix[options.mix_count - 1];
+}
+
+static void set_events(Worker* w, LoadConn* c) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (c->want_write ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static int conn_open(Worker* w, LoadConn* c) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)options.port);
+    if (inet_pton(AF_INET, options.host, &addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid address: %s\n", options.host);
+        return -1;
+    }
+    
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    c->connected = 0;
+    c->want_write = 1;
+    c->head = 0;
+    c->inflight = 0;
+    c->wlen = 0;
+    c->woff = 0;
+    c->rlen = 0;
+    c->opened_at = now_ns();
+    
+    if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    
+    // Writable once the connection completes
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void conn_reopen(Worker* w, LoadConn* c) {
+    close(c->fd);
+    c->fd = -1;
+    w->reconnects++;
+    if (conn_open(w, c) < 0) {
+        w->failures++;
+    }
+}
+
+static void conn_fail(Worker* w, LoadConn* c) {
+    w->failures++;
+    w->errors += (uint64_t)c->inflight;
+    conn_reopen(w, c);
+}
+
+static void enqueue(Worker* w, LoadConn* c, uint64_t stamp) {
+    const MixEntry* cmd = pick_command(w);
+    memcpy(c->wbuf + c->wlen, cmd->text, cmd->len);
+    c->wlen += cmd->len;
+    c->stamps[(c->head + c->inflight) % MAX_DEPTH] = stamp;
+    c->inflight++;
+}
+
+static void flush(Worker* w, LoadConn* c) {
+    while (c->woff < c->wlen) {
+        ssize_t sent = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            conn_fail(w, c);
+            return;
+        }
+        c->woff += (size_t)sent;
+    }
+    if (c->woff == c->wlen) {
+        c->woff = 0;
+        c->wlen = 0;
+    }
+    
+    int want_write = (c->wlen > 0);
+    if (want_write != c->want_write) {
+        c->want_write = want_write;
+        set_events(w, c);
+    }
+}
+
+// Top up the pipeline: closed loop fills it, open loop sends what is due
+static void fill(Worker* w, LoadConn* c, uint64_t now) {
+    if (!c->connected) {
+        return;
+    }
+    int depth = options.keepalive ? options.depth : 1;
+    while (c->inflight < depth && c->wlen + longest_request <= write_capacity) {
+        if (options.rate > 0) {
+            if (c->next_due > now) {
+                break;
+            }
+            enqueue(w, c, c->next_due);
+            c->next_due += w->interval;
+        } else {
+            // Without keep-alive the connect time is part of the request
+            enqueue(w, c, options.keepalive ? now : c->opened_at);
+        }
+    }
+    flush(w, c);
+}
+
+static void handle_readable(Worker* w, LoadConn* c) {
+    for (;;) {
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+        if (n == 0) {
+            conn_fail(w, c);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            conn_fail(w, c);
+            return;
+        }
+        
+        uint64_t now = now_ns();
+        size_t len = c->rlen + (size_t)n;
+        size_t pos = 0;
+        for (;;) {
+            char* line = c->rbuf + pos;
+            char* newline = (char*)memchr(line, '\n', len - pos);
+            if (newline == NULL) {
+                break;
+            }
+            pos += (size_t)(newline - line) + 1;
+            if (c->inflight == 0) {
+                // Unsolicited line, e.g. a multi-line reply in the mix
+                w->errors++;
+                continue;
+            }
+            record_latency(w, now - c->stamps[c->head]);
+            if (strncmp(line, "ERROR", 5) == 0) {
+                w->errors++;
+            }
+            c->head = (c->head + 1) % MAX_DEPTH;
+            c->inflight--;
+        }
+        
+        if (pos == 0 && len == sizeof(c->rbuf)) {
+            // A reply longer than the read buffer; give up on it
+            conn_fail(w, c);
+            return;
+        }
+        memmove(c->rbuf, c->rbuf + pos, len - pos);
+        c->rlen = len - pos;
+        
+        if (!options.keepalive && c->inflight == 0) {
+            conn_reopen(w, c);
+            return;
+        }
+        if (now < deadline) {
+            fill(w, c, now);
+        }
+    }
+}
+
+static void handle_connected(Worker* w, LoadConn* c) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+        // Not retried: a refused connect would otherwise spin
+        w->failures++;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    c->connected = 1;
+    c->want_write = 0;
+    set_events(w, c);
+    fill(w, c, now_ns());
+}
+
+// Milliseconds until the earliest due request, for the epoll timeout
+static int next_timeout(Worker* w, uint64_t now) {
+    if (options.rate <= 0) {
+        return 100;
+    }
+    uint64_t earliest = deadline;
+    for (int i = 0; i < options.connections; i++) {
+        LoadConn* c = &w->conns[i];
+        if (c->connected && c->inflight < options.depth && c->next_due < earliest) {
+            earliest = c->next_due;
+        }
+    }
+    if (earliest <= now) {
+        return 0;
+    }
+    // Round down: sub-millisecond intervals are met by polling
+    uint64_t ms = (earliest - now) / 1000000;
+    return (ms > 100) ? 100 : (int)ms;
+}
+
+static void* worker_run(void* arg) {
+    Worker* w = (Worker*)arg;
+    int total_conns = options.threads * options.connections;
+    struct epoll_event events[256];
+    
+    uint64_t start = now_ns();
+    for (int i = 0; i < options.connections; i++) {
+        LoadConn* c = &w->conns[i];
+        if (options.rate > 0) {
+            // Stagger connections evenly over one interval
+            int global = w->index * options.connections + i;
+            c->next_due = start + w->interval * (uint64_t)global / (uint64_t)total_conns;
+        }
+        if (conn_open(w, c) < 0) {
+            w->failures++;
+        }
+    }
+    
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= deadline) {
+            break;
+        }
+        
+        int n = epoll_wait(w->epfd, events, 256, next_timeout(w, now));
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            LoadConn* c = (LoadConn*)events[i].data.ptr;
+            if (!c->connected) {
+                handle_connected(w, c);
+                continue;
+            }
+            if (events[i].events & EPOLLIN) {
+                handle_readable(w, c);
+            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                conn_fail(w, c);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && c->connected) {
+                flush(w, c);
+            }
+        }
+        
+        if (options.rate > 0) {
+            now = now_ns();
+            for (int i = 0; i < options.connections; i++) {
+                fill(w, &w->conns[i], now);
+            }
+        }
+    }
+    
+    for (int i = 0; i < options.connections; i++) {
+        if (w->conns[i].fd >= 0) {
+            close(w->conns[i].fd);
+        }
+    }
+    return NULL;
+}
+
+// Parse "CMD[:weight],..."; a bare ECHO gets a message of the payload size
+static int parse_mix(const char* spec) {
+    char* copy = strdup(spec);
+    char* save = NULL;
+    options.mix_count = 0;
+    options.total_weight = 0;
+    
+    for (char* item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if (options.mix_count == MAX_MIX) {
+            fprintf(stderr, "At most %d commands in the mix\n", MAX_MIX);
+            free(copy);
+            return -1;
+        }
+        int weight = 1;
+        char* colon = strrchr(item, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            weight = atoi(colon + 1);
+        }
+        if (weight <= 0 || *item == '\0') {
+            fprintf(stderr, "Invalid mix entry: %s\n", item);
+            free(copy);
+            return -1;
+        }
+        
+        MixEntry* entry = &options.mix[options.mix_count++];
+        size_t len = strlen(item);
+        int echo = (strcmp(item, "ECHO") == 0);
+        entry->len = len + (echo ? 1 + options.payload : 0) + 1;
+        entry->text = (char*)malloc(entry->len);
+        memcpy(entry->text, item, len);
+        if (echo) {
+            entry->text[len] = ' ';
+            memset(entry->text + len + 1, 'x', options.payload);
+        }
+        entry->text[entry->len - 1] = '\n';
+        entry->weight = weight;
+        options.total_weight += weight;
+    }
+    
+    free(copy);
+    return (options.mix_count > 0) ? 0 : -1;
+}
+
+static void usage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  -h HOST     server address (default %s)\n", DEFAULT_HOST);
+    printf("  -p PORT     server port (default %d)\n", DEFAULT_PORT);
+    printf("  -t N        threads (default 4)\n");
+    printf("  -c N        connections per thread (default 16)\n");
+    printf("  -P N        requests in flight per connection (default 1, max %d)\n", MAX_DEPTH);
+    printf("  -r RATE     open loop at RATE requests/s overall (default: closed loop)\n");
+    printf("  -d SECONDS  test duration (default 10)\n");
+    printf("  -m MIX      command mix, e.g. \"PING:8,ECHO:1,TIME:1\" (default PING)\n");
+    printf("              commands must have one-line replies\n");
+    printf("  -s BYTES    ECHO message size (default 16)\n");
+    printf("  -n          new connection per request instead of keep-alive\n");
+}
+
+static void report(Worker* workers, double elapsed) {
+    uint64_t histogram[HIST_BUCKETS] = {0};
+    uint64_t completed = 0, errors = 0, failures = 0, reconnects = 0;
+    uint64_t total_latency = 0, max_latency = 0;
+    
+    for (int t = 0; t < options.threads; t++) {
+        Worker* w = &workers[t];
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            histogram[b] += w->histogram[b];
+        }
+        completed += w->completed;
+        errors += w->errors;
+        failures += w->failures;
+        reconnects += w->reconnects;
+        total_latency += w->total_latency;
+        if (w->max_latency > max_latency) {
+            max_latency = w->max_latency;
+        }
+    }
+    
+    printf("%d threads x %d connections, pipeline %d, %s, %s, %.1f s\n",
+           options.threads, options.connections, options.keepalive ? options.depth : 1,
+           (options.rate > 0) ? "open loop" : "closed loop",
+           options.keepalive ? "keep-alive" : "connection per request", elapsed);
+    if (options.rate > 0) {
+        printf("target rate: %.0f/s\n", options.rate);
+    }
+    printf("requests: %llu (%.0f/s), errors: %llu, failed connections: %llu, reconnects: %llu\n",
+           (unsigned long long)completed, completed / elapsed, (unsigned long long)errors,
+           (unsigned long long)failures, (unsigned long long)reconnects);
+    if (completed == 0) {
+        return;
+    }
+    printf("latency: mean=%.1fus p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+           total_latency / (double)completed / 1000.0,
+           hist_percentile(histogram, completed, 0.50, max_latency) / 1000.0,
+           hist_percentile(histogram, completed, 0.99, max_latency) / 1000.0,
+           hist_percentile(histogram, completed, 0.999, max_latency) / 1000.0,
+           max_latency / 1000.0);
+}
+
+int main(int argc, char* argv[]) {
+    const char* mix = "PING";
+    options.host = DEFAULT_HOST;
+    options.port = DEFAULT_PORT;
+    options.threads = 4;
+    options.connections = 16;
+    options.depth = 1;
+    options.rate = 0;
+    options.duration = 10;
+    options.keepalive = 1;
+    options.payload = 16;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:t:c:P:r:d:m:s:n")) != -1) {
+        switch (opt) {
+            case 'h': options.host = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 't': options.threads = atoi(optarg); break;
+            case 'c': options.connections = atoi(optarg); break;
+            case 'P': options.depth = atoi(optarg); break;
+            case 'r': options.rate = atof(optarg); break;
+            case 'd': options.duration = atoi(optarg); break;
+            case 'm': mix = optarg; break;
+            case 's': options.payload = (size_t)atol(optarg); break;
+            case 'n': options.keepalive = 0; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (options.threads < 1 || options.connections < 1 || options.depth < 1 ||
+        options.depth > MAX_DEPTH || options.duration < 1 || options.rate < 0 ||
+        parse_mix(mix) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    for (int i = 0; i < options.mix_count; i++) {
+        if (options.mix[i].len > longest_request) {
+            longest_request = options.mix[i].len;
+        }
+    }
+    write_capacity = longest_request * (size_t)options.depth;
+    
+    Worker* workers = (Worker*)calloc((size_t)options.threads, sizeof(Worker));
+    int total_conns = options.threads * options.connections;
+    uint64_t start = now_ns();
+    deadline = start + (uint64_t)options.duration * 1000000000ULL;
+    
+    for (int t = 0; t < options.threads; t++) {
+        Worker* w = &workers[t];
+        w->index = t;
+        w->seed = 0x9E3779B97F4A7C15ULL * (uint64_t)(t + 1);
+        w->epfd = epoll_create1(0);
+        if (options.rate > 0) {
+            w->interval = (uint64_t)(total_conns * 1e9 / options.rate);
+        }
+        w->conns = (LoadConn*)calloc((size_t)options.connections, sizeof(LoadConn));
+        for (int i = 0; i < options.connections; i++) {
+            w->conns[i].fd = -1;
+            w->conns[i].wbuf = (char*)malloc(write_capacity);
+        }
+        if (w->epfd < 0 || pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+            perror("worker");
+            return 1;
+        }
+    }
+    
+    for (int t = 0; t < options.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    report(workers, elapsed);
+    
+    for (int t = 0; t < options.threads; t++) {
+        for (int i = 0; i < options.connections; i++) {
+            free(workers[t].conns[i].wbuf);
+        }
+        free(workers[t].conns);
+        close(workers[t].epfd);
+    }
+    free(workers);
+    for (int i = 0; i < options.mix_count; i++) {
+        free(options.mix[i].text);
+    }
+    return 0;
+}
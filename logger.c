@@ -1,13 +1,28 @@
 #include "logger.h"
+#include "task_ring.h"
+#include "clock.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// Formatted record size; longer messages are truncated
+#define LOG_RECORD_SIZE 496
+
+// Records per writev() and the writer's idle flush interval
+#define LOG_WRITE_BATCH 64
+#define LOG_FLUSH_INTERVAL_MS 50
 
 static FILE* log_fp = NULL;
-static LogLevel min_log_level = LOG_INFO;
+atomic_int logger_min_level = LOG_INFO;
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static const char* level_strings[] = {
@@ -16,10 +31,60 @@ static const char* level_strings[] = {
     "ERROR"
 };
 
+// Slot of the async ring: one pre-formatted line, written in place
+typedef struct {
+    atomic_size_t sequence;
+    size_t length;
+    char text[LOG_RECORD_SIZE];
+} LogCell;
+
+// Multi-producer, single-consumer ring drained by the writer thread
+typedef struct {
+    alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    alignas(CACHE_LINE_SIZE) size_t dequeue_pos;
+    LogCell* cells;
+    size_t mask;
+    
+    LogOverflowPolicy overflow;
+    atomic_size_t dropped;
+    
+    pthread_t writer;
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t wake_cond;
+    atomic_int stop;
+} LogRing;
+
+static _Atomic(LogRing*) async_ring = NULL;
+
+static __thread char thread_timestamp[CLOCK_TIMESTAMP_LEN + 1];
+
+// The clock formats each second once for all threads; this is a copy
+static const char* format_timestamp(void) {
+    clock_timestamp(thread_timestamp);
+    return thread_timestamp;
+}
+
+// Format "[timestamp] [LEVEL] message\n" into buf; returns its length
+static size_t format_record(char* buf, size_t size, LogLevel level,
+                            const char* format, va_list args) {
+    int prefix = snprintf(buf, size, "[%s] [%s] ", format_timestamp(), level_strings[level]);
+    size_t len = (prefix > 0) ? (size_t)prefix : 0;
+    if (len >= size - 1) {
+        len = size - 2;
+    }
+    
+    int body = vsnprintf(buf + len, size - len - 1, format, args);
+    if (body > 0) {
+        len += ((size_t)body < size - len - 1) ? (size_t)body : size - len - 2;
+    }
+    buf[len++] = '\n';
+    return len;
+}
+
 void logger_init(const char* log_file, LogLevel min_level) {
     pthread_mutex_lock(&log_mutex);
     
-    min_log_level = min_level;
+    atomic_store(&logger_min_level, (int)min_level);
     
     if (log_file != NULL) {
         log_fp = fopen(log_file, "a");
@@ -32,27 +97,252 @@ void logger_init(const char* log_file, LogLevel min_level) {
     pthread_mutex_unlock(&log_mutex);
 }
 
-void log_message(LogLevel level, const char* format, ...) {
-    if (level < min_log_level) {
+// Write every iovec, retrying partial writes
+static void write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+}
+
+static void write_records(struct iovec* iov, int count) {
+    // writev() may advance the iovecs, so each destination gets a copy
+    struct iovec copy[LOG_WRITE_BATCH];
+    
+    memcpy(copy, iov, sizeof(struct iovec) * (size_t)count);
+    write_all(STDOUT_FILENO, copy, count);
+    
+    if (log_fp != NULL) {
+        memcpy(copy, iov, sizeof(struct iovec) * (size_t)count);
+        write_all(fileno(log_fp), copy, count);
+    }
+}
+
+static void report_dropped(LogRing* ring) {
+    size_t dropped = atomic_exchange(&ring->dropped, 0);
+    if (dropped == 0) {
+        return;
+    }
+    
+    char text[128];
+    int len = snprintf(text, sizeof(text), "[%s] [%s] Log buffer full, dropped %zu messages\n",
+                       format_timestamp(), level_strings[LOG_ERROR], dropped);
+    struct iovec iov = { .iov_base = text, .iov_len = (size_t)len };
+    write_records(&iov, 1);
+}
+
+// Write out every published record in batches; returns records written
+static size_t drain_ring(LogRing* ring) {
+    size_t total = 0;
+    
+    while (1) {
+        struct iovec iov[LOG_WRITE_BATCH];
+        size_t pos = ring->dequeue_pos;
+        int count = 0;
+        
+        // Gather a run of published cells and write them in place
+        while (count < LOG_WRITE_BATCH) {
+            LogCell* cell = &ring->cells[(pos + (size_t)count) & ring->mask];
+            size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+            if (seq != pos + (size_t)count + 1) {
+                break;
+            }
+            iov[count].iov_base = cell->text;
+            iov[count].iov_len = cell->length;
+            count++;
+        }
+        
+        if (count == 0) {
+            break;
+        }
+        
+        write_records(iov, count);
+        
+        // Hand the cells back to producers
+        for (int i = 0; i < count; i++) {
+            LogCell* cell = &ring->cells[(pos + (size_t)i) & ring->mask];
+            atomic_store_explicit(&cell->sequence, pos + (size_t)i + ring->mask + 1,
+                                  memory_order_release);
+        }
+        ring->dequeue_pos = pos + (size_t)count;
+        total += (size_t)count;
+    }
+    
+    report_dropped(ring);
+    return total;
+}
+
+static void* writer_thread(void* arg) {
+    LogRing* ring = (LogRing*)arg;
+    
+    while (1) {
+        int stopping = atomic_load(&ring->stop);
+        
+        if (drain_ring(ring) > 0) {
+            continue;
+        }
+        if (stopping) {
+            // Read stop before the final drain so nothing published
+            // before logger_close() is left behind
+            break;
+        }
+        
+        // Idle: wake on producers passing the threshold or on the timer
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&ring->wake_mutex);
+        if (!atomic_load(&ring->stop)) {
+            pthread_cond_timedwait(&ring->wake_cond, &ring->wake_mutex, &deadline);
+        }
+        pthread_mutex_unlock(&ring->wake_mutex);
+    }
+    
+    return NULL;
+}
+
+static void wake_writer(LogRing* ring) {
+    pthread_mutex_lock(&ring->wake_mutex);
+    pthread_cond_signal(&ring->wake_cond);
+    pthread_mutex_unlock(&ring->wake_mutex);
+}
+
+// Claim a cell, or return NULL when the ring is full
+static LogCell* claim_cell(LogRing* ring, size_t* claimed) {
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    
+    while (1) {
+        LogCell* cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *claimed = pos;
+                return cell;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static void log_async(LogRing* ring, LogLevel level, const char* format, va_list args) {
+    size_t pos;
+    LogCell* cell = claim_cell(ring, &pos);
+    
+    while (cell == NULL) {
+        if (ring->overflow == LOG_OVERFLOW_DROP) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        // Block: let the writer make room
+        wake_writer(ring);
+        sched_yield();
+        cell = claim_cell(ring, &pos);
+    }
+    
+    cell->length = format_record(cell->text, sizeof(cell->text), level, format, args);
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    
+    // Only wake the writer early once a batch has accumulated; otherwise
+    // its flush timer picks the record up
+    if (((pos + 1) & (LOG_WRITE_BATCH - 1)) == 0) {
+        wake_writer(ring);
+    }
+}
+
+int logger_start_async(size_t capacity, LogOverflowPolicy overflow) {
+    size_t size = LOG_WRITE_BATCH;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    
+    LogRing* ring = (LogRing*)aligned_alloc(CACHE_LINE_SIZE, sizeof(LogRing));
+    if (ring == NULL) {
+        return -1;
+    }
+    memset(ring, 0, sizeof(LogRing));
+    
+    ring->cells = (LogCell*)malloc(sizeof(LogCell) * size);
+    if (ring->cells == NULL) {
+        free(ring);
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&ring->cells[i].sequence, i);
+    }
+    ring->mask = size - 1;
+    ring->overflow = overflow;
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->stop, 0);
+    pthread_mutex_init(&ring->wake_mutex, NULL);
+    pthread_cond_init(&ring->wake_cond, NULL);
+    
+    // Records written so far went through stdio; keep them in order
+    pthread_mutex_lock(&log_mutex);
+    fflush(stdout);
+    if (log_fp != NULL) {
+        fflush(log_fp);
+    }
+    
+    if (pthread_create(&ring->writer, NULL, writer_thread, ring) != 0) {
+        pthread_mutex_unlock(&log_mutex);
+        pthread_mutex_destroy(&ring->wake_mutex);
+        pthread_cond_destroy(&ring->wake_cond);
+        free(ring->cells);
+        free(ring);
+        return -1;
+    }
+    atomic_store_explicit(&async_ring, ring, memory_order_release);
+    pthread_mutex_unlock(&log_mutex);
+    
+    return 0;
+}
+
+static void log_vwrite(LogLevel level, const char* format, va_list args) {
+    LogRing* ring = atomic_load_explicit(&async_ring, memory_order_acquire);
+    if (ring != NULL) {
+        log_async(ring, level, format, args);
         return;
     }
     
     pthread_mutex_lock(&log_mutex);
     
     // Get current timestamp
-    time_t now;
-    time(&now);
-    struct tm* tm_info = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+    const char* timestamp = format_timestamp();
     
     // Print to stdout
     printf("[%s] [%s] ", timestamp, level_strings[level]);
     
-    va_list args;
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
+    va_list copy;
+    va_copy(copy, args);
+    vprintf(format, copy);
+    va_end(copy);
     
     printf("\n");
     fflush(stdout);
@@ -60,9 +350,9 @@ void log_message(LogLevel level, const char* format, ...) {
     // Print to file if available
     if (log_fp != NULL) {
         fprintf(log_fp, "[%s] [%s] ", timestamp, level_strings[level]);
-        va_start(args, format);
-        vfprintf(log_fp, format, args);
-        va_end(args);
+        va_copy(copy, args);
+        vfprintf(log_fp, format, copy);
+        va_end(copy);
         fprintf(log_fp, "\n");
         fflush(log_fp);
     }
@@ -70,7 +360,40 @@ void log_message(LogLevel level, const char* format, ...) {
     pthread_mutex_unlock(&log_mutex);
 }
 
+void log_message(LogLevel level, const char* format, ...) {
+    if (!log_enabled(level)) {
+        return;
+    }
+    
+    va_list args;
+    va_start(args, format);
+    log_vwrite(level, format, args);
+    va_end(args);
+}
+
+void log_write(LogLevel level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_vwrite(level, format, args);
+    va_end(args);
+}
+
 void logger_close(void) {
+    LogRing* ring = atomic_load(&async_ring);
+    if (ring != NULL) {
+        // Final drain: the writer empties the ring before exiting.
+        // Callers must have stopped logging from other threads.
+        atomic_store(&ring->stop, 1);
+        wake_writer(ring);
+        pthread_join(ring->writer, NULL);
+        atomic_store(&async_ring, NULL);
+        
+        pthread_mutex_destroy(&ring->wake_mutex);
+        pthread_cond_destroy(&ring->wake_cond);
+        free(ring->cells);
+        free(ring);
+    }
+    
     pthread_mutex_lock(&log_mutex);
     
     if (log_fp != NULL) {
@@ -2,8 +2,16 @@
 #define LOGGER_H
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <time.h>
 
+// Lowest level compiled in (0 = DEBUG, 1 = INFO, 2 = ERROR); set from the
+// Makefile with LOG_MIN_LEVEL=n. Macros below it expand to nothing.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
 // Log levels
 typedef enum {
     LOG_DEBUG,
@@ -11,13 +19,68 @@ typedef enum {
     LOG_ERROR
 } LogLevel;
 
+// What an async log_message() does when the ring is full
+typedef enum {
+    LOG_OVERFLOW_DROP,    // discard the record and count it
+    LOG_OVERFLOW_BLOCK    // wait for the writer to make room
+} LogOverflowPolicy;
+
 // Initialize logger with file path (NULL for stdout only)
 void logger_init(const char* log_file, LogLevel min_level);
 
+// Switch to asynchronous logging: callers format into a lock-free ring
+// of capacity records and a writer thread batches them out with writev().
+// Returns 0 on success, -1 if the logger stays synchronous.
+int logger_start_async(size_t capacity, LogOverflowPolicy overflow);
+
 // Log a message
-void log_message(LogLevel level, const char* format, ...);
+void log_message(LogLevel level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Log without the level check; used by the macros below
+void log_write(LogLevel level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Runtime minimum level, set by logger_init()
+extern atomic_int logger_min_level;
+
+static inline int log_enabled(LogLevel level) {
+    return (int)level >= atomic_load_explicit(&logger_min_level, memory_order_relaxed);
+}
+
+// Level-specific logging. Arguments are only evaluated when the level is
+// enabled; levels below LOG_MIN_LEVEL are type-checked but generate no
+// code. The names are function-like macros, so the LogLevel constants of
+// the same name are unaffected.
+#define LOG_AT(level, ...)                  \
+    do {                                    \
+        if (log_enabled(level)) {           \
+            log_write(level, __VA_ARGS__);  \
+        }                                   \
+    } while (0)
+
+#define LOG_DISABLED(level, ...)            \
+    do {                                    \
+        if (0) {                            \
+            log_write(level, __VA_ARGS__);  \
+        }                                   \
+    } while (0)
+
+#if LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_DISABLED(LOG_DEBUG, __VA_ARGS__)
+#endif
+
+#if LOG_MIN_LEVEL <= 1
+#define LOG_INFO(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) LOG_DISABLED(LOG_INFO, __VA_ARGS__)
+#endif
+
+#define LOG_ERROR(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
 
-// Close logger
+// Close logger; in async mode, writes out every queued record first
 void logger_close(void);
 
 #endif // LOGGER_H
@@ -0,0 +1,279 @@
+#include "object_pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define OBJECT_POOL_MAX_POOLS 32
+#define OBJECT_ALIGN 16
+
+// Thread cache bounds: a cache holding more than CACHE_LIMIT objects
+// flushes CACHE_BATCH of them back to the depot; an empty cache takes
+// CACHE_BATCH from it
+#define CACHE_LIMIT 64
+#define CACHE_BATCH 32
+
+typedef struct FreeObject {
+    struct FreeObject* next;
+} FreeObject;
+
+typedef struct Slab {
+    struct Slab* next;
+} Slab;
+
+// One per (thread, pool); only the owning thread touches the free list
+typedef struct ObjectCache {
+    FreeObject* head;
+    atomic_size_t count;
+    struct ObjectCache* next;
+} ObjectCache;
+
+struct ObjectPool {
+    int id;
+    const char* name;
+    size_t object_size;
+    size_t objects_per_slab;
+    
+    pthread_mutex_t lock;
+    FreeObject* depot;
+    size_t depot_count;
+    Slab* slabs;
+    size_t slab_count;
+    size_t total;
+    ObjectCache* caches;
+};
+
+static ObjectPool* registry[OBJECT_POOL_MAX_POOLS];
+static int registry_count = 0;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread ObjectCache* thread_caches[OBJECT_POOL_MAX_POOLS];
+
+ObjectPool* object_pool_create(const char* name, size_t object_size, size_t objects_per_slab) {
+    ObjectPool* pool = (ObjectPool*)calloc(1, sizeof(ObjectPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    
+    if (object_size < sizeof(FreeObject)) {
+        object_size = sizeof(FreeObject);
+    }
+    pool->object_size = (object_size + OBJECT_ALIGN - 1) & ~(size_t)(OBJECT_ALIGN - 1);
+    pool->objects_per_slab = (objects_per_slab > 0) ? objects_per_slab : 64;
+    pool->name = name;
+    
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+    
+    // Pool ids index the thread-local cache table and are never reused
+    pthread_mutex_lock(&registry_mutex);
+    if (registry_count == OBJECT_POOL_MAX_POOLS) {
+        pthread_mutex_unlock(&registry_mutex);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        return NULL;
+    }
+    pool->id = registry_count++;
+    registry[pool->id] = pool;
+    pthread_mutex_unlock(&registry_mutex);
+    
+    return pool;
+}
+
+// Carve a new slab into the depot; caller holds pool->lock
+static int carve_slab(ObjectPool* pool) {
+    size_t header = (sizeof(Slab) + OBJECT_ALIGN - 1) & ~(size_t)(OBJECT_ALIGN - 1);
+    char* memory = (char*)malloc(header + pool->object_size * pool->objects_per_slab);
+    if (memory == NULL) {
+        return -1;
+    }
+    
+    Slab* slab = (Slab*)memory;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_count++;
+    
+    char* object = memory + header;
+    for (size_t i = 0; i < pool->objects_per_slab; i++) {
+        FreeObject* free_object = (FreeObject*)object;
+        free_object->next = pool->depot;
+        pool->depot = free_object;
+        object += pool->object_size;
+    }
+    pool->depot_count += pool->objects_per_slab;
+    pool->total += pool->objects_per_slab;
+    return 0;
+}
+
+static ObjectCache* get_cache(ObjectPool* pool) {
+    ObjectCache* cache = thread_caches[pool->id];
+    if (cache != NULL) {
+        return cache;
+    }
+    
+    // First use of this pool on this thread
+    cache = (ObjectCache*)calloc(1, sizeof(ObjectCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    cache->next = pool->caches;
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->lock);
+    
+    thread_caches[pool->id] = cache;
+    return cache;
+}
+
+void* object_pool_alloc(ObjectPool* pool) {
+    ObjectCache* cache = get_cache(pool);
+    if (cache == NULL) {
+        return NULL;
+    }
+    
+    if (cache->head == NULL) {
+        // Refill a batch from the depot
+        pthread_mutex_lock(&pool->lock);
+        if (pool->depot == NULL && carve_slab(pool) != 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        
+        size_t moved = 0;
+        while (pool->depot != NULL && moved < CACHE_BATCH) {
+            FreeObject* object = pool->depot;
+            pool->depot = object->next;
+            object->next = cache->head;
+            cache->head = object;
+            moved++;
+        }
+        pool->depot_count -= moved;
+        atomic_fetch_add_explicit(&cache->count, moved, memory_order_relaxed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    
+    FreeObject* object = cache->head;
+    cache->head = object->next;
+    atomic_fetch_sub_explicit(&cache->count, 1, memory_order_relaxed);
+    return object;
+}
+
+void object_pool_free(ObjectPool* pool, void* object) {
+    if (object == NULL) {
+        return;
+    }
+    
+    ObjectCache* cache = get_cache(pool);
+    FreeObject* free_object = (FreeObject*)object;
+    
+    if (cache == NULL) {
+        // No cache for this thread: return it straight to the depot
+        pthread_mutex_lock(&pool->lock);
+        free_object->next = pool->depot;
+        pool->depot = free_object;
+        pool->depot_count++;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    
+    free_object->next = cache->head;
+    cache->head = free_object;
+    size_t count = atomic_fetch_add_explicit(&cache->count, 1, memory_order_relaxed) + 1;
+    
+    if (count > CACHE_LIMIT) {
+        // Flush a batch so objects freed on this thread can be reused by
+        // threads that allocate
+        pthread_mutex_lock(&pool->lock);
+        for (size_t i = 0; i < CACHE_BATCH; i++) {
+            FreeObject* flushed = cache->head;
+            cache->head = flushed->next;
+            flushed->next = pool->depot;
+            pool->depot = flushed;
+        }
+        pool->depot_count += CACHE_BATCH;
+        atomic_fetch_sub_explicit(&cache->count, CACHE_BATCH, memory_order_relaxed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void object_pool_stats(ObjectPool* pool, ObjectPoolStats* stats) {
+    pthread_mutex_lock(&pool->lock);
+    
+    size_t cached = 0;
+    for (ObjectCache* cache = pool->caches; cache != NULL; cache = cache->next) {
+        cached += atomic_load_explicit(&cache->count, memory_order_relaxed);
+    }
+    
+    stats->name = pool->name;
+    stats->object_size = pool->object_size;
+    stats->slabs = pool->slab_count;
+    stats->total = pool->total;
+    stats->free = pool->depot_count + cached;
+    stats->live = (stats->total > stats->free) ? stats->total - stats->free : 0;
+    
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int object_pool_report(char* buf, size_t size) {
+    size_t used = 0;
+    
+    pthread_mutex_lock(&registry_mutex);
+    for (int i = 0; i < registry_count && used < size; i++) {
+        if (registry[i] == NULL) {
+            continue;
+        }
+        
+        ObjectPoolStats stats;
+        object_pool_stats(registry[i], &stats);
+        if (stats.slabs == 0) {
+            continue;   // never used
+        }
+        int written = snprintf(buf + used, size - used,
+                               "%s: size=%zu live=%zu free=%zu slabs=%zu\n",
+                               stats.name, stats.object_size, stats.live,
+                               stats.free, stats.slabs);
+        if (written < 0) {
+            break;
+        }
+        used += (size_t)written;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    
+    if (used >= size) {
+        used = (size > 0) ? size - 1 : 0;
+    }
+    return (int)used;
+}
+
+void object_pool_destroy(ObjectPool* pool) {
+    if (pool == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&registry_mutex);
+    registry[pool->id] = NULL;
+    pthread_mutex_unlock(&registry_mutex);
+    
+    // The calling thread's cache pointer would dangle otherwise
+    thread_caches[pool->id] = NULL;
+    
+    Slab* slab = pool->slabs;
+    while (slab != NULL) {
+        Slab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    
+    ObjectCache* cache = pool->caches;
+    while (cache != NULL) {
+        ObjectCache* next = cache->next;
+        free(cache);
+        cache = next;
+    }
+    
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
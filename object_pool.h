@@ -0,0 +1,42 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <stddef.h>
+
+// Fixed-size object allocator. Each thread keeps a small free list per
+// pool, refilled from and flushed to a shared depot in batches, so the
+// steady-state alloc/free path touches no locks and never calls malloc.
+// Pools are meant to live for the whole process.
+typedef struct ObjectPool ObjectPool;
+
+typedef struct {
+    const char* name;
+    size_t object_size;
+    size_t slabs;        // slabs carved from malloc
+    size_t total;        // objects carved from slabs
+    size_t live;         // objects handed out
+    size_t free;         // objects cached in the depot or thread caches
+} ObjectPoolStats;
+
+// Create a pool of objects of object_size bytes, carved objects_per_slab
+// at a time. Returns NULL on allocation failure or when the pool limit
+// is reached.
+ObjectPool* object_pool_create(const char* name, size_t object_size, size_t objects_per_slab);
+
+// Allocate an object (uninitialized) or NULL if out of memory
+void* object_pool_alloc(ObjectPool* pool);
+
+// Return an object; may be called from any thread
+void object_pool_free(ObjectPool* pool, void* object);
+
+// Snapshot counters (approximate while other threads are active)
+void object_pool_stats(ObjectPool* pool, ObjectPoolStats* stats);
+
+// Format one line per registered pool that has carved a slab into buf;
+// returns bytes written
+int object_pool_report(char* buf, size_t size);
+
+// Free all slabs; every object must have been returned
+void object_pool_destroy(ObjectPool* pool);
+
+#endif // OBJECT_POOL_H
@@ -0,0 +1,32 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// Static tracepoints (USDT) under the "tcpserver" provider, for bpftrace,
+// perf or SystemTap to attach to a running server: make SDT=1, which needs
+// <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel). An unattached
+// probe is a single nop; its arguments are values the code has at hand
+// anyway. Without SDT=1 the macros compile to nothing. tracing/ has
+// bpftrace scripts that use them.
+//
+// Probes and their arguments:
+//   connection__accept  fd, peer IP (string), peer port
+//   task__enqueue       task function, task argument (the Connection)
+//   task__dequeue       task function, task argument; about to run
+//   command__start      verb (not NUL-terminated), verb length
+//   command__done       verb, verb length, service time in ns
+//   send__done          fd, bytes written by the send that drained the
+//                       connection's output
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(tcpserver, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(tcpserver, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(tcpserver, name, a, b, c)
+#else
+#define PROBE1(name, a) do { (void)(a); } while (0)
+#define PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#endif // PROBES_H
@@ -1,67 +1,479 @@
 #include "protocol.h"
 #include "logger.h"
+#include "clock.h"
+#include "connection.h"
+#include "probes.h"
 #include <string.h>
 #include <stdio.h>
-#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 
-#define MAX_COMMAND_LEN 1024
+// Open-addressed table kept at most half full so probes stay short
+#define COMMAND_MAX_VERBS 32
+#define COMMAND_TABLE_BITS 6
+#define COMMAND_TABLE_SIZE (1 << COMMAND_TABLE_BITS)
 
-static void trim_newline(char* str) {
-    int len = strlen(str);
-    if (len > 0 && str[len - 1] == '\n') {
-        str[len - 1] = '\0';
+// Largest STATS DETAIL reply; longer reports are truncated
+#define STATS_REPORT_LIMIT (64 * 1024)
+
+// Room reserved for the STATS MEMORY report
+#define STATS_MEMORY_REPORT_SIZE 1024
+
+typedef struct {
+    const char* name;
+    size_t len;
+    uint64_t key;           // first eight bytes of the verb
+    uint8_t opcode;
+    CommandHandler handler;
+    int min_args;
+    int max_args;
+    int flags;
+    StatsCommand stat;
+} CommandEntry;
+
+static CommandEntry entries[COMMAND_MAX_VERBS];
+static int entry_count = 0;
+// Entry index plus one; 0 marks a free slot
+static uint8_t table[COMMAND_TABLE_SIZE];
+// Binary opcode to entry index plus one
+static uint8_t opcode_table[256];
+
+static pthread_once_t builtins_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char unknown_reply[] = "ERROR: Unknown command\n";
+static const char arity_reply[] = "ERROR: Wrong number of arguments\n";
+static const char length_reply[] = "ERROR: Invalid length\n";
+static const char no_stream_reply[] = "ERROR: Streaming not supported\n";
+static const char no_datagram_reply[] = "ERROR: Not available over UDP\n";
+static const char rate_limited_reply[] = "ERROR: Rate limited\n";
+static const char subscribed_reply[] =
+    "ERROR: Only SUBSCRIBE, UNSUBSCRIBE, PING and QUIT while subscribed\n";
+
+// Verbs are short, so the first eight bytes plus the length almost
+// always identify one; the remainder is compared only for longer verbs
+static inline uint64_t verb_key(const char* verb, size_t len) {
+    uint64_t key = 0;
+    memcpy(&key, verb, (len < sizeof(key)) ? len : sizeof(key));
+    return key;
+}
+
+static inline unsigned verb_slot(uint64_t key, size_t len) {
+    return (unsigned)(((key ^ len) * 0x9E3779B97F4A7C15ULL) >> (64 - COMMAND_TABLE_BITS));
+}
+
+static const CommandEntry* lookup(const char* verb, size_t len) {
+    uint64_t key = verb_key(verb, len);
+    for (unsigned slot = verb_slot(key, len);; slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1)) {
+        if (table[slot] == 0) {
+            return NULL;
+        }
+        const CommandEntry* entry = &entries[table[slot] - 1];
+        if (entry->key == key && entry->len == len &&
+            (len <= sizeof(key) || memcmp(entry->name + sizeof(key), verb + sizeof(key),
+                                          len - sizeof(key)) == 0)) {
+            return entry;
+        }
+    }
+}
+
+static int add_entry(const char* verb, uint8_t opcode, CommandHandler handler,
+                     int min_args, int max_args, int flags, StatsCommand stat) {
+    size_t len = strlen(verb);
+    int result = -1;
+    
+    pthread_mutex_lock(&register_mutex);
+    if (entry_count < COMMAND_MAX_VERBS && lookup(verb, len) == NULL &&
+        (opcode == 0 || opcode_table[opcode] == 0)) {
+        CommandEntry* entry = &entries[entry_count];
+        entry->name = verb;
+        entry->len = len;
+        entry->key = verb_key(verb, len);
+        entry->opcode = opcode;
+        entry->handler = handler;
+        entry->min_args = min_args;
+        entry->max_args = max_args;
+        entry->flags = flags;
+        entry->stat = stat;
+        
+        unsigned slot = verb_slot(entry->key, len);
+        while (table[slot] != 0) {
+            slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1);
+        }
+        table[slot] = (uint8_t)(++entry_count);
+        if (opcode != 0) {
+            opcode_table[opcode] = (uint8_t)entry_count;
+        }
+        result = 0;
+    }
+    pthread_mutex_unlock(&register_mutex);
+    
+    if (result < 0) {
+        LOG_ERROR("Cannot register command %s", verb);
+    }
+    return result;
+}
+
+static int cmd_ping(const Command* cmd, Buffer* out) {
+    (void)cmd;
+    return buffer_append(out, "PONG\n", 5);
+}
+
+static int cmd_time(const Command* cmd, Buffer* out) {
+    (void)cmd;
+    if (buffer_reserve(out, CLOCK_TIMESTAMP_LEN + 1) < 0) {
+        return -1;
+    }
+    size_t len = clock_timestamp(buffer_tail(out));
+    buffer_tail(out)[len] = '\n';
+    buffer_commit(out, len + 1);
+    return 0;
+}
+
+static int cmd_echo(const Command* cmd, Buffer* out) {
+    const CommandArg* message = &cmd->args[0];
+    if (buffer_reserve(out, message->len + 1) < 0) {
+        return -1;
+    }
+    memcpy(buffer_tail(out), message->data, message->len);
+    buffer_tail(out)[message->len] = '\n';
+    buffer_commit(out, message->len + 1);
+    return 0;
+}
+
+// Full report, terminated by an END line. The report's size depends on
+// the number of threads and gauges, so grow until it fits.
+static int stats_detail(Buffer* out) {
+    size_t want = 4096;
+    for (;;) {
+        if (buffer_reserve(out, want) < 0) {
+            return -1;
+        }
+        size_t space = buffer_space(out);
+        int len = stats_report(buffer_tail(out), space);
+        if ((size_t)len + 1 < space || space >= STATS_REPORT_LIMIT) {
+            buffer_commit(out, (size_t)len);
+            break;
+        }
+        want = space * 2;
+    }
+    return buffer_append(out, "END\n", 4);
+}
+
+// Connection and buffer memory, terminated by an END line
+static int stats_memory(Buffer* out) {
+    if (buffer_reserve(out, STATS_MEMORY_REPORT_SIZE) < 0) {
+        return -1;
+    }
+    int len = connection_memory_report(buffer_tail(out), buffer_space(out));
+    buffer_commit(out, (size_t)len);
+    return buffer_append(out, "END\n", 4);
+}
+
+static int cmd_stats(const Command* cmd, Buffer* out) {
+    if (cmd->argc == 0) {
+        char reply[64];
+        int len = snprintf(reply, sizeof(reply), "Active clients: %d\n",
+                           stats_active_connections());
+        return buffer_append(out, reply, (size_t)len);
+    }
+    if (cmd->args[0].len == 6 && memcmp(cmd->args[0].data, "DETAIL", 6) == 0) {
+        return stats_detail(out);
+    }
+    if (cmd->args[0].len == 6 && memcmp(cmd->args[0].data, "MEMORY", 6) == 0) {
+        return stats_memory(out);
+    }
+    return buffer_append(out, unknown_reply, sizeof(unknown_reply) - 1);
+}
+
+// STREAM <len>: the len raw bytes that follow the request are echoed
+// back as they arrive, after the request line itself. The connection
+// layer relays them without staging the whole payload.
+static int cmd_stream(const Command* cmd, Buffer* out) {
+    if (cmd->stream == NULL) {
+        return buffer_append(out, no_stream_reply, sizeof(no_stream_reply) - 1);
+    }
+    
+    const CommandArg* arg = &cmd->args[0];
+    uint64_t length = 0;
+    int valid = (arg->len > 0 && arg->len <= 18);
+    for (size_t i = 0; valid && i < arg->len; i++) {
+        if (arg->data[i] < '0' || arg->data[i] > '9') {
+            valid = 0;
+        } else {
+            length = length * 10 + (uint64_t)(arg->data[i] - '0');
+        }
+    }
+    if (!valid) {
+        return buffer_append(out, length_reply, sizeof(length_reply) - 1);
+    }
+    
+    char reply[32];
+    int len = snprintf(reply, sizeof(reply), "STREAM %llu\n", (unsigned long long)length);
+    if (buffer_append(out, reply, (size_t)len) < 0) {
+        return -1;
+    }
+    *cmd->stream = length;
+    return 0;
+}
+
+static int cmd_quit(const Command* cmd, Buffer* out) {
+    (void)cmd;
+    if (buffer_append(out, "Goodbye\n", 8) < 0) {
+        return -1;
+    }
+    return 1; // Signal to close connection
+}
+
+static void register_builtins(void) {
+    add_entry("PING", OPCODE_PING, cmd_ping, 0, 0,
+              COMMAND_DATAGRAM | COMMAND_SUBSCRIBER | COMMAND_FAST, STATS_CMD_PING);
+    add_entry("TIME", OPCODE_TIME, cmd_time, 0, 0, COMMAND_DATAGRAM | COMMAND_FAST,
+              STATS_CMD_TIME);
+    add_entry("ECHO", OPCODE_ECHO, cmd_echo, 1, 1, COMMAND_RAW_ARGS, STATS_CMD_ECHO);
+    add_entry("STATS", OPCODE_STATS, cmd_stats, 0, 1, COMMAND_DATAGRAM | COMMAND_FAST,
+              STATS_CMD_STATS);
+    add_entry("QUIT", OPCODE_QUIT, cmd_quit, 0, 0, COMMAND_SUBSCRIBER | COMMAND_FAST,
+              STATS_CMD_QUIT);
+    add_entry("STREAM", 0, cmd_stream, 1, 1, 0, STATS_CMD_STREAM);
+}
+
+int command_register(const char* verb, uint8_t opcode, CommandHandler handler,
+                     int min_args, int max_args, int flags, StatsCommand stat) {
+    pthread_once(&builtins_once, register_builtins);
+    return add_entry(verb, opcode, handler, min_args, max_args, flags, stat);
+}
+
+int command_is_fast(const char* line, size_t len) {
+    pthread_once(&builtins_once, register_builtins);
+    const char* space = (const char*)memchr(line, ' ', len);
+    const CommandEntry* entry = lookup(line, (space != NULL) ? (size_t)(space - line) : len);
+    return entry != NULL && (entry->flags & COMMAND_FAST);
+}
+
+int opcode_is_fast(uint8_t opcode) {
+    pthread_once(&builtins_once, register_builtins);
+    int index = opcode_table[opcode];
+    return index != 0 && (entries[index - 1].flags & COMMAND_FAST);
+}
+
+// Split the words after the verb. Returns the word count, or
+// COMMAND_MAX_ARGS + 1 if there are more than fit.
+static int split_args(Command* cmd) {
+    const char* p = cmd->rest.data;
+    const char* end = p + cmd->rest.len;
+    int argc = 0;
+    
+    while (p < end) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        if (argc == COMMAND_MAX_ARGS) {
+            return COMMAND_MAX_ARGS + 1;
+        }
+        const char* word = p;
+        while (p < end && *p != ' ') {
+            p++;
+        }
+        cmd->args[argc].data = word;
+        cmd->args[argc].len = (size_t)(p - word);
+        argc++;
     }
-    if (len > 1 && str[len - 2] == '\r') {
-        str[len - 2] = '\0';
+    return argc;
+}
+
+// Derive the arguments from cmd->rest and run the handler. has_args is
+// false when a text request had no separator after its verb.
+static int dispatch(const CommandEntry* entry, Command* cmd, int has_args, Buffer* out,
+                    uint16_t* status) {
+    cmd->argc = 0;
+    if (entry->flags & COMMAND_RAW_ARGS) {
+        if (has_args) {
+            cmd->args[0] = cmd->rest;
+            cmd->argc = 1;
+        }
+    } else {
+        cmd->argc = split_args(cmd);
     }
+    
+    if (cmd->argc < entry->min_args || cmd->argc > entry->max_args) {
+        *status = BINARY_STATUS_BAD_ARGUMENTS;
+        return buffer_append(out, arity_reply, sizeof(arity_reply) - 1);
+    }
+    *status = BINARY_STATUS_OK;
+    return entry->handler(cmd, out);
 }
 
-int process_command(const char* command, char* response, int response_size, int* active_clients) {
-    char cmd_copy[MAX_COMMAND_LEN];
-    strncpy(cmd_copy, command, sizeof(cmd_copy) - 1);
-    cmd_copy[sizeof(cmd_copy) - 1] = '\0';
+// Parse and run one text request. Verbs lacking any of the required
+// flags are answered with refusal instead.
+static int process_line(const char* line, size_t len, Buffer* out, uint64_t* stream,
+                        struct Connection* client, int required, const char* refusal,
+                        size_t refusal_len) {
+    uint64_t start = clock_monotonic_ns();
+    pthread_once(&builtins_once, register_builtins);
     
-    // Remove trailing newline
-    trim_newline(cmd_copy);
+    LOG_DEBUG("Processing command: %.*s", (int)len, line);
     
-    log_message(LOG_DEBUG, "Processing command: %s", cmd_copy);
+    Command cmd;
+    const char* space = (const char*)memchr(line, ' ', len);
+    size_t verb_len = (space != NULL) ? (size_t)(space - line) : len;
+    cmd.verb.data = line;
+    cmd.verb.len = verb_len;
+    cmd.rest.data = line + verb_len + (space != NULL);
+    cmd.rest.len = len - verb_len - (space != NULL);
+    cmd.stream = stream;
+    cmd.client = client;
+    PROBE2(command__start, line, verb_len);
     
-    // PING command
-    if (strcmp(cmd_copy, "PING") == 0) {
-        snprintf(response, response_size, "PONG\n");
-        return 0;
+    int result;
+    StatsCommand stat = STATS_CMD_UNKNOWN;
+    const CommandEntry* entry = lookup(line, verb_len);
+    if (entry == NULL) {
+        result = buffer_append(out, unknown_reply, sizeof(unknown_reply) - 1);
+    } else if ((entry->flags & required) != required) {
+        stat = entry->stat;
+        result = buffer_append(out, refusal, refusal_len);
+    } else {
+        uint16_t status;
+        stat = entry->stat;
+        result = dispatch(entry, &cmd, space != NULL, out, &status);
     }
     
-    // TIME command
-    if (strcmp(cmd_copy, "TIME") == 0) {
-        time_t now = time(NULL);
-        struct tm* tm_info = localtime(&now);
-        char time_str[64];
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
-        snprintf(response, response_size, "%s\n", time_str);
-        return 0;
+    uint64_t elapsed = clock_monotonic_ns() - start;
+    stats_record_command(stat, elapsed);
+    PROBE3(command__done, line, verb_len, elapsed);
+    return result;
+}
+
+int process_command(const char* line, size_t len, Buffer* out, uint64_t* stream,
+                    struct Connection* client) {
+    return process_line(line, len, out, stream, client, 0, NULL, 0);
+}
+
+int process_subscriber_command(const char* line, size_t len, Buffer* out,
+                               struct Connection* client) {
+    return process_line(line, len, out, NULL, client, COMMAND_SUBSCRIBER, subscribed_reply,
+                        sizeof(subscribed_reply) - 1);
+}
+
+int process_datagram(const char* line, size_t len, Buffer* out) {
+    return process_line(line, len, out, NULL, NULL, COMMAND_DATAGRAM, no_datagram_reply,
+                        sizeof(no_datagram_reply) - 1);
+}
+
+static inline uint32_t load_be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void store_be32(unsigned char* p, uint32_t value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+// Layout: opcode, flags, status (16 bits), request id, payload length
+void binary_header_decode(const char* data, BinaryHeader* header) {
+    const unsigned char* p = (const unsigned char*)data;
+    header->opcode = p[0];
+    header->flags = p[1];
+    header->status = (uint16_t)((p[2] << 8) | p[3]);
+    header->request_id = load_be32(p + 4);
+    header->length = load_be32(p + 8);
+}
+
+static void binary_header_encode(const BinaryHeader* header, char* data) {
+    unsigned char* p = (unsigned char*)data;
+    p[0] = header->opcode;
+    p[1] = header->flags;
+    p[2] = (unsigned char)(header->status >> 8);
+    p[3] = (unsigned char)header->status;
+    store_be32(p + 4, header->request_id);
+    store_be32(p + 8, header->length);
+}
+
+int process_binary_command(const BinaryHeader* request, const char* payload, Buffer* out) {
+    uint64_t start = clock_monotonic_ns();
+    pthread_once(&builtins_once, register_builtins);
+    
+    LOG_DEBUG("Processing binary command: opcode %u, id %u, %u bytes",
+              request->opcode, request->request_id, request->length);
+    
+    // The header is filled in once the reply length is known. Handlers
+    // may compact the buffer, so remember its offset from the start.
+    if (buffer_reserve(out, PROTOCOL_BINARY_HEADER_SIZE) < 0) {
+        return -1;
     }
+    size_t header_at = buffer_length(out);
+    buffer_commit(out, PROTOCOL_BINARY_HEADER_SIZE);
     
-    // ECHO command
-    if (strncmp(cmd_copy, "ECHO ", 5) == 0) {
-        const char* message = cmd_copy + 5;
-        snprintf(response, response_size, "%s\n", message);
-        return 0;
+    int result;
+    uint16_t status;
+    StatsCommand stat = STATS_CMD_UNKNOWN;
+    int index = opcode_table[request->opcode];
+    // Probes see the verb the opcode stands for
+    const char* verb = (index != 0) ? entries[index - 1].name : "";
+    size_t verb_len = (index != 0) ? entries[index - 1].len : 0;
+    PROBE2(command__start, verb, verb_len);
+    if (index == 0) {
+        status = BINARY_STATUS_UNKNOWN_COMMAND;
+        result = buffer_append(out, unknown_reply, sizeof(unknown_reply) - 1);
+    } else {
+        const CommandEntry* entry = &entries[index - 1];
+        Command cmd;
+        cmd.verb.data = entry->name;
+        cmd.verb.len = entry->len;
+        cmd.rest.data = payload;
+        cmd.rest.len = request->length;
+        // Frames carry their payload already
+        cmd.stream = NULL;
+        cmd.client = NULL;
+        stat = entry->stat;
+        result = dispatch(entry, &cmd, 1, out, &status);
+    }
+    if (result < 0) {
+        return -1;
     }
     
-    // STATS command
-    if (strcmp(cmd_copy, "STATS") == 0) {
-        snprintf(response, response_size, "Active clients: %d\n", *active_clients);
-        return 0;
+    // Frames carry their length, so the text reply's newline is dropped
+    size_t reply_len = buffer_length(out) - header_at - PROTOCOL_BINARY_HEADER_SIZE;
+    if (reply_len > 0 && buffer_begin(out)[buffer_length(out) - 1] == '\n') {
+        buffer_trim(out, 1);
+        reply_len--;
     }
     
-    // QUIT command
-    if (strcmp(cmd_copy, "QUIT") == 0) {
-        snprintf(response, response_size, "Goodbye\n");
-        return 1; // Signal to close connection
+    BinaryHeader reply;
+    reply.opcode = request->opcode;
+    reply.flags = request->flags;
+    reply.status = status;
+    reply.request_id = request->request_id;
+    reply.length = (uint32_t)reply_len;
+    binary_header_encode(&reply, buffer_begin(out) + header_at);
+    
+    uint64_t elapsed = clock_monotonic_ns() - start;
+    stats_record_command(stat, elapsed);
+    PROBE3(command__done, verb, verb_len, elapsed);
+    return result;
+}
+
+int protocol_rate_limited(const BinaryHeader* request, Buffer* out) {
+    if (request == NULL) {
+        return buffer_append(out, rate_limited_reply, sizeof(rate_limited_reply) - 1);
     }
     
-    // Unknown command
-    snprintf(response, response_size, "ERROR: Unknown command\n");
+    size_t len = sizeof(rate_limited_reply) - 2;
+    if (buffer_reserve(out, PROTOCOL_BINARY_HEADER_SIZE + len) < 0) {
+        return -1;
+    }
+    BinaryHeader reply;
+    reply.opcode = request->opcode;
+    reply.flags = request->flags;
+    reply.status = BINARY_STATUS_RATE_LIMITED;
+    reply.request_id = request->request_id;
+    reply.length = (uint32_t)len;
+    binary_header_encode(&reply, buffer_tail(out));
+    memcpy(buffer_tail(out) + PROTOCOL_BINARY_HEADER_SIZE, rate_limited_reply, len);
+    buffer_commit(out, PROTOCOL_BINARY_HEADER_SIZE + len);
     return 0;
 }
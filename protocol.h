@@ -1,8 +1,140 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
-// Process a client command and generate response
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+#include "stats.h"
+
+struct Connection;
+
+#define COMMAND_MAX_ARGS 8
+
+// Slice of the request line, borrowed for the duration of a handler and
+// not NUL-terminated
+typedef struct {
+    const char* data;
+    size_t len;
+} CommandArg;
+
+// A request parsed in place: the verb, the space separated words after
+// it, and the unsplit remainder after the verb's separator
+typedef struct {
+    CommandArg verb;
+    CommandArg args[COMMAND_MAX_ARGS];
+    int argc;
+    CommandArg rest;
+    // A handler that takes over the raw bytes following the request
+    // stores their count here; NULL where the transport cannot stream
+    uint64_t* stream;
+    // Connection the request arrived on, for handlers that keep state
+    // per client (SUBSCRIBE); NULL where there is none
+    struct Connection* client;
+} Command;
+
+// Append the reply to out. Returns 0 on success, 1 if the client should
+// be disconnected after the reply, -1 on failure.
+typedef int (*CommandHandler)(const Command* cmd, Buffer* out);
+
+// Pass everything after "VERB " as the single argument rest (which may
+// be empty) instead of splitting it into words
+#define COMMAND_RAW_ARGS 0x1
+
+// Also answer the verb in a single datagram (UDP_PORT): it keeps no
+// connection state and its reply depends on the request alone
+#define COMMAND_DATAGRAM 0x2
+
+// Also accepted once the connection has subscribed to a channel (see
+// pubsub.h); everything else is refused until it disconnects
+#define COMMAND_SUBSCRIBER 0x4
+
+// Cheap and bounded: a connection that only sends verbs like this is
+// scheduled in the thread pool's high lane (see thread_pool.h), ahead of
+// connections running anything else
+#define COMMAND_FAST 0x8
+
+// Add a verb to the dispatcher. Requests with fewer than min_args or more
+// than max_args arguments are rejected before the handler runs. Verbs are
+// matched case-sensitively. opcode names the command in binary mode; 0
+// leaves it text-only. Register before the server starts accepting
+// clients; lookups take no lock. Returns 0 on success, -1 if the verb or
+// opcode is already registered or the table is full.
+int command_register(const char* verb, uint8_t opcode, CommandHandler handler,
+                     int min_args, int max_args, int flags, StatsCommand stat);
+
+// Whether the verb line starts with, or the binary opcode, is registered
+// with COMMAND_FAST; unknown verbs are not
+int command_is_fast(const char* line, size_t len);
+int opcode_is_fast(uint8_t opcode);
+
+// Process one request line (len bytes, no line terminator) and append
+// the reply to out. stream receives the number of raw payload bytes the
+// client sends next (STREAM); pass NULL if the caller cannot relay them.
+// client is passed on to handlers as Command.client and may be NULL.
 // Returns 0 on success, -1 on error, 1 if client should disconnect
-int process_command(const char* command, char* response, int response_size, int* active_clients);
+int process_command(const char* line, size_t len, Buffer* out, uint64_t* stream,
+                    struct Connection* client);
+
+// Process a request from a subscribed connection: like process_command(),
+// but only verbs registered with COMMAND_SUBSCRIBER run
+int process_subscriber_command(const char* line, size_t len, Buffer* out,
+                               struct Connection* client);
+
+// Process a request that arrived as a datagram: like process_command(),
+// but only verbs registered with COMMAND_DATAGRAM run and the others get
+// an error reply. Returns 0 on success, -1 on error.
+int process_datagram(const char* line, size_t len, Buffer* out);
+
+// Binary mode. A connection whose first byte is PROTOCOL_BINARY_MAGIC
+// exchanges frames instead of lines: a fixed header in network byte
+// order followed by length bytes of payload. The payload holds what
+// follows the verb in the text protocol, and the reply payload is the
+// text reply without its final newline.
+#define PROTOCOL_BINARY_MAGIC 0xB1
+#define PROTOCOL_BINARY_HEADER_SIZE 12
+#define PROTOCOL_BINARY_MAX_PAYLOAD (1024 * 1024)
+
+// Opcodes of the built-in commands
+#define OPCODE_PING 1
+#define OPCODE_TIME 2
+#define OPCODE_ECHO 3
+#define OPCODE_STATS 4
+#define OPCODE_QUIT 5
+
+// Cache commands (kvstore.c)
+#define OPCODE_SET 6
+#define OPCODE_GET 7
+#define OPCODE_DEL 8
+#define OPCODE_INCR 9
+#define OPCODE_EXPIRE 10
+
+// Pub/sub (pubsub.c); SUBSCRIBE and UNSUBSCRIBE are text-only
+#define OPCODE_PUBLISH 11
+
+// Reply status
+#define BINARY_STATUS_OK 0
+#define BINARY_STATUS_UNKNOWN_COMMAND 1
+#define BINARY_STATUS_BAD_ARGUMENTS 2
+#define BINARY_STATUS_RATE_LIMITED 3
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t flags;          // echoed back in the reply
+    uint16_t status;        // 0 in requests
+    uint32_t request_id;    // echoed back so clients can match replies
+    uint32_t length;        // payload bytes after the header
+} BinaryHeader;
+
+// Parse a header from PROTOCOL_BINARY_HEADER_SIZE bytes
+void binary_header_decode(const char* data, BinaryHeader* header);
+
+// Run a binary request and append the complete reply frame to out
+// Returns 0 on success, -1 on error, 1 if client should disconnect
+int process_binary_command(const BinaryHeader* request, const char* payload, Buffer* out);
+
+// Answer a request refused by the rate limiter without running it:
+// "ERROR: Rate limited", as a line or, if request is not NULL, as a frame
+// with BINARY_STATUS_RATE_LIMITED. Returns 0 on success, -1 on error.
+int protocol_rate_limited(const BinaryHeader* request, Buffer* out);
 
 #endif // PROTOCOL_H
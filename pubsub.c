@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include "pubsub.h"
+#include "connection.h"
+#include "reactor.h"
+#include "protocol.h"
+#include "task_ring.h"
+#include "stats.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Channels hash to one of PUBSUB_STRIPES stripes, each a chained table
+// under its own reader-writer lock: PUBLISH reads, SUBSCRIBE and
+// UNSUBSCRIBE write
+#define PUBSUB_STRIPE_BITS 4
+#define PUBSUB_STRIPES (1 << PUBSUB_STRIPE_BITS)
+#define PUBSUB_INITIAL_BUCKETS 16
+
+// Message references a subscriber's queue starts with; it doubles as
+// needed up to the byte limit
+#define PUBSUB_INITIAL_QUEUE 16
+
+// Shared by every queue it is in and freed by whoever drops the last
+// reference. data holds the line sent to subscribers.
+typedef struct {
+    atomic_uint refs;
+    size_t len;
+    char data[];
+} PubsubMessage;
+
+typedef struct Channel {
+    struct Channel* next;       // bucket chain
+    uint64_t hash;
+    size_t name_len;
+    char name[PUBSUB_CHANNEL_MAX];
+    PubsubSubscriber** subscribers;
+    int count;
+    int capacity;
+} Channel;
+
+typedef struct {
+    alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+    Channel** buckets;
+    size_t bucket_count;        // power of two
+    size_t channel_count;
+} ChannelStripe;
+
+struct PubsubSubscriber {
+    struct Connection* conn;
+    
+    // Written by publishers, read by the connection's owner
+    pthread_mutex_t lock;
+    PubsubMessage** queue;      // ring of capacity entries
+    size_t head;
+    size_t count;
+    size_t capacity;
+    size_t queued_bytes;
+    size_t sent;                // bytes of the head message already written
+    int wakeup_pending;         // the reactor has been asked to serve it
+    int overflowed;             // full under PUBSUB_OVERFLOW_DISCONNECT
+    
+    // Only the owner touches these
+    Channel* channels[PUBSUB_MAX_SUBSCRIPTIONS];
+    int channel_count;
+};
+
+static ChannelStripe stripes[PUBSUB_STRIPES];
+static size_t queue_limit = 0;
+static PubsubOverflowPolicy overflow_policy = PUBSUB_OVERFLOW_DISCONNECT;
+static atomic_long subscriber_count = 0;
+
+static const char arity_reply[] = "ERROR: Wrong number of arguments\n";
+static const char unsupported_reply[] = "ERROR: Subscriptions not supported\n";
+static const char name_reply[] = "ERROR: Channel name too long\n";
+static const char too_many_reply[] = "ERROR: Too many subscriptions\n";
+static const char newline_reply[] = "ERROR: Message contains a newline\n";
+static const char no_memory_reply[] = "ERROR: Out of memory\n";
+
+static uint64_t channel_hash(const char* name, size_t len) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001B3ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+
+static inline ChannelStripe* stripe_for(uint64_t hash) {
+    return &stripes[hash >> (64 - PUBSUB_STRIPE_BITS)];
+}
+
+static inline Channel** bucket_for(ChannelStripe* stripe, uint64_t hash) {
+    return &stripe->buckets[hash & (stripe->bucket_count - 1)];
+}
+
+// Caller holds the stripe lock
+static Channel* find_channel(ChannelStripe* stripe, uint64_t hash, const char* name, size_t len) {
+    for (Channel* ch = *bucket_for(stripe, hash); ch != NULL; ch = ch->next) {
+        if (ch->hash == hash && ch->name_len == len && memcmp(ch->name, name, len) == 0) {
+            return ch;
+        }
+    }
+    return NULL;
+}
+
+// Double the bucket array; on allocation failure the chains just get
+// longer. Caller holds the stripe's write lock.
+static void grow_buckets(ChannelStripe* stripe) {
+    size_t count = stripe->bucket_count * 2;
+    Channel** buckets = (Channel**)calloc(count, sizeof(Channel*));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < stripe->bucket_count; i++) {
+        Channel* ch = stripe->buckets[i];
+        while (ch != NULL) {
+            Channel* next = ch->next;
+            Channel** bucket = &buckets[ch->hash & (count - 1)];
+            ch->next = *bucket;
+            *bucket = ch;
+            ch = next;
+        }
+    }
+    free(stripe->buckets);
+    stripe->buckets = buckets;
+    stripe->bucket_count = count;
+}
+
+static void message_release(PubsubMessage* msg) {
+    if (atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1) {
+        free(msg);
+    }
+}
+
+// Queue a reference to msg unless the subscriber is too far behind.
+// Returns 1 if queued. Caller holds the channel's stripe lock, so the
+// subscriber cannot be detached meanwhile.
+static int deliver(PubsubSubscriber* sub, PubsubMessage* msg) {
+    pthread_mutex_lock(&sub->lock);
+    if (sub->overflowed) {
+        pthread_mutex_unlock(&sub->lock);
+        return 0;
+    }
+    
+    // A message larger than the limit still goes to an empty queue
+    int full = (sub->count > 0 && sub->queued_bytes + msg->len > queue_limit);
+    if (!full && sub->count == sub->capacity) {
+        size_t capacity = (sub->capacity > 0) ? sub->capacity * 2 : PUBSUB_INITIAL_QUEUE;
+        PubsubMessage** queue = (PubsubMessage**)malloc(capacity * sizeof(PubsubMessage*));
+        if (queue == NULL) {
+            full = 1;
+        } else {
+            for (size_t i = 0; i < sub->count; i++) {
+                queue[i] = sub->queue[(sub->head + i) % sub->capacity];
+            }
+            free(sub->queue);
+            sub->queue = queue;
+            sub->head = 0;
+            sub->capacity = capacity;
+        }
+    }
+    
+    int wake = 0;
+    if (full) {
+        if (overflow_policy == PUBSUB_OVERFLOW_DISCONNECT) {
+            sub->overflowed = 1;
+            wake = !sub->wakeup_pending;
+            sub->wakeup_pending = 1;
+        }
+        stats_add(STATS_PUBSUB_DROPPED, 1);
+    } else {
+        atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+        sub->queue[(sub->head + sub->count) % sub->capacity] = msg;
+        sub->count++;
+        sub->queued_bytes += msg->len;
+        wake = !sub->wakeup_pending;
+        sub->wakeup_pending = 1;
+    }
+    pthread_mutex_unlock(&sub->lock);
+    
+    if (wake) {
+        reactor_kick(sub->conn->reactor, sub->conn);
+    }
+    return !full;
+}
+
+// Send payload to every subscriber of channel; returns how many got it
+static int publish(const char* channel, size_t channel_len, const char* payload,
+                   size_t payload_len) {
+    size_t len = 8 + channel_len + 1 + payload_len + 1;
+    PubsubMessage* msg = (PubsubMessage*)malloc(sizeof(PubsubMessage) + len);
+    if (msg == NULL) {
+        return -1;
+    }
+    atomic_init(&msg->refs, 1);
+    msg->len = len;
+    char* p = msg->data;
+    memcpy(p, "MESSAGE ", 8);
+    p += 8;
+    memcpy(p, channel, channel_len);
+    p += channel_len;
+    *p++ = ' ';
+    memcpy(p, payload, payload_len);
+    p[payload_len] = '\n';
+    
+    int receivers = 0;
+    uint64_t hash = channel_hash(channel, channel_len);
+    ChannelStripe* stripe = stripe_for(hash);
+    pthread_rwlock_rdlock(&stripe->lock);
+    Channel* ch = find_channel(stripe, hash, channel, channel_len);
+    if (ch != NULL) {
+        for (int i = 0; i < ch->count; i++) {
+            receivers += deliver(ch->subscribers[i], msg);
+        }
+    }
+    pthread_rwlock_unlock(&stripe->lock);
+    
+    message_release(msg);
+    stats_add(STATS_PUBSUB_PUBLISHED, 1);
+    stats_add(STATS_PUBSUB_DELIVERED, (uint64_t)receivers);
+    return receivers;
+}
+
+// Add sub to the channel, creating it if needed. Returns 0 on success,
+// -1 on allocation failure.
+static int join(PubsubSubscriber* sub, const char* name, size_t len) {
+    uint64_t hash = channel_hash(name, len);
+    ChannelStripe* stripe = stripe_for(hash);
+    int result = -1;
+    
+    pthread_rwlock_wrlock(&stripe->lock);
+    Channel* ch = find_channel(stripe, hash, name, len);
+    if (ch == NULL) {
+        ch = (Channel*)calloc(1, sizeof(Channel));
+        if (ch == NULL) {
+            goto out;
+        }
+        ch->hash = hash;
+        ch->name_len = len;
+        memcpy(ch->name, name, len);
+        if (stripe->channel_count >= stripe->bucket_count) {
+            grow_buckets(stripe);
+        }
+        Channel** bucket = bucket_for(stripe, hash);
+        ch->next = *bucket;
+        *bucket = ch;
+        stripe->channel_count++;
+    }
+    if (ch->count == ch->capacity) {
+        int capacity = (ch->capacity > 0) ? ch->capacity * 2 : 4;
+        PubsubSubscriber** subscribers = (PubsubSubscriber**)realloc(
+            ch->subscribers, (size_t)capacity * sizeof(PubsubSubscriber*));
+        if (subscribers == NULL) {
+            goto out;
+        }
+        ch->subscribers = subscribers;
+        ch->capacity = capacity;
+    }
+    ch->subscribers[ch->count++] = sub;
+    sub->channels[sub->channel_count++] = ch;
+    result = 0;
+    
+out:
+    // A channel created for nobody is not left behind
+    if (result < 0 && ch != NULL && ch->count == 0) {
+        Channel** link = bucket_for(stripe, hash);
+        while (*link != ch) {
+            link = &(*link)->next;
+        }
+        *link = ch->next;
+        stripe->channel_count--;
+        free(ch->subscribers);
+        free(ch);
+    }
+    pthread_rwlock_unlock(&stripe->lock);
+    return result;
+}
+
+// Remove sub from its index-th channel, freeing the channel once empty
+static void leave(PubsubSubscriber* sub, int index) {
+    Channel* ch = sub->channels[index];
+    ChannelStripe* stripe = stripe_for(ch->hash);
+    
+    pthread_rwlock_wrlock(&stripe->lock);
+    for (int i = 0; i < ch->count; i++) {
+        if (ch->subscribers[i] == sub) {
+            ch->subscribers[i] = ch->subscribers[--ch->count];
+            break;
+        }
+    }
+    if (ch->count == 0) {
+        Channel** link = bucket_for(stripe, ch->hash);
+        while (*link != ch) {
+            link = &(*link)->next;
+        }
+        *link = ch->next;
+        stripe->channel_count--;
+        free(ch->subscribers);
+        free(ch);
+    }
+    pthread_rwlock_unlock(&stripe->lock);
+    
+    sub->channels[index] = sub->channels[--sub->channel_count];
+}
+
+// Index of the named channel among sub's subscriptions, or -1
+static int find_subscription(const PubsubSubscriber* sub, const char* name, size_t len) {
+    for (int i = 0; i < sub->channel_count; i++) {
+        const Channel* ch = sub->channels[i];
+        if (ch->name_len == len && memcmp(ch->name, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static PubsubSubscriber* subscriber_create(struct Connection* conn) {
+    PubsubSubscriber* sub = (PubsubSubscriber*)calloc(1, sizeof(PubsubSubscriber));
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->conn = conn;
+    pthread_mutex_init(&sub->lock, NULL);
+    atomic_fetch_add_explicit(&subscriber_count, 1, memory_order_relaxed);
+    return sub;
+}
+
+int pubsub_pending(PubsubSubscriber* sub, struct iovec* iov, int max) {
+    int filled = 0;
+    pthread_mutex_lock(&sub->lock);
+    for (size_t i = 0; i < sub->count && filled < max; i++) {
+        PubsubMessage* msg = sub->queue[(sub->head + i) % sub->capacity];
+        size_t skip = (i == 0) ? sub->sent : 0;
+        iov[filled].iov_base = msg->data + skip;
+        iov[filled].iov_len = msg->len - skip;
+        filled++;
+    }
+    pthread_mutex_unlock(&sub->lock);
+    return filled;
+}
+
+void pubsub_written(PubsubSubscriber* sub, size_t bytes) {
+    pthread_mutex_lock(&sub->lock);
+    while (bytes > 0 && sub->count > 0) {
+        PubsubMessage* msg = sub->queue[sub->head];
+        size_t left = msg->len - sub->sent;
+        if (bytes < left) {
+            sub->sent += bytes;
+            break;
+        }
+        bytes -= left;
+        sub->sent = 0;
+        sub->head = (sub->head + 1) % sub->capacity;
+        sub->count--;
+        sub->queued_bytes -= msg->len;
+        message_release(msg);
+    }
+    pthread_mutex_unlock(&sub->lock);
+}
+
+int pubsub_overflowed(PubsubSubscriber* sub) {
+    pthread_mutex_lock(&sub->lock);
+    int overflowed = sub->overflowed;
+    pthread_mutex_unlock(&sub->lock);
+    return overflowed;
+}
+
+void pubsub_wakeup_taken(PubsubSubscriber* sub) {
+    pthread_mutex_lock(&sub->lock);
+    sub->wakeup_pending = 0;
+    pthread_mutex_unlock(&sub->lock);
+}
+
+void pubsub_wakeup(struct Connection* conn) {
+    PubsubSubscriber* sub = conn->pubsub;
+    pthread_mutex_lock(&sub->lock);
+    int wake = !sub->wakeup_pending;
+    sub->wakeup_pending = 1;
+    pthread_mutex_unlock(&sub->lock);
+    
+    if (wake) {
+        reactor_kick(conn->reactor, conn);
+    }
+}
+
+void pubsub_detach(struct Connection* conn) {
+    PubsubSubscriber* sub = conn->pubsub;
+    if (sub == NULL) {
+        return;
+    }
+    while (sub->channel_count > 0) {
+        leave(sub, sub->channel_count - 1);
+    }
+    
+    // Unreachable now: the queue is ours alone
+    for (size_t i = 0; i < sub->count; i++) {
+        message_release(sub->queue[(sub->head + i) % sub->capacity]);
+    }
+    free(sub->queue);
+    pthread_mutex_destroy(&sub->lock);
+    free(sub);
+    conn->pubsub = NULL;
+    atomic_fetch_sub_explicit(&subscriber_count, 1, memory_order_relaxed);
+}
+
+// ---- Commands ----
+
+static int append_subscription(Buffer* out, const char* verb, const CommandArg* channel,
+                               int count) {
+    char reply[PUBSUB_CHANNEL_MAX + 32];
+    int len = snprintf(reply, sizeof(reply), "%s %.*s %d\n", verb,
+                       (int)channel->len, channel->data, count);
+    return buffer_append(out, reply, (size_t)len);
+}
+
+// SUBSCRIBE <channel>...: one "SUBSCRIBED <channel> <count>" line per
+// channel, count being the connection's subscriptions. From then on the
+// connection receives "MESSAGE <channel> <message>" lines and only takes
+// the verbs registered with COMMAND_SUBSCRIBER.
+static int cmd_subscribe(const Command* cmd, Buffer* out) {
+    Connection* conn = cmd->client;
+    // The io_uring backend has no reactor to hand the connection to
+    if (conn == NULL || conn->reactor == NULL) {
+        return buffer_append(out, unsupported_reply, sizeof(unsupported_reply) - 1);
+    }
+    
+    for (int i = 0; i < cmd->argc; i++) {
+        const CommandArg* channel = &cmd->args[i];
+        if (channel->len > PUBSUB_CHANNEL_MAX) {
+            if (buffer_append(out, name_reply, sizeof(name_reply) - 1) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (conn->pubsub == NULL && (conn->pubsub = subscriber_create(conn)) == NULL) {
+            return buffer_append(out, no_memory_reply, sizeof(no_memory_reply) - 1);
+        }
+        
+        PubsubSubscriber* sub = conn->pubsub;
+        if (find_subscription(sub, channel->data, channel->len) < 0) {
+            if (sub->channel_count == PUBSUB_MAX_SUBSCRIPTIONS) {
+                if (buffer_append(out, too_many_reply, sizeof(too_many_reply) - 1) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (join(sub, channel->data, channel->len) < 0) {
+                if (buffer_append(out, no_memory_reply, sizeof(no_memory_reply) - 1) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+        }
+        if (append_subscription(out, "SUBSCRIBED", channel, sub->channel_count) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// UNSUBSCRIBE [<channel>...]: leave the named channels, or all of them,
+// with an "UNSUBSCRIBED <channel> <count>" line each. The connection
+// stays in subscriber mode.
+static int cmd_unsubscribe(const Command* cmd, Buffer* out) {
+    Connection* conn = cmd->client;
+    PubsubSubscriber* sub = (conn != NULL) ? conn->pubsub : NULL;
+    
+    if (cmd->argc == 0) {
+        if (sub == NULL || sub->channel_count == 0) {
+            return buffer_append(out, "OK\n", 3);
+        }
+        while (sub->channel_count > 0) {
+            const Channel* ch = sub->channels[sub->channel_count - 1];
+            char name[PUBSUB_CHANNEL_MAX];
+            CommandArg channel = { name, ch->name_len };
+            memcpy(name, ch->name, ch->name_len);
+            leave(sub, sub->channel_count - 1);
+            if (append_subscription(out, "UNSUBSCRIBED", &channel, sub->channel_count) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    
+    for (int i = 0; i < cmd->argc; i++) {
+        const CommandArg* channel = &cmd->args[i];
+        if (channel->len > PUBSUB_CHANNEL_MAX) {
+            if (buffer_append(out, name_reply, sizeof(name_reply) - 1) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        int index = (sub != NULL) ? find_subscription(sub, channel->data, channel->len) : -1;
+        if (index >= 0) {
+            leave(sub, index);
+        }
+        int count = (sub != NULL) ? sub->channel_count : 0;
+        if (append_subscription(out, "UNSUBSCRIBED", channel, count) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// PUBLISH <channel> <message>: the number of subscribers it was queued
+// to. The message is everything after the channel's space.
+static int cmd_publish(const Command* cmd, Buffer* out) {
+    const CommandArg* rest = &cmd->args[0];
+    const char* space = (const char*)memchr(rest->data, ' ', rest->len);
+    if (space == NULL || space == rest->data) {
+        return buffer_append(out, arity_reply, sizeof(arity_reply) - 1);
+    }
+    size_t channel_len = (size_t)(space - rest->data);
+    if (channel_len > PUBSUB_CHANNEL_MAX) {
+        return buffer_append(out, name_reply, sizeof(name_reply) - 1);
+    }
+    // Binary frames may carry one, which would split the subscribers' line
+    const char* message = space + 1;
+    size_t message_len = rest->len - channel_len - 1;
+    if (memchr(message, '\n', message_len) != NULL) {
+        return buffer_append(out, newline_reply, sizeof(newline_reply) - 1);
+    }
+    
+    int receivers = publish(rest->data, channel_len, message, message_len);
+    if (receivers < 0) {
+        return buffer_append(out, no_memory_reply, sizeof(no_memory_reply) - 1);
+    }
+    char reply[16];
+    int len = snprintf(reply, sizeof(reply), "%d\n", receivers);
+    return buffer_append(out, reply, (size_t)len);
+}
+
+static long pubsub_subscribers(void* arg) {
+    (void)arg;
+    return atomic_load_explicit(&subscriber_count, memory_order_relaxed);
+}
+
+int pubsub_init(size_t limit, PubsubOverflowPolicy overflow) {
+    queue_limit = limit;
+    overflow_policy = overflow;
+    
+    // Writer preference: a steady stream of PUBLISH must not hold off
+    // SUBSCRIBE
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < PUBSUB_STRIPES; i++) {
+        ChannelStripe* stripe = &stripes[i];
+        pthread_rwlock_init(&stripe->lock, &attr);
+        stripe->buckets = (Channel**)calloc(PUBSUB_INITIAL_BUCKETS, sizeof(Channel*));
+        if (stripe->buckets == NULL) {
+            LOG_ERROR("malloc() failed for pub/sub channels");
+            pthread_rwlockattr_destroy(&attr);
+            return -1;
+        }
+        stripe->bucket_count = PUBSUB_INITIAL_BUCKETS;
+    }
+    pthread_rwlockattr_destroy(&attr);
+    
+    stats_register_gauge("pubsub.subscribers", pubsub_subscribers, NULL);
+    
+    if (command_register("SUBSCRIBE", 0, cmd_subscribe, 1, COMMAND_MAX_ARGS,
+                         COMMAND_SUBSCRIBER, STATS_CMD_SUBSCRIBE) < 0 ||
+        command_register("UNSUBSCRIBE", 0, cmd_unsubscribe, 0, COMMAND_MAX_ARGS,
+                         COMMAND_SUBSCRIBER, STATS_CMD_UNSUBSCRIBE) < 0 ||
+        command_register("PUBLISH", OPCODE_PUBLISH, cmd_publish, 1, 1, COMMAND_RAW_ARGS,
+                         STATS_CMD_PUBLISH) < 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Publish/subscribe behind SUBSCRIBE, UNSUBSCRIBE and PUBLISH. A published
+// message is formatted once into an immutable, reference-counted buffer
+// and a reference is queued to every subscriber of the channel; nothing
+// is copied per subscriber. The publisher never writes to a subscriber's
+// socket: it wakes the subscriber's reactor, which serves subscribed
+// connections inline (reactor_adopt()) and writes the queued messages
+// with one sendmsg() per batch.
+//
+// Each subscriber's queue is capped at PUBSUB_QUEUE_LIMIT bytes. A
+// subscriber that falls that far behind has new messages dropped or is
+// disconnected (PUBSUB_OVERFLOW), so it never stalls the publisher.
+
+// Longest channel name
+#define PUBSUB_CHANNEL_MAX 64
+
+// Channels one connection may subscribe to
+#define PUBSUB_MAX_SUBSCRIPTIONS 32
+
+// What happens to a subscriber whose queue is full
+typedef enum {
+    PUBSUB_OVERFLOW_DISCONNECT,     // close it; it resubscribes and resyncs
+    PUBSUB_OVERFLOW_DROP            // leave out messages until it catches up
+} PubsubOverflowPolicy;
+
+struct Connection;
+typedef struct PubsubSubscriber PubsubSubscriber;
+
+// Set up channels and register the commands; call before the server
+// starts accepting clients. queue_limit caps each subscriber's queued
+// bytes. Returns 0 on success, -1 on failure (logged).
+int pubsub_init(size_t queue_limit, PubsubOverflowPolicy overflow);
+
+// The rest is for the connection's owner: the worker running the command
+// that subscribed it, then its reactor thread.
+
+// Point iov at up to max of the queued bytes, oldest first, and return
+// how many entries were filled (0 if nothing is queued)
+int pubsub_pending(PubsubSubscriber* sub, struct iovec* iov, int max);
+
+// The first bytes of what pubsub_pending() returned have been written;
+// release the messages sent in full
+void pubsub_written(PubsubSubscriber* sub, size_t bytes);
+
+// Whether the queue overflowed under PUBSUB_OVERFLOW_DISCONNECT, so the
+// connection must be closed
+int pubsub_overflowed(PubsubSubscriber* sub);
+
+// The reactor took the connection off its queue of subscribers to serve;
+// the next message queued asks for another wakeup
+void pubsub_wakeup_taken(PubsubSubscriber* sub);
+
+// Ask the connection's reactor to serve it again, as a new message does
+void pubsub_wakeup(struct Connection* conn);
+
+// Leave every channel and drop the queue; conn->pubsub is NULL after.
+// Once this returns no publisher can reach the connection.
+void pubsub_detach(struct Connection* conn);
+
+#endif // PUBSUB_H
@@ -0,0 +1,169 @@
+#include "ratelimit.h"
+#include "task_ring.h"
+#include "clock.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#define RATELIMIT_TABLE_MIN 64
+#define RATELIMIT_TABLE_MAX (1 << 24)
+
+enum {
+    BUCKET_CONNECTIONS,
+    BUCKET_COMMANDS,
+    BUCKET_COUNT
+};
+
+// Two slots to a cache line, so a probe sequence touches at most four
+typedef struct {
+    alignas(32) _Atomic uint32_t addr;      // 0 = never used
+    // Per limit, the monotonic time in ns from which the bucket is full.
+    // Each token taken pushes it one interval further out; the bucket is
+    // empty once it is more than a burst's worth ahead of now.
+    _Atomic uint64_t full_at[BUCKET_COUNT];
+} RateSlot;
+
+typedef struct {
+    uint64_t interval;      // ns per token; 0 = no limit
+    uint64_t tolerance;     // how far full_at may run ahead: burst - 1 tokens
+} RateLimit;
+
+static RateSlot* slots = NULL;
+static uint32_t slot_mask = 0;
+static int slot_shift = 32;
+static RateLimit limits[BUCKET_COUNT];
+
+static RateLimit make_limit(int rate, int burst) {
+    RateLimit limit = { 0, 0 };
+    if (rate <= 0) {
+        return limit;
+    }
+    if (rate > RATELIMIT_RATE_MAX) {
+        rate = RATELIMIT_RATE_MAX;
+    }
+    if (burst <= 0) {
+        burst = rate;
+    } else if (burst > RATELIMIT_BURST_MAX) {
+        burst = RATELIMIT_BURST_MAX;
+    }
+    limit.interval = 1000000000ULL / (uint64_t)rate;
+    limit.tolerance = (uint64_t)(burst - 1) * limit.interval;
+    return limit;
+}
+
+int ratelimit_init(const RateLimitConfig* config) {
+    limits[BUCKET_CONNECTIONS] = make_limit(config->connections_per_sec,
+                                            config->connection_burst);
+    limits[BUCKET_COMMANDS] = make_limit(config->commands_per_sec, config->command_burst);
+    if (limits[BUCKET_CONNECTIONS].interval == 0 && limits[BUCKET_COMMANDS].interval == 0) {
+        return 0;
+    }
+    
+    uint32_t size = RATELIMIT_TABLE_MIN;
+    int bits = 6;
+    while (size < (uint32_t)config->table_size && size < RATELIMIT_TABLE_MAX) {
+        size <<= 1;
+        bits++;
+    }
+    
+    RateSlot* table = (RateSlot*)aligned_alloc(CACHE_LINE_SIZE, size * sizeof(RateSlot));
+    if (table == NULL) {
+        LOG_ERROR("malloc() failed for rate limit table");
+        return -1;
+    }
+    memset(table, 0, size * sizeof(RateSlot));
+    slots = table;
+    slot_mask = size - 1;
+    slot_shift = 32 - bits;
+    return 0;
+}
+
+// Full buckets carry no history, so the slot can change hands
+static int slot_idle(RateSlot* slot, uint64_t now) {
+    for (int b = 0; b < BUCKET_COUNT; b++) {
+        if (atomic_load_explicit(&slot->full_at[b], memory_order_relaxed) > now) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The slot tracking addr, claiming a free or idle one for it; NULL if
+// every probed slot belongs to an active address
+static RateSlot* find_slot(uint32_t addr, uint64_t now) {
+    // Fibonacci hashing spreads consecutive addresses across the table
+    uint32_t home = (addr * 0x9E3779B1u) >> slot_shift;
+    RateSlot* idle = NULL;
+    uint32_t idle_owner = 0;
+    
+    for (int i = 0; i < RATELIMIT_PROBES; i++) {
+        RateSlot* slot = &slots[(home + i) & slot_mask];
+        uint32_t owner = atomic_load_explicit(&slot->addr, memory_order_relaxed);
+        if (owner == addr) {
+            return slot;
+        }
+        if (owner == 0) {
+            // Slots are never emptied, so addr is not further along
+            if (atomic_compare_exchange_strong_explicit(&slot->addr, &owner, addr,
+                                                        memory_order_relaxed,
+                                                        memory_order_relaxed) ||
+                owner == addr) {
+                return slot;
+            }
+            continue;
+        }
+        if (idle == NULL && slot_idle(slot, now)) {
+            idle = slot;
+            idle_owner = owner;
+        }
+    }
+    
+    if (idle != NULL &&
+        (atomic_compare_exchange_strong_explicit(&idle->addr, &idle_owner, addr,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed) ||
+         idle_owner == addr)) {
+        return idle;
+    }
+    return NULL;
+}
+
+static int take_token(_Atomic uint64_t* full_at, const RateLimit* limit, uint64_t now) {
+    uint64_t old = atomic_load_explicit(full_at, memory_order_relaxed);
+    for (;;) {
+        uint64_t from = (old > now) ? old : now;
+        if (from - now > limit->tolerance) {
+            return 0;
+        }
+        if (atomic_compare_exchange_weak_explicit(full_at, &old, from + limit->interval,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            return 1;
+        }
+    }
+}
+
+static int allow(int bucket, uint32_t addr) {
+    const RateLimit* limit = &limits[bucket];
+    // A peer whose address could not be read is not tracked
+    if (limit->interval == 0 || addr == 0) {
+        return 1;
+    }
+    
+    uint64_t now = clock_monotonic_ns();
+    RateSlot* slot = find_slot(addr, now);
+    if (slot == NULL) {
+        return 1;
+    }
+    return take_token(&slot->full_at[bucket], limit, now);
+}
+
+int ratelimit_allow_connection(uint32_t addr) {
+    return allow(BUCKET_CONNECTIONS, addr);
+}
+
+int ratelimit_allow_command(uint32_t addr) {
+    return allow(BUCKET_COMMANDS, addr);
+}
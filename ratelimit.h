@@ -0,0 +1,40 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// Per-source-IP limits on new connections and on commands. Every address
+// has one token bucket per limit in a fixed-size open-addressing table
+// shared by all reactors and workers. A bucket is a single word, the time
+// at which it will be full again (GCRA), updated with compare-and-swap, so
+// a check takes no lock and stays at a few tens of nanoseconds.
+//
+// An address whose buckets are both full is indistinguishable from one
+// never seen, so its slot is reused for the next address that needs it.
+// When every slot within RATELIMIT_PROBES of an address's home slot holds
+// an active client the address goes unlimited: the table bounds memory,
+// not the number of clients.
+
+#define RATELIMIT_PROBES 8
+#define RATELIMIT_RATE_MAX 1000000      // per second
+#define RATELIMIT_BURST_MAX 1000000
+
+typedef struct {
+    int connections_per_sec;    // 0 = no limit
+    int connection_burst;       // 0 = one second's worth
+    int commands_per_sec;
+    int command_burst;
+    int table_size;             // slots, rounded up to a power of two
+} RateLimitConfig;
+
+// Set up the table; call before the server starts accepting clients.
+// With both rates 0 nothing is allocated and every check passes.
+// Returns 0 on success, -1 on failure (logged).
+int ratelimit_init(const RateLimitConfig* config);
+
+// Take a token for a new connection or a command from addr (IPv4, network
+// byte order). Returns 1 if allowed, 0 if over the limit.
+int ratelimit_allow_connection(uint32_t addr);
+int ratelimit_allow_command(uint32_t addr);
+
+#endif // RATELIMIT_H
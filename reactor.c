@@ -0,0 +1,606 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "pubsub.h"
+#include "logger.h"
+#include "stats.h"
+#include "ratelimit.h"
+#include "clock.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define REACTOR_MAX_EVENTS 256
+
+// How often a reactor that stopped accepting checks for a free slot
+#define REACTOR_PAUSE_POLL_MS 10
+
+// Timeout resolution; the wheel turns every 102.4 seconds
+#define REACTOR_TIMER_TICK_MS 100
+#define REACTOR_TIMER_SLOTS 1024
+
+// Connections are edge-triggered and one-shot so that exactly one worker
+// owns a connection between an event and the following re-arm
+#define CONNECTION_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT)
+
+// Adopted subscribers belong to the loop alone, so they stay armed, and
+// report each time their socket has room again
+#define SUBSCRIBER_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+static uint64_t now_ms(void) {
+    return clock_monotonic_ns() / 1000000;
+}
+
+// Tag a descriptor with the address of its Reactor field so events can
+// be told apart from connections
+static int watch_fd(Reactor* reactor, int fd, int* tag) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = tag;
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+Reactor* reactor_create(int wakeup_fd, ThreadPool* pool) {
+    Reactor* reactor = (Reactor*)calloc(1, sizeof(Reactor));
+    if (reactor == NULL) {
+        return NULL;
+    }
+    
+    reactor->listener_count = 0;
+    reactor->wakeup_fd = wakeup_fd;
+    reactor->pool = pool;
+    reactor->overload = CONNECTION_OVERLOAD_REJECT;
+    reactor->drain_timeout_ms = 0;
+    reactor->accept_paused = 0;
+    reactor->connections = NULL;
+    reactor->connection_count = 0;
+    atomic_init(&reactor->draining, 0);
+    reactor->epoll_fd = -1;
+    reactor->notify_fd = -1;
+    reactor->close_list = NULL;
+    reactor->adopt_list = NULL;
+    reactor->kick_list = NULL;
+    pthread_mutex_init(&reactor->notify_lock, NULL);
+    
+    if (timer_wheel_init(&reactor->timers, REACTOR_TIMER_SLOTS, REACTOR_TIMER_TICK_MS,
+                         now_ms()) < 0) {
+        LOG_ERROR("malloc() failed for timer wheel");
+        reactor_destroy(reactor);
+        return NULL;
+    }
+    
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+        LOG_ERROR("epoll_create1() failed: %s", strerror(errno));
+        reactor_destroy(reactor);
+        return NULL;
+    }
+    
+    reactor->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->notify_fd < 0) {
+        LOG_ERROR("eventfd() failed: %s", strerror(errno));
+        reactor_destroy(reactor);
+        return NULL;
+    }
+    
+    if (watch_fd(reactor, wakeup_fd, &reactor->wakeup_fd) < 0) {
+        LOG_ERROR("epoll_ctl() failed for wakeup fd: %s", strerror(errno));
+        reactor_destroy(reactor);
+        return NULL;
+    }
+    
+    if (watch_fd(reactor, reactor->notify_fd, &reactor->notify_fd) < 0) {
+        LOG_ERROR("epoll_ctl() failed for notify fd: %s", strerror(errno));
+        reactor_destroy(reactor);
+        return NULL;
+    }
+    
+    return reactor;
+}
+
+int reactor_add_listener(Reactor* reactor, int listen_fd, const SocketProfile* profile) {
+    if (reactor->listener_count == SOCKET_MAX_LISTENERS) {
+        LOG_ERROR("Too many listeners");
+        return -1;
+    }
+    
+    ReactorListener* listener = &reactor->listeners[reactor->listener_count];
+    listener->fd = listen_fd;
+    listener->profile = profile;
+    if (watch_fd(reactor, listen_fd, &listener->fd) < 0) {
+        LOG_ERROR("epoll_ctl() failed for listener: %s", strerror(errno));
+        return -1;
+    }
+    reactor->listener_count++;
+    return 0;
+}
+
+// The listener an event belongs to, or NULL for any other tag
+static ReactorListener* find_listener(Reactor* reactor, void* tag) {
+    ReactorListener* first = &reactor->listeners[0];
+    ReactorListener* end = first + reactor->listener_count;
+    char* p = (char*)tag;
+    if (p < (char*)first || p >= (char*)end) {
+        return NULL;
+    }
+    return first + (p - (char*)first) / sizeof(ReactorListener);
+}
+
+void reactor_set_timeouts(Reactor* reactor, const ConnectionTimeouts* timeouts) {
+    reactor->timeouts = *timeouts;
+    // Workers cannot touch the wheel, so a deadline they move earlier
+    // (idle to read) is only noticed when the timer next fires. Checking
+    // at least this often bounds how late such a timeout runs.
+    int min = connection_timeouts_min(timeouts);
+    reactor->timer_recheck_ms = (min > 0 && min / 4 < REACTOR_TIMER_TICK_MS)
+                                ? REACTOR_TIMER_TICK_MS : min / 4;
+}
+
+// Arm the connection's timer for its published deadline, or the next
+// recheck if that comes first
+static void arm_timer(Reactor* reactor, Connection* conn, uint64_t now) {
+    uint64_t recheck = now + (uint64_t)reactor->timer_recheck_ms;
+    uint64_t due;
+    if (connection_deadline(conn, &due) == CONNECTION_TIMEOUT_NONE || due > recheck) {
+        due = recheck;
+    }
+    timer_wheel_arm(&reactor->timers, &conn->timer, due);
+}
+
+// Workers only push deadlines back, so the wheel re-arms lazily when an
+// entry fires early. An expired connection is shut down rather than
+// closed here: whoever owns it, or the next event if nobody does, sees
+// the hang-up and closes it through the usual path.
+static void timer_fired(TimerEntry* entry, uint64_t now, void* arg) {
+    Reactor* reactor = (Reactor*)arg;
+    Connection* conn = (Connection*)((char*)entry - offsetof(Connection, timer));
+    
+    uint64_t due;
+    ConnectionTimeoutKind kind = connection_deadline(conn, &due);
+    if (kind == CONNECTION_TIMEOUT_NONE || due > now) {
+        arm_timer(reactor, conn, now);
+        return;
+    }
+    
+    connection_timed_out(conn, kind);
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+// Wake the loop for a queue that just became non-empty
+static void notify(Reactor* reactor) {
+    uint64_t one = 1;
+    ssize_t ignored = write(reactor->notify_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void reactor_close(Reactor* reactor, Connection* conn) {
+    // Only the reactor thread closes an adopted connection. Events for it
+    // may still sit in the current batch, so they are skipped until the
+    // batch is done and the connection is freed.
+    if (conn->adopted) {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        conn->closed = 1;
+    }
+    
+    pthread_mutex_lock(&reactor->notify_lock);
+    int was_empty = (reactor->close_list == NULL);
+    conn->next_queued = reactor->close_list;
+    reactor->close_list = conn;
+    pthread_mutex_unlock(&reactor->notify_lock);
+    
+    if (was_empty) {
+        notify(reactor);
+    }
+}
+
+void reactor_adopt(Reactor* reactor, Connection* conn) {
+    pthread_mutex_lock(&reactor->notify_lock);
+    int was_empty = (reactor->adopt_list == NULL);
+    conn->next_queued = reactor->adopt_list;
+    reactor->adopt_list = conn;
+    pthread_mutex_unlock(&reactor->notify_lock);
+    
+    if (was_empty) {
+        notify(reactor);
+    }
+}
+
+void reactor_kick(Reactor* reactor, Connection* conn) {
+    pthread_mutex_lock(&reactor->notify_lock);
+    int was_empty = (reactor->kick_list == NULL);
+    conn->next_kicked = reactor->kick_list;
+    reactor->kick_list = conn;
+    pthread_mutex_unlock(&reactor->notify_lock);
+    
+    if (was_empty) {
+        notify(reactor);
+    }
+}
+
+// Close every connection on a list taken from close_list
+static void reap_closed(Reactor* reactor, Connection* conn) {
+    while (conn != NULL) {
+        Connection* next = conn->next_queued;
+        if (conn->pubsub != NULL) {
+            // No publisher can reach it once detached, and so none can
+            // queue it again after it is taken off the kick list
+            pubsub_detach(conn);
+            pthread_mutex_lock(&reactor->notify_lock);
+            for (Connection** link = &reactor->kick_list; *link != NULL;
+                 link = &(*link)->next_kicked) {
+                if (*link == conn) {
+                    *link = conn->next_kicked;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&reactor->notify_lock);
+        }
+        timer_wheel_cancel(&reactor->timers, &conn->timer);
+        connection_unlink(&reactor->connections, conn);
+        reactor->connection_count--;
+        connection_destroy(conn);
+        conn = next;
+    }
+}
+
+// Serve a subscriber from now on. Anything it already sent or was sent
+// is picked up by the event the re-registration reports at once, as the
+// socket is writable.
+static void adopt(Reactor* reactor, Connection* conn) {
+    conn->adopted = 1;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = SUBSCRIBER_EVENTS;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        LOG_ERROR("epoll_ctl() failed for %s:%d: %s",
+                  conn->ip, conn->port, strerror(errno));
+        connection_close(conn);
+    }
+}
+
+// Handle what other threads queued since the last wakeup: adoptions,
+// then subscribers to serve, then connections to close
+static void service_queues(Reactor* reactor) {
+    uint64_t value;
+    ssize_t ignored = read(reactor->notify_fd, &value, sizeof(value));
+    (void)ignored;
+    
+    pthread_mutex_lock(&reactor->notify_lock);
+    Connection* adopted = reactor->adopt_list;
+    Connection* kicked = reactor->kick_list;
+    Connection* closed = reactor->close_list;
+    reactor->adopt_list = NULL;
+    reactor->kick_list = NULL;
+    reactor->close_list = NULL;
+    pthread_mutex_unlock(&reactor->notify_lock);
+    
+    while (adopted != NULL) {
+        Connection* next = adopted->next_queued;
+        adopt(reactor, adopted);
+        adopted = next;
+    }
+    
+    // Subscribers still owned by a worker are served once adopted
+    while (kicked != NULL) {
+        Connection* next = kicked->next_kicked;
+        pubsub_wakeup_taken(kicked->pubsub);
+        if (kicked->adopted && !kicked->closed) {
+            connection_serve(kicked);
+        }
+        kicked = next;
+    }
+    
+    reap_closed(reactor, closed);
+}
+
+// Stop or resume listener events. Listeners are level-triggered, so a
+// paused reactor must take them out of the interest set to not spin.
+static void set_accept_paused(Reactor* reactor, int paused) {
+    for (int i = 0; i < reactor->listener_count; i++) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = paused ? 0 : EPOLLIN;
+        ev.data.ptr = &reactor->listeners[i].fd;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, reactor->listeners[i].fd, &ev) < 0) {
+            LOG_ERROR("epoll_ctl() failed for listener: %s", strerror(errno));
+            return;
+        }
+    }
+    
+    reactor->accept_paused = paused;
+    if (paused) {
+        stats_add(STATS_ACCEPT_PAUSES, 1);
+        LOG_DEBUG("Connection limit reached, pausing accept");
+    } else {
+        LOG_DEBUG("Resuming accept");
+    }
+}
+
+// Accept every pending connection on a listener
+static void reactor_accept(Reactor* reactor, ReactorListener* listener) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        
+        int admitted = (connection_admit() == 0);
+        if (!admitted && reactor->overload == CONNECTION_OVERLOAD_PAUSE) {
+            set_accept_paused(reactor, 1);
+            return;
+        }
+        
+        int client_socket = accept4(listener->fd, (struct sockaddr*)&client_addr,
+                                    &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (admitted) {
+                connection_admit_cancel();
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR("accept() failed: %s", strerror(errno));
+            }
+            return;
+        }
+        
+        if (!admitted) {
+            // Cheap refusal keeps latency bounded for admitted clients
+            connection_reject(client_socket);
+            continue;
+        }
+        if (!ratelimit_allow_connection(client_addr.sin_addr.s_addr)) {
+            connection_admit_cancel();
+            connection_reject_rate_limited(client_socket);
+            continue;
+        }
+        if (listener->profile != NULL) {
+            socket_apply_accepted(client_socket, listener->profile);
+        }
+        
+        Connection* conn = connection_create(client_socket, &client_addr, reactor);
+        if (conn == NULL) {
+            LOG_ERROR("malloc() failed for connection");
+            connection_admit_cancel();
+            close(client_socket);
+            continue;
+        }
+        
+        LOG_INFO("Client connected: %s:%d (Active: %d)",
+                 conn->ip, conn->port, stats_active_connections());
+        connection_link(&reactor->connections, conn);
+        reactor->connection_count++;
+        
+        // Before the deadline below, which bounds a handshake by the read
+        // timeout
+        if (listener->profile != NULL && listener->profile->tls &&
+            connection_start_tls(conn) < 0) {
+            connection_close(conn);
+            continue;
+        }
+        
+        // Before the connection is visible to workers
+        if (reactor->timer_recheck_ms > 0) {
+            uint64_t now = now_ms();
+            connection_update_deadline(conn, &reactor->timeouts, 0, now);
+            arm_timer(reactor, conn, now);
+        }
+        
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = CONNECTION_EVENTS;
+        ev.data.ptr = conn;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            LOG_ERROR("epoll_ctl() failed for %s:%d: %s",
+                      conn->ip, conn->port, strerror(errno));
+            connection_close(conn);
+        }
+    }
+}
+
+// Readable (or hung up) connection: hand it to a worker, which publishes
+// a new deadline when it re-arms. Adopted subscribers are served here.
+// Connections that have only run COMMAND_FAST verbs, and new ones, go to
+// the high lane.
+static void dispatch(Reactor* reactor, Connection* conn) {
+    if (conn->adopted) {
+        if (!conn->closed) {
+            connection_serve(conn);
+        }
+        return;
+    }
+    
+    connection_clear_deadline(conn);
+    ThreadPoolPriority prio = conn->bulk ? THREAD_POOL_PRIO_NORMAL : THREAD_POOL_PRIO_HIGH;
+    int result = thread_pool_add_task_prio(reactor->pool, connection_process, conn, prio);
+    if (result == THREAD_POOL_FULL) {
+        connection_shed(conn);
+    } else if (result < 0) {
+        LOG_ERROR("Failed to add task to thread pool");
+        stats_add(STATS_ERRORS, 1);
+        connection_close(conn);
+    }
+}
+
+// Stop accepting, then shut the read side of every connection. Idle ones
+// wake up at once with an end of file; busy ones see it once their worker
+// has answered what it already read. Either way the worker queues the
+// notice and closes after the last write. Runs the loop until every
+// connection is gone or the deadline passes.
+static void reactor_drain(Reactor* reactor) {
+    uint64_t start = now_ms();
+    uint64_t deadline = start + (uint64_t)reactor->drain_timeout_ms;
+    
+    // The wakeup eventfd stays readable, and the listeners are left to
+    // the owner (or to the process they were handed to)
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->wakeup_fd, NULL);
+    for (int i = 0; i < reactor->listener_count; i++) {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->listeners[i].fd, NULL);
+    }
+    
+    atomic_store(&reactor->draining, 1);
+    reactor->drain.connections = reactor->connection_count;
+    for (Connection* conn = reactor->connections; conn != NULL; conn = conn->live_next) {
+        shutdown(conn->fd, SHUT_RD);
+    }
+    
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    uint64_t now = start;
+    while (reactor->connection_count > 0 && now < deadline) {
+        int queued = 0;
+        int timeout = (int)(deadline - now);
+        int timer = timer_wheel_timeout(&reactor->timers, now);
+        if (timer >= 0 && timer < timeout) {
+            timeout = timer;
+        }
+        int count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+        if (count < 0 && errno != EINTR) {
+            LOG_ERROR("epoll_wait() failed: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &reactor->notify_fd) {
+                queued = 1;
+            } else {
+                dispatch(reactor, (Connection*)events[i].data.ptr);
+            }
+        }
+        if (queued) {
+            service_queues(reactor);
+        }
+        now = now_ms();
+        if (reactor->timers.count > 0) {
+            timer_wheel_advance(&reactor->timers, now, timer_fired, reactor);
+        }
+    }
+    
+    reactor->drain.forced = reactor->connection_count;
+    reactor->drain.closed = reactor->drain.connections - reactor->drain.forced;
+    reactor->drain.elapsed_ms = now_ms() - start;
+}
+
+int reactor_run(Reactor* reactor) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int stopping = 0;
+    
+    while (!stopping) {
+        int timeout = timer_wheel_timeout(&reactor->timers, now_ms());
+        if (reactor->accept_paused && (timeout < 0 || timeout > REACTOR_PAUSE_POLL_MS)) {
+            timeout = REACTOR_PAUSE_POLL_MS;
+        }
+        int count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("epoll_wait() failed: %s", strerror(errno));
+            return -1;
+        }
+        
+        int queued = 0;
+        for (int i = 0; i < count; i++) {
+            void* tag = events[i].data.ptr;
+            
+            // Connections woken in the same batch are still dispatched:
+            // their one-shot events have fired and will not come again
+            if (tag == &reactor->wakeup_fd) {
+                stopping = 1;
+                continue;
+            }
+            
+            ReactorListener* listener = find_listener(reactor, tag);
+            if (listener != NULL) {
+                // Events already collected for a listener paused meanwhile
+                if (!reactor->accept_paused && !stopping) {
+                    reactor_accept(reactor, listener);
+                }
+                continue;
+            }
+            
+            if (tag == &reactor->notify_fd) {
+                queued = 1;
+                continue;
+            }
+            
+            dispatch(reactor, (Connection*)tag);
+        }
+        if (queued) {
+            service_queues(reactor);
+        }
+        
+        if (reactor->timers.count > 0) {
+            timer_wheel_advance(&reactor->timers, now_ms(), timer_fired, reactor);
+        }
+        
+        if (reactor->accept_paused && !connection_admission_full() && !stopping) {
+            set_accept_paused(reactor, 0);
+            for (int l = 0; l < reactor->listener_count && !reactor->accept_paused; l++) {
+                reactor_accept(reactor, &reactor->listeners[l]);
+            }
+        }
+    }
+    
+    if (reactor->drain_timeout_ms > 0) {
+        reactor_drain(reactor);
+    } else {
+        reactor->drain.connections = reactor->connection_count;
+        reactor->drain.forced = reactor->connection_count;
+    }
+    return 0;
+}
+
+int reactor_rearm(Reactor* reactor, Connection* conn) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = CONNECTION_EVENTS;
+    
+    // Unsent replies: wait for room, and stop reading if they pile up.
+    // A TLS handshake can be stuck on a write too.
+    size_t pending = buffer_length(&conn->out) + conn->stream_piped;
+    if (conn->handshake_wants_write) {
+        ev.events |= EPOLLOUT;
+    }
+    if (pending > 0) {
+        ev.events |= EPOLLOUT;
+        if (conn->closing || pending >= CONNECTION_OUTPUT_HIGH_WATER) {
+            ev.events &= ~(uint32_t)(EPOLLIN | EPOLLRDHUP);
+        }
+    }
+    ev.data.ptr = conn;
+    
+    // Published before the re-arm, after which the reactor may hand the
+    // connection to another worker
+    if (reactor->timer_recheck_ms > 0) {
+        connection_update_deadline(conn, &reactor->timeouts, pending, now_ms());
+    }
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+void reactor_destroy(Reactor* reactor) {
+    if (reactor == NULL) {
+        return;
+    }
+    
+    // Workers have stopped, so whatever they queued can be closed here,
+    // and whatever is left after the drain with it. Connections waiting
+    // to be adopted are still on the open list.
+    if (reactor->notify_fd >= 0) {
+        reap_closed(reactor, reactor->close_list);
+        close(reactor->notify_fd);
+    }
+    while (reactor->connections != NULL) {
+        Connection* conn = reactor->connections;
+        connection_unlink(&reactor->connections, conn);
+        connection_destroy(conn);
+    }
+    if (reactor->epoll_fd >= 0) {
+        close(reactor->epoll_fd);
+    }
+    timer_wheel_destroy(&reactor->timers);
+    pthread_mutex_destroy(&reactor->notify_lock);
+    free(reactor);
+}
@@ -0,0 +1,105 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "thread_pool.h"
+#include "connection.h"
+#include "timer_wheel.h"
+#include "socket_options.h"
+
+// A listening socket and the options applied to what it accepts
+typedef struct {
+    int fd;
+    const SocketProfile* profile;   // may be NULL
+} ReactorListener;
+
+// Event loop owning listening sockets and the connections accepted on
+// them. Readable connections are handed to the thread pool as short tasks,
+// except subscribers, which the loop serves itself.
+typedef struct Reactor {
+    int epoll_fd;
+    ReactorListener listeners[SOCKET_MAX_LISTENERS];
+    int listener_count;
+    int wakeup_fd;
+    ThreadPool* pool;
+    // Set by the owner after creation; defaults to rejecting and closing
+    // connections at once on shutdown
+    ConnectionOverloadPolicy overload;
+    int drain_timeout_ms;
+    int accept_paused;
+    
+    // Open connections, and the shutdown drain; workers read draining
+    Connection* connections;
+    int connection_count;
+    atomic_int draining;
+    ConnectionDrainStats drain;
+    
+    // Connection timeouts (see reactor_set_timeouts()), driven by a wheel
+    // that only the reactor thread touches
+    ConnectionTimeouts timeouts;
+    int timer_recheck_ms;
+    TimerWheel timers;
+    
+    // Work queued by other threads, all handled once the current batch of
+    // events is done: connections closed by workers, freed here so the
+    // wheel never holds a dangling entry; subscribers to adopt; and
+    // subscribers with messages waiting. notify_fd is an eventfd that
+    // wakes the loop when a queue becomes non-empty.
+    int notify_fd;
+    pthread_mutex_t notify_lock;
+    Connection* close_list;
+    Connection* adopt_list;
+    Connection* kick_list;
+} Reactor;
+
+// Create a reactor. Once wakeup_fd (an eventfd shared with the signal
+// handler) is readable the loop stops accepting and drains: every
+// connection answers the commands it has already received, text clients
+// get "ERROR: shutting down", and each closes once its output is written.
+// Whatever is still open after drain_timeout_ms is closed by
+// reactor_destroy().
+Reactor* reactor_create(int wakeup_fd, ThreadPool* pool);
+
+// Accept connections from a non-blocking listening socket, applying
+// profile's per-connection options (profile may be NULL); call before
+// reactor_run(). Returns 0 on success, -1 on failure.
+int reactor_add_listener(Reactor* reactor, int listen_fd, const SocketProfile* profile);
+
+// Enable per-connection timeouts; call before reactor_run(). Expired
+// connections are shut down and then closed by whoever owns them.
+void reactor_set_timeouts(Reactor* reactor, const ConnectionTimeouts* timeouts);
+
+// Run the event loop until woken up and drained; returns 0 on clean stop,
+// -1 on error
+int reactor_run(Reactor* reactor);
+
+// Whether the reactor is draining for shutdown; safe from any thread
+static inline int reactor_draining(Reactor* reactor) {
+    return atomic_load_explicit(&reactor->draining, memory_order_relaxed);
+}
+
+// Re-enable events for a connection after a worker has drained it; also
+// waits for EPOLLOUT while the connection has unsent output
+int reactor_rearm(Reactor* reactor, Connection* conn);
+
+// Queue a connection to be closed and freed on the reactor thread; safe
+// to call from any thread
+void reactor_close(Reactor* reactor, Connection* conn);
+
+// Instead of re-arming a connection that subscribed, its worker hands it
+// to the reactor thread, which serves it inline with connection_serve()
+// until it closes. Publishers on other threads never have to race the
+// one-shot ownership of a worker to get a message out.
+void reactor_adopt(Reactor* reactor, Connection* conn);
+
+// Ask the reactor thread to serve a subscriber, e.g. because a message
+// was queued for it; safe to call from any thread. Callers make sure a
+// connection is queued at most once (pubsub_wakeup()).
+void reactor_kick(Reactor* reactor, Connection* conn);
+
+// Release the reactor once its workers have stopped, closing every
+// connection still open (does not close the listeners or wakeup_fd)
+void reactor_destroy(Reactor* reactor);
+
+#endif // REACTOR_H
@@ -7,128 +7,380 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "config.h"
 #include "logger.h"
 #include "thread_pool.h"
-#include "protocol.h"
-
-#define BUFFER_SIZE 4096
+#include "reactor.h"
+#include "object_pool.h"
+#include "stats.h"
+#include "cpu_affinity.h"
+#include "handoff.h"
+#include "udp.h"
+#include "kvstore.h"
+#include "ratelimit.h"
+#include "pubsub.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+#ifdef HAVE_TLS
+#include "tls.h"
+#endif
 
 // Global variables for signal handling
 static volatile sig_atomic_t server_running = 1;
-static int server_socket = -1;
+static volatile sig_atomic_t stop_signal = 0;
+static int wakeup_fd = -1;
 
-// Thread-safe active client counter
-static int active_clients = 0;
-static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Set once a new process has taken over the listeners
+static atomic_int handed_over = 0;
 
-// Structure to pass client info to worker threads
+// One accept loop and event loop with its own listener and worker pool.
+// Shards share nothing on the accept -> process path.
 typedef struct {
-    int client_socket;
-    struct sockaddr_in client_addr;
-} ClientInfo;
+    int index;
+    int cpu;                    // CPU the reactor is pinned to, or -1
+    int listen_fds[SOCKET_MAX_LISTENERS];
+    int listen_config[SOCKET_MAX_LISTENERS];    // index into config.listeners
+    int listen_count;
+    ThreadPool* pool;
+    Reactor* reactor;
+#ifdef HAVE_IO_URING
+    UringReactor* uring;
+#endif
+    pthread_t thread;
+    int thread_started;
+} Shard;
 
 // Signal handler for graceful shutdown
 void signal_handler(int signal) {
-    if (signal == SIGINT) {
-        log_message(LOG_INFO, "Received SIGINT, shutting down...");
+    if (signal == SIGINT || signal == SIGTERM) {
         server_running = 0;
+        stop_signal = signal;
         
-        // Close server socket to unblock accept()
-        if (server_socket != -1) {
-            close(server_socket);
+        // Wake every reactor out of epoll_wait(); the eventfd is never
+        // read, so it stays readable for all of them. write() is
+        // async-signal-safe.
+        if (wakeup_fd != -1) {
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeup_fd, &one, sizeof(one));
+            (void)ignored;
         }
     }
 }
 
-// Increment active client count
-void increment_active_clients(void) {
-    pthread_mutex_lock(&clients_mutex);
-    active_clients++;
-    pthread_mutex_unlock(&clients_mutex);
+// Create a non-blocking listening socket tuned by profile. With
+// reuse_port set, several sockets can bind the same port and the kernel
+// spreads connections across them.
+static int create_listener(int port, int backlog, int reuse_port, const SocketProfile* profile,
+                           int shard_cpu) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("socket() failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    // Set socket options
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        LOG_ERROR("setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        LOG_ERROR("setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    if (socket_apply_listener(fd, profile, shard_cpu) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    // Bind socket
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    
+    if (bind(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        LOG_ERROR("bind() failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    // Listen for connections
+    if (listen(fd, backlog) < 0) {
+        LOG_ERROR("listen() failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
 }
 
-// Decrement active client count
-void decrement_active_clients(void) {
-    pthread_mutex_lock(&clients_mutex);
-    active_clients--;
-    pthread_mutex_unlock(&clients_mutex);
+// Called by the upgrade thread once a new process serves our listeners
+static void handoff_complete(void) {
+    atomic_store(&handed_over, 1);
+    signal_handler(SIGINT);
 }
 
-// Get active client count
-int get_active_clients(void) {
-    int count;
-    pthread_mutex_lock(&clients_mutex);
-    count = active_clients;
-    pthread_mutex_unlock(&clients_mutex);
-    return count;
+// A shard's socket for a configured listener, or -1
+static int shard_listener_fd(const Shard* shard, int listener) {
+    for (int i = 0; i < shard->listen_count; i++) {
+        if (shard->listen_config[i] == listener) {
+            return shard->listen_fds[i];
+        }
+    }
+    return -1;
 }
 
-// Handle client connection (executed by worker thread)
-void handle_client(void* arg) {
-    ClientInfo* client_info = (ClientInfo*)arg;
-    int client_socket = client_info->client_socket;
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_info->client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    int client_port = ntohs(client_info->client_addr.sin_port);
-    
-    increment_active_clients();
-    log_message(LOG_INFO, "Client connected: %s:%d (Active: %d)", 
-                client_ip, client_port, get_active_clients());
-    
-    char buffer[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
-    
-    while (1) {
-        // Receive data from client
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                log_message(LOG_INFO, "Client disconnected: %s:%d", client_ip, client_port);
-            } else {
-                log_message(LOG_ERROR, "recv() failed for %s:%d: %s", 
-                           client_ip, client_port, strerror(errno));
+// Hand sockets inherited from systemd or a previous server to the shards:
+// the n-th socket for a port goes to shard n % shard_count, so the accept
+// queue of every SO_REUSEPORT socket passed in keeps being served. A UDP
+// socket for UDP_PORT is stored in *udp_fd. Sockets for ports not
+// configured are closed.
+static void adopt_listeners(Shard* shards, int shard_count, const ServerConfig* config,
+                            const int* fds, int count, int* udp_fd) {
+    int adopted[SOCKET_MAX_LISTENERS] = {0};
+    ino_t seen[HANDOFF_MAX_FDS];
+    int seen_count = 0;
+    
+    for (int i = 0; i < count; i++) {
+        int port = handoff_listener_port(fds[i]);
+        int listener = -1;
+        for (int l = 0; l < config->listener_count; l++) {
+            if (config->listeners[l].port == port) {
+                listener = l;
             }
-            break;
         }
         
-        buffer[bytes_received] = '\0';
+        // The same socket may come in under several descriptors
+        struct stat st;
+        int duplicate = 0;
+        if (fstat(fds[i], &st) == 0) {
+            for (int j = 0; j < seen_count; j++) {
+                duplicate |= (seen[j] == st.st_ino);
+            }
+            seen[seen_count++] = st.st_ino;
+        }
         
-        // Process command
-        int active_count = get_active_clients();
-        int result = process_command(buffer, response, sizeof(response), &active_count);
+        int type = 0;
+        socklen_t len = sizeof(type);
+        if (getsockopt(fds[i], SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_DGRAM) {
+            if (!duplicate && *udp_fd < 0 && config->udp_port > 0 && port == config->udp_port) {
+                *udp_fd = fds[i];
+                continue;
+            }
+            if (!duplicate) {
+                LOG_ERROR("Closing inherited UDP socket for port %d: port not configured", port);
+            }
+            close(fds[i]);
+            continue;
+        }
         
-        // Send response
-        ssize_t bytes_sent = send(client_socket, response, strlen(response), 0);
-        if (bytes_sent < 0) {
-            log_message(LOG_ERROR, "send() failed for %s:%d: %s", 
-                       client_ip, client_port, strerror(errno));
-            break;
+        Shard* shard = (listener >= 0) ? &shards[adopted[listener] % shard_count] : NULL;
+        if (listener < 0 || duplicate || shard->listen_count == SOCKET_MAX_LISTENERS) {
+            if (!duplicate) {
+                LOG_ERROR("Closing inherited listener for port %d: %s", port,
+                          (listener < 0) ? "port not configured" : "too many listeners");
+            }
+            close(fds[i]);
+            continue;
+        }
+        shard->listen_config[shard->listen_count] = listener;
+        shard->listen_fds[shard->listen_count++] = fds[i];
+        adopted[listener]++;
+    }
+}
+
+// "on CPUs 4,5 (node 0)" for the CPUs of a set of threads, "unpinned"
+// for none
+static void describe_cpus(const CpuList* cpus, char* buf, size_t size) {
+    if (cpus->count == 0) {
+        snprintf(buf, size, "unpinned");
+        return;
+    }
+    CpuList nodes;
+    nodes.count = 0;
+    for (int i = 0; i < cpus->count; i++) {
+        int node = cpu_numa_node(cpus->cpus[i]);
+        int seen = 0;
+        for (int n = 0; n < nodes.count; n++) {
+            seen |= (nodes.cpus[n] == node);
+        }
+        if (!seen) {
+            nodes.cpus[nodes.count++] = node;
+        }
+    }
+    char cpu_text[128];
+    char node_text[64];
+    cpu_list_format(cpus, cpu_text, sizeof(cpu_text));
+    cpu_list_format(&nodes, node_text, sizeof(node_text));
+    snprintf(buf, size, "on %s %s (node%s %s)", (cpus->count > 1) ? "CPUs" : "CPU", cpu_text,
+             (nodes.count > 1) ? "s" : "", node_text);
+}
+
+// Log where each shard's reactor and workers run
+static void log_topology(const Shard* shards, int count) {
+    LOG_INFO("CPU topology: %d NUMA node%s", cpu_numa_node_count(),
+             (cpu_numa_node_count() > 1) ? "s" : "");
+    for (int i = 0; i < count; i++) {
+        const Shard* shard = &shards[i];
+        CpuList cpus;
+        cpus.count = 0;
+        if (shard->cpu >= 0) {
+            cpus.cpus[cpus.count++] = shard->cpu;
         }
+        char reactor[256];
+        describe_cpus(&cpus, reactor, sizeof(reactor));
         
-        // Check if client should disconnect
-        if (result == 1) {
-            log_message(LOG_INFO, "Client requested disconnect: %s:%d", client_ip, client_port);
-            break;
+        if (shard->pool == NULL) {
+            LOG_INFO("Shard %d: reactor %s", i, reactor);
+            continue;
         }
+        cpus.count = 0;
+        for (int w = 0; w < shard->pool->worker_count && cpus.count < CPU_LIST_MAX; w++) {
+            if (shard->pool->workers[w].cpu >= 0) {
+                cpus.cpus[cpus.count++] = shard->pool->workers[w].cpu;
+            }
+        }
+        char workers[256];
+        describe_cpus(&cpus, workers, sizeof(workers));
+        LOG_INFO("Shard %d: reactor %s, %d workers %s", i, reactor,
+                 shard->pool->worker_count, workers);
     }
+}
+
+// Run a shard's event loop with whichever backend it was created for
+static void shard_run(Shard* shard) {
+    char label[32];
+    snprintf(label, sizeof(label), "shard%d.reactor", shard->index);
+    stats_thread_init(label);
     
-    // Close client socket
-    close(client_socket);
-    decrement_active_clients();
-    log_message(LOG_DEBUG, "Connection closed: %s:%d (Active: %d)", 
-                client_ip, client_port, get_active_clients());
+#ifdef HAVE_IO_URING
+    if (shard->uring != NULL) {
+        uring_reactor_run(shard->uring);
+        return;
+    }
+#endif
+    reactor_run(shard->reactor);
+}
+
+static void* shard_thread(void* arg) {
+    shard_run((Shard*)arg);
+    return NULL;
+}
+
+// Wait for the shard threads to finish draining
+static void shards_join(Shard* shards, int count) {
+    for (int i = 0; i < count; i++) {
+        if (shards[i].thread_started) {
+            pthread_join(shards[i].thread, NULL);
+            shards[i].thread_started = 0;
+        }
+    }
+}
+
+// Log what the shutdown drain did over all shards
+static void report_drain(const Shard* shards, int count, int drain_timeout_ms) {
+    ConnectionDrainStats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < count; i++) {
+        const ConnectionDrainStats* drain = NULL;
+        if (shards[i].reactor != NULL) {
+            drain = &shards[i].reactor->drain;
+        }
+#ifdef HAVE_IO_URING
+        if (shards[i].uring != NULL) {
+            drain = uring_reactor_drain_stats(shards[i].uring);
+        }
+#endif
+        if (drain == NULL) {
+            continue;
+        }
+        total.connections += drain->connections;
+        total.closed += drain->closed;
+        total.forced += drain->forced;
+        if (drain->elapsed_ms > total.elapsed_ms) {
+            total.elapsed_ms = drain->elapsed_ms;
+        }
+    }
+    if (drain_timeout_ms == 0) {
+        LOG_INFO("Drain disabled: closed %d connections at once", total.connections);
+        return;
+    }
+    LOG_INFO("Drained %d connections in %llu ms: %d closed after their replies, "
+             "%d force-closed at the %d ms deadline",
+             total.connections, (unsigned long long)total.elapsed_ms, total.closed,
+             total.forced, drain_timeout_ms);
+}
+
+// Set up TLS if any listener's profile asks for it. Returns 0 on success
+// (or when no listener does), -1 on failure (logged).
+static int setup_tls(const ServerConfig* config) {
+    int listeners = 0;
+    for (int l = 0; l < config->listener_count; l++) {
+        if (config->socket_profiles[config->listeners[l].profile].tls) {
+            listeners++;
+        }
+    }
+    if (listeners == 0) {
+        return 0;
+    }
     
-    free(client_info);
+#ifdef HAVE_TLS
+    // Only the epoll backend runs the handshake
+    if (config->io_backend == IO_BACKEND_IO_URING) {
+        LOG_ERROR("TLS listeners need the epoll backend");
+        return -1;
+    }
+    if (tls_init(config->tls_cert_file, config->tls_key_file, config->tls_session_cache) < 0) {
+        return -1;
+    }
+    LOG_INFO("TLS: %d listener%s, kernel TLS after the handshake, session cache %d",
+             listeners, (listeners == 1) ? "" : "s", config->tls_session_cache);
+    return 0;
+#else
+    LOG_ERROR("TLS listeners need a build with TLS=1");
+    return -1;
+#endif
+}
+
+// Stop shard threads and release everything they own
+static void shards_destroy(Shard* shards, int count) {
+    shards_join(shards, count);
+    
+    // Any worker may publish to subscribers of any reactor, so all of
+    // them stop before the first reactor goes
+    for (int i = 0; i < count; i++) {
+        thread_pool_destroy(shards[i].pool);
+        shards[i].pool = NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        for (int l = 0; l < shards[i].listen_count; l++) {
+            close(shards[i].listen_fds[l]);
+        }
+        reactor_destroy(shards[i].reactor);
+#ifdef HAVE_IO_URING
+        uring_reactor_destroy(shards[i].uring);
+#endif
+    }
+    
+    free(shards);
 }
 
 int main(int argc, char* argv[]) {
     ServerConfig config;
-    ThreadPool* pool = NULL;
     
     // Set default configuration
     config_set_defaults(&config);
@@ -144,112 +396,369 @@ int main(int argc, char* argv[]) {
     // Initialize logger
     const char* log_file = (strlen(config.log_file) > 0) ? config.log_file : NULL;
     logger_init(log_file, config.log_level);
+    if (config.log_async && config.log_buffer_records > 0 &&
+        logger_start_async((size_t)config.log_buffer_records, config.log_overflow) < 0) {
+        LOG_ERROR("Failed to start async logger, logging synchronously");
+    }
     
-    log_message(LOG_INFO, "Starting TCP server...");
-    log_message(LOG_INFO, "Port: %d", config.port);
-    log_message(LOG_INFO, "Thread pool size: %d", config.thread_pool_size);
-    log_message(LOG_INFO, "Max connections: %d", config.max_connections);
+#ifndef HAVE_IO_URING
+    if (config.io_backend == IO_BACKEND_IO_URING) {
+        LOG_ERROR("io_uring backend not compiled in (build with IO_URING=1), using epoll");
+        config.io_backend = IO_BACKEND_EPOLL;
+    }
+#endif
     
-    // Setup signal handler
-    signal(SIGINT, signal_handler);
+    // Each shard gets an equal share of the worker threads
+    int shard_count = config.reactor_threads;
+    int workers_per_shard = config.thread_pool_size / shard_count;
+    if (workers_per_shard < 1) {
+        workers_per_shard = 1;
+    }
+    
+    LOG_INFO("Starting TCP server...");
+    LOG_INFO("Thread pool size: %d", config.thread_pool_size);
+    LOG_INFO("Reactor threads: %d (%d workers each)", shard_count, workers_per_shard);
+    LOG_INFO("I/O backend: %s",
+             (config.io_backend == IO_BACKEND_IO_URING) ? "io_uring" : "epoll");
+    LOG_INFO("Max connections: %d (%s when full)", config.max_connections,
+             (config.overload_policy == CONNECTION_OVERLOAD_PAUSE) ? "pause" : "reject");
+    LOG_INFO("Timeouts: idle %dms, read %dms, write %dms, drain %dms",
+             config.idle_timeout_ms, config.read_timeout_ms, config.write_timeout_ms,
+             config.drain_timeout_ms);
     
-    // Create thread pool
-    pool = thread_pool_create(config.thread_pool_size);
-    if (pool == NULL) {
-        log_message(LOG_ERROR, "Failed to create thread pool");
+    if (kv_init((size_t)config.kv_memory_limit_mb * 1024 * 1024) < 0) {
         logger_close();
         return EXIT_FAILURE;
     }
+    if (config.kv_memory_limit_mb > 0) {
+        LOG_INFO("Cache: %d shards, %d MB limit", KV_SHARDS, config.kv_memory_limit_mb);
+    } else {
+        LOG_INFO("Cache: %d shards, no memory limit", KV_SHARDS);
+    }
     
-    // Create socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        log_message(LOG_ERROR, "socket() failed: %s", strerror(errno));
-        thread_pool_destroy(pool);
+    if (pubsub_init((size_t)config.pubsub_queue_limit_kb * 1024, config.pubsub_overflow) < 0) {
         logger_close();
         return EXIT_FAILURE;
     }
+    LOG_INFO("Pub/sub: %d KB per subscriber, %s when full", config.pubsub_queue_limit_kb,
+             (config.pubsub_overflow == PUBSUB_OVERFLOW_DROP) ? "drop" : "disconnect");
     
-    // Set socket options
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        log_message(LOG_ERROR, "setsockopt() failed: %s", strerror(errno));
-        close(server_socket);
-        thread_pool_destroy(pool);
+    if (ratelimit_init(&config.rate_limit) < 0) {
         logger_close();
         return EXIT_FAILURE;
     }
+    if (config.rate_limit.connections_per_sec > 0 || config.rate_limit.commands_per_sec > 0) {
+        LOG_INFO("Rate limits per client IP: %d connections/s, %d commands/s",
+                 config.rate_limit.connections_per_sec, config.rate_limit.commands_per_sec);
+    }
     
-    // Bind socket
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(config.port);
+    if (setup_tls(&config) < 0) {
+        logger_close();
+        return EXIT_FAILURE;
+    }
     
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        log_message(LOG_ERROR, "bind() failed: %s", strerror(errno));
-        close(server_socket);
-        thread_pool_destroy(pool);
+    // Eventfd used by the signal handler to stop the reactors
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        LOG_ERROR("eventfd() failed: %s", strerror(errno));
         logger_close();
         return EXIT_FAILURE;
     }
     
-    // Listen for connections
-    if (listen(server_socket, config.max_connections) < 0) {
-        log_message(LOG_ERROR, "listen() failed: %s", strerror(errno));
-        close(server_socket);
-        thread_pool_destroy(pool);
+    // Setup signal handler; systemd stops services with SIGTERM
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    
+    Shard* shards = (Shard*)calloc(shard_count, sizeof(Shard));
+    if (shards == NULL) {
+        LOG_ERROR("malloc() failed for reactor shards");
+        close(wakeup_fd);
         logger_close();
         return EXIT_FAILURE;
     }
     
-    log_message(LOG_INFO, "Server listening on port %d", config.port);
+    // Pin only to CPUs the process is allowed on
+    cpu_affinity_init();
+    int dropped = cpu_list_restrict(&config.worker_cpus) + cpu_list_restrict(&config.reactor_cpus);
+    if (dropped > 0) {
+        LOG_ERROR("Ignoring %d CPUs outside the process affinity mask", dropped);
+    }
     
-    // Main accept loop
-    while (server_running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+    for (int i = 0; i < shard_count; i++) {
+        shards[i].index = i;
+        shards[i].cpu = cpu_list_pick(&config.reactor_cpus, i);
+        shards[i].listen_count = 0;
+    }
+    
+    // Listeners passed in by systemd, or else taken over from the server
+    // running at UPGRADE_SOCKET, are used instead of binding new ones
+    int inherited[HANDOFF_MAX_FDS];
+    int handoff_peer = -1;
+    int inherited_count = handoff_systemd_listeners(inherited, HANDOFF_MAX_FDS);
+    if (inherited_count > 0) {
+        LOG_INFO("Socket activated with %d listeners", inherited_count);
+    } else if (strlen(config.upgrade_socket) > 0) {
+        inherited_count = handoff_receive(config.upgrade_socket, inherited, HANDOFF_MAX_FDS,
+                                          &handoff_peer);
+        if (inherited_count > 0) {
+            LOG_INFO("Took over %d listeners from the server at %s", inherited_count,
+                     config.upgrade_socket);
+        } else if (inherited_count < 0) {
+            inherited_count = 0;
+        }
+    }
+    int udp_fd = -1;
+    adopt_listeners(shards, shard_count, &config, inherited, inherited_count, &udp_fd);
+    
+    ThreadPoolOptions pool_options;
+    thread_pool_options_init(&pool_options);
+    pool_options.queue_type = config.thread_pool_queue;
+    pool_options.queue_capacity = config.task_queue_capacity;
+    pool_options.scheduler = config.thread_pool_scheduler;
+    pool_options.queue_limit = config.task_queue_limit;
+    pool_options.high_weight = config.thread_pool_high_weight;
+    pool_options.reserved_workers = config.thread_pool_reserved_workers;
+    if (config.worker_cpus.count > 0) {
+        pool_options.cpus = &config.worker_cpus;
+    }
+    
+    connection_set_limit(config.max_connections);
+    
+    ConnectionTimeouts timeouts;
+    timeouts.idle_ms = config.idle_timeout_ms;
+    timeouts.read_ms = config.read_timeout_ms;
+    timeouts.write_ms = config.write_timeout_ms;
+    
+    // Create a listener, thread pool and reactor for every shard
+    for (int i = 0; i < shard_count; i++) {
+        Shard* shard = &shards[i];
+        
+        // Build the shard on its reactor's CPU: the reactor, its rings and
+        // the worker deques are first touched here, so they land on the
+        // NUMA node the shard runs on
+        if (cpu_affinity_set_current(shard->cpu) != 0) {
+            LOG_ERROR("Cannot pin reactor %d to CPU %d", i, shard->cpu);
+            shard->cpu = -1;
+        }
         
-        int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
+        int shard_cpu = (shard->cpu >= 0) ? shard->cpu : i;
         
-        if (client_socket < 0) {
-            if (server_running) {
-                log_message(LOG_ERROR, "accept() failed: %s", strerror(errno));
+        // Inherited listeners keep their queue but take this profile
+        for (int l = 0; l < shard->listen_count; l++) {
+            const ListenerConfig* listener = &config.listeners[shard->listen_config[l]];
+            socket_apply_listener(shard->listen_fds[l],
+                                  &config.socket_profiles[listener->profile], shard_cpu);
+        }
+        
+        for (int l = 0; l < config.listener_count; l++) {
+            if (shard_listener_fd(shard, l) >= 0) {
+                continue;
             }
-            break;
+            
+            // Fewer inherited sockets than shards: share one
+            int fd = -1;
+            for (int s = 0; s < shard_count && fd < 0; s++) {
+                fd = shard_listener_fd(&shards[s], l);
+            }
+            if (fd >= 0) {
+                fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+            } else {
+                const ListenerConfig* listener = &config.listeners[l];
+                fd = create_listener(listener->port, config.listen_backlog, shard_count > 1,
+                                     &config.socket_profiles[listener->profile], shard_cpu);
+            }
+            if (fd < 0 || shard->listen_count == SOCKET_MAX_LISTENERS) {
+                if (fd >= 0) {
+                    LOG_ERROR("Too many listeners");
+                    close(fd);
+                }
+                shards_destroy(shards, shard_count);
+                close(wakeup_fd);
+                logger_close();
+                return EXIT_FAILURE;
+            }
+            shard->listen_config[shard->listen_count] = l;
+            shard->listen_fds[shard->listen_count++] = fd;
         }
         
-        // Allocate client info structure
-        ClientInfo* client_info = (ClientInfo*)malloc(sizeof(ClientInfo));
-        if (client_info == NULL) {
-            log_message(LOG_ERROR, "malloc() failed for client info");
-            close(client_socket);
+#ifdef HAVE_IO_URING
+        // io_uring shards execute commands inline on the ring thread
+        if (config.io_backend == IO_BACKEND_IO_URING) {
+            shard->uring = uring_reactor_create(wakeup_fd, &timeouts, config.drain_timeout_ms);
+            if (shard->uring == NULL) {
+                LOG_ERROR("Failed to create io_uring reactor");
+                shards_destroy(shards, shard_count);
+                close(wakeup_fd);
+                logger_close();
+                return EXIT_FAILURE;
+            }
+            for (int l = 0; l < shard->listen_count; l++) {
+                const ListenerConfig* listener = &config.listeners[shard->listen_config[l]];
+                uring_reactor_add_listener(shard->uring, shard->listen_fds[l],
+                                           &config.socket_profiles[listener->profile]);
+            }
             continue;
         }
+#endif
+        
+        pool_options.cpu_offset = i * workers_per_shard;
+        shard->pool = thread_pool_create(workers_per_shard, &pool_options);
+        if (shard->pool == NULL) {
+            LOG_ERROR("Failed to create thread pool");
+            shards_destroy(shards, shard_count);
+            close(wakeup_fd);
+            logger_close();
+            return EXIT_FAILURE;
+        }
         
-        client_info->client_socket = client_socket;
-        client_info->client_addr = client_addr;
+        char gauge[32];
+        snprintf(gauge, sizeof(gauge), "shard%d.queue_depth", i);
+        stats_register_gauge(gauge, thread_pool_queue_depth, shard->pool);
+        snprintf(gauge, sizeof(gauge), "shard%d.queue_high", i);
+        stats_register_gauge(gauge, thread_pool_high_depth, shard->pool);
         
-        // Add task to thread pool
-        if (thread_pool_add_task(pool, handle_client, client_info) < 0) {
-            log_message(LOG_ERROR, "Failed to add task to thread pool");
-            close(client_socket);
-            free(client_info);
+        shard->reactor = reactor_create(wakeup_fd, shard->pool);
+        if (shard->reactor == NULL) {
+            LOG_ERROR("Failed to create reactor");
+            shards_destroy(shards, shard_count);
+            close(wakeup_fd);
+            logger_close();
+            return EXIT_FAILURE;
+        }
+        for (int l = 0; l < shard->listen_count; l++) {
+            const ListenerConfig* listener = &config.listeners[shard->listen_config[l]];
+            if (reactor_add_listener(shard->reactor, shard->listen_fds[l],
+                                     &config.socket_profiles[listener->profile]) < 0) {
+                shards_destroy(shards, shard_count);
+                close(wakeup_fd);
+                logger_close();
+                return EXIT_FAILURE;
+            }
+        }
+        shard->reactor->overload = config.overload_policy;
+        shard->reactor->drain_timeout_ms = config.drain_timeout_ms;
+        reactor_set_timeouts(shard->reactor, &timeouts);
+    }
+    
+    // Report the options each port ended up with, as the kernel sees them
+    for (int l = 0; l < config.listener_count; l++) {
+        char name[32];
+        char options[256];
+        snprintf(name, sizeof(name), "listener %d", config.listeners[l].port);
+        socket_profile_describe(shard_listener_fd(&shards[0], l),
+                                &config.socket_profiles[config.listeners[l].profile],
+                                options, sizeof(options));
+        stats_register_info(name, options);
+        LOG_INFO("Server listening on port %d (%s)", config.listeners[l].port, options);
+    }
+    
+    log_topology(shards, shard_count);
+    
+    // Health checks over UDP, answered off the TCP accept path
+    UdpServer* udp = NULL;
+    if (config.udp_port > 0) {
+        if (udp_fd < 0) {
+            udp_fd = udp_socket_create(config.udp_port);
+        }
+        if (udp_fd >= 0) {
+            // Probes start failing as soon as shutdown begins
+            udp = udp_server_start(udp_fd, config.udp_batch, wakeup_fd);
         }
+        if (udp == NULL) {
+            shards_destroy(shards, shard_count);
+            close(wakeup_fd);
+            logger_close();
+            return EXIT_FAILURE;
+        }
+        LOG_INFO("Answering UDP health checks on port %d (batches of %d)", config.udp_port,
+                 config.udp_batch);
+    }
+    
+    // Shard 0 runs on the main thread, the others get their own
+    for (int i = 1; i < shard_count; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        cpu_affinity_attr(&attr, shards[i].cpu);
+        int rc = pthread_create(&shards[i].thread, &attr, shard_thread, &shards[i]);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            LOG_ERROR("Failed to create reactor thread %d", i);
+            signal_handler(SIGINT);
+            break;
+        }
+        shards[i].thread_started = 1;
     }
     
-    // Cleanup
-    log_message(LOG_INFO, "Shutting down server...");
+    // Back onto shard 0's CPU after building the others
+    cpu_affinity_set_current(shards[0].cpu);
     
-    if (server_socket != -1) {
-        close(server_socket);
+    // Serving: release the old server, then let the next one take over
+    // from us
+    if (handoff_peer >= 0) {
+        handoff_confirm(handoff_peer);
+        char state[32];
+        snprintf(state, sizeof(state), "MAINPID=%d", (int)getpid());
+        handoff_notify(state);
     }
+    handoff_notify("READY=1");
     
-    thread_pool_destroy(pool);
+    HandoffServer* handoff = NULL;
+    if (strlen(config.upgrade_socket) > 0) {
+        int fds[HANDOFF_MAX_FDS];
+        int count = 0;
+        for (int i = 0; i < shard_count; i++) {
+            for (int l = 0; l < shards[i].listen_count && count < HANDOFF_MAX_FDS; l++) {
+                fds[count++] = shards[i].listen_fds[l];
+            }
+        }
+        if (udp != NULL && count < HANDOFF_MAX_FDS) {
+            fds[count++] = udp_server_fd(udp);
+        }
+        handoff = handoff_server_start(config.upgrade_socket, fds, count, handoff_complete);
+        if (handoff != NULL) {
+            LOG_INFO("Accepting upgrades at %s", config.upgrade_socket);
+        }
+    }
     
-    log_message(LOG_INFO, "Server stopped. Total active clients at shutdown: %d", 
-                get_active_clients());
+    // Run the event loop until SIGINT
+    shard_run(&shards[0]);
+    
+    if (atomic_load(&handed_over)) {
+        LOG_INFO("Listeners handed over, shutting down...");
+    } else if (!server_running) {
+        LOG_INFO("Received %s, shutting down...", (stop_signal == SIGTERM) ? "SIGTERM" : "SIGINT");
+    }
+    
+    // Every reactor drains its connections before its loop returns
+    LOG_INFO("Shutting down server...");
+    handoff_notify("STOPPING=1");
+    handoff_server_stop(handoff);
+    
+    // Health checks have gone unanswered since the wakeup that began the
+    // drain. The socket is closed only now that the handoff server, which
+    // may pass it to a new process, has stopped.
+    udp_server_stop(udp);
+    shards_join(shards, shard_count);
+    report_drain(shards, shard_count, config.drain_timeout_ms);
+    
+    shards_destroy(shards, shard_count);
+    close(wakeup_fd);
+#ifdef HAVE_TLS
+    tls_cleanup();
+#endif
+    
+    LOG_INFO("Server stopped. Total active clients at shutdown: %d",
+             stats_active_connections());
+    
+    // Pools persist for the process lifetime; report how far they grew
+    char report[1024];
+    if (object_pool_report(report, sizeof(report)) > 0) {
+        char* saveptr = NULL;
+        for (char* line = strtok_r(report, "\n", &saveptr); line != NULL;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+            LOG_INFO("Object pool %s", line);
+        }
+    }
     
     logger_close();
     
@@ -0,0 +1,119 @@
+#include "socket_options.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+void socket_profile_init(SocketProfile* profile, const char* name) {
+    memset(profile, 0, sizeof(*profile));
+    snprintf(profile->name, sizeof(profile->name), "%s", name);
+    profile->nodelay = 1;
+    profile->incoming_cpu = SOCKET_INCOMING_CPU_UNSET;
+}
+
+int socket_profile_set(SocketProfile* profile, const char* key, const char* value) {
+    if (strcmp(key, "NODELAY") == 0) {
+        profile->nodelay = atoi(value);
+    } else if (strcmp(key, "QUICKACK") == 0) {
+        profile->quickack = atoi(value);
+    } else if (strcmp(key, "BUSY_POLL") == 0) {
+        profile->busy_poll = atoi(value);
+    } else if (strcmp(key, "TLS") == 0) {
+        profile->tls = atoi(value);
+    } else if (strcmp(key, "RCVBUF") == 0) {
+        profile->rcvbuf = atoi(value);
+    } else if (strcmp(key, "SNDBUF") == 0) {
+        profile->sndbuf = atoi(value);
+    } else if (strcmp(key, "DEFER_ACCEPT") == 0) {
+        profile->defer_accept = atoi(value);
+    } else if (strcmp(key, "FASTOPEN") == 0) {
+        profile->fastopen = atoi(value);
+    } else if (strcmp(key, "INCOMING_CPU") == 0) {
+        profile->incoming_cpu = (strcmp(value, "shard") == 0) ? SOCKET_INCOMING_CPU_SHARD
+                                                               : atoi(value);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int set_option(int fd, int level, int option, int value, const char* name) {
+    if (setsockopt(fd, level, option, &value, sizeof(value)) < 0) {
+        LOG_ERROR("setsockopt(%s) failed: %s", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int socket_apply_listener(int fd, const SocketProfile* profile, int shard_cpu) {
+    // Buffer sizes must be set before listen() to take part in the
+    // window scale negotiated with each client
+    if (profile->rcvbuf > 0 &&
+        set_option(fd, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf, "SO_RCVBUF") < 0) {
+        return -1;
+    }
+    if (profile->sndbuf > 0 &&
+        set_option(fd, SOL_SOCKET, SO_SNDBUF, profile->sndbuf, "SO_SNDBUF") < 0) {
+        return -1;
+    }
+    if (profile->defer_accept > 0 &&
+        set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile->defer_accept,
+                   "TCP_DEFER_ACCEPT") < 0) {
+        return -1;
+    }
+    if (profile->fastopen > 0 &&
+        set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, profile->fastopen, "TCP_FASTOPEN") < 0) {
+        return -1;
+    }
+    
+    // With SO_REUSEPORT the kernel prefers the listener whose CPU matches
+    // the one that processed the connection's packets
+    int cpu = (profile->incoming_cpu == SOCKET_INCOMING_CPU_SHARD) ? shard_cpu
+                                                                   : profile->incoming_cpu;
+    if (cpu >= 0 && set_option(fd, SOL_SOCKET, SO_INCOMING_CPU, cpu, "SO_INCOMING_CPU") < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void socket_apply_accepted(int fd, const SocketProfile* profile) {
+    int value;
+    if (profile->nodelay) {
+        value = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    }
+    if (profile->quickack) {
+        value = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &value, sizeof(value));
+    }
+    if (profile->busy_poll > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &profile->busy_poll, sizeof(profile->busy_poll));
+    }
+}
+
+static int get_option(int fd, int level, int option) {
+    int value = -1;
+    socklen_t len = sizeof(value);
+    if (getsockopt(fd, level, option, &value, &len) < 0) {
+        return -1;
+    }
+    return value;
+}
+
+void socket_profile_describe(int fd, const SocketProfile* profile, char* buf, size_t size) {
+    // The kernel doubles buffer sizes for bookkeeping and rounds the
+    // defer timeout to retransmits, so report what it actually uses
+    snprintf(buf, size,
+             "profile=%s tls=%d nodelay=%d quickack=%d busy_poll=%d rcvbuf=%d sndbuf=%d "
+             "defer_accept=%d fastopen=%d incoming_cpu=%d",
+             profile->name, profile->tls, profile->nodelay, profile->quickack,
+             profile->busy_poll,
+             get_option(fd, SOL_SOCKET, SO_RCVBUF), get_option(fd, SOL_SOCKET, SO_SNDBUF),
+             get_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT),
+             get_option(fd, IPPROTO_TCP, TCP_FASTOPEN),
+             get_option(fd, SOL_SOCKET, SO_INCOMING_CPU));
+}
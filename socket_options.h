@@ -0,0 +1,57 @@
+#ifndef SOCKET_OPTIONS_H
+#define SOCKET_OPTIONS_H
+
+#include <stddef.h>
+
+#define SOCKET_MAX_PROFILES 8
+#define SOCKET_MAX_LISTENERS 8
+#define SOCKET_PROFILE_NAME_SIZE 32
+
+// SO_INCOMING_CPU: leave unset, or use the shard's CPU (the one its
+// reactor is pinned to, else its index)
+#define SOCKET_INCOMING_CPU_UNSET (-1)
+#define SOCKET_INCOMING_CPU_SHARD (-2)
+
+// A named set of socket options. Listener options are set once on every
+// listening socket and inherited by what it accepts; the others are set
+// on each accepted socket. 0 leaves the kernel default.
+typedef struct {
+    char name[SOCKET_PROFILE_NAME_SIZE];
+    
+    // Accepted sockets
+    int nodelay;        // TCP_NODELAY: disable Nagle
+    int quickack;       // TCP_QUICKACK: ack at once (the kernel may drop
+                        // back to delayed acks later)
+    int busy_poll;      // SO_BUSY_POLL: microseconds to spin in recv
+    int tls;            // TLS handshake, then kernel TLS (make TLS=1)
+    
+    // Listeners
+    int rcvbuf;         // SO_RCVBUF bytes
+    int sndbuf;         // SO_SNDBUF bytes
+    int defer_accept;   // TCP_DEFER_ACCEPT: seconds to wait for data
+    int fastopen;       // TCP_FASTOPEN: pending TFO request queue length
+    int incoming_cpu;   // SO_INCOMING_CPU, or one of the values above
+} SocketProfile;
+
+// Fill in the built-in profile: Nagle off, everything else default
+void socket_profile_init(SocketProfile* profile, const char* name);
+
+// Set one option from its config key (NODELAY, QUICKACK, BUSY_POLL, TLS,
+// RCVBUF, SNDBUF, DEFER_ACCEPT, FASTOPEN, INCOMING_CPU). Returns 0 on
+// success, -1 for an unknown key.
+int socket_profile_set(SocketProfile* profile, const char* key, const char* value);
+
+// Apply the listener options to a socket that is bound but not yet
+// listening; shard_cpu resolves SOCKET_INCOMING_CPU_SHARD. Returns 0 on
+// success, -1 if an option was refused (logged).
+int socket_apply_listener(int fd, const SocketProfile* profile, int shard_cpu);
+
+// Apply the per-connection options to an accepted socket. Failures are
+// ignored: the connection works either way.
+void socket_apply_accepted(int fd, const SocketProfile* profile);
+
+// Describe the options in effect on a listener, as read back from the
+// kernel where it reports them, e.g. for STATS DETAIL
+void socket_profile_describe(int fd, const SocketProfile* profile, char* buf, size_t size);
+
+#endif // SOCKET_OPTIONS_H
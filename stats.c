@@ -0,0 +1,353 @@
+#include "stats.h"
+#include "task_ring.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Log-linear histogram: values below 2^STATS_HIST_SUB_BITS get a bucket
+// each, every power of two above that is split into 2^STATS_HIST_SUB_BITS
+// buckets (about 6% relative error). Values are clamped to 2^40 ns.
+#define STATS_HIST_SUB_BITS 4
+#define STATS_HIST_SUB_COUNT (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_MAX_EXP 40
+#define STATS_HIST_BUCKETS ((STATS_HIST_MAX_EXP - STATS_HIST_SUB_BITS + 2) * STATS_HIST_SUB_COUNT)
+
+#define STATS_MAX_GAUGES 16
+#define STATS_MAX_INFO 16
+#define STATS_LABEL_SIZE 32
+#define STATS_INFO_SIZE 256
+
+typedef struct StatsSlot {
+    _Atomic uint64_t counters[STATS_COUNTER_COUNT];
+    _Atomic uint64_t commands[STATS_CMD_COUNT];
+    _Atomic uint64_t max_latency[STATS_CMD_COUNT];
+    _Atomic uint64_t histogram[STATS_CMD_COUNT][STATS_HIST_BUCKETS];
+    char label[STATS_LABEL_SIZE];
+    struct StatsSlot* next;
+} StatsSlot;
+
+typedef struct {
+    char name[STATS_LABEL_SIZE];
+    long (*read)(void* arg);
+    void* arg;
+} StatsGauge;
+
+typedef struct {
+    char name[STATS_LABEL_SIZE];
+    char value[STATS_INFO_SIZE];
+} StatsInfo;
+
+static const char* counter_names[STATS_COUNTER_COUNT] = {
+    "connections_accepted",
+    "connections_closed",
+    "bytes_in",
+    "bytes_out",
+    "errors",
+    "tasks_run",
+    "busy_ns",
+    "connections_rejected",
+    "connections_shed",
+    "accept_pauses",
+    "timeouts_idle",
+    "timeouts_read",
+    "timeouts_write",
+    "udp_datagrams",
+    "udp_batches",
+    "kv_hits",
+    "kv_misses",
+    "kv_evictions",
+    "kv_expired",
+    "pubsub_published",
+    "pubsub_delivered",
+    "pubsub_dropped",
+    "pubsub_disconnects",
+    "tls_handshakes",
+    "tls_resumed",
+    "tls_failures",
+    "rate_limited_connections",
+    "rate_limited_commands"
+};
+
+static const char* command_names[STATS_CMD_COUNT] = {
+    "PING",
+    "TIME",
+    "ECHO",
+    "STATS",
+    "QUIT",
+    "STREAM",
+    "SET",
+    "GET",
+    "DEL",
+    "INCR",
+    "EXPIRE",
+    "SUBSCRIBE",
+    "UNSUBSCRIBE",
+    "PUBLISH",
+    "UNKNOWN"
+};
+
+// Slots are never freed, so totals survive their threads and readers
+// can walk the list without a lock. The mutex guards the gauges, the
+// info lines and the report's scratch histogram.
+static _Atomic(StatsSlot*) slots = NULL;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static StatsGauge gauges[STATS_MAX_GAUGES];
+static int gauge_count = 0;
+
+static StatsInfo info[STATS_MAX_INFO];
+static int info_count = 0;
+
+static __thread StatsSlot* thread_slot = NULL;
+
+static StatsSlot* slot_create(const char* label) {
+    size_t size = (sizeof(StatsSlot) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    StatsSlot* slot = (StatsSlot*)aligned_alloc(CACHE_LINE_SIZE, size);
+    if (slot == NULL) {
+        return NULL;
+    }
+    memset(slot, 0, size);
+    snprintf(slot->label, sizeof(slot->label), "%s", label);
+    
+    StatsSlot* head = atomic_load_explicit(&slots, memory_order_relaxed);
+    do {
+        slot->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&slots, &head, slot,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    return slot;
+}
+
+static inline StatsSlot* first_slot(void) {
+    return atomic_load_explicit(&slots, memory_order_acquire);
+}
+
+static inline StatsSlot* get_slot(void) {
+    if (thread_slot == NULL) {
+        thread_slot = slot_create("thread");
+    }
+    return thread_slot;
+}
+
+// Single-writer increment: no locked instruction, readers see whole values
+static inline void slot_add(_Atomic uint64_t* value, uint64_t delta) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+void stats_thread_init(const char* label) {
+    if (thread_slot == NULL) {
+        thread_slot = slot_create(label);
+    }
+}
+
+void stats_add(StatsCounter counter, uint64_t value) {
+    StatsSlot* slot = get_slot();
+    if (slot != NULL) {
+        slot_add(&slot->counters[counter], value);
+    }
+}
+
+static int hist_bucket(uint64_t value) {
+    if (value < STATS_HIST_SUB_COUNT) {
+        return (int)value;
+    }
+    if (value >= (1ULL << (STATS_HIST_MAX_EXP + 1))) {
+        value = (1ULL << (STATS_HIST_MAX_EXP + 1)) - 1;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int)((value >> (exponent - STATS_HIST_SUB_BITS)) & (STATS_HIST_SUB_COUNT - 1));
+    return (exponent - STATS_HIST_SUB_BITS + 1) * STATS_HIST_SUB_COUNT + sub;
+}
+
+// Largest value that falls into a bucket
+static uint64_t hist_bucket_limit(int bucket) {
+    if (bucket < STATS_HIST_SUB_COUNT) {
+        return (uint64_t)bucket;
+    }
+    int exponent = bucket / STATS_HIST_SUB_COUNT + STATS_HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(bucket % STATS_HIST_SUB_COUNT);
+    int shift = exponent - STATS_HIST_SUB_BITS;
+    return ((STATS_HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void stats_record_command(StatsCommand command, uint64_t latency_ns) {
+    StatsSlot* slot = get_slot();
+    if (slot == NULL) {
+        return;
+    }
+    slot_add(&slot->commands[command], 1);
+    slot_add(&slot->histogram[command][hist_bucket(latency_ns)], 1);
+    if (latency_ns > atomic_load_explicit(&slot->max_latency[command], memory_order_relaxed)) {
+        atomic_store_explicit(&slot->max_latency[command], latency_ns, memory_order_relaxed);
+    }
+}
+
+uint64_t stats_total(StatsCounter counter) {
+    uint64_t total = 0;
+    for (StatsSlot* slot = first_slot(); slot != NULL; slot = slot->next) {
+        total += atomic_load_explicit(&slot->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+int stats_active_connections(void) {
+    uint64_t accepted = 0;
+    uint64_t closed = 0;
+    for (StatsSlot* slot = first_slot(); slot != NULL; slot = slot->next) {
+        accepted += atomic_load_explicit(&slot->counters[STATS_CONNECTIONS_ACCEPTED],
+                                         memory_order_relaxed);
+        closed += atomic_load_explicit(&slot->counters[STATS_CONNECTIONS_CLOSED],
+                                       memory_order_relaxed);
+    }
+    // Slots are read one after another, so a connection closed during the
+    // sweep may be counted as closed but not yet accepted
+    return (closed >= accepted) ? 0 : (int)(accepted - closed);
+}
+
+void stats_register_gauge(const char* name, long (*read)(void* arg), void* arg) {
+    pthread_mutex_lock(&stats_mutex);
+    if (gauge_count < STATS_MAX_GAUGES) {
+        StatsGauge* gauge = &gauges[gauge_count++];
+        snprintf(gauge->name, sizeof(gauge->name), "%s", name);
+        gauge->read = read;
+        gauge->arg = arg;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_register_info(const char* name, const char* value) {
+    pthread_mutex_lock(&stats_mutex);
+    if (info_count < STATS_MAX_INFO) {
+        StatsInfo* entry = &info[info_count++];
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+        snprintf(entry->value, sizeof(entry->value), "%s", value);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+// Value below which the given fraction of samples falls, reported as the
+// bucket's upper bound but never above the recorded maximum
+static uint64_t hist_percentile(const uint64_t* histogram, uint64_t count, double fraction,
+                                uint64_t max) {
+    uint64_t rank = (uint64_t)(fraction * (double)count);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen > rank) {
+            uint64_t limit = hist_bucket_limit(i);
+            return (limit < max) ? limit : max;
+        }
+    }
+    return max;
+}
+
+void stats_report_append(char* buf, size_t size, size_t* used, const char* format, ...) {
+    if (*used >= size) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buf + *used, size - *used, format, args);
+    va_end(args);
+    if (written > 0) {
+        *used += (size_t)written;
+    }
+}
+
+int stats_report(char* buf, size_t size) {
+    uint64_t totals[STATS_COUNTER_COUNT] = {0};
+    uint64_t commands[STATS_CMD_COUNT] = {0};
+    uint64_t max_latency[STATS_CMD_COUNT] = {0};
+    static uint64_t histogram[STATS_CMD_COUNT][STATS_HIST_BUCKETS];
+    size_t used = 0;
+    
+    // histogram is static to keep it off the worker's stack
+    pthread_mutex_lock(&stats_mutex);
+    memset(histogram, 0, sizeof(histogram));
+    
+    for (StatsSlot* slot = first_slot(); slot != NULL; slot = slot->next) {
+        for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+            totals[i] += atomic_load_explicit(&slot->counters[i], memory_order_relaxed);
+        }
+        for (int c = 0; c < STATS_CMD_COUNT; c++) {
+            uint64_t count = atomic_load_explicit(&slot->commands[c], memory_order_relaxed);
+            if (count == 0) {
+                continue;
+            }
+            commands[c] += count;
+            uint64_t max = atomic_load_explicit(&slot->max_latency[c], memory_order_relaxed);
+            if (max > max_latency[c]) {
+                max_latency[c] = max;
+            }
+            for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+                histogram[c][b] += atomic_load_explicit(&slot->histogram[c][b],
+                                                        memory_order_relaxed);
+            }
+        }
+    }
+    
+    uint64_t accepted = totals[STATS_CONNECTIONS_ACCEPTED];
+    uint64_t closed = totals[STATS_CONNECTIONS_CLOSED];
+    stats_report_append(buf, size, &used, "Active clients: %llu\n",
+                        (unsigned long long)((closed >= accepted) ? 0 : accepted - closed));
+    
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+        stats_report_append(buf, size, &used, "%s: %llu\n", counter_names[i],
+                            (unsigned long long)totals[i]);
+    }
+    
+    for (int i = 0; i < gauge_count; i++) {
+        stats_report_append(buf, size, &used, "%s: %ld\n", gauges[i].name,
+                            gauges[i].read(gauges[i].arg));
+    }
+    
+    for (int i = 0; i < info_count; i++) {
+        stats_report_append(buf, size, &used, "%s: %s\n", info[i].name, info[i].value);
+    }
+    
+    for (int c = 0; c < STATS_CMD_COUNT; c++) {
+        if (commands[c] == 0) {
+            continue;
+        }
+        // Histogram totals may trail the command counts by in-flight updates
+        uint64_t samples = 0;
+        for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+            samples += histogram[c][b];
+        }
+        if (samples == 0) {
+            continue;
+        }
+        stats_report_append(buf, size, &used,
+                            "cmd %s: count=%llu p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus\n",
+                            command_names[c], (unsigned long long)commands[c],
+                            hist_percentile(histogram[c], samples, 0.50, max_latency[c]) / 1000.0,
+                            hist_percentile(histogram[c], samples, 0.90, max_latency[c]) / 1000.0,
+                            hist_percentile(histogram[c], samples, 0.99, max_latency[c]) / 1000.0,
+                            max_latency[c] / 1000.0);
+    }
+    
+    for (StatsSlot* slot = first_slot(); slot != NULL; slot = slot->next) {
+        uint64_t tasks = atomic_load_explicit(&slot->counters[STATS_TASKS_RUN],
+                                              memory_order_relaxed);
+        uint64_t busy = atomic_load_explicit(&slot->counters[STATS_BUSY_NS],
+                                             memory_order_relaxed);
+        if (tasks == 0) {
+            continue;
+        }
+        stats_report_append(buf, size, &used, "thread %s: tasks=%llu busy=%.1fms\n", slot->label,
+                            (unsigned long long)tasks, busy / 1000000.0);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    
+    if (used >= size) {
+        used = (size > 0) ? size - 1 : 0;
+    }
+    return (int)used;
+}
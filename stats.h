@@ -0,0 +1,97 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Server-wide counters. Every thread updates a private, cache-line
+// aligned slot with plain relaxed stores; readers sum all slots, so the
+// request path never writes a cache line another thread writes.
+typedef enum {
+    STATS_CONNECTIONS_ACCEPTED,
+    STATS_CONNECTIONS_CLOSED,
+    STATS_BYTES_IN,
+    STATS_BYTES_OUT,
+    STATS_ERRORS,
+    STATS_TASKS_RUN,
+    STATS_BUSY_NS,              // time spent running pool tasks
+    STATS_CONNECTIONS_REJECTED, // turned away at the connection limit
+    STATS_CONNECTIONS_SHED,     // closed because the task queue was full
+    STATS_ACCEPT_PAUSES,        // times a reactor stopped accepting
+    STATS_TIMEOUTS_IDLE,        // closed after IDLE_TIMEOUT_MS of silence
+    STATS_TIMEOUTS_READ,        // request not completed within READ_TIMEOUT_MS
+    STATS_TIMEOUTS_WRITE,       // output not taken within WRITE_TIMEOUT_MS
+    STATS_UDP_DATAGRAMS,        // requests received on UDP_PORT
+    STATS_UDP_BATCHES,          // recvmmsg() calls that returned datagrams
+    STATS_KV_HITS,              // cache GETs that found the key
+    STATS_KV_MISSES,
+    STATS_KV_EVICTIONS,         // items dropped to stay under the memory limit
+    STATS_KV_EXPIRED,           // items dropped when their TTL passed
+    STATS_PUBSUB_PUBLISHED,     // PUBLISH requests
+    STATS_PUBSUB_DELIVERED,     // messages queued to subscribers
+    STATS_PUBSUB_DROPPED,       // not queued because a subscriber was behind
+    STATS_PUBSUB_DISCONNECTS,   // subscribers closed for falling behind
+    STATS_TLS_HANDSHAKES,       // completed and offloaded to kernel TLS
+    STATS_TLS_RESUMED,          // of those, resumed sessions
+    STATS_TLS_FAILURES,         // handshakes failed or not offloadable
+    STATS_RATE_LIMITED_CONNECTIONS, // turned away by RATE_LIMIT_CONNECTIONS
+    STATS_RATE_LIMITED_COMMANDS,    // refused by RATE_LIMIT_COMMANDS
+    STATS_COUNTER_COUNT
+} StatsCounter;
+
+// Commands with their own count and latency histogram
+typedef enum {
+    STATS_CMD_PING,
+    STATS_CMD_TIME,
+    STATS_CMD_ECHO,
+    STATS_CMD_STATS,
+    STATS_CMD_QUIT,
+    STATS_CMD_STREAM,
+    STATS_CMD_SET,
+    STATS_CMD_GET,
+    STATS_CMD_DEL,
+    STATS_CMD_INCR,
+    STATS_CMD_EXPIRE,
+    STATS_CMD_SUBSCRIBE,
+    STATS_CMD_UNSUBSCRIBE,
+    STATS_CMD_PUBLISH,
+    STATS_CMD_UNKNOWN,
+    STATS_CMD_COUNT
+} StatsCommand;
+
+// Name the calling thread's slot in STATS DETAIL. Only takes effect
+// before the thread's first update; unnamed threads report as "thread".
+void stats_thread_init(const char* label);
+
+// Add to a counter of the calling thread
+void stats_add(StatsCounter counter, uint64_t value);
+
+// Count a command with its execution time
+void stats_record_command(StatsCommand command, uint64_t latency_ns);
+
+// Sum of a counter over all threads
+uint64_t stats_total(StatsCounter counter);
+
+// Connections accepted and not yet closed
+int stats_active_connections(void);
+
+// Register a value sampled at report time, such as a queue depth. At
+// most a handful are kept; name is copied.
+void stats_register_gauge(const char* name, long (*read)(void* arg), void* arg);
+
+// Register a fixed line of configuration, such as a listener's socket
+// options, reported as "name: value". Both strings are copied.
+void stats_register_info(const char* name, const char* value);
+
+// Format the full report (counters, gauges, per-command percentiles and
+// per-thread busy time) into buf; returns bytes written
+int stats_report(char* buf, size_t size);
+
+// snprintf for building a report into buf: appends at *used and advances
+// it by what the line needed, so *used >= size once the report has been
+// cut short. Appends nothing past that point; the caller clamps *used to
+// size - 1 when it is done.
+__attribute__((format(printf, 4, 5)))
+void stats_report_append(char* buf, size_t size, size_t* used, const char* format, ...);
+
+#endif // STATS_H
@@ -0,0 +1,98 @@
+#include "task_ring.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+int task_ring_init(TaskRing* ring, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    
+    ring->cells = (TaskCell*)malloc(sizeof(TaskCell) * size);
+    if (ring->cells == NULL) {
+        return -1;
+    }
+    
+    // A cell whose sequence equals the enqueue position is free
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&ring->cells[i].sequence, i);
+    }
+    
+    ring->mask = size - 1;
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    return 0;
+}
+
+void task_ring_destroy(TaskRing* ring) {
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+int task_ring_push(TaskRing* ring, void (*function)(void*), void* arg) {
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    TaskCell* cell;
+    
+    while (1) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        
+        if (diff == 0) {
+            // Free cell: claim it by advancing the enqueue cursor
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The consumer has not released this cell yet: full
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    
+    cell->function = function;
+    cell->arg = arg;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+int task_ring_pop(TaskRing* ring, void (**function)(void*), void** arg) {
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    TaskCell* cell;
+    
+    while (1) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        
+        if (diff == 0) {
+            // Published cell: claim it by advancing the dequeue cursor
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Nothing published at this position yet: empty
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    
+    *function = cell->function;
+    *arg = cell->arg;
+    
+    // Hand the cell back to producers one lap ahead
+    atomic_store_explicit(&cell->sequence, pos + ring->mask + 1, memory_order_release);
+    return 0;
+}
+
+size_t task_ring_size(TaskRing* ring) {
+    size_t head = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    return (tail > head) ? tail - head : 0;
+}
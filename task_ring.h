@@ -0,0 +1,41 @@
+#ifndef TASK_RING_H
+#define TASK_RING_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+
+// Slot of the ring; tasks are stored inline, no per-task allocation
+typedef struct {
+    atomic_size_t sequence;
+    void (*function)(void* arg);
+    void* arg;
+} TaskCell;
+
+// Bounded lock-free multi-producer/multi-consumer ring (Vyukov). The
+// producer and consumer cursors live on separate cache lines.
+typedef struct {
+    alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+    alignas(CACHE_LINE_SIZE) TaskCell* cells;
+    size_t mask;
+} TaskRing;
+
+// Allocate a ring with capacity rounded up to a power of two
+int task_ring_init(TaskRing* ring, size_t capacity);
+
+// Free the ring's cells
+void task_ring_destroy(TaskRing* ring);
+
+// Returns 0 on success, -1 if the ring is full
+int task_ring_push(TaskRing* ring, void (*function)(void*), void* arg);
+
+// Returns 0 on success, -1 if the ring is empty
+int task_ring_pop(TaskRing* ring, void (**function)(void*), void** arg);
+
+// Approximate number of queued tasks
+size_t task_ring_size(TaskRing* ring);
+
+#endif // TASK_RING_H
@@ -4,7 +4,12 @@ Automated test script for the TCP server
 Tests all protocol commands and concurrent connections
 """
 
+import os
+import signal
 import socket
+import struct
+import subprocess
+import tempfile
 import threading
 import time
 import sys
@@ -19,17 +24,17 @@ class TestResults:
         self.passed = 0
         self.failed = 0
         self.errors = []
-    
+
     def add_pass(self, test_name):
         self.passed += 1
         print(f"✓ {test_name}")
-    
+
     def add_fail(self, test_name, reason):
         self.failed += 1
         error = f"✗ {test_name}: {reason}"
         self.errors.append(error)
         print(error)
-    
+
     def summary(self):
         total = self.passed + self.failed
         print("\n" + "="*60)
@@ -99,6 +104,167 @@ def test_stats(results):
     except Exception as e:
         results.add_fail("STATS command", str(e))
 
+def test_stats_detail(results):
+    """Test STATS DETAIL report"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            s.sendall(b"PING\nSTATS DETAIL\n")
+            data = b''
+            while not data.endswith(b"END\n"):
+                chunk = s.recv(4096)
+                if not chunk:
+                    break
+                data += chunk
+            report = data.decode()
+
+        required = ["Active clients:", "connections_accepted:", "bytes_in:", "cmd PING: count="]
+        missing = [field for field in required if field not in report]
+        if not missing:
+            results.add_pass("STATS DETAIL command")
+        else:
+            results.add_fail("STATS DETAIL command", f"Missing {missing}")
+    except Exception as e:
+        results.add_fail("STATS DETAIL command", str(e))
+
+def test_stats_memory(results, num_idle=16):
+    """Test that STATS MEMORY reports idle connections holding no buffers"""
+    idle = []
+    try:
+        # Each has had a reply, so each has drained an output buffer
+        for _ in range(num_idle):
+            s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            s.sendall(b"PING\n")
+            s.recv(64)
+            idle.append(s)
+
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            s.sendall(b"STATS MEMORY\n")
+            data = b''
+            while not data.endswith(b"END\n"):
+                chunk = s.recv(4096)
+                if not chunk:
+                    break
+                data += chunk
+        fields = dict(line.split(": ", 1) for line in data.decode().splitlines() if ": " in line)
+
+        per_connection = int(fields.get("bytes_per_connection", "-1"))
+        if "buffers_4k" not in fields or per_connection < 0:
+            results.add_fail("STATS MEMORY command", f"Unexpected report {fields}")
+        elif per_connection >= 4096:
+            results.add_fail("STATS MEMORY command",
+                             f"{per_connection} bytes per connection with {num_idle} idle")
+        else:
+            results.add_pass(f"STATS MEMORY ({per_connection} bytes per connection)")
+    except Exception as e:
+        results.add_fail("STATS MEMORY command", str(e))
+    finally:
+        for s in idle:
+            s.close()
+
+def test_cache_commands(results):
+    """Test SET/GET/DEL/INCR/EXPIRE on one connection"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            key = f"test:{time.time()}"
+            requests = [f"SET {key} hello cache", f"GET {key}", f"INCR {key}:n 41",
+                        f"INCR {key}:n", f"INCR {key}", f"EXPIRE {key} 1",
+                        f"DEL {key}:n", f"GET {key}:n"]
+            s.sendall("".join(r + "\n" for r in requests).encode())
+            replies = recv_lines(s, len(requests))
+            expected = ["OK", "VALUE hello cache", "41", "42",
+                        "ERROR: Not an integer or out of range", "OK", "DELETED", "NOT_FOUND"]
+
+            time.sleep(1.1)
+            s.sendall(f"GET {key}\n".encode())
+            expired = recv_lines(s, 1)
+            if replies == expected and expired == ["NOT_FOUND"]:
+                results.add_pass("Cache commands")
+            else:
+                results.add_fail("Cache commands", f"Got {replies} then {expired}")
+    except Exception as e:
+        results.add_fail("Cache commands", str(e))
+
+def test_cache_failed_set(results, size=40 * 1024):
+    """Test that a SET refused for memory leaves the old value in place"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            key = f"test:{time.time()}:keep"
+            big = "x" * size
+            # Past a small KV_MEMORY_LIMIT_MB's per-shard share, it is refused
+            s.sendall(f"SET {key} old\nSET {key} {big}\nGET {key}\n".encode())
+            replies = recv_lines(s, 3)
+
+            if replies[:2] == ["OK", "OK"]:
+                expected = f"VALUE {big}"
+            else:
+                expected = "VALUE old"
+            if len(replies) == 3 and replies[1] in ("OK", "ERROR: Out of memory") and \
+               replies[2] == expected:
+                results.add_pass(f"Cache failed SET keeps old value (SET {replies[1]})")
+            else:
+                results.add_fail("Cache failed SET", f"Got {[r[:40] for r in replies]}")
+    except Exception as e:
+        results.add_fail("Cache failed SET", str(e))
+
+def test_pubsub(results, num_subscribers=4):
+    """Test SUBSCRIBE/PUBLISH fan-out and subscriber mode"""
+    subscribers = []
+    try:
+        channel = f"news:{time.time()}"
+        for i in range(num_subscribers):
+            s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            s.sendall(f"SUBSCRIBE {channel} {channel}:{i}\n".encode())
+            subscribers.append(s)
+        acks = [recv_lines(subscribers[0], 1)]
+        if acks[0] == ["ERROR: Subscriptions not supported"]:
+            print("- Pub/sub: not supported by this backend, skipped")
+            return
+        if len(acks[0]) < 2:
+            acks[0] += recv_lines(subscribers[0], 1)
+        acks += [recv_lines(s, 2) for s in subscribers[1:]]
+
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as p:
+            p.settimeout(TIMEOUT)
+            p.connect((SERVER_HOST, SERVER_PORT))
+            p.sendall(f"PUBLISH {channel} hello all\nPUBLISH {channel}:0 just you\n"
+                      f"PUBLISH {channel}:none nobody\n".encode())
+            counts = recv_lines(p, 3)
+
+        # The first subscriber also gets the message on its own channel
+        messages = [recv_lines(s, 2 if i == 0 else 1) for i, s in enumerate(subscribers)]
+        first = subscribers[0]
+        first.sendall(f"GET x\nPING\nUNSUBSCRIBE {channel}\n".encode())
+        after = recv_lines(first, 3)
+
+        expected_acks = [[f"SUBSCRIBED {channel} 1", f"SUBSCRIBED {channel}:{i} 2"]
+                         for i in range(num_subscribers)]
+        expected_messages = [[f"MESSAGE {channel} hello all"]] * num_subscribers
+        expected_messages[0] = expected_messages[0] + [f"MESSAGE {channel}:0 just you"]
+        expected_after = ["ERROR: Only SUBSCRIBE, UNSUBSCRIBE, PING and QUIT while subscribed",
+                          "PONG", f"UNSUBSCRIBED {channel} 1"]
+        if (acks == expected_acks and counts == [str(num_subscribers), "1", "0"] and
+                messages == expected_messages and after == expected_after):
+            results.add_pass(f"Pub/sub ({num_subscribers} subscribers)")
+        else:
+            results.add_fail("Pub/sub", f"Got {acks}, {counts}, {messages}, {after}")
+    except Exception as e:
+        results.add_fail("Pub/sub", str(e))
+    finally:
+        for s in subscribers:
+            s.close()
+
 def test_quit(results):
     """Test QUIT command"""
     try:
@@ -121,21 +287,33 @@ def test_unknown_command(results):
     except Exception as e:
         results.add_fail("Unknown command handling", str(e))
 
+def test_command_arguments(results):
+    """Test argument checking and that ECHO keeps its text verbatim"""
+    try:
+        echo = send_command("ECHO two  spaces ")
+        wrong = send_command("PING extra")
+        if echo == "two  spaces" and wrong.startswith("ERROR"):
+            results.add_pass("Command arguments")
+        else:
+            results.add_fail("Command arguments", f"Got '{echo}' and '{wrong}'")
+    except Exception as e:
+        results.add_fail("Command arguments", str(e))
+
 def concurrent_client(client_id, num_commands, results_lock, success_count):
     """Function for concurrent client test"""
     try:
         with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
             s.settimeout(TIMEOUT)
             s.connect((SERVER_HOST, SERVER_PORT))
-            
+
             for i in range(num_commands):
                 message = f"Client{client_id}_Msg{i}"
                 s.sendall(f"ECHO {message}\n".encode())
                 response = s.recv(4096).decode().strip()
-                
+
                 if response != message:
                     return
-            
+
             with results_lock:
                 success_count[0] += 1
     except Exception as e:
@@ -147,16 +325,16 @@ def test_concurrent_connections(results, num_clients=10, commands_per_client=5):
         threads = []
         results_lock = threading.Lock()
         success_count = [0]
-        
+
         for i in range(num_clients):
             t = threading.Thread(target=concurrent_client, 
                                args=(i, commands_per_client, results_lock, success_count))
             threads.append(t)
             t.start()
-        
+
         for t in threads:
             t.join(timeout=TIMEOUT * 2)
-        
+
         if success_count[0] == num_clients:
             results.add_pass(f"Concurrent connections ({num_clients} clients)")
         else:
@@ -171,14 +349,14 @@ def test_persistent_connection(results):
         with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
             s.settimeout(TIMEOUT)
             s.connect((SERVER_HOST, SERVER_PORT))
-            
+
             # Send multiple commands on same connection
             commands = [
                 ("PING", "PONG"),
                 ("ECHO Test123", "Test123"),
                 ("STATS", "Active clients:"),
             ]
-            
+
             all_passed = True
             for cmd, expected in commands:
                 s.sendall(cmd.encode() + b'\n')
@@ -186,7 +364,7 @@ def test_persistent_connection(results):
                 if expected not in response:
                     all_passed = False
                     break
-            
+
             if all_passed:
                 results.add_pass("Persistent connection (multiple commands)")
             else:
@@ -194,6 +372,315 @@ def test_persistent_connection(results):
     except Exception as e:
         results.add_fail("Persistent connection", str(e))
 
+def recv_lines(s, count):
+    """Read until count newline-terminated lines have arrived"""
+    data = b''
+    while data.count(b'\n') < count:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    return data.decode().splitlines()
+
+def test_pipelined_commands(results, num_commands=200):
+    """Test many commands sent in a single write"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+
+            payload = b''.join(f"ECHO msg{i}\nPING\n".encode() for i in range(num_commands))
+            s.sendall(payload)
+            lines = recv_lines(s, num_commands * 2)
+
+            expected = []
+            for i in range(num_commands):
+                expected += [f"msg{i}", "PONG"]
+            if lines == expected:
+                results.add_pass(f"Pipelined commands ({num_commands * 2} in one write)")
+            else:
+                results.add_fail("Pipelined commands", f"Got {len(lines)} of {len(expected)} replies in order")
+    except Exception as e:
+        results.add_fail("Pipelined commands", str(e))
+
+def bulk_client(num_commands, stop):
+    """Pipeline long ECHO requests until stop is set"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            payload = ("ECHO " + "x" * 1024 + "\n").encode() * num_commands
+            while not stop.is_set():
+                s.sendall(payload)
+                recv_lines(s, num_commands)
+    except Exception:
+        pass
+
+def test_fast_commands_under_load(results, num_bulk=4, num_pings=50):
+    """Test that PINGs stay prompt while other clients flood ECHO"""
+    try:
+        stop = threading.Event()
+        threads = [threading.Thread(target=bulk_client, args=(200, stop)) for _ in range(num_bulk)]
+        for t in threads:
+            t.start()
+        time.sleep(0.2)
+
+        worst = 0.0
+        ok = True
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            # A slow verb first: the connection has to find its way back
+            # to the high lane
+            s.sendall(b"ECHO warmup\n")
+            ok = recv_lines(s, 1) == ["warmup"]
+            for _ in range(num_pings):
+                start = time.monotonic()
+                s.sendall(b"PING\n")
+                if recv_lines(s, 1) != ["PONG"]:
+                    ok = False
+                    break
+                worst = max(worst, time.monotonic() - start)
+
+        stop.set()
+        for t in threads:
+            t.join(timeout=TIMEOUT * 2)
+
+        if ok and worst < 1.0:
+            results.add_pass(f"Fast commands under load (worst PING {worst * 1000:.1f} ms)")
+        else:
+            results.add_fail("Fast commands under load",
+                             f"replies ok: {ok}, worst PING {worst * 1000:.1f} ms")
+    except Exception as e:
+        results.add_fail("Fast commands under load", str(e))
+
+def test_split_command(results):
+    """Test a command split across several writes"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+            for part in (b"EC", b"HO spl", b"it\r\nPI"):
+                s.sendall(part)
+                time.sleep(0.05)
+            s.sendall(b"NG\n")
+            lines = recv_lines(s, 2)
+
+            if lines == ["split", "PONG"]:
+                results.add_pass("Split command across writes")
+            else:
+                results.add_fail("Split command", f"Got {lines}")
+    except Exception as e:
+        results.add_fail("Split command", str(e))
+
+BINARY_MAGIC = b'\xb1'
+BINARY_HEADER = struct.Struct('!BBHII')
+
+def recv_exact(s, size):
+    """Read exactly size bytes"""
+    data = b''
+    while len(data) < size:
+        chunk = s.recv(size - len(data))
+        if not chunk:
+            raise Exception("Connection closed")
+        data += chunk
+    return data
+
+def recv_frame(s):
+    """Read one binary reply as (opcode, status, request id, payload)"""
+    opcode, _, status, request_id, length = BINARY_HEADER.unpack(recv_exact(s, BINARY_HEADER.size))
+    return opcode, status, request_id, recv_exact(s, length)
+
+def test_binary_protocol(results):
+    """Test binary framing, including a payload far larger than a text line"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+
+            large = bytes(range(256)) * 1024
+            frames = [(1, 7, b''), (3, 8, large), (99, 9, b''), (5, 10, b'')]
+            s.sendall(BINARY_MAGIC + b''.join(BINARY_HEADER.pack(op, 0, 0, rid, len(p)) + p
+                                              for op, rid, p in frames))
+            replies = [recv_frame(s) for _ in frames]
+
+            expected = [(1, 0, 7, b'PONG'), (3, 0, 8, large), (99, 1, 9, b'ERROR: Unknown command'),
+                        (5, 0, 10, b'Goodbye')]
+            if replies == expected:
+                results.add_pass("Binary protocol")
+            else:
+                results.add_fail("Binary protocol", f"Got {[r[:3] for r in replies]}")
+    except Exception as e:
+        results.add_fail("Binary protocol", str(e))
+
+def test_stream_echo(results, size=4 * 1024 * 1024):
+    """Test STREAM relaying a payload much larger than any buffer"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+
+            # Send from another thread: the reply arrives while the
+            # payload is still going out
+            payload = bytes(range(251)) * (size // 251 + 1)
+            payload = payload[:size]
+            sender = threading.Thread(target=s.sendall,
+                                      args=(f"STREAM {size}\n".encode() + payload + b"PING\n",))
+            sender.start()
+            header = recv_exact(s, len(f"STREAM {size}\n"))
+            echoed = recv_exact(s, size)
+            after = recv_lines(s, 1)
+            sender.join(timeout=TIMEOUT)
+
+            if header == f"STREAM {size}\n".encode() and echoed == payload and after == ["PONG"]:
+                results.add_pass("Streaming echo")
+            else:
+                results.add_fail("Streaming echo", f"Got header {header!r}, "
+                                 f"payload intact: {echoed == payload}, then {after}")
+    except Exception as e:
+        results.add_fail("Streaming echo", str(e))
+
+def test_idle_connections(results, num_idle=32):
+    """Test that idle connections do not starve new clients"""
+    idle = []
+    try:
+        # Hold more idle connections open than there are worker threads
+        for _ in range(num_idle):
+            s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            idle.append(s)
+
+        response = send_command("PING")
+        if response == "PONG":
+            results.add_pass(f"Idle connections ({num_idle} held open)")
+        else:
+            results.add_fail("Idle connections", f"Expected 'PONG', got '{response}'")
+    except Exception as e:
+        results.add_fail("Idle connections", str(e))
+    finally:
+        for s in idle:
+            s.close()
+
+def test_udp_health_checks(results):
+    """Test the stateless verbs over UDP (UDP_PORT=8080 in the config)"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+            s.settimeout(1.0)
+            s.sendto(b"PING\n", (SERVER_HOST, SERVER_PORT))
+            try:
+                pong = s.recvfrom(2048)[0]
+            except socket.timeout:
+                print("- UDP health checks: no UDP listener, skipped")
+                return
+
+            # Requests go out in one burst so the server sees a batch
+            s.settimeout(TIMEOUT)
+            requests = [b"PING", b"STATS", b"ECHO hi\n"]
+            for request in requests:
+                s.sendto(request, (SERVER_HOST, SERVER_PORT))
+            replies = sorted(s.recvfrom(2048)[0] for _ in requests)
+            expected = sorted([b"PONG\n", b"ERROR: Not available over UDP\n"])
+            stats = [r for r in replies if r.startswith(b"Active clients:")]
+            others = sorted(r for r in replies if not r.startswith(b"Active clients:"))
+            if pong == b"PONG\n" and len(stats) == 1 and others == expected:
+                results.add_pass("UDP health checks")
+            else:
+                results.add_fail("UDP health checks", f"Got {pong!r} then {replies}")
+    except Exception as e:
+        results.add_fail("UDP health checks", str(e))
+
+def test_udp_refused_while_draining(results, port=18080):
+    """Test that UDP probes stop getting PONG once SIGTERM starts the drain"""
+    if not os.access("./server", os.X_OK):
+        print("- UDP during drain: no ./server to start, skipped")
+        return
+    name = "UDP health checks refused while draining"
+    config = tempfile.NamedTemporaryFile("w", suffix=".txt", delete=False)
+    config.write(f"PORT={port}\nUDP_PORT={port}\nDRAIN_TIMEOUT_MS=3000\n"
+                 "WRITE_TIMEOUT_MS=0\nLOG_FILE=\n")
+    config.close()
+    server = subprocess.Popen(["./server", config.name],
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    client = None
+    try:
+        deadline = time.monotonic() + TIMEOUT
+        while client is None:
+            try:
+                # A small receive buffer, so unread replies back up quickly
+                client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                client.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+                client.settimeout(TIMEOUT)
+                client.connect((SERVER_HOST, port))
+            except OSError:
+                client.close()
+                client = None
+                if time.monotonic() > deadline:
+                    raise
+                time.sleep(0.05)
+
+        with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as probe:
+            probe.settimeout(1.0)
+            probe.connect((SERVER_HOST, port))
+            probe.send(b"PING\n")
+            before = probe.recv(2048)
+
+            # A client that does not read its replies keeps the drain going
+            # until DRAIN_TIMEOUT_MS
+            line = b"ECHO " + b"x" * 1024 + b"\n"
+            flood = threading.Thread(target=lambda: client.sendall(line * 4096), daemon=True)
+            flood.start()
+            time.sleep(0.3)
+            server.send_signal(signal.SIGTERM)
+            time.sleep(0.3)
+
+            try:
+                probe.send(b"PING\n")
+                after = probe.recv(2048)
+            except (socket.timeout, ConnectionRefusedError):
+                after = None
+            draining = server.poll() is None
+
+        if before == b"PONG\n" and after is None and draining:
+            results.add_pass(name)
+        else:
+            results.add_fail(name, f"before {before!r}, during drain {after!r}, "
+                             f"server still draining: {draining}")
+    except Exception as e:
+        results.add_fail(name, str(e))
+    finally:
+        if client is not None:
+            client.close()
+        try:
+            server.wait(timeout=TIMEOUT)
+        except subprocess.TimeoutExpired:
+            server.kill()
+            server.wait()
+        os.unlink(config.name)
+
+def test_rate_limits(results, num_commands=5000):
+    """Test commands past the per-IP limit (RATE_LIMIT_COMMANDS under 4000 in the config)"""
+    try:
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            s.settimeout(TIMEOUT)
+            s.connect((SERVER_HOST, SERVER_PORT))
+            s.sendall(b"PING\n" * num_commands)
+            lines = recv_lines(s, num_commands)
+
+        limited = lines.count("ERROR: Rate limited")
+        if limited == 0 and lines.count("PONG") == num_commands:
+            print("- Rate limits: no RATE_LIMIT_COMMANDS, skipped")
+            return
+        # The burst is served first; the rest only as tokens come back
+        if lines[0] == "PONG" and limited + lines.count("PONG") == num_commands:
+            results.add_pass(f"Rate limits ({limited} of {num_commands} commands refused)")
+        else:
+            results.add_fail("Rate limits", f"Got {len(lines)} replies, {limited} refused")
+    except Exception as e:
+        results.add_fail("Rate limits", str(e))
+
 def check_server_running():
     """Check if server is running"""
     try:
@@ -208,17 +695,17 @@ def main():
     print("="*60)
     print("TCP Server Test Suite")
     print("="*60)
-    
+
     # Check if server is running
     if not check_server_running():
         print(f"\n✗ Error: Server is not running on {SERVER_HOST}:{SERVER_PORT}")
         print("Please start the server before running tests.")
         sys.exit(1)
-    
+
     print(f"\n✓ Server is running on {SERVER_HOST}:{SERVER_PORT}\n")
-    
+
     results = TestResults()
-    
+
     # Run basic command tests
     print("Testing Basic Commands:")
     print("-" * 60)
@@ -226,19 +713,35 @@ def main():
     test_time(results)
     test_echo(results)
     test_stats(results)
+    test_stats_detail(results)
+    test_stats_memory(results)
+    test_cache_commands(results)
+    test_cache_failed_set(results)
+    test_pubsub(results)
     test_quit(results)
     test_unknown_command(results)
-    
+    test_command_arguments(results)
+
     # Run connection tests
     print("\nTesting Connection Handling:")
     print("-" * 60)
     test_persistent_connection(results)
+    test_pipelined_commands(results)
+    test_split_command(results)
+    test_binary_protocol(results)
+    test_stream_echo(results)
     test_concurrent_connections(results, num_clients=10)
     test_concurrent_connections(results, num_clients=20)
-    
+    test_fast_commands_under_load(results)
+    test_idle_connections(results)
+    test_udp_health_checks(results)
+    test_udp_refused_while_draining(results)
+    # Last: it uses up this client's command tokens
+    test_rate_limits(results)
+
     # Print summary
     success = results.summary()
-    
+
     sys.exit(0 if success else 1)
 
 if __name__ == "__main__":
@@ -1,17 +1,114 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
 #include "logger.h"
+#include "object_pool.h"
+#include "stats.h"
+#include "clock.h"
+#include "probes.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
-static void* worker_thread(void* arg) {
-    ThreadPool* pool = (ThreadPool*)arg;
+#define DEFAULT_QUEUE_CAPACITY 65536
+#define DEFAULT_DEQUE_CAPACITY 1024
+#define DEFAULT_HIGH_WEIGHT 8
+
+// Empty ring polls before an idle lock-free worker parks on the futex;
+// each pass polls every lane
+#define WORKER_SPIN_COUNT 128
+
+static void futex_wait(atomic_int* addr, int expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_int* addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Worker running on the current thread, if any
+static __thread ThreadPoolWorker* current_worker = NULL;
+
+// Mutex-queue task nodes, shared by every pool in the process
+#define TASKS_PER_SLAB 256
+static ObjectPool* task_pool = NULL;
+static pthread_once_t task_pool_once = PTHREAD_ONCE_INIT;
+
+static void task_pool_init(void) {
+    task_pool = object_pool_create("tasks", sizeof(Task), TASKS_PER_SLAB);
+}
+
+// Numbers pools in worker labels for STATS DETAIL
+static atomic_int pool_counter = 0;
+
+// Run a task, accounting its time to the calling worker
+static inline void run_task(void (*function)(void*), void* arg) {
+    PROBE2(task__dequeue, function, arg);
+    uint64_t start = clock_monotonic_ns();
+    function(arg);
+    stats_add(STATS_BUSY_NS, clock_monotonic_ns() - start);
+    stats_add(STATS_TASKS_RUN, 1);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Account a task taken from a lane against the worker's high streak
+static inline void note_lane(ThreadPoolWorker* self, ThreadPoolPriority prio) {
+    if (prio == THREAD_POOL_PRIO_NORMAL) {
+        self->high_streak = 0;
+    } else if (self->high_streak < self->pool->high_weight) {
+        self->high_streak++;
+    }
+}
+
+// Next task of the mutex queue for this worker, or NULL; called with the
+// queue locked
+static Task* take_task_mutex(ThreadPoolWorker* self) {
+    ThreadPool* pool = self->pool;
+    Task* high = pool->task_queue_head[THREAD_POOL_PRIO_HIGH];
+    Task* normal = self->reserved ? NULL : pool->task_queue_head[THREAD_POOL_PRIO_NORMAL];
+    
+    ThreadPoolPriority prio;
+    if (high != NULL && (normal == NULL || self->high_streak < pool->high_weight)) {
+        prio = THREAD_POOL_PRIO_HIGH;
+    } else if (normal != NULL) {
+        prio = THREAD_POOL_PRIO_NORMAL;
+    } else {
+        return NULL;
+    }
+    
+    Task* task = pool->task_queue_head[prio];
+    pool->task_queue_head[prio] = task->next;
+    if (task->next == NULL) {
+        pool->task_queue_tail[prio] = NULL;
+    }
+    pool->task_queue_length--;
+    note_lane(self, prio);
+    return task;
+}
+
+static void* worker_thread_mutex(ThreadPoolWorker* self) {
+    ThreadPool* pool = self->pool;
+    pthread_cond_t* cond = self->reserved ? &pool->reserved_cond : &pool->queue_cond;
     
     while (1) {
         pthread_mutex_lock(&pool->queue_mutex);
         
-        // Wait for tasks or shutdown signal
-        while (pool->task_queue_head == NULL && !pool->shutdown) {
-            pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
+        // Wait for a task this worker serves or the shutdown signal
+        Task* task = NULL;
+        while (!pool->shutdown && (task = take_task_mutex(self)) == NULL) {
+            pool->reserved_waiting += self->reserved;
+            pthread_cond_wait(cond, &pool->queue_mutex);
+            pool->reserved_waiting -= self->reserved;
         }
         
         // Check for shutdown
@@ -20,51 +117,291 @@ static void* worker_thread(void* arg) {
             break;
         }
         
-        // Get task from queue
-        Task* task = pool->task_queue_head;
-        if (task != NULL) {
-            pool->task_queue_head = task->next;
-            if (pool->task_queue_head == NULL) {
-                pool->task_queue_tail = NULL;
+        pthread_mutex_unlock(&pool->queue_mutex);
+        
+        // Execute task
+        run_task(task->function, task->arg);
+        object_pool_free(task_pool, task);
+    }
+    
+    return NULL;
+}
+
+static unsigned int xorshift32(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Work stealing: own deque first, then the injection ring, then a sweep
+// over the other workers starting at a random victim
+static int find_task_stealing(ThreadPoolWorker* self, WorkFunction* function, void** arg) {
+    ThreadPool* pool = self->pool;
+    
+    if (work_deque_pop(&self->deque, function, arg) == 0) {
+        return 1;
+    }
+    
+    if (task_ring_pop(&pool->rings[THREAD_POOL_PRIO_NORMAL], function, arg) == 0) {
+        return 1;
+    }
+    
+    int count = pool->worker_count;
+    if (count > 1) {
+        int start = (int)(xorshift32(&self->rng) % (unsigned int)count);
+        for (int i = 0; i < count; i++) {
+            int victim = (start + i) % count;
+            if (victim == self->index) {
+                continue;
+            }
+            if (work_deque_steal(&pool->workers[victim].deque, function, arg) == WORK_DEQUE_OK) {
+                return 1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+static int find_normal_task(ThreadPoolWorker* self, WorkFunction* function, void** arg) {
+    if (self->pool->scheduler == THREAD_POOL_SCHED_WORK_STEALING) {
+        return find_task_stealing(self, function, arg);
+    }
+    return task_ring_pop(&self->pool->rings[THREAD_POOL_PRIO_NORMAL], function, arg) == 0;
+}
+
+// The high lane first, unless this worker has used up its streak; then
+// normal work, and the high lane again if there is none
+static int find_task(ThreadPoolWorker* self, WorkFunction* function, void** arg) {
+    ThreadPool* pool = self->pool;
+    TaskRing* high = &pool->rings[THREAD_POOL_PRIO_HIGH];
+    int high_first = self->reserved || self->high_streak < pool->high_weight;
+    
+    if (high_first && task_ring_pop(high, function, arg) == 0) {
+        note_lane(self, THREAD_POOL_PRIO_HIGH);
+        return 1;
+    }
+    if (self->reserved) {
+        return 0;
+    }
+    if (find_normal_task(self, function, arg)) {
+        note_lane(self, THREAD_POOL_PRIO_NORMAL);
+        return 1;
+    }
+    // Idle polls look at each ring once
+    if (!high_first && task_ring_pop(high, function, arg) == 0) {
+        note_lane(self, THREAD_POOL_PRIO_HIGH);
+        return 1;
+    }
+    return 0;
+}
+
+// Worker loop for the lock-free ring and for work stealing
+static void* worker_thread_lockfree(ThreadPoolWorker* self) {
+    ThreadPool* pool = self->pool;
+    atomic_int* park_seq = self->reserved ? &pool->reserved_seq : &pool->park_seq;
+    atomic_int* sleepers = self->reserved ? &pool->reserved_sleepers : &pool->sleepers;
+    WorkFunction function;
+    void* arg;
+    
+    while (!atomic_load(&pool->shutdown)) {
+        // Spin briefly before giving up the CPU
+        int found = 0;
+        for (int i = 0; i < WORKER_SPIN_COUNT / THREAD_POOL_PRIO_COUNT; i++) {
+            if (find_task(self, &function, &arg)) {
+                found = 1;
+                break;
             }
+            cpu_relax();
         }
         
-        pthread_mutex_unlock(&pool->queue_mutex);
+        if (!found) {
+            // Announce ourselves as a sleeper, then re-check for work so a
+            // producer that missed us cannot leave a task behind
+            atomic_fetch_add(sleepers, 1);
+            int seq = atomic_load(park_seq);
+            if (find_task(self, &function, &arg)) {
+                found = 1;
+            } else if (!atomic_load(&pool->shutdown)) {
+                futex_wait(park_seq, seq);
+            }
+            atomic_fetch_sub(sleepers, 1);
+        }
         
-        // Execute task
-        if (task != NULL) {
-            task->function(task->arg);
-            free(task);
+        if (found) {
+            run_task(function, arg);
         }
     }
     
-    log_message(LOG_DEBUG, "Worker thread exiting");
     return NULL;
 }
 
-ThreadPool* thread_pool_create(int num_threads) {
+static void* worker_thread(void* arg) {
+    ThreadPoolWorker* self = (ThreadPoolWorker*)arg;
+    ThreadPool* pool = self->pool;
+    current_worker = self;
+    
+    char label[32];
+    snprintf(label, sizeof(label), "pool%d.worker%d", pool->id, self->index);
+    stats_thread_init(label);
+    
+    if (pool->scheduler == THREAD_POOL_SCHED_WORK_STEALING ||
+        pool->queue_type == THREAD_POOL_QUEUE_LOCKFREE) {
+        worker_thread_lockfree(self);
+    } else {
+        worker_thread_mutex(self);
+    }
+    
+    LOG_DEBUG("Worker thread exiting");
+    return NULL;
+}
+
+void thread_pool_options_init(ThreadPoolOptions* options) {
+    options->queue_type = THREAD_POOL_QUEUE_MUTEX;
+    options->queue_capacity = DEFAULT_QUEUE_CAPACITY;
+    options->scheduler = THREAD_POOL_SCHED_FIFO;
+    options->deque_capacity = DEFAULT_DEQUE_CAPACITY;
+    options->queue_limit = 0;
+    options->cpus = NULL;
+    options->cpu_offset = 0;
+    options->high_weight = DEFAULT_HIGH_WEIGHT;
+    options->reserved_workers = 0;
+}
+
+// Release per-worker state
+static void workers_destroy(ThreadPool* pool) {
+    if (pool->workers == NULL) {
+        return;
+    }
+    for (int i = 0; i < pool->worker_count; i++) {
+        work_deque_destroy(&pool->workers[i].deque);
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+}
+
+static void rings_destroy(ThreadPool* pool) {
+    for (int p = 0; p < THREAD_POOL_PRIO_COUNT; p++) {
+        task_ring_destroy(&pool->rings[p]);
+    }
+}
+
+static int workers_create(ThreadPool* pool, int num_threads, const ThreadPoolOptions* options) {
+    size_t size = sizeof(ThreadPoolWorker) * (size_t)num_threads;
+    pool->workers = (ThreadPoolWorker*)aligned_alloc(CACHE_LINE_SIZE, size);
+    if (pool->workers == NULL) {
+        return -1;
+    }
+    memset(pool->workers, 0, size);
+    
+    long deque_capacity = (options->deque_capacity > 0) ? options->deque_capacity
+                                                        : DEFAULT_DEQUE_CAPACITY;
+    // At least one worker serves the normal lane
+    int reserved = options->reserved_workers;
+    if (reserved > num_threads - 1) {
+        reserved = num_threads - 1;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        ThreadPoolWorker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->cpu = (options->cpus != NULL) ? cpu_list_pick(options->cpus, options->cpu_offset + i)
+                                              : -1;
+        worker->reserved = (i >= num_threads - reserved);
+        worker->rng = 2654435761u * (unsigned int)(i + 1);
+        
+        if (pool->scheduler == THREAD_POOL_SCHED_WORK_STEALING &&
+            work_deque_init(&worker->deque, deque_capacity) != 0) {
+            pool->worker_count = i;
+            workers_destroy(pool);
+            return -1;
+        }
+    }
+    
+    pool->worker_count = num_threads;
+    return 0;
+}
+
+ThreadPool* thread_pool_create(int num_threads, const ThreadPoolOptions* options) {
     if (num_threads <= 0) {
         return NULL;
     }
     
-    ThreadPool* pool = (ThreadPool*)malloc(sizeof(ThreadPool));
+    ThreadPoolOptions defaults;
+    if (options == NULL) {
+        thread_pool_options_init(&defaults);
+        options = &defaults;
+    }
+    
+    // The ring cursors are cache-line aligned, so the pool must be too
+    ThreadPool* pool = (ThreadPool*)aligned_alloc(CACHE_LINE_SIZE, sizeof(ThreadPool));
     if (pool == NULL) {
         return NULL;
     }
+    memset(pool, 0, sizeof(ThreadPool));
     
-    pool->thread_count = num_threads;
-    pool->task_queue_head = NULL;
-    pool->task_queue_tail = NULL;
-    pool->shutdown = 0;
+    pool->id = atomic_fetch_add(&pool_counter, 1);
+    pool->thread_count = 0;
+    pool->queue_type = options->queue_type;
+    pool->scheduler = options->scheduler;
+    pool->high_weight = (options->high_weight > 0) ? options->high_weight : 1;
+    for (int p = 0; p < THREAD_POOL_PRIO_COUNT; p++) {
+        pool->task_queue_head[p] = NULL;
+        pool->task_queue_tail[p] = NULL;
+    }
+    pool->task_queue_limit = options->queue_limit;
+    pool->reserved_waiting = 0;
+    atomic_init(&pool->park_seq, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->reserved_seq, 0);
+    atomic_init(&pool->reserved_sleepers, 0);
+    atomic_init(&pool->shutdown, 0);
     
-    // Initialize mutex and condition variable
+    // Work stealing uses the rings as its injection queues for tasks
+    // submitted from outside the pool
+    if (pool->queue_type == THREAD_POOL_QUEUE_LOCKFREE ||
+        pool->scheduler == THREAD_POOL_SCHED_WORK_STEALING) {
+        size_t capacity = (options->queue_capacity > 0) ? (size_t)options->queue_capacity
+                                                        : DEFAULT_QUEUE_CAPACITY;
+        for (int p = 0; p < THREAD_POOL_PRIO_COUNT; p++) {
+            if (task_ring_init(&pool->rings[p], capacity) != 0) {
+                rings_destroy(pool);
+                free(pool);
+                return NULL;
+            }
+        }
+    }
+    
+    if (workers_create(pool, num_threads, options) != 0) {
+        rings_destroy(pool);
+        free(pool);
+        return NULL;
+    }
+    
+    // Initialize mutex and condition variables
     if (pthread_mutex_init(&pool->queue_mutex, NULL) != 0) {
+        workers_destroy(pool);
+        rings_destroy(pool);
         free(pool);
         return NULL;
     }
     
     if (pthread_cond_init(&pool->queue_cond, NULL) != 0) {
         pthread_mutex_destroy(&pool->queue_mutex);
+        workers_destroy(pool);
+        rings_destroy(pool);
+        free(pool);
+        return NULL;
+    }
+    
+    if (pthread_cond_init(&pool->reserved_cond, NULL) != 0) {
+        pthread_cond_destroy(&pool->queue_cond);
+        pthread_mutex_destroy(&pool->queue_mutex);
+        workers_destroy(pool);
+        rings_destroy(pool);
         free(pool);
         return NULL;
     }
@@ -74,30 +411,56 @@ ThreadPool* thread_pool_create(int num_threads) {
     if (pool->threads == NULL) {
         pthread_mutex_destroy(&pool->queue_mutex);
         pthread_cond_destroy(&pool->queue_cond);
+        pthread_cond_destroy(&pool->reserved_cond);
+        workers_destroy(pool);
+        rings_destroy(pool);
         free(pool);
         return NULL;
     }
     
-    // Create worker threads
+    // Create worker threads, already on their CPUs so the stats slot,
+    // object caches and slabs they allocate are on the local NUMA node
     for (int i = 0; i < num_threads; i++) {
-        if (pthread_create(&pool->threads[i], NULL, worker_thread, pool) != 0) {
-            log_message(LOG_ERROR, "Failed to create worker thread %d", i);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (cpu_affinity_attr(&attr, pool->workers[i].cpu) != 0) {
+            LOG_ERROR("Cannot pin worker thread %d to CPU %d", i, pool->workers[i].cpu);
+            pool->workers[i].cpu = -1;
+        }
+        int rc = pthread_create(&pool->threads[i], &attr, worker_thread, &pool->workers[i]);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            LOG_ERROR("Failed to create worker thread %d", i);
             thread_pool_destroy(pool);
             return NULL;
         }
-        log_message(LOG_DEBUG, "Created worker thread %d", i);
+        pool->thread_count++;
+        LOG_DEBUG("Created worker thread %d", i);
     }
     
-    log_message(LOG_INFO, "Thread pool created with %d threads", num_threads);
+    const char* mode = "mutex queue";
+    if (pool->scheduler == THREAD_POOL_SCHED_WORK_STEALING) {
+        mode = "work stealing";
+    } else if (pool->queue_type == THREAD_POOL_QUEUE_LOCKFREE) {
+        mode = "lock-free queue";
+    }
+    int reserved = 0;
+    for (int i = 0; i < num_threads; i++) {
+        reserved += pool->workers[i].reserved;
+    }
+    if (reserved > 0) {
+        LOG_INFO("Thread pool created with %d threads (%s, %d for the high lane only)",
+                 num_threads, mode, reserved);
+    } else {
+        LOG_INFO("Thread pool created with %d threads (%s)", num_threads, mode);
+    }
     return pool;
 }
 
-int thread_pool_add_task(ThreadPool* pool, void (*function)(void*), void* arg) {
-    if (pool == NULL || function == NULL) {
-        return -1;
-    }
-    
-    Task* task = (Task*)malloc(sizeof(Task));
+static int add_task_mutex(ThreadPool* pool, void (*function)(void*), void* arg,
+                          ThreadPoolPriority prio) {
+    pthread_once(&task_pool_once, task_pool_init);
+    Task* task = (Task*)object_pool_alloc(task_pool);
     if (task == NULL) {
         return -1;
     }
@@ -110,27 +473,151 @@ int thread_pool_add_task(ThreadPool* pool, void (*function)(void*), void* arg) {
     
     if (pool->shutdown) {
         pthread_mutex_unlock(&pool->queue_mutex);
-        free(task);
+        object_pool_free(task_pool, task);
         return -1;
     }
     
-    // Add task to queue
-    if (pool->task_queue_tail == NULL) {
-        pool->task_queue_head = task;
-        pool->task_queue_tail = task;
+    if (pool->task_queue_limit > 0 && pool->task_queue_length >= pool->task_queue_limit) {
+        pthread_mutex_unlock(&pool->queue_mutex);
+        object_pool_free(task_pool, task);
+        return THREAD_POOL_FULL;
+    }
+    
+    // Add task to its lane
+    if (pool->task_queue_tail[prio] == NULL) {
+        pool->task_queue_head[prio] = task;
     } else {
-        pool->task_queue_tail->next = task;
-        pool->task_queue_tail = task;
+        pool->task_queue_tail[prio]->next = task;
     }
+    pool->task_queue_tail[prio] = task;
+    pool->task_queue_length++;
     
-    // Signal a worker thread
-    pthread_cond_signal(&pool->queue_cond);
+    // Signal a worker thread, a reserved one if it is free for the task
+    if (prio == THREAD_POOL_PRIO_HIGH && pool->reserved_waiting > 0) {
+        pthread_cond_signal(&pool->reserved_cond);
+    } else {
+        pthread_cond_signal(&pool->queue_cond);
+    }
     
     pthread_mutex_unlock(&pool->queue_mutex);
     
     return 0;
 }
 
+// Wake a parked worker after publishing a task to the given lane; high
+// tasks go to a parked reserved worker if there is one
+static void wake_sleeper(ThreadPool* pool, ThreadPoolPriority prio) {
+    // Only pay for a futex wake when a worker is actually parked. The
+    // fence orders the push before the sleeper check, pairing with the
+    // sleeper's increment before its final re-check of the ring.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (prio == THREAD_POOL_PRIO_HIGH && atomic_load(&pool->reserved_sleepers) > 0) {
+        atomic_fetch_add(&pool->reserved_seq, 1);
+        futex_wake(&pool->reserved_seq, 1);
+    } else if (atomic_load(&pool->sleepers) > 0) {
+        atomic_fetch_add(&pool->park_seq, 1);
+        futex_wake(&pool->park_seq, 1);
+    }
+}
+
+static int add_task_lockfree(ThreadPool* pool, void (*function)(void*), void* arg,
+                             ThreadPoolPriority prio) {
+    if (atomic_load(&pool->shutdown)) {
+        return -1;
+    }
+    
+    if (task_ring_push(&pool->rings[prio], function, arg) != 0) {
+        return THREAD_POOL_FULL;
+    }
+    
+    wake_sleeper(pool, prio);
+    return 0;
+}
+
+static int add_task_stealing(ThreadPool* pool, void (*function)(void*), void* arg,
+                             ThreadPoolPriority prio) {
+    ThreadPoolWorker* self = current_worker;
+    
+    // A worker resubmitting to its own pool keeps the task local. High
+    // tasks are shared instead: a deque is only served after the high
+    // lane. So are a reserved worker's normal tasks, since it never pops
+    // its own deque.
+    if (prio == THREAD_POOL_PRIO_NORMAL && self != NULL && self->pool == pool &&
+        !self->reserved && !atomic_load(&pool->shutdown) &&
+        work_deque_push(&self->deque, function, arg) == 0) {
+        wake_sleeper(pool, prio);
+        return 0;
+    }
+    
+    return add_task_lockfree(pool, function, arg, prio);
+}
+
+int thread_pool_add_task_prio(ThreadPool* pool, void (*function)(void*), void* arg,
+                              ThreadPoolPriority prio) {
+    if (pool == NULL || function == NULL || prio < 0 || prio >= THREAD_POOL_PRIO_COUNT) {
+        return -1;
+    }
+    
+    // Before the push: a worker may dequeue the task at once
+    PROBE2(task__enqueue, function, arg);
+    if (pool->scheduler == THREAD_POOL_SCHED_WORK_STEALING) {
+        return add_task_stealing(pool, function, arg, prio);
+    }
+    if (pool->queue_type == THREAD_POOL_QUEUE_LOCKFREE) {
+        return add_task_lockfree(pool, function, arg, prio);
+    }
+    return add_task_mutex(pool, function, arg, prio);
+}
+
+int thread_pool_add_task(ThreadPool* pool, void (*function)(void*), void* arg) {
+    return thread_pool_add_task_prio(pool, function, arg, THREAD_POOL_PRIO_NORMAL);
+}
+
+long thread_pool_queue_depth(void* arg) {
+    ThreadPool* pool = (ThreadPool*)arg;
+    long depth = 0;
+    
+    if (pool->scheduler == THREAD_POOL_SCHED_WORK_STEALING ||
+        pool->queue_type == THREAD_POOL_QUEUE_LOCKFREE) {
+        for (int p = 0; p < THREAD_POOL_PRIO_COUNT; p++) {
+            depth += (long)task_ring_size(&pool->rings[p]);
+        }
+        for (int i = 0; i < pool->worker_count; i++) {
+            WorkDeque* deque = &pool->workers[i].deque;
+            long size = atomic_load_explicit(&deque->bottom, memory_order_relaxed) -
+                        atomic_load_explicit(&deque->top, memory_order_relaxed);
+            if (size > 0) {
+                depth += size;
+            }
+        }
+    } else {
+        pthread_mutex_lock(&pool->queue_mutex);
+        depth = pool->task_queue_length;
+        pthread_mutex_unlock(&pool->queue_mutex);
+    }
+    
+    return depth;
+}
+
+long thread_pool_high_depth(void* arg) {
+    ThreadPool* pool = (ThreadPool*)arg;
+    long depth = 0;
+    
+    if (pool->scheduler == THREAD_POOL_SCHED_WORK_STEALING ||
+        pool->queue_type == THREAD_POOL_QUEUE_LOCKFREE) {
+        depth = (long)task_ring_size(&pool->rings[THREAD_POOL_PRIO_HIGH]);
+    } else {
+        pthread_mutex_lock(&pool->queue_mutex);
+        for (Task* task = pool->task_queue_head[THREAD_POOL_PRIO_HIGH]; task != NULL;
+             task = task->next) {
+            depth++;
+        }
+        pthread_mutex_unlock(&pool->queue_mutex);
+    }
+    
+    return depth;
+}
+
 void thread_pool_destroy(ThreadPool* pool) {
     if (pool == NULL) {
         return;
@@ -138,10 +625,16 @@ void thread_pool_destroy(ThreadPool* pool) {
     
     // Signal shutdown
     pthread_mutex_lock(&pool->queue_mutex);
-    pool->shutdown = 1;
+    atomic_store(&pool->shutdown, 1);
     pthread_cond_broadcast(&pool->queue_cond);
+    pthread_cond_broadcast(&pool->reserved_cond);
     pthread_mutex_unlock(&pool->queue_mutex);
     
+    atomic_fetch_add(&pool->park_seq, 1);
+    futex_wake(&pool->park_seq, INT_MAX);
+    atomic_fetch_add(&pool->reserved_seq, 1);
+    futex_wake(&pool->reserved_seq, INT_MAX);
+    
     // Wait for all threads to finish
     for (int i = 0; i < pool->thread_count; i++) {
         pthread_join(pool->threads[i], NULL);
@@ -149,21 +642,26 @@ void thread_pool_destroy(ThreadPool* pool) {
     
     // Clean up remaining tasks
     pthread_mutex_lock(&pool->queue_mutex);
-    Task* task = pool->task_queue_head;
-    while (task != NULL) {
-        Task* next = task->next;
-        free(task);
-        task = next;
+    for (int p = 0; p < THREAD_POOL_PRIO_COUNT; p++) {
+        Task* task = pool->task_queue_head[p];
+        while (task != NULL) {
+            Task* next = task->next;
+            object_pool_free(task_pool, task);
+            task = next;
+        }
     }
     pthread_mutex_unlock(&pool->queue_mutex);
     
     // Destroy synchronization primitives
     pthread_mutex_destroy(&pool->queue_mutex);
     pthread_cond_destroy(&pool->queue_cond);
+    pthread_cond_destroy(&pool->reserved_cond);
     
     // Free resources
+    workers_destroy(pool);
+    rings_destroy(pool);
     free(pool->threads);
     free(pool);
     
-    log_message(LOG_INFO, "Thread pool destroyed");
+    LOG_INFO("Thread pool destroyed");
 }
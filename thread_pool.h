@@ -2,6 +2,10 @@
 #define THREAD_POOL_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include "task_ring.h"
+#include "work_deque.h"
+#include "cpu_affinity.h"
 
 // Task structure for the queue
 typedef struct Task {
@@ -10,26 +14,117 @@ typedef struct Task {
     struct Task* next;
 } Task;
 
-// Thread pool structure
+// Task queue implementations
+typedef enum {
+    THREAD_POOL_QUEUE_MUTEX,     // linked list behind a mutex and condvar
+    THREAD_POOL_QUEUE_LOCKFREE   // bounded lock-free ring, futex parking
+} ThreadPoolQueueType;
+
+// Scheduling policies
+typedef enum {
+    THREAD_POOL_SCHED_FIFO,          // every worker serves the shared queue
+    THREAD_POOL_SCHED_WORK_STEALING  // per-worker deques plus random stealing
+} ThreadPoolScheduler;
+
+// Lanes of the task queue. Workers serve the high lane first, but take a
+// normal task after high_weight high ones in a row while normal tasks
+// wait, so neither lane starves.
+typedef enum {
+    THREAD_POOL_PRIO_HIGH,       // short, latency-critical (health checks)
+    THREAD_POOL_PRIO_NORMAL,     // everything else; thread_pool_add_task()
+    THREAD_POOL_PRIO_COUNT
+} ThreadPoolPriority;
+
+// Options for thread_pool_create(); NULL selects the defaults
+typedef struct {
+    ThreadPoolQueueType queue_type;
+    int queue_capacity;          // ring slots for THREAD_POOL_QUEUE_LOCKFREE
+    ThreadPoolScheduler scheduler;
+    int deque_capacity;          // per-worker slots for work stealing
+    int queue_limit;             // most tasks waiting in the mutex queue; 0 = no limit
+    const CpuList* cpus;         // pin worker i to cpus[cpu_offset + i]; NULL = unpinned
+    int cpu_offset;
+    int high_weight;             // high-lane tasks per normal one when both wait
+    int reserved_workers;        // the last this many serve the high lane only
+} ThreadPoolOptions;
+
+// thread_pool_add_task() result when the queue is at its limit
+#define THREAD_POOL_FULL (-2)
+
+struct ThreadPool;
+
+// Per-worker state. Under work stealing, tasks a worker submits to its
+// own pool go to the bottom of its deque and are popped LIFO, so state
+// they touch is still in that core's cache.
 typedef struct {
+    struct ThreadPool* pool;
+    int index;
+    int cpu;                     // CPU the worker is pinned to, or -1
+    int reserved;                // serves the high lane only
+    int high_streak;             // high-lane tasks run since the last normal one
+    unsigned int rng;
+    WorkDeque deque;
+} ThreadPoolWorker;
+
+// Thread pool structure
+typedef struct ThreadPool {
+    int id;
     pthread_t* threads;
     int thread_count;
+    ThreadPoolQueueType queue_type;
+    ThreadPoolScheduler scheduler;
     
-    Task* task_queue_head;
-    Task* task_queue_tail;
+    ThreadPoolWorker* workers;
+    int worker_count;
+    int high_weight;
+    
+    // Mutex queue, one list per lane; the limit covers both
+    Task* task_queue_head[THREAD_POOL_PRIO_COUNT];
+    Task* task_queue_tail[THREAD_POOL_PRIO_COUNT];
+    int task_queue_length;
+    int task_queue_limit;
     
     pthread_mutex_t queue_mutex;
     pthread_cond_t queue_cond;
+    pthread_cond_t reserved_cond;   // reserved workers wait here
+    int reserved_waiting;
+    
+    // Lock-free queue per lane (also the injection queues for work
+    // stealing) and idle parking. Reserved workers park separately, so a
+    // wakeup for normal work never lands on one.
+    TaskRing rings[THREAD_POOL_PRIO_COUNT];
+    alignas(CACHE_LINE_SIZE) atomic_int park_seq;
+    atomic_int sleepers;
+    alignas(CACHE_LINE_SIZE) atomic_int reserved_seq;
+    atomic_int reserved_sleepers;
     
-    int shutdown;
+    atomic_int shutdown;
 } ThreadPool;
 
+// Fill in the default options
+void thread_pool_options_init(ThreadPoolOptions* options);
+
 // Create and initialize thread pool
-ThreadPool* thread_pool_create(int num_threads);
+ThreadPool* thread_pool_create(int num_threads, const ThreadPoolOptions* options);
 
-// Add a task to the queue
+// Add a task to the queue. Returns 0 on success, THREAD_POOL_FULL if the
+// queue is at its limit (the ring's capacity for the lock-free queue) and
+// -1 on other failures, such as a pool that is shutting down.
 int thread_pool_add_task(ThreadPool* pool, void (*function)(void*), void* arg);
 
+// Same, in the given lane; thread_pool_add_task() uses the normal lane.
+// Under work stealing a worker's own normal tasks stay on its deque,
+// unless it is reserved, and high ones always go to the shared high lane.
+int thread_pool_add_task_prio(ThreadPool* pool, void (*function)(void*), void* arg,
+                              ThreadPoolPriority prio);
+
+// Tasks waiting to run (approximate); takes a ThreadPool* as void* so it
+// can be registered as a stats gauge
+long thread_pool_queue_depth(void* arg);
+
+// Of those, the tasks waiting in the high lane
+long thread_pool_high_depth(void* arg);
+
 // Shutdown and destroy thread pool
 void thread_pool_destroy(ThreadPool* pool);
 
@@ -0,0 +1,108 @@
+#include "timer_wheel.h"
+#include <stdlib.h>
+
+int timer_wheel_init(TimerWheel* wheel, size_t slots, uint64_t tick_ms, uint64_t now_ms) {
+    size_t count = 1;
+    while (count < slots) {
+        count <<= 1;
+    }
+    
+    wheel->slots = (TimerEntry*)malloc(count * sizeof(TimerEntry));
+    if (wheel->slots == NULL) {
+        return -1;
+    }
+    // Each head is the sentinel of a circular list
+    for (size_t i = 0; i < count; i++) {
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+    }
+    
+    wheel->mask = count - 1;
+    wheel->tick_ms = (tick_ms > 0) ? tick_ms : 1;
+    wheel->current = now_ms / wheel->tick_ms;
+    wheel->count = 0;
+    return 0;
+}
+
+void timer_wheel_destroy(TimerWheel* wheel) {
+    free(wheel->slots);
+    wheel->slots = NULL;
+}
+
+static void unlink_entry(TimerEntry* entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+void timer_wheel_arm(TimerWheel* wheel, TimerEntry* entry, uint64_t due_ms) {
+    if (timer_entry_armed(entry)) {
+        unlink_entry(entry);
+        wheel->count--;
+    }
+    
+    uint64_t expires = (due_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    if (expires <= wheel->current) {
+        expires = wheel->current + 1;
+    }
+    entry->expires = expires;
+    
+    // Insert at the head so an entry re-armed from a callback is not
+    // visited again by the walk of the same slot
+    TimerEntry* head = &wheel->slots[expires & wheel->mask];
+    entry->next = head->next;
+    entry->prev = head;
+    head->next->prev = entry;
+    head->next = entry;
+    wheel->count++;
+}
+
+void timer_wheel_cancel(TimerWheel* wheel, TimerEntry* entry) {
+    if (timer_entry_armed(entry)) {
+        unlink_entry(entry);
+        wheel->count--;
+    }
+}
+
+int timer_wheel_advance(TimerWheel* wheel, uint64_t now_ms, TimerCallback callback, void* arg) {
+    uint64_t target = now_ms / wheel->tick_ms;
+    if (target <= wheel->current) {
+        return 0;
+    }
+    
+    // After a long stall one pass over every slot finds all due entries
+    uint64_t steps = target - wheel->current;
+    if (steps > wheel->mask + 1) {
+        steps = wheel->mask + 1;
+    }
+    
+    int fired = 0;
+    uint64_t first = wheel->current + 1;
+    for (uint64_t i = 0; i < steps; i++) {
+        uint64_t tick = first + i;
+        TimerEntry* head = &wheel->slots[tick & wheel->mask];
+        wheel->current = (i + 1 == steps) ? target : tick;
+        
+        TimerEntry* entry = head->next;
+        while (entry != head) {
+            TimerEntry* next = entry->next;
+            if (entry->expires <= target) {
+                unlink_entry(entry);
+                wheel->count--;
+                callback(entry, now_ms, arg);
+                fired++;
+            }
+            entry = next;
+        }
+    }
+    return fired;
+}
+
+int timer_wheel_timeout(const TimerWheel* wheel, uint64_t now_ms) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+    uint64_t next_ms = (wheel->current + 1) * wheel->tick_ms;
+    return (next_ms > now_ms) ? (int)(next_ms - now_ms) : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Intrusive timer, embedded in the object it times out
+typedef struct TimerEntry {
+    struct TimerEntry* next;
+    struct TimerEntry* prev;
+    uint64_t expires;       // tick the entry fires on
+} TimerEntry;
+
+// Called for every entry that expires, after it has been unlinked; the
+// callback may re-arm it
+typedef void (*TimerCallback)(TimerEntry* entry, uint64_t now_ms, void* arg);
+
+// Hashed timing wheel: one list per tick, an entry due further out than
+// one revolution stays in its slot until the wheel comes round to its
+// tick. Arming and cancelling are O(1); a tick only visits one slot.
+// Single-threaded: only the owning event loop may touch the wheel.
+typedef struct {
+    TimerEntry* slots;      // list heads
+    uint64_t mask;
+    uint64_t tick_ms;
+    uint64_t current;       // last tick processed
+    size_t count;           // armed entries
+} TimerWheel;
+
+// Set up a wheel of slots lists (rounded up to a power of two) that
+// advances every tick_ms. Returns 0 on success, -1 on allocation failure.
+int timer_wheel_init(TimerWheel* wheel, size_t slots, uint64_t tick_ms, uint64_t now_ms);
+
+// Free the slots; armed entries are forgotten, not called
+void timer_wheel_destroy(TimerWheel* wheel);
+
+static inline void timer_entry_init(TimerEntry* entry) {
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+static inline int timer_entry_armed(const TimerEntry* entry) {
+    return entry->next != NULL;
+}
+
+// Fire entry once due_ms has passed, rounded up to the next tick. An
+// armed entry is moved.
+void timer_wheel_arm(TimerWheel* wheel, TimerEntry* entry, uint64_t due_ms);
+
+// Disarm entry; does nothing if it is not armed
+void timer_wheel_cancel(TimerWheel* wheel, TimerEntry* entry);
+
+// Run the callback for every entry due by now_ms. Returns the number of
+// entries that fired.
+int timer_wheel_advance(TimerWheel* wheel, uint64_t now_ms, TimerCallback callback, void* arg);
+
+// Milliseconds until the next tick, for use as a poll timeout; -1 when
+// nothing is armed
+int timer_wheel_timeout(const TimerWheel* wheel, uint64_t now_ms);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,359 @@
+#include "tls.h"
+#include "logger.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/tls.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+// TLS 1.2 suites the kernel can take over: AEADs only
+#define TLS_CIPHER_LIST "ECDHE+AESGCM:ECDHE+CHACHA20"
+
+#define TLS_TRAFFIC_SECRET_LABEL "CLIENT_TRAFFIC_SECRET_0 "
+
+struct TlsHandshake {
+    SSL* ssl;
+    int fd;
+    // The client's first application traffic secret, from the key log.
+    // OpenSSL 3.0 offloads only sending under TLS 1.3, so the receive
+    // keys are derived from it and installed here.
+    unsigned char rx_secret[EVP_MAX_MD_SIZE];
+    size_t rx_secret_len;
+};
+
+static SSL_CTX* tls_ctx = NULL;
+
+// Reason for the most recent OpenSSL failure
+static const char* last_error(void) {
+    unsigned long error = ERR_get_error();
+    ERR_clear_error();
+    return (error != 0) ? ERR_reason_error_string(error) : "unknown error";
+}
+
+// Whether the kernel has the "tls" upper layer protocol. It can only be
+// attached to a connected socket, so try a loopback connection; asking
+// also loads the module on demand.
+static int kernel_tls_available(void) {
+    int available = 0;
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int accepted = -1;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    if (listener >= 0 && client >= 0 &&
+        bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        listen(listener, 1) == 0 &&
+        getsockname(listener, (struct sockaddr*)&addr, &len) == 0 &&
+        connect(client, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        accepted = accept(listener, NULL, NULL);
+        if (setsockopt(client, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+            available = 1;
+        } else {
+            LOG_ERROR("Kernel TLS not available: %s (is the tls module loaded?)",
+                      strerror(errno));
+        }
+    } else {
+        LOG_ERROR("Cannot probe for kernel TLS: %s", strerror(errno));
+    }
+    
+    if (accepted >= 0) {
+        close(accepted);
+    }
+    if (client >= 0) {
+        close(client);
+    }
+    if (listener >= 0) {
+        close(listener);
+    }
+    return available;
+}
+
+// Keep the secret the receive keys are derived from, if OpenSSL does
+// not install them itself
+static void keylog(const SSL* ssl, const char* line) {
+    size_t prefix = strlen(TLS_TRAFFIC_SECRET_LABEL);
+    if (strncmp(line, TLS_TRAFFIC_SECRET_LABEL, prefix) != 0) {
+        return;
+    }
+    TlsHandshake* handshake = (TlsHandshake*)SSL_get_app_data(ssl);
+    const char* hex = strrchr(line, ' ');
+    if (handshake == NULL || hex == NULL) {
+        return;
+    }
+    
+    hex++;
+    size_t len = strlen(hex) / 2;
+    if (len > sizeof(handshake->rx_secret)) {
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return;
+        }
+        handshake->rx_secret[i] = (unsigned char)byte;
+    }
+    handshake->rx_secret_len = len;
+}
+
+int tls_init(const char* cert_file, const char* key_file, int session_cache) {
+    if (cert_file[0] == '\0' || key_file[0] == '\0') {
+        LOG_ERROR("TLS listeners need TLS_CERT_FILE and TLS_KEY_FILE");
+        return -1;
+    }
+    if (!kernel_tls_available()) {
+        return -1;
+    }
+    
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        LOG_ERROR("SSL_CTX_new() failed: %s", last_error());
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                             SSL_OP_NO_COMPRESSION);
+    if (SSL_CTX_set_cipher_list(ctx, TLS_CIPHER_LIST) != 1) {
+        LOG_ERROR("No usable TLS 1.2 ciphers: %s", last_error());
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1) {
+        LOG_ERROR("Cannot load certificate %s: %s", cert_file, last_error());
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        LOG_ERROR("Cannot load key %s: %s", key_file, last_error());
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    
+    // Tickets resume without server state; the cache covers clients that
+    // send a session ID instead
+    static const unsigned char session_context[] = "tcpserver";
+    SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+    if (session_cache > 0) {
+        SSL_CTX_sess_set_cache_size(ctx, session_cache);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_keylog_callback(ctx, keylog);
+    
+    tls_ctx = ctx;
+    return 0;
+}
+
+void tls_cleanup(void) {
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+}
+
+TlsHandshake* tls_accept(int fd) {
+    TlsHandshake* handshake = (TlsHandshake*)calloc(1, sizeof(TlsHandshake));
+    if (handshake == NULL) {
+        LOG_ERROR("malloc() failed for TLS handshake");
+        return NULL;
+    }
+    handshake->fd = fd;
+    handshake->ssl = SSL_new(tls_ctx);
+    if (handshake->ssl == NULL || SSL_set_fd(handshake->ssl, fd) != 1) {
+        LOG_ERROR("SSL_new() failed: %s", last_error());
+        tls_free(handshake);
+        return NULL;
+    }
+    SSL_set_app_data(handshake->ssl, handshake);
+    SSL_set_accept_state(handshake->ssl);
+    return handshake;
+}
+
+// HKDF-Expand-Label (RFC 8446 section 7.1) with an empty context
+static int expand_label(const EVP_MD* md, const unsigned char* secret, size_t secret_len,
+                        const char* label, unsigned char* out, size_t out_len) {
+    unsigned char info[64];
+    size_t label_len = strlen(label);
+    size_t n = 0;
+    info[n++] = (unsigned char)(out_len >> 8);
+    info[n++] = (unsigned char)out_len;
+    info[n++] = (unsigned char)(6 + label_len);
+    memcpy(info + n, "tls13 ", 6);
+    n += 6;
+    memcpy(info + n, label, label_len);
+    n += label_len;
+    info[n++] = 0;
+    
+    EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    int ok = pctx != NULL &&
+             EVP_PKEY_derive_init(pctx) > 0 &&
+             EVP_PKEY_CTX_set_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+             EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+             EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, (int)secret_len) > 0 &&
+             EVP_PKEY_CTX_add1_hkdf_info(pctx, info, (int)n) > 0 &&
+             EVP_PKEY_derive(pctx, out, &out_len) > 0;
+    EVP_PKEY_CTX_free(pctx);
+    return ok ? 0 : -1;
+}
+
+// Install the TLS 1.3 receive keys. The handshake read nothing past the
+// client's Finished, so the next record is the first under these keys.
+static int install_receive_keys(TlsHandshake* handshake) {
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(handshake->ssl);
+    if (SSL_version(handshake->ssl) != TLS1_3_VERSION || cipher == NULL ||
+        handshake->rx_secret_len == 0 || SSL_has_pending(handshake->ssl)) {
+        return -1;
+    }
+    const EVP_MD* md = SSL_CIPHER_get_handshake_digest(cipher);
+    
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    memset(&info, 0, sizeof(info));
+    unsigned char* key;
+    size_t key_len;
+    unsigned char* salt;
+    size_t salt_len;
+    unsigned char* iv;
+    size_t info_len;
+    
+    switch (SSL_CIPHER_get_protocol_id(cipher)) {
+    case 0x1301:     // TLS_AES_128_GCM_SHA256
+        info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        key = info.aes128.key;
+        key_len = sizeof(info.aes128.key);
+        salt = info.aes128.salt;
+        salt_len = sizeof(info.aes128.salt);
+        iv = info.aes128.iv;
+        info_len = sizeof(info.aes128);
+        break;
+    case 0x1302:     // TLS_AES_256_GCM_SHA384
+        info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        key = info.aes256.key;
+        key_len = sizeof(info.aes256.key);
+        salt = info.aes256.salt;
+        salt_len = sizeof(info.aes256.salt);
+        iv = info.aes256.iv;
+        info_len = sizeof(info.aes256);
+        break;
+    case 0x1303:     // TLS_CHACHA20_POLY1305_SHA256
+        info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        key = info.chacha.key;
+        key_len = sizeof(info.chacha.key);
+        salt = NULL;
+        salt_len = 0;
+        iv = info.chacha.iv;
+        info_len = sizeof(info.chacha);
+        break;
+    default:
+        return -1;
+    }
+    info.aes128.info.version = TLS_1_3_VERSION;
+    
+    // The kernel splits the 12-byte nonce base into salt and IV
+    unsigned char nonce[12];
+    if (expand_label(md, handshake->rx_secret, handshake->rx_secret_len, "key",
+                     key, key_len) < 0 ||
+        expand_label(md, handshake->rx_secret, handshake->rx_secret_len, "iv",
+                     nonce, sizeof(nonce)) < 0) {
+        return -1;
+    }
+    if (salt_len > 0) {
+        memcpy(salt, nonce, salt_len);
+    }
+    memcpy(iv, nonce + salt_len, sizeof(nonce) - salt_len);
+    
+    int rc = setsockopt(handshake->fd, SOL_TLS, TLS_RX, &info, (socklen_t)info_len);
+    OPENSSL_cleanse(&info, sizeof(info));
+    OPENSSL_cleanse(handshake->rx_secret, sizeof(handshake->rx_secret));
+    return (rc == 0) ? 0 : -1;
+}
+
+TlsHandshakeResult tls_handshake(TlsHandshake* handshake, const char* ip, int port) {
+    ERR_clear_error();
+    errno = 0;
+    int rc = SSL_do_handshake(handshake->ssl);
+    if (rc != 1) {
+        int error = SSL_get_error(handshake->ssl, rc);
+        if (error == SSL_ERROR_WANT_READ) {
+            return TLS_HANDSHAKE_WANT_READ;
+        }
+        if (error == SSL_ERROR_WANT_WRITE) {
+            return TLS_HANDSHAKE_WANT_WRITE;
+        }
+        // Scanners and clients hanging up mid-handshake are routine
+        const char* reason = (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0)
+                             ? ((errno != 0) ? strerror(errno) : "connection closed")
+                             : last_error();
+        LOG_INFO("TLS handshake with %s:%d failed: %s", ip, port, reason);
+        stats_add(STATS_TLS_FAILURES, 1);
+        return TLS_HANDSHAKE_FAILED;
+    }
+    
+    // Sending needs the kernel as much as receiving: nothing is left to
+    // encrypt in user space once the handshake state is freed
+    const char* cipher = SSL_get_cipher_name(handshake->ssl);
+    if (!BIO_get_ktls_send(SSL_get_wbio(handshake->ssl)) ||
+        (!BIO_get_ktls_recv(SSL_get_rbio(handshake->ssl)) &&
+         install_receive_keys(handshake) < 0)) {
+        LOG_ERROR("Kernel TLS refused %s %s for %s:%d, closing",
+                  SSL_get_version(handshake->ssl), cipher, ip, port);
+        stats_add(STATS_TLS_FAILURES, 1);
+        return TLS_HANDSHAKE_FAILED;
+    }
+    
+    int resumed = SSL_session_reused(handshake->ssl);
+    stats_add(STATS_TLS_HANDSHAKES, 1);
+    if (resumed) {
+        stats_add(STATS_TLS_RESUMED, 1);
+    }
+    LOG_DEBUG("TLS %s %s with %s:%d%s", SSL_get_version(handshake->ssl), cipher,
+              ip, port, resumed ? " (resumed)" : "");
+    return TLS_HANDSHAKE_DONE;
+}
+
+void tls_free(TlsHandshake* handshake) {
+    if (handshake == NULL) {
+        return;
+    }
+    // SSL_set_fd() leaves the descriptor open when the SSL goes
+    SSL_free(handshake->ssl);
+    OPENSSL_cleanse(handshake->rx_secret, sizeof(handshake->rx_secret));
+    free(handshake);
+}
+
+void tls_close_notify(int fd) {
+    static unsigned char alert[2] = { 1, 0 };   // warning, close_notify
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    struct iovec iov = { alert, sizeof(alert) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    // The record type rides in a control message; 21 is alert
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = 21;
+    sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
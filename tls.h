@@ -0,0 +1,44 @@
+#ifndef TLS_H
+#define TLS_H
+
+// TLS for listeners whose socket profile sets TLS=1 (make TLS=1). OpenSSL
+// runs the handshake only: the session keys then go to kernel TLS
+// (TLS_TX/TLS_RX) and the OpenSSL state is freed, so from there on the
+// connection is a plain socket whose send(), recv(), sendmsg() and
+// splice() the kernel encrypts. One context serves every shard, so a
+// reconnecting client resumes its session (ticket or cache) whichever
+// shard it lands on.
+
+typedef struct TlsHandshake TlsHandshake;
+
+typedef enum {
+    TLS_HANDSHAKE_DONE,         // kernel TLS carries the connection both ways
+    TLS_HANDSHAKE_WANT_READ,
+    TLS_HANDSHAKE_WANT_WRITE,
+    TLS_HANDSHAKE_FAILED        // logged; close the connection
+} TlsHandshakeResult;
+
+// Load the certificate chain and key and check that the kernel offers
+// TLS; call before the server starts accepting clients. session_cache
+// bounds the sessions kept for resumption (0 turns the cache off, leaving
+// session tickets). Returns 0 on success, -1 on failure (logged).
+int tls_init(const char* cert_file, const char* key_file, int session_cache);
+
+// Free the context once no handshake is left
+void tls_cleanup(void);
+
+// Start the server side of a handshake on an accepted socket; NULL on
+// failure (logged)
+TlsHandshake* tls_accept(int fd);
+
+// Advance the handshake as far as the socket allows. ip and port name the
+// peer in logs.
+TlsHandshakeResult tls_handshake(TlsHandshake* handshake, const char* ip, int port);
+
+// Release the OpenSSL state; the socket is left open
+void tls_free(TlsHandshake* handshake);
+
+// Best-effort close_notify alert through kernel TLS, before close()
+void tls_close_notify(int fd);
+
+#endif // TLS_H
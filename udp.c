@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include "udp.h"
+#include "protocol.h"
+#include "buffer.h"
+#include "stats.h"
+#include "logger.h"
+#include "cpu_affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+
+// Batches taken per wakeup before checking for stop, so a flood cannot
+// keep the thread from exiting
+#define UDP_BATCHES_PER_WAKEUP 16
+
+static const char too_long_reply[] = "ERROR: Request too long\n";
+static const char too_large_reply[] = "ERROR: Reply too large for UDP\n";
+
+struct UdpServer {
+    int fd;
+    int stop_fd;                // eventfd that wakes the thread to exit
+    int shutdown_fd;            // server shutting down: stop answering
+    int batch;
+    pthread_t thread;
+    int thread_started;
+    
+    // One slot per datagram of a batch: the request and its sender, and
+    // the reply sent back to it
+    struct mmsghdr in[UDP_BATCH_MAX];
+    struct iovec in_iov[UDP_BATCH_MAX];
+    struct sockaddr_storage peers[UDP_BATCH_MAX];
+    char requests[UDP_BATCH_MAX][UDP_REQUEST_MAX];
+    struct mmsghdr out[UDP_BATCH_MAX];
+    struct iovec out_iov[UDP_BATCH_MAX];
+    Buffer replies[UDP_BATCH_MAX];
+};
+
+int udp_socket_create(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("UDP socket() failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        LOG_ERROR("UDP bind() to port %d failed: %s", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Build the reply to datagram i into its reply buffer. Returns 0 if
+// there is nothing to send.
+static int answer(UdpServer* server, int i) {
+    Buffer* reply = &server->replies[i];
+    buffer_consume(reply, buffer_length(reply));
+    
+    if (server->in[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        return buffer_append(reply, too_long_reply, sizeof(too_long_reply) - 1) == 0;
+    }
+    
+    // One request per datagram; the line terminator is optional
+    const char* request = server->requests[i];
+    size_t len = server->in[i].msg_len;
+    const char* newline = (const char*)memchr(request, '\n', len);
+    if (newline != NULL) {
+        len = (size_t)(newline - request);
+    }
+    if (len > 0 && request[len - 1] == '\r') {
+        len--;
+    }
+    
+    if (process_datagram(request, len, reply) < 0) {
+        stats_add(STATS_ERRORS, 1);
+        return 0;
+    }
+    if (buffer_length(reply) > UDP_REPLY_MAX) {
+        buffer_consume(reply, buffer_length(reply));
+        return buffer_append(reply, too_large_reply, sizeof(too_large_reply) - 1) == 0;
+    }
+    return buffer_length(reply) > 0;
+}
+
+// Send the first count replies. A full send buffer drops the rest: UDP
+// probes are retried by whoever sent them.
+static void send_replies(UdpServer* server, int count) {
+    int sent = 0;
+    while (sent < count) {
+        int n = sendmmsg(server->fd, server->out + sent, (unsigned)(count - sent), MSG_DONTWAIT);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            stats_add(STATS_ERRORS, (uint64_t)(count - sent));
+            return;
+        }
+        // Only the first message failed (an unreachable peer, say)
+        stats_add(STATS_ERRORS, 1);
+        sent++;
+    }
+}
+
+// Receive and answer batches until the socket is empty, or for at most
+// UDP_BATCHES_PER_WAKEUP batches
+static void serve_batches(UdpServer* server) {
+    for (int round = 0; round < UDP_BATCHES_PER_WAKEUP; round++) {
+        for (int i = 0; i < server->batch; i++) {
+            server->in[i].msg_hdr.msg_namelen = sizeof(server->peers[i]);
+        }
+        int n = recvmmsg(server->fd, server->in, (unsigned)server->batch, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG_ERROR("recvmmsg() failed: %s", strerror(errno));
+                stats_add(STATS_ERRORS, 1);
+            }
+            return;
+        }
+        stats_add(STATS_UDP_DATAGRAMS, (uint64_t)n);
+        stats_add(STATS_UDP_BATCHES, 1);
+        
+        int replies = 0;
+        for (int i = 0; i < n; i++) {
+            if (!answer(server, i)) {
+                continue;
+            }
+            struct msghdr* hdr = &server->out[replies].msg_hdr;
+            hdr->msg_name = &server->peers[i];
+            hdr->msg_namelen = server->in[i].msg_hdr.msg_namelen;
+            server->out_iov[replies].iov_base = buffer_begin(&server->replies[i]);
+            server->out_iov[replies].iov_len = buffer_length(&server->replies[i]);
+            replies++;
+        }
+        send_replies(server, replies);
+        
+        if (n < server->batch) {
+            return;
+        }
+    }
+}
+
+static void* udp_thread(void* arg) {
+    UdpServer* server = (UdpServer*)arg;
+    stats_thread_init("udp");
+    
+    struct pollfd pfds[3];
+    pfds[0].fd = server->fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = server->stop_fd;
+    pfds[1].events = POLLIN;
+    pfds[2].fd = server->shutdown_fd;     // ignored by poll() if -1
+    pfds[2].events = POLLIN;
+    while (1) {
+        int n = poll(pfds, 3, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || pfds[1].revents != 0) {
+            break;
+        }
+        if (pfds[2].revents != 0) {
+            // Leave probes unanswered from now on rather than report a
+            // server that is going away as healthy. Not shutdown(): after
+            // an upgrade the new process serves the same socket.
+            LOG_INFO("UDP health checks stopped");
+            break;
+        }
+        if (pfds[0].revents != 0) {
+            serve_batches(server);
+        }
+    }
+    return NULL;
+}
+
+UdpServer* udp_server_start(int fd, int batch, int shutdown_fd) {
+    UdpServer* server = (UdpServer*)calloc(1, sizeof(UdpServer));
+    if (server == NULL) {
+        LOG_ERROR("malloc() failed for UDP server");
+        close(fd);
+        return NULL;
+    }
+    server->fd = fd;
+    server->shutdown_fd = shutdown_fd;
+    server->batch = (batch < 1) ? 1 : (batch > UDP_BATCH_MAX) ? UDP_BATCH_MAX : batch;
+    for (int i = 0; i < UDP_BATCH_MAX; i++) {
+        server->in_iov[i].iov_base = server->requests[i];
+        server->in_iov[i].iov_len = sizeof(server->requests[i]);
+        server->in[i].msg_hdr.msg_name = &server->peers[i];
+        server->in[i].msg_hdr.msg_iov = &server->in_iov[i];
+        server->in[i].msg_hdr.msg_iovlen = 1;
+        server->out[i].msg_hdr.msg_iov = &server->out_iov[i];
+        server->out[i].msg_hdr.msg_iovlen = 1;
+        buffer_init(&server->replies[i]);
+    }
+    
+    server->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (server->stop_fd < 0) {
+        LOG_ERROR("UDP eventfd() failed: %s", strerror(errno));
+        udp_server_stop(server);
+        return NULL;
+    }
+    
+    // Not on the CPU of whichever reactor the caller is pinned to
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    cpu_affinity_attr(&attr, -1);
+    int rc = pthread_create(&server->thread, &attr, udp_thread, server);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        LOG_ERROR("Failed to create UDP thread");
+        udp_server_stop(server);
+        return NULL;
+    }
+    server->thread_started = 1;
+    return server;
+}
+
+int udp_server_fd(const UdpServer* server) {
+    return server->fd;
+}
+
+void udp_server_stop(UdpServer* server) {
+    if (server == NULL) {
+        return;
+    }
+    if (server->thread_started) {
+        uint64_t one = 1;
+        ssize_t ignored = write(server->stop_fd, &one, sizeof(one));
+        (void)ignored;
+        pthread_join(server->thread, NULL);
+    }
+    if (server->stop_fd >= 0) {
+        close(server->stop_fd);
+    }
+    close(server->fd);
+    for (int i = 0; i < UDP_BATCH_MAX; i++) {
+        buffer_free(&server->replies[i]);
+    }
+    free(server);
+}
@@ -0,0 +1,41 @@
+#ifndef UDP_H
+#define UDP_H
+
+// Health checks over UDP. Load balancers and monitors that probe with
+// PING every second would otherwise cost a handshake, an accept and a
+// queued task each; here a dedicated thread answers the stateless verbs
+// (COMMAND_DATAGRAM) in batches, one request per datagram, with
+// recvmmsg()/sendmmsg().
+
+#define UDP_BATCH_MAX 64
+
+// Largest request; longer datagrams get an error reply
+#define UDP_REQUEST_MAX 512
+
+// Largest reply: one unfragmented packet on a 1500 byte MTU, so a small
+// spoofed request never draws a large answer. Longer replies (STATS
+// DETAIL) are replaced by an error.
+#define UDP_REPLY_MAX 1472
+
+typedef struct UdpServer UdpServer;
+
+// Bind a UDP socket on port. Returns the socket, or -1 on failure
+// (logged).
+int udp_socket_create(int port);
+
+// Answer requests on fd (which the server takes over) from a background
+// thread, receiving up to batch datagrams per call. Once shutdown_fd
+// becomes readable (it is only polled, never read) the thread stops
+// answering, so health checks fail while the reactors drain; -1 for none.
+// The socket stays open until udp_server_stop(): it may still be passed
+// to a new process on upgrade, which shares it and answers in our place.
+// Returns NULL on failure (logged; fd is closed).
+UdpServer* udp_server_start(int fd, int batch, int shutdown_fd);
+
+// Descriptor being served, e.g. to pass to a new process on upgrade
+int udp_server_fd(const UdpServer* server);
+
+// Stop the thread and close the socket
+void udp_server_stop(UdpServer* server);
+
+#endif // UDP_H
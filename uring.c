@@ -0,0 +1,881 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "connection.h"
+#include "logger.h"
+#include "object_pool.h"
+#include "stats.h"
+#include "ratelimit.h"
+#include "probes.h"
+#include "clock.h"
+#include "timer_wheel.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define URING_ENTRIES 1024
+#define URING_BUF_COUNT 512          // must be a power of two
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+
+// Connection timeouts are checked on a ring timeout every tick
+#define URING_TIMER_TICK_MS 100
+#define URING_TIMER_SLOTS 1024
+
+// user_data values for ring-wide operations; connection operations carry
+// the connection pointer with the operation in the low bits. Listener i
+// accepts with UD_ACCEPT + i.
+#define UD_WAKEUP 2ULL
+#define UD_TIMER 3ULL
+#define UD_DRAIN 4ULL               // drain deadline
+#define UD_ACCEPT_CANCEL 5ULL
+#define UD_ACCEPT 8ULL
+#define UD_OP_MASK 7ULL
+
+enum {
+    OP_RECV = 1,
+    OP_SEND = 2,
+    OP_SHUTDOWN = 3,
+    OP_CANCEL = 4
+};
+
+typedef struct {
+    Connection base;
+    int inflight;           // submitted operations still to complete
+    int closing;
+    int shut;
+    int quit;
+    
+    // Multishot recv state; it is cancelled while the framer is paused
+    // by unsent output and re-armed once the output drains
+    int recv_active;
+    int recv_cancel;
+    
+    // Output owned by the in-flight send; replies framed meanwhile queue
+    // up in base.out
+    Buffer send;
+    int send_active;
+} UringConnection;
+
+// Pool objects are 16-byte aligned, leaving the low bits free for UD_OP_MASK
+#define URING_CONNECTIONS_PER_SLAB 64
+static ObjectPool* uring_connection_pool = NULL;
+static pthread_once_t uring_connection_pool_once = PTHREAD_ONCE_INIT;
+
+static void uring_connection_pool_init(void) {
+    uring_connection_pool = object_pool_create("uring connections", sizeof(UringConnection),
+                                               URING_CONNECTIONS_PER_SLAB);
+}
+
+typedef struct {
+    int fd;
+    const SocketProfile* profile;   // may be NULL
+} UringListener;
+
+struct UringReactor {
+    int ring_fd;
+    UringListener listeners[SOCKET_MAX_LISTENERS];
+    int listener_count;
+    int wakeup_fd;
+    int running;
+    
+    // Submission queue
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe* sqes;
+    
+    // Completion queue
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    
+    // Provided receive buffers
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    char* buffers;
+    unsigned short buf_tail;
+    
+    // Connection timeouts; the wheel advances on every UD_TIMER completion
+    ConnectionTimeouts timeouts;
+    int timer_recheck_ms;
+    TimerWheel timers;
+    struct __kernel_timespec tick;
+    
+    // Open connections and the shutdown drain (see uring_reactor_create())
+    Connection* connections;
+    int connection_count;
+    int drain_timeout_ms;
+    int draining;
+    uint64_t drain_start_ms;
+    struct __kernel_timespec drain_deadline;
+    ConnectionDrainStats drain;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int ring_map(UringReactor* reactor) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    
+    reactor->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (reactor->ring_fd < 0 && errno == EINVAL) {
+        // Older kernel: retry without optional flags
+        memset(&params, 0, sizeof(params));
+        reactor->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (reactor->ring_fd < 0) {
+        LOG_ERROR("io_uring_setup() failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    reactor->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    reactor->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (reactor->cq_ring_size > reactor->sq_ring_size) {
+            reactor->sq_ring_size = reactor->cq_ring_size;
+        }
+        reactor->cq_ring_size = reactor->sq_ring_size;
+    }
+    
+    reactor->sq_ring = mmap(NULL, reactor->sq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, reactor->ring_fd, IORING_OFF_SQ_RING);
+    if (reactor->sq_ring == MAP_FAILED) {
+        reactor->sq_ring = NULL;
+        return -1;
+    }
+    
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        reactor->cq_ring = reactor->sq_ring;
+    } else {
+        reactor->cq_ring = mmap(NULL, reactor->cq_ring_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, reactor->ring_fd, IORING_OFF_CQ_RING);
+        if (reactor->cq_ring == MAP_FAILED) {
+            reactor->cq_ring = NULL;
+            return -1;
+        }
+    }
+    
+    reactor->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    reactor->sqes = mmap(NULL, reactor->sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, reactor->ring_fd, IORING_OFF_SQES);
+    if (reactor->sqes == MAP_FAILED) {
+        reactor->sqes = NULL;
+        return -1;
+    }
+    
+    char* sq = (char*)reactor->sq_ring;
+    reactor->sq_head = (unsigned*)(sq + params.sq_off.head);
+    reactor->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    reactor->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    reactor->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    reactor->sq_local_tail = *reactor->sq_tail;
+    
+    // Identity mapping: SQE slot i is always at array index i
+    unsigned* sq_array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < reactor->sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    
+    char* cq = (char*)reactor->cq_ring;
+    reactor->cq_head = (unsigned*)(cq + params.cq_off.head);
+    reactor->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    reactor->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    reactor->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    
+    return 0;
+}
+
+// Hand a receive buffer (back) to the kernel
+static void buffer_provide(UringReactor* reactor, unsigned short bid) {
+    struct io_uring_buf* buf = &reactor->buf_ring->bufs[reactor->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(reactor->buffers + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    reactor->buf_tail++;
+    __atomic_store_n(&reactor->buf_ring->tail, reactor->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int buffers_register(UringReactor* reactor) {
+    reactor->buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    void* ring = mmap(NULL, reactor->buf_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) {
+        return -1;
+    }
+    reactor->buf_ring = (struct io_uring_buf_ring*)ring;
+    
+    reactor->buffers = (char*)malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (reactor->buffers == NULL) {
+        return -1;
+    }
+    
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)reactor->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_io_uring_register(reactor->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        LOG_ERROR("io_uring buffer ring registration failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    reactor->buf_tail = 0;
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++) {
+        buffer_provide(reactor, (unsigned short)i);
+    }
+    return 0;
+}
+
+// Pass queued submissions to the kernel, optionally waiting for completions
+static int ring_submit(UringReactor* reactor, unsigned wait_nr) {
+    __atomic_store_n(reactor->sq_tail, reactor->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned pending = reactor->sq_local_tail - __atomic_load_n(reactor->sq_head, __ATOMIC_ACQUIRE);
+    
+    if (pending == 0 && wait_nr == 0) {
+        return 0;
+    }
+    
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    return sys_io_uring_enter(reactor->ring_fd, pending, wait_nr, flags);
+}
+
+static struct io_uring_sqe* ring_get_sqe(UringReactor* reactor) {
+    unsigned head = __atomic_load_n(reactor->sq_head, __ATOMIC_ACQUIRE);
+    if (reactor->sq_local_tail - head >= reactor->sq_entries) {
+        // Submission queue full: flush it before queueing more
+        ring_submit(reactor, 0);
+        head = __atomic_load_n(reactor->sq_head, __ATOMIC_ACQUIRE);
+        if (reactor->sq_local_tail - head >= reactor->sq_entries) {
+            return NULL;
+        }
+    }
+    
+    struct io_uring_sqe* sqe = &reactor->sqes[reactor->sq_local_tail & reactor->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    reactor->sq_local_tail++;
+    return sqe;
+}
+
+static uint64_t conn_tag(UringConnection* uc, int op) {
+    return (uint64_t)(uintptr_t)uc | (uint64_t)op;
+}
+
+static void arm_accept(UringReactor* reactor, int index) {
+    struct io_uring_sqe* sqe = ring_get_sqe(reactor);
+    if (sqe == NULL) {
+        LOG_ERROR("io_uring submission queue full, accept not armed");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor->listeners[index].fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UD_ACCEPT + (uint64_t)index;
+}
+
+static void arm_wakeup(UringReactor* reactor) {
+    struct io_uring_sqe* sqe = ring_get_sqe(reactor);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = reactor->wakeup_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UD_WAKEUP;
+}
+
+static uint64_t now_ms(void) {
+    return clock_monotonic_ns() / 1000000;
+}
+
+static void arm_tick(UringReactor* reactor) {
+    struct io_uring_sqe* sqe = ring_get_sqe(reactor);
+    if (sqe == NULL) {
+        LOG_ERROR("io_uring submission queue full, timeouts not armed");
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&reactor->tick;
+    sqe->len = 1;
+    sqe->user_data = UD_TIMER;
+}
+
+static void begin_close(UringConnection* uc) {
+    uc->closing = 1;
+    if (!uc->shut) {
+        // Terminates the multishot recv and any pending send
+        uc->shut = 1;
+        shutdown(uc->base.fd, SHUT_RDWR);
+    }
+}
+
+static void free_connection(UringReactor* reactor, UringConnection* uc) {
+    connection_unlink(&reactor->connections, &uc->base);
+    reactor->connection_count--;
+    close(uc->base.fd);
+    connection_release(&uc->base);
+    buffer_free(&uc->send);
+    object_pool_free(uring_connection_pool, uc);
+}
+
+// Free the connection once the kernel holds no more references to it
+static void maybe_free(UringReactor* reactor, UringConnection* uc) {
+    if (!uc->closing || uc->inflight > 0) {
+        return;
+    }
+    timer_wheel_cancel(&reactor->timers, &uc->base.timer);
+    free_connection(reactor, uc);
+    
+    // The last drained connection ends the loop
+    if (reactor->draining && reactor->connection_count == 0) {
+        reactor->running = 0;
+    }
+}
+
+static void arm_recv(UringReactor* reactor, UringConnection* uc) {
+    struct io_uring_sqe* sqe = ring_get_sqe(reactor);
+    if (sqe == NULL) {
+        LOG_ERROR("io_uring submission queue full, closing %s:%d",
+                  uc->base.ip, uc->base.port);
+        begin_close(uc);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->base.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = conn_tag(uc, OP_RECV);
+    uc->inflight++;
+    uc->recv_active = 1;
+}
+
+// Stop receiving while input is held back, resume once it is not. A new
+// recv is only armed after the cancel has completed, so the cancel
+// cannot match it.
+static void update_recv(UringReactor* reactor, UringConnection* uc) {
+    if (uc->closing) {
+        return;
+    }
+    
+    if (uc->base.input_paused) {
+        if (!uc->recv_active || uc->recv_cancel) {
+            return;
+        }
+        struct io_uring_sqe* sqe = ring_get_sqe(reactor);
+        if (sqe == NULL) {
+            return;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = conn_tag(uc, OP_RECV);
+        sqe->user_data = conn_tag(uc, OP_CANCEL);
+        uc->inflight++;
+        uc->recv_cancel = 1;
+    } else if (!uc->recv_active && !uc->recv_cancel) {
+        arm_recv(reactor, uc);
+    }
+}
+
+static void submit_send(UringReactor* reactor, UringConnection* uc) {
+    struct io_uring_sqe* sqe = ring_get_sqe(reactor);
+    if (sqe == NULL) {
+        LOG_ERROR("io_uring submission queue full, closing %s:%d",
+                  uc->base.ip, uc->base.port);
+        begin_close(uc);
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = uc->base.fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer_begin(&uc->send);
+    sqe->len = (unsigned)buffer_length(&uc->send);
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = conn_tag(uc, OP_SEND);
+    uc->inflight++;
+    uc->send_active = 1;
+    
+    // After QUIT, link the shutdown behind the final send
+    if (uc->quit && buffer_length(&uc->base.out) == 0) {
+        struct io_uring_sqe* link = ring_get_sqe(reactor);
+        if (link == NULL) {
+            return;
+        }
+        sqe->flags |= IOSQE_IO_LINK;
+        link->opcode = IORING_OP_SHUTDOWN;
+        link->fd = uc->base.fd;
+        link->len = SHUT_RDWR;
+        link->user_data = conn_tag(uc, OP_SHUTDOWN);
+        uc->inflight++;
+    }
+}
+
+// Start a send for queued output unless one is already in flight
+static void flush_output(UringReactor* reactor, UringConnection* uc) {
+    if (uc->send_active || buffer_length(&uc->base.out) == 0 || uc->shut) {
+        return;
+    }
+    
+    // The drained send buffer becomes the next output queue
+    buffer_swap(&uc->send, &uc->base.out);
+    submit_send(reactor, uc);
+}
+
+// Drain: send the notice after any pending output, then shut down
+// behind the last send
+static void drain_close(UringReactor* reactor, UringConnection* uc) {
+    connection_drain(&uc->base);
+    uc->quit = 1;
+    uc->closing = 1;
+    if (uc->send_active) {
+        return;     // handle_send() flushes the rest
+    }
+    if (buffer_length(&uc->base.out) == 0) {
+        begin_close(uc);
+    } else {
+        flush_output(reactor, uc);
+    }
+}
+
+static void feed_result(UringConnection* uc, int result) {
+    if (result == 1) {
+        // QUIT: the shutdown is linked behind the final send
+        uc->quit = 1;
+        uc->closing = 1;
+    } else if (result < 0) {
+        begin_close(uc);
+    }
+}
+
+// Arm the connection's timer for its deadline
+static void arm_timer(UringReactor* reactor, UringConnection* uc, uint64_t now) {
+    uint64_t due;
+    if (connection_deadline(&uc->base, &due) == CONNECTION_TIMEOUT_NONE) {
+        due = now + (uint64_t)reactor->timer_recheck_ms;
+    }
+    timer_wheel_arm(&reactor->timers, &uc->base.timer, due);
+}
+
+// A deadline pushed back by progress is picked up lazily when the entry
+// fires early
+static void timer_fired(TimerEntry* entry, uint64_t now, void* arg) {
+    UringReactor* reactor = (UringReactor*)arg;
+    UringConnection* uc = (UringConnection*)((char*)entry - offsetof(UringConnection, base.timer));
+    if (uc->closing) {
+        return;
+    }
+    
+    uint64_t due;
+    ConnectionTimeoutKind kind = connection_deadline(&uc->base, &due);
+    if (kind == CONNECTION_TIMEOUT_NONE || due > now) {
+        arm_timer(reactor, uc, now);
+        return;
+    }
+    
+    connection_timed_out(&uc->base, kind);
+    begin_close(uc);
+    maybe_free(reactor, uc);
+}
+
+// Publish the deadline for the connection's current state. Everything
+// runs on the ring thread, so a deadline that moved earlier re-arms the
+// timer right away.
+static void update_deadline(UringReactor* reactor, UringConnection* uc) {
+    if (reactor->timer_recheck_ms == 0 || uc->closing) {
+        return;
+    }
+    uint64_t now = now_ms();
+    size_t unsent = buffer_length(&uc->base.out) + buffer_length(&uc->send);
+    connection_update_deadline(&uc->base, &reactor->timeouts, unsent, now);
+    
+    uint64_t due;
+    if (connection_deadline(&uc->base, &due) != CONNECTION_TIMEOUT_NONE &&
+        due / URING_TIMER_TICK_MS < uc->base.timer.expires) {
+        timer_wheel_arm(&reactor->timers, &uc->base.timer, due);
+    }
+}
+
+static void add_connection(UringReactor* reactor, int client_socket,
+                           const struct sockaddr_in* client_addr) {
+    UringConnection* uc = (UringConnection*)object_pool_alloc(uring_connection_pool);
+    if (uc == NULL) {
+        LOG_ERROR("malloc() failed for connection");
+        connection_admit_cancel();
+        close(client_socket);
+        return;
+    }
+    
+    memset(uc, 0, sizeof(*uc));
+    connection_init(&uc->base, client_socket, client_addr, NULL);
+    LOG_INFO("Client connected: %s:%d (Active: %d)",
+             uc->base.ip, uc->base.port, stats_active_connections());
+    connection_link(&reactor->connections, &uc->base);
+    reactor->connection_count++;
+    
+    // Accepted just as the drain cancelled the accept
+    if (reactor->draining) {
+        shutdown(client_socket, SHUT_RD);
+    }
+    if (reactor->timer_recheck_ms > 0) {
+        uint64_t now = now_ms();
+        connection_update_deadline(&uc->base, &reactor->timeouts, 0, now);
+        arm_timer(reactor, uc, now);
+    }
+    arm_recv(reactor, uc);
+}
+
+static void handle_accept(UringReactor* reactor, int index, struct io_uring_cqe* cqe) {
+    if (cqe->res >= 0) {
+        // The completion carries no address
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        if (getpeername(cqe->res, (struct sockaddr*)&client_addr, &client_len) < 0) {
+            memset(&client_addr, 0, sizeof(client_addr));
+        }
+        
+        // Multishot accept keeps accepting, so at the limit the only
+        // option is to turn the client away
+        if (connection_admit() < 0) {
+            connection_reject(cqe->res);
+        } else if (!ratelimit_allow_connection(client_addr.sin_addr.s_addr)) {
+            connection_admit_cancel();
+            connection_reject_rate_limited(cqe->res);
+        } else {
+            const SocketProfile* profile = reactor->listeners[index].profile;
+            if (profile != NULL) {
+                socket_apply_accepted(cqe->res, profile);
+            }
+            add_connection(reactor, cqe->res, &client_addr);
+        }
+    } else if (cqe->res != -ECANCELED) {
+        LOG_ERROR("accept() failed: %s", strerror(-cqe->res));
+    }
+    
+    // Multishot accept stops on error; re-arm it
+    if (!(cqe->flags & IORING_CQE_F_MORE) && reactor->running && !reactor->draining) {
+        arm_accept(reactor, index);
+    }
+}
+
+static void handle_recv(UringReactor* reactor, UringConnection* uc, struct io_uring_cqe* cqe) {
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        char* data = reactor->buffers + (size_t)bid * URING_BUF_SIZE;
+        stats_add(STATS_BYTES_IN, (uint64_t)cqe->res);
+        
+        if (!uc->closing) {
+            feed_result(uc, connection_feed(&uc->base, data, (size_t)cqe->res));
+        }
+        
+        buffer_provide(reactor, bid);
+        flush_output(reactor, uc);
+        update_recv(reactor, uc);
+        update_deadline(reactor, uc);
+    }
+    
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return;
+    }
+    
+    // The multishot recv has terminated
+    uc->inflight--;
+    uc->recv_active = 0;
+    if (cqe->res == -ECANCELED && uc->recv_cancel && !uc->closing) {
+        // Paused for backpressure
+    } else if (cqe->res == 0 && reactor->draining && !uc->closing) {
+        // The drain shut the read side
+        drain_close(reactor, uc);
+    } else if (cqe->res == 0) {
+        if (!uc->closing) {
+            LOG_INFO("Client disconnected: %s:%d", uc->base.ip, uc->base.port);
+        }
+        begin_close(uc);
+    } else if (cqe->res == -ENOBUFS || cqe->res > 0) {
+        // Out of provided buffers or kernel-side restart: re-arm
+        update_recv(reactor, uc);
+    } else {
+        if (!uc->closing && cqe->res != -ECANCELED) {
+            LOG_ERROR("recv() failed for %s:%d: %s",
+                      uc->base.ip, uc->base.port, strerror(-cqe->res));
+            stats_add(STATS_ERRORS, 1);
+        }
+        begin_close(uc);
+    }
+    maybe_free(reactor, uc);
+}
+
+static void handle_send(UringReactor* reactor, UringConnection* uc, struct io_uring_cqe* cqe) {
+    uc->inflight--;
+    uc->send_active = 0;
+    
+    if (cqe->res < 0) {
+        if (!uc->shut && cqe->res != -ECANCELED) {
+            LOG_ERROR("send() failed for %s:%d: %s",
+                      uc->base.ip, uc->base.port, strerror(-cqe->res));
+            stats_add(STATS_ERRORS, 1);
+        }
+        begin_close(uc);
+    } else {
+        buffer_consume(&uc->send, (size_t)cqe->res);
+        stats_add(STATS_BYTES_OUT, (uint64_t)cqe->res);
+        if (cqe->res > 0) {
+            uc->base.output_progress = 1;
+        }
+        if (buffer_length(&uc->send) > 0 && !uc->shut) {
+            submit_send(reactor, uc);
+        } else {
+            // Room again: run lines held back by the high-water mark
+            if (uc->base.input_paused && !uc->closing) {
+                feed_result(uc, connection_consume(&uc->base));
+            }
+            flush_output(reactor, uc);
+            update_recv(reactor, uc);
+            
+            // Nothing left to send: return both buffers to the pool
+            if (!uc->send_active && buffer_length(&uc->base.out) == 0) {
+                PROBE2(send__done, uc->base.fd, cqe->res);
+                buffer_free(&uc->send);
+                buffer_free(&uc->base.out);
+            }
+            
+            // Drained with nothing left to send
+            if (uc->quit && !uc->send_active && !uc->shut) {
+                begin_close(uc);
+            }
+        }
+        update_deadline(reactor, uc);
+    }
+    maybe_free(reactor, uc);
+}
+
+// Stop accepting and shut the read side of every connection: each one
+// answers what it has received, then drains out through drain_close()
+static void begin_drain(UringReactor* reactor) {
+    reactor->drain.connections = reactor->connection_count;
+    reactor->drain_start_ms = now_ms();
+    if (reactor->drain_timeout_ms <= 0 || reactor->connection_count == 0) {
+        reactor->running = 0;
+        return;
+    }
+    reactor->draining = 1;
+    
+    for (int i = 0; i < reactor->listener_count; i++) {
+        struct io_uring_sqe* sqe = ring_get_sqe(reactor);
+        if (sqe == NULL) {
+            break;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = UD_ACCEPT + (uint64_t)i;
+        sqe->user_data = UD_ACCEPT_CANCEL;
+    }
+    
+    for (Connection* conn = reactor->connections; conn != NULL; conn = conn->live_next) {
+        shutdown(conn->fd, SHUT_RD);
+    }
+    
+    struct io_uring_sqe* sqe = ring_get_sqe(reactor);
+    if (sqe == NULL) {
+        reactor->running = 0;
+        return;
+    }
+    reactor->drain_deadline.tv_sec = reactor->drain_timeout_ms / 1000;
+    reactor->drain_deadline.tv_nsec = (reactor->drain_timeout_ms % 1000) * 1000000LL;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&reactor->drain_deadline;
+    sqe->len = 1;
+    sqe->user_data = UD_DRAIN;
+}
+
+static void handle_completion(UringReactor* reactor, struct io_uring_cqe* cqe) {
+    uint64_t data = cqe->user_data;
+    
+    if (data >= UD_ACCEPT && data < UD_ACCEPT + (uint64_t)reactor->listener_count) {
+        handle_accept(reactor, (int)(data - UD_ACCEPT), cqe);
+        return;
+    }
+    
+    if (data == UD_WAKEUP) {
+        begin_drain(reactor);
+        return;
+    }
+    
+    if (data == UD_DRAIN) {
+        reactor->running = 0;
+        return;
+    }
+    
+    if (data == UD_ACCEPT_CANCEL) {
+        return;
+    }
+    
+    if (data == UD_TIMER) {
+        timer_wheel_advance(&reactor->timers, now_ms(), timer_fired, reactor);
+        if (reactor->running) {
+            arm_tick(reactor);
+        }
+        return;
+    }
+    
+    UringConnection* uc = (UringConnection*)(uintptr_t)(data & ~UD_OP_MASK);
+    switch ((int)(data & UD_OP_MASK)) {
+        case OP_RECV:
+            handle_recv(reactor, uc, cqe);
+            break;
+        case OP_SEND:
+            handle_send(reactor, uc, cqe);
+            break;
+        case OP_SHUTDOWN:
+            uc->inflight--;
+            uc->shut = 1;
+            maybe_free(reactor, uc);
+            break;
+        case OP_CANCEL:
+            uc->inflight--;
+            uc->recv_cancel = 0;
+            update_recv(reactor, uc);
+            maybe_free(reactor, uc);
+            break;
+    }
+}
+
+UringReactor* uring_reactor_create(int wakeup_fd, const ConnectionTimeouts* timeouts,
+                                   int drain_timeout_ms) {
+    UringReactor* reactor = (UringReactor*)calloc(1, sizeof(UringReactor));
+    if (reactor == NULL) {
+        return NULL;
+    }
+    connection_set_state_size(sizeof(UringConnection));
+    
+    pthread_once(&uring_connection_pool_once, uring_connection_pool_init);
+    
+    reactor->ring_fd = -1;
+    reactor->listener_count = 0;
+    reactor->wakeup_fd = wakeup_fd;
+    reactor->timeouts = *timeouts;
+    reactor->timer_recheck_ms = connection_timeouts_min(timeouts);
+    reactor->tick.tv_nsec = URING_TIMER_TICK_MS * 1000000LL;
+    reactor->connections = NULL;
+    reactor->connection_count = 0;
+    reactor->drain_timeout_ms = drain_timeout_ms;
+    
+    if (timer_wheel_init(&reactor->timers, URING_TIMER_SLOTS, URING_TIMER_TICK_MS, now_ms()) < 0) {
+        LOG_ERROR("malloc() failed for timer wheel");
+        free(reactor);
+        return NULL;
+    }
+    
+    if (ring_map(reactor) < 0 || buffers_register(reactor) < 0) {
+        uring_reactor_destroy(reactor);
+        return NULL;
+    }
+    
+    return reactor;
+}
+
+int uring_reactor_add_listener(UringReactor* reactor, int listen_fd, const SocketProfile* profile) {
+    if (reactor->listener_count == SOCKET_MAX_LISTENERS) {
+        LOG_ERROR("Too many listeners");
+        return -1;
+    }
+    reactor->listeners[reactor->listener_count].fd = listen_fd;
+    reactor->listeners[reactor->listener_count].profile = profile;
+    reactor->listener_count++;
+    return 0;
+}
+
+int uring_reactor_run(UringReactor* reactor) {
+    reactor->running = 1;
+    for (int i = 0; i < reactor->listener_count; i++) {
+        arm_accept(reactor, i);
+    }
+    arm_wakeup(reactor);
+    if (reactor->timer_recheck_ms > 0) {
+        arm_tick(reactor);
+    }
+    
+    while (reactor->running) {
+        if (ring_submit(reactor, 1) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            LOG_ERROR("io_uring_enter() failed: %s", strerror(errno));
+            return -1;
+        }
+        
+        unsigned head = *reactor->cq_head;
+        unsigned tail = __atomic_load_n(reactor->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handle_completion(reactor, &reactor->cqes[head & reactor->cq_mask]);
+            head++;
+        }
+        __atomic_store_n(reactor->cq_head, head, __ATOMIC_RELEASE);
+    }
+    
+    reactor->drain.forced = reactor->connection_count;
+    reactor->drain.closed = reactor->drain.connections - reactor->drain.forced;
+    reactor->drain.elapsed_ms = now_ms() - reactor->drain_start_ms;
+    return 0;
+}
+
+const ConnectionDrainStats* uring_reactor_drain_stats(const UringReactor* reactor) {
+    return &reactor->drain;
+}
+
+void uring_reactor_destroy(UringReactor* reactor) {
+    if (reactor == NULL) {
+        return;
+    }
+    
+    if (reactor->sqes != NULL) {
+        munmap(reactor->sqes, reactor->sqes_size);
+    }
+    if (reactor->cq_ring != NULL && reactor->cq_ring != reactor->sq_ring) {
+        munmap(reactor->cq_ring, reactor->cq_ring_size);
+    }
+    if (reactor->sq_ring != NULL) {
+        munmap(reactor->sq_ring, reactor->sq_ring_size);
+    }
+    if (reactor->ring_fd >= 0) {
+        close(reactor->ring_fd);
+    }
+    if (reactor->buf_ring != NULL) {
+        munmap(reactor->buf_ring, reactor->buf_ring_size);
+    }
+    free(reactor->buffers);
+    
+    // Connections left after the drain; the ring that referenced them is
+    // gone
+    while (reactor->connections != NULL) {
+        free_connection(reactor, (UringConnection*)reactor->connections);
+    }
+    timer_wheel_destroy(&reactor->timers);
+    free(reactor);
+}
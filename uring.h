@@ -0,0 +1,38 @@
+#ifndef URING_H
+#define URING_H
+
+// io_uring I/O backend (built with `make IO_URING=1`). One ring per shard
+// runs multishot accept and multishot recv into a provided buffer ring,
+// and executes commands inline on the shard thread through the same
+// connection layer as the epoll reactor.
+
+#include "connection.h"
+#include "socket_options.h"
+
+typedef struct UringReactor UringReactor;
+
+// Create a ring. Once wakeup_fd becomes readable the loop stops accepting
+// and drains like the epoll reactor for up to drain_timeout_ms (0 exits
+// at once); what is left is closed by uring_reactor_destroy().
+// Connections are closed once a timeout expires. Returns NULL if
+// io_uring is unavailable.
+UringReactor* uring_reactor_create(int wakeup_fd, const ConnectionTimeouts* timeouts,
+                                   int drain_timeout_ms);
+
+// Accept from a listening socket, applying profile's per-connection
+// options (profile may be NULL); call before uring_reactor_run().
+// Returns 0 on success, -1 if there are too many listeners.
+int uring_reactor_add_listener(UringReactor* reactor, int listen_fd, const SocketProfile* profile);
+
+// Run the event loop until woken up and drained; returns 0 on clean
+// stop, -1 on error
+int uring_reactor_run(UringReactor* reactor);
+
+// What the shutdown drain did, once uring_reactor_run() has returned
+const ConnectionDrainStats* uring_reactor_drain_stats(const UringReactor* reactor);
+
+// Release the ring and its buffers (does not close the listeners or
+// wakeup_fd)
+void uring_reactor_destroy(UringReactor* reactor);
+
+#endif // URING_H
@@ -0,0 +1,92 @@
+#include "work_deque.h"
+#include <stdlib.h>
+
+int work_deque_init(WorkDeque* deque, long capacity) {
+    long size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    
+    deque->cells = (WorkCell*)calloc((size_t)size, sizeof(WorkCell));
+    if (deque->cells == NULL) {
+        return -1;
+    }
+    
+    deque->mask = size - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return 0;
+}
+
+void work_deque_destroy(WorkDeque* deque) {
+    free(deque->cells);
+    deque->cells = NULL;
+}
+
+int work_deque_push(WorkDeque* deque, WorkFunction function, void* arg) {
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    
+    if (b - t > deque->mask) {
+        return -1;
+    }
+    
+    WorkCell* cell = &deque->cells[b & deque->mask];
+    atomic_store_explicit(&cell->function, function, memory_order_relaxed);
+    atomic_store_explicit(&cell->arg, arg, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+int work_deque_pop(WorkDeque* deque, WorkFunction* function, void** arg) {
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    
+    if (t > b) {
+        // Empty
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return -1;
+    }
+    
+    WorkCell* cell = &deque->cells[b & deque->mask];
+    *function = atomic_load_explicit(&cell->function, memory_order_relaxed);
+    *arg = atomic_load_explicit(&cell->arg, memory_order_relaxed);
+    
+    if (t == b) {
+        // Last element: race thieves for it
+        int won = atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                          memory_order_seq_cst,
+                                                          memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return won ? 0 : -1;
+    }
+    
+    return 0;
+}
+
+WorkDequeResult work_deque_steal(WorkDeque* deque, WorkFunction* function, void** arg) {
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    
+    if (t >= b) {
+        return WORK_DEQUE_EMPTY;
+    }
+    
+    WorkCell* cell = &deque->cells[t & deque->mask];
+    WorkFunction f = atomic_load_explicit(&cell->function, memory_order_relaxed);
+    void* a = atomic_load_explicit(&cell->arg, memory_order_relaxed);
+    
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return WORK_DEQUE_ABORT;
+    }
+    
+    *function = f;
+    *arg = a;
+    return WORK_DEQUE_OK;
+}
@@ -0,0 +1,49 @@
+#ifndef WORK_DEQUE_H
+#define WORK_DEQUE_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include "task_ring.h"
+
+typedef void (*WorkFunction)(void* arg);
+
+// Slot fields are atomic because a thief may read a slot the owner is
+// recycling; such a read always loses its CAS on top and is discarded
+typedef struct {
+    _Atomic(WorkFunction) function;
+    _Atomic(void*) arg;
+} WorkCell;
+
+// Fixed-capacity Chase-Lev deque (Le et al. C11 formulation). The owning
+// worker pushes and pops at the bottom (LIFO); other workers steal from
+// the top (FIFO).
+typedef struct {
+    alignas(CACHE_LINE_SIZE) atomic_long top;
+    alignas(CACHE_LINE_SIZE) atomic_long bottom;
+    alignas(CACHE_LINE_SIZE) WorkCell* cells;
+    long mask;
+} WorkDeque;
+
+// Result of work_deque_steal()
+typedef enum {
+    WORK_DEQUE_OK,
+    WORK_DEQUE_EMPTY,
+    WORK_DEQUE_ABORT    // lost a race with another thief or the owner
+} WorkDequeResult;
+
+// Allocate a deque with capacity rounded up to a power of two
+int work_deque_init(WorkDeque* deque, long capacity);
+
+// Free the deque's cells
+void work_deque_destroy(WorkDeque* deque);
+
+// Owner only. Returns 0 on success, -1 if the deque is full.
+int work_deque_push(WorkDeque* deque, WorkFunction function, void* arg);
+
+// Owner only. Returns 0 on success, -1 if the deque is empty.
+int work_deque_pop(WorkDeque* deque, WorkFunction* function, void** arg);
+
+// Any thread
+WorkDequeResult work_deque_steal(WorkDeque* deque, WorkFunction* function, void** arg);
+
+#endif // WORK_DEQUE_H